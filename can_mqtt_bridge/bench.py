@@ -0,0 +1,292 @@
+"""End-to-end MQTT-over-CAN benchmark: PUBLISH round trips from simulated nodes through the bridge to a broker.
+
+Every case puts h42_sim_node processes in --mqtt mode on the simulated bus (canbus_sim.py), in front of
+IsotpCanServer and CanTcpBridge, with a stub broker on localhost that acknowledges every QoS 1 PUBLISH. The
+nodes time each PUBLISH to its PUBACK. Cases sweep payload size, ISO-TP block size and STmin, which both the
+bridge and the nodes ask for when receiving.
+
+Results are JSON, tagged with the commit, so runs can be compared:
+
+    python3 bench.py --output before.json
+    python3 bench.py --output after.json --compare before.json
+"""
+import argparse
+import asyncio
+import dataclasses
+import itertools
+import json
+import logging
+import os
+import struct
+import subprocess
+import sys
+import threading
+import time
+from typing import Dict, List, Optional, Sequence, Set, Tuple
+
+import can_tcp_bridge
+import canbus_sim
+import isotp_can_server
+import sim_main
+
+MQTT_CONNECT = 1
+MQTT_CONNACK = 2
+MQTT_PUBLISH = 3
+MQTT_PUBACK = 4
+MQTT_PINGREQ = 12
+MQTT_PINGRESP = 13
+MQTT_DISCONNECT = 14
+
+# What --compare prints, and whether a higher value is better
+COMPARED_METRICS = (('latency_ms.p50', False), ('latency_ms.p99', False), ('payload_bytes_per_s', True),
+                    ('publishes_per_s', True), ('bus_frames_per_s', True), ('bus_utilization', False))
+
+
+@dataclasses.dataclass(frozen=True)
+class BenchCase:
+    payload_size: int
+    block_size: int
+    stmin_ms: int
+
+
+@dataclasses.dataclass
+class BenchConfig:
+    nodes: int = 1
+    bitrate: int = 20000
+    # Time after the last node powered up before measuring, for the nodes to connect
+    warmup: float = 5.0
+    duration: float = 10.0
+    # PUBLISH period of each node, 0 for back to back
+    period_ms: int = 0
+    error_rate: float = 0.0
+    seed: int = 1
+    join_interval_ms: int = 200
+    # Nodes send topic aliases, see mqtt_compact.py
+    compact: bool = False
+    # Nodes compress large PUBLISH packets
+    compress: bool = False
+    # Nodes publish Home Assistant discovery configs instead of filler
+    discovery: bool = False
+    node_binary: str = sim_main.DEFAULT_NODE_BINARY
+
+
+class StubBroker:
+    """Answers CONNECT, QoS 1 PUBLISH and PINGREQ and drops everything else."""
+
+    def __init__(self) -> None:
+        self.publishes = 0
+        self.__server: Optional[asyncio.Server] = None
+
+    async def start(self) -> int:
+        """Returns the port it listens on."""
+        self.__server = await asyncio.start_server(self.__handle, '127.0.0.1', 0)
+        return int(self.__server.sockets[0].getsockname()[1])
+
+    async def close(self) -> None:
+        if self.__server is not None:
+            self.__server.close()
+
+    async def __handle(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        try:
+            while True:
+                first = (await reader.readexactly(1))[0]
+                length, shift = 0, 0
+                while True:
+                    b = (await reader.readexactly(1))[0]
+                    length |= (b & 0x7F) << shift
+                    shift += 7
+                    if not b & 0x80:
+                        break
+                body = await reader.readexactly(length)
+                kind = first >> 4
+                if kind == MQTT_CONNECT:
+                    writer.write(bytes([MQTT_CONNACK << 4, 2, 0, 0]))
+                elif kind == MQTT_PUBLISH:
+                    self.publishes += 1
+                    if (first >> 1) & 3 == 1:
+                        topic_len = struct.unpack_from('>H', body)[0]
+                        writer.write(bytes([MQTT_PUBACK << 4, 2]) + body[2 + topic_len:4 + topic_len])
+                elif kind == MQTT_PINGREQ:
+                    writer.write(bytes([MQTT_PINGRESP << 4, 0]))
+                elif kind == MQTT_DISCONNECT:
+                    break
+                await writer.drain()
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        writer.close()
+
+
+def node_argv(config: BenchConfig, case: BenchCase, index: int) -> List[str]:
+    argv = [config.node_binary, '--mqtt', '--index', str(index), '--size', str(case.payload_size),
+            '--period-ms', str(config.period_ms), '--seed', str(config.seed),
+            '--rx-block-size', str(case.block_size), '--rx-st-min-us', str(case.stmin_ms * 1000)]
+    if config.compact:
+        argv.append('--compact')
+    if config.compress:
+        argv.append('--compress')
+    if config.discovery:
+        argv.append('--discovery')
+    return argv
+
+
+async def run_case(config: BenchConfig, case: BenchCase, logger: logging.Logger) -> Dict[str, object]:
+    # Round trips as the nodes report them: node port, microseconds
+    reports: List[Tuple[int, int]] = []
+    reports_lock = threading.Lock()
+
+    def on_report(port: int, data: bytes) -> None:
+        _, rtt_us = struct.unpack('<II', data)
+        with reports_lock:
+            reports.append((port, rtt_us))
+
+    sim = canbus_sim.RealTimeCanBus(config.bitrate, config.error_rate, config.seed)
+    sim.start()
+    bus = sim.add_python_port()
+    broker = StubBroker()
+    broker_port = await broker.start()
+    server = isotp_can_server.IsotpCanServer(bus, logger, rx_block_size=case.block_size, rx_stmin_ms=case.stmin_ms,
+                                             bitrate=config.bitrate)
+    bridge = can_tcp_bridge.CanTcpBridge(server, '127.0.0.1', broker_port, logger)
+    tasks = [asyncio.create_task(server.run()), asyncio.create_task(bridge.run())]
+    try:
+        for i in range(config.nodes):
+            if i > 0:
+                await asyncio.sleep(config.join_interval_ms / 1000.0)
+            sim.add_process_port(node_argv(config, case, i), on_report)
+        await asyncio.sleep(config.warmup)
+
+        with reports_lock:
+            first = len(reports)
+        bus_before = sim.stats()
+        start = time.monotonic()
+        await asyncio.sleep(config.duration)
+        elapsed = time.monotonic() - start
+        bus_after = sim.stats()
+        with reports_lock:
+            window = reports[first:]
+    finally:
+        for task in tasks:
+            task.cancel()
+        await asyncio.gather(*tasks, return_exceptions=True)
+        await broker.close()
+        sim.stop()
+        bus.shutdown()
+
+    latencies = [rtt_us / 1000.0 for _, rtt_us in window]
+    nodes_reporting: Set[int] = {port for port, _ in window}
+    frames = bus_after.frames - bus_before.frames
+    return {
+        'nodes_publishing': len(nodes_reporting),
+        'publishes': len(window),
+        'elapsed_s': round(elapsed, 3),
+        'publishes_per_s': round(len(window) / elapsed, 2),
+        'payload_bytes_per_s': round(len(window) * case.payload_size / elapsed, 1),
+        'latency_ms': {f'p{p}': sim_main.percentile(latencies, p) for p in (50, 90, 99, 100)},
+        'bus_frames_per_s': round(frames / elapsed, 1),
+        'bus_error_frames': bus_after.error_frames - bus_before.error_frames,
+        'bus_utilization': round((bus_after.busy_time - bus_before.busy_time) / elapsed, 4),
+    }
+
+
+def git_revision() -> Optional[str]:
+    try:
+        out = subprocess.run(['git', 'describe', '--always', '--dirty'], capture_output=True, text=True,
+                             cwd=os.path.dirname(os.path.abspath(__file__)), check=True)
+    except (OSError, subprocess.CalledProcessError):
+        return None
+    return out.stdout.strip()
+
+
+async def run_bench(config: BenchConfig, cases: Sequence[BenchCase], logger: logging.Logger) -> Dict[str, object]:
+    results = []
+    for case in cases:
+        logger.info(f"Running {case}")
+        results.append({'case': dataclasses.asdict(case), 'result': await run_case(config, case, logger)})
+    return {
+        'revision': git_revision(),
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        'config': {k: v for k, v in dataclasses.asdict(config).items() if k != 'node_binary'},
+        'cases': results,
+    }
+
+
+def _metric(result: Dict[str, object], path: str) -> Optional[float]:
+    value: object = result
+    for key in path.split('.'):
+        if not isinstance(value, dict):
+            return None
+        value = value.get(key)
+    return float(value) if isinstance(value, (int, float)) else None
+
+
+def compare(old: Dict[str, object], new: Dict[str, object]) -> List[str]:
+    """One line per case and metric, with the change from old to new."""
+    def by_case(doc: Dict[str, object]) -> Dict[Tuple[Tuple[str, object], ...], Dict[str, object]]:
+        cases = doc.get('cases')
+        assert isinstance(cases, list)
+        return {tuple(sorted(c['case'].items())): c['result'] for c in cases}
+
+    old_cases = by_case(old)
+    lines = [f"{old.get('revision')} -> {new.get('revision')}"]
+    for key, result in by_case(new).items():
+        if key not in old_cases:
+            continue
+        lines.append(' '.join(f'{k}={v}' for k, v in key))
+        for metric, higher_is_better in COMPARED_METRICS:
+            before, after = _metric(old_cases[key], metric), _metric(result, metric)
+            if before is None or after is None:
+                continue
+            change = (after - before) / before * 100 if before else 0.0
+            better = (change > 0) == higher_is_better
+            mark = '' if abs(change) < 5 else (' better' if better else ' WORSE')
+            lines.append(f'  {metric:22} {before:10.2f} -> {after:10.2f} ({change:+.1f}%){mark}')
+    return lines
+
+
+def _int_list(value: str) -> List[int]:
+    return [int(v) for v in value.split(',')]
+
+
+def main(argv: Sequence[str]) -> None:
+    defaults = BenchConfig()
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--sizes', type=_int_list, default=[16, 64, 256, 1024], help="PUBLISH payload sizes")
+    parser.add_argument('--block-sizes', type=_int_list, default=[0, 8])
+    parser.add_argument('--stmins', type=_int_list, default=[0, 2], help="STmin values in milliseconds")
+    parser.add_argument('--nodes', type=int, default=defaults.nodes)
+    parser.add_argument('--bitrate', type=int, default=defaults.bitrate)
+    parser.add_argument('--warmup', type=float, default=defaults.warmup, help="seconds")
+    parser.add_argument('--duration', type=float, default=defaults.duration, help="seconds measured per case")
+    parser.add_argument('--period-ms', type=int, default=defaults.period_ms,
+                        help="PUBLISH period of each node, 0 for back to back")
+    parser.add_argument('--error-rate', type=float, default=defaults.error_rate)
+    parser.add_argument('--seed', type=int, default=defaults.seed)
+    parser.add_argument('--join-interval-ms', type=int, default=defaults.join_interval_ms)
+    parser.add_argument('--compact', action='store_true', help="nodes send topic aliases")
+    parser.add_argument('--compress', action='store_true', help="nodes compress large PUBLISH packets")
+    parser.add_argument('--discovery', action='store_true',
+                        help="nodes publish Home Assistant discovery configs, cut or padded to the payload size")
+    parser.add_argument('--node-binary', default=os.environ.get('H42_SIM_NODE', defaults.node_binary))
+    parser.add_argument('--output', help="write the results here as well as to stdout")
+    parser.add_argument('--compare', help="earlier results to compare against")
+    args = parser.parse_args(argv)
+
+    config = BenchConfig(**{f.name: getattr(args, f.name) for f in dataclasses.fields(BenchConfig)})
+    cases = [BenchCase(*c) for c in itertools.product(args.sizes, args.block_sizes, args.stmins)]
+    logging.basicConfig(level=logging.WARNING, stream=sys.stderr)
+    logger = logging.getLogger('bench')
+    results = asyncio.run(run_bench(config, cases, logger))
+
+    text = json.dumps(results, indent=2)
+    print(text)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    if args.compare:
+        with open(args.compare) as f:
+            old = json.load(f)
+        print('\n'.join(compare(old, results)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
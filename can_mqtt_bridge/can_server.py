@@ -1,11 +1,28 @@
-from typing import Protocol
+from typing import Optional, Protocol, Sequence
 
+from msg import Priority
 from packet import RecvPacket, SendPacket
 
 
 class CanServer(Protocol):
-    def recv_packet(self) -> RecvPacket:
+    async def recv_packet(self) -> RecvPacket:
         pass
 
-    def send_packet(self, p: SendPacket) -> None:
+    async def send_packet(self, p: SendPacket) -> None:
+        pass
+
+    async def send_discovery_status(self, dst_addr: int, set_hash: int, cached: bool) -> None:
+        """Answers a discovery check of the node."""
+        pass
+
+    def node_last_heard(self, node_addr: int) -> Optional[float]:
+        """time.monotonic() of the last frame from the node, None for a node we don't know."""
+        pass
+
+    def accepts_broadcast(self, node_addr: int) -> bool:
+        """Whether send_broadcast() may include the node."""
+        pass
+
+    async def send_broadcast(self, dst_addrs: Sequence[int], data: bytes, priority: Priority = Priority.STATE) -> None:
+        """Sends data to all of dst_addrs at once. Up to MAX_PACKET_SIZE bytes with one byte per node and one more."""
         pass
@@ -1,70 +1,277 @@
+import asyncio
 import logging
-import socket
-import threading
-from typing import Dict
+import time
+from typing import Dict, List, Optional, Set, Tuple, Union
 
 from can_server import CanServer
-from packet import SendPacket
+from discovery_cache import DiscoveryCache
+from mqtt_compact import DISCOVERY_CHECK, DISCOVERY_COMMIT, CompactDecoder, CompactDecoderError, Discovery
+from mqtt_keepalive import KeepaliveProxy
+from mqtt_mux import MqttMux, MuxOutput
+from mqtt_priority import StreamPriority
+from packet import MAX_PACKET_SIZE, SendPacket
 
-# Define maximum send size as a constant. ISOTP max is 4095
-MAX_SEND_SIZE = 2048
+
+class _Broadcast:
+    """Data for several nodes in multiplex mode. Sent once each of them has been sent what was queued before it."""
+
+    def __init__(self, node_ids: Tuple[int, ...], data: bytes) -> None:
+        self.node_ids = node_ids
+        self.data = data
+        self.ready = 0
+        self.sent = asyncio.Event()
 
 
 class CanTcpBridge:
+    # How often broker sessions of nodes with FEATURE_KEEPALIVE_PROXY are looked after
+    KEEPALIVE_TICK_S = 1.0
+    # The broker session of multiplex mode
+    MUX_CLIENT_ID = "h42_can_bridge"
+    MUX_KEEPALIVE_S = 60
+    MUX_RECONNECT_S = 5.0
+
     def __init__(self,
                  can_srv: CanServer,
                  tcp_server_host: str,
                  tcp_server_port: int,
-                 logger: logging.Logger):
+                 logger: logging.Logger,
+                 multiplex: bool = False):
+        """multiplex carries all nodes over one broker session (mqtt_mux.py) rather than a TCP connection each."""
         self.can_server = can_srv
         self.tcp_server_host = tcp_server_host
         self.tcp_server_port = tcp_server_port
         self.logger = logger
-        self.connections: Dict[int, socket.socket] = {}
-        self.lock = threading.Lock()
+        self.connections: Dict[int, asyncio.StreamWriter] = {}
+        # Per node, for nodes sending compact MQTT. Outlives TCP connections like the node's stream does
+        self.decoders: Dict[int, CompactDecoder] = {}
+        self.discovery_cache = DiscoveryCache()
+        # Per TCP connection of a node with FEATURE_KEEPALIVE_PROXY
+        self.keepalives: Dict[int, KeepaliveProxy] = {}
+        self.mux = MqttMux(self.MUX_CLIENT_ID, self.MUX_KEEPALIVE_S) if multiplex else None
+        self.mux_writer: Optional[asyncio.StreamWriter] = None
+        # Per node in multiplex mode, what is on its way to the node
+        self.mux_queues: Dict[int, asyncio.Queue[Union[bytes, _Broadcast]]] = {}
+        # The event loop only keeps weak references to tasks
+        self.handlers: Set[asyncio.Task[None]] = set()
 
-    def run(self):
-        receiver_thread = threading.Thread(target=self._receiver_loop)
-        receiver_thread.start()
-        receiver_thread.join()
+    async def run(self) -> None:
+        if self.mux is None:
+            await asyncio.gather(self._receiver_loop(), self._keepalive_loop())
+        else:
+            await asyncio.gather(self._receiver_loop(), self._keepalive_loop(), self._mux_broker_loop())
 
-    def _receiver_loop(self):
+    async def _receiver_loop(self) -> None:
         while True:
-            packet = self.can_server.recv_packet()
-            with self.lock:
-                if packet.src_addr not in self.connections:
-                    self.logger.info(f"First CAN packet from node {packet.src_addr}. Opening new TCP connection")
-                    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-                    sock.connect((self.tcp_server_host, self.tcp_server_port))
-                    self.connections[packet.src_addr] = sock
-                    handler_thread = threading.Thread(target=self._handle_connection, args=(packet.src_addr, sock))
-                    handler_thread.start()
-                else:
-                    sock = self.connections[packet.src_addr]
+            packet = await self.can_server.recv_packet()
+            data = packet.data
+            if packet.compact_mqtt:
+                decoder = self.decoders.setdefault(packet.src_addr, CompactDecoder())
+                try:
+                    items = decoder.feed_items(data)
+                except CompactDecoderError as e:
+                    # The node starts over with a CONNECT once the broker connection is gone
+                    self.logger.error(f"Bad compact MQTT from node {packet.src_addr}: {e}. Closing TCP connection.")
+                    writer = self.connections.get(packet.src_addr)
+                    if writer is not None:
+                        self._close_connection(packet.src_addr, writer)
+                    continue
+                data = await self._expand_discovery(packet.src_addr, items)
+                if not data:
+                    continue
+            if self.mux is not None:
+                await self._mux_send(self.mux.from_node(packet.src_addr, data, packet.keepalive_proxy))
+                continue
+            writer = self.connections.get(packet.src_addr)
+            if writer is None:
+                self.logger.info(f"First CAN packet from node {packet.src_addr}. Opening new TCP connection")
+                reader, writer = await asyncio.open_connection(self.tcp_server_host, self.tcp_server_port)
+                self.connections[packet.src_addr] = writer
+                proxy = KeepaliveProxy() if packet.keepalive_proxy else None
+                if proxy is not None:
+                    self.keepalives[packet.src_addr] = proxy
+                handler = asyncio.create_task(self._handle_connection(packet.src_addr, reader, writer, proxy))
+                self.handlers.add(handler)
+                handler.add_done_callback(self.handlers.discard)
+            proxy = self.keepalives.get(packet.src_addr)
+            if proxy is not None:
+                data = proxy.from_node(data)
             try:
-                sock.sendall(packet.data)
+                writer.write(data)
+                await writer.drain()
             except Exception as e:
                 self.logger.error(
                     f"Error sending to TCP server for node {packet.src_addr}: {e}. Closing TCP connection.")
-                with self.lock:
-                    if packet.src_addr in self.connections and self.connections[packet.src_addr] == sock:
-                        del self.connections[packet.src_addr]
-                sock.close()
+                self._close_connection(packet.src_addr, writer)
+
+    async def _keepalive_loop(self) -> None:
+        """Pings the broker for nodes that leave it to us, and hangs up on those gone from the bus."""
+        while True:
+            await asyncio.sleep(self.KEEPALIVE_TICK_S)
+            now = time.monotonic()
+            if self.mux is not None:
+                await self._mux_tick(now)
+            for node_id, proxy in list(self.keepalives.items()):
+                writer = self.connections[node_id]
+                if proxy.node_lost(now, self.can_server.node_last_heard(node_id)):
+                    self.logger.warning(f"Node {node_id} silent on the bus. Closing TCP connection.")
+                    self._close_connection(node_id, writer)
+                    continue
+                ping = proxy.ping(now)
+                if ping is not None:
+                    writer.write(ping)
+
+    async def _mux_tick(self, now: float) -> None:
+        assert self.mux is not None
+        await self._mux_send(self.mux.expire(now, self.can_server.node_last_heard))
+        if self.mux_writer is None:
+            return
+        if self.mux.broker_silent(now):
+            self.logger.error("Broker not answering pings. Closing TCP connection.")
+            self.mux_writer.close()
+            return
+        ping = self.mux.ping(now)
+        if ping is not None:
+            self.mux_writer.write(ping)
+
+    async def _mux_broker_loop(self) -> None:
+        """Keeps the broker session of all nodes open."""
+        assert self.mux is not None
+        while True:
+            try:
+                reader, writer = await asyncio.open_connection(self.tcp_server_host, self.tcp_server_port)
+            except OSError as e:
+                self.logger.error(f"Error connecting to TCP server: {e}. Retrying in {self.MUX_RECONNECT_S} s")
+                await asyncio.sleep(self.MUX_RECONNECT_S)
+                continue
+            self.logger.info("Opened TCP connection for all nodes")
+            self.mux_writer = writer
+            writer.write(self.mux.connect())
+            try:
+                while True:
+                    data = await reader.read(MAX_PACKET_SIZE)
+                    if not data:
+                        break
+                    await self._mux_send(self.mux.from_broker(data))
+            except Exception as e:
+                self.logger.error(f"Error receiving from TCP server: {e}. Closing connection")
+            finally:
+                self.mux_writer = None
+                self.mux.broker_lost()
+                writer.close()
+            await asyncio.sleep(self.MUX_RECONNECT_S)
+
+    async def _mux_send(self, out: MuxOutput) -> None:
+        for node_id in out.lost:
+            self.logger.warning(f"Node {node_id} gone or its stream broken. Ended its MQTT session.")
+        for node_ids, data in out.node_items:
+            # Once for the nodes that take broadcasts, if it fits
+            shared = tuple(n for n in node_ids if self.can_server.accepts_broadcast(n)) if len(node_ids) > 1 else ()
+            if len(shared) > 1 and 1 + len(shared) + len(data) <= MAX_PACKET_SIZE:
+                broadcast = _Broadcast(shared, bytes(data))
+                for node_id in shared:
+                    self._mux_queue(node_id).put_nowait(broadcast)
+                node_ids = tuple(n for n in node_ids if n not in shared)
+            for node_id in node_ids:
+                self._mux_queue(node_id).put_nowait(bytes(data))
+        if out.broker and self.mux_writer is not None:
+            try:
+                self.mux_writer.write(out.broker)
+                await self.mux_writer.drain()
+            except Exception as e:
+                self.logger.error(f"Error sending to TCP server: {e}. Closing TCP connection.")
+                self.mux_writer.close()
+
+    def _mux_queue(self, node_id: int) -> asyncio.Queue[Union[bytes, _Broadcast]]:
+        queue = self.mux_queues.get(node_id)
+        if queue is None:
+            queue = self.mux_queues[node_id] = asyncio.Queue()
+            sender = asyncio.create_task(self._mux_node_sender(node_id, queue))
+            self.handlers.add(sender)
+            sender.add_done_callback(self.handlers.discard)
+        return queue
+
+    async def _mux_node_sender(self, node_id: int, queue: asyncio.Queue[Union[bytes, _Broadcast]]) -> None:
+        """One per node, so a node slow to take its packets holds up no other. Except for broadcasts, which wait
+        for all of their nodes."""
+        item: Optional[Union[bytes, _Broadcast]] = None
+        priority = StreamPriority()
+        while True:
+            if item is None:
+                item = await queue.get()
+            if isinstance(item, _Broadcast):
+                await self._mux_broadcast(item)
+                item = None
+                continue
+            data, item = item, None
+            while item is None and not queue.empty():
+                queued = queue.get_nowait()
+                if isinstance(queued, _Broadcast):
+                    item = queued
+                else:
+                    data += queued
+            try:
+                for i in range(0, len(data), MAX_PACKET_SIZE):
+                    chunk = data[i:i + MAX_PACKET_SIZE]
+                    await self.can_server.send_packet(SendPacket(node_id, chunk, priority.feed(chunk)))
+            except Exception as e:
+                self.logger.error(f"Error sending to node {node_id}: {e}")
+
+    async def _mux_broadcast(self, broadcast: _Broadcast) -> None:
+        """The sender of the last node to get to the broadcast sends it, the others wait for that. The nodes
+        queue broadcasts in the same order, so they don't wait for each other in a circle."""
+        broadcast.ready += 1
+        if broadcast.ready < len(broadcast.node_ids):
+            await broadcast.sent.wait()
+            return
+        try:
+            await self.can_server.send_broadcast(broadcast.node_ids, broadcast.data,
+                                                 StreamPriority().feed(broadcast.data))
+        except Exception as e:
+            self.logger.error(f"Error broadcasting to nodes {list(broadcast.node_ids)}: {e}")
+        finally:
+            broadcast.sent.set()
+
+    def _close_connection(self, node_id: int, writer: asyncio.StreamWriter) -> None:
+        if self.connections.get(node_id) is writer:
+            del self.connections[node_id]
+            self.keepalives.pop(node_id, None)
+        writer.close()
+
+    async def _expand_discovery(self, node_id: int, items: List[Union[bytes, Discovery]]) -> bytes:
+        """The MQTT stream of the node, with cached discovery configs in place of a check that hits."""
+        out = bytearray()
+        for item in items:
+            if isinstance(item, bytes):
+                self.discovery_cache.record(node_id, item)
+                out += item
+            elif item.op == DISCOVERY_CHECK:
+                replay = self.discovery_cache.check(node_id, item.set_hash)
+                if replay is not None:
+                    self.logger.info(f"Node {node_id} discovery set {item.set_hash:08x} cached, "
+                                     f"replaying {len(replay)} bytes")
+                    out += replay
+                await self.can_server.send_discovery_status(node_id, item.set_hash, replay is not None)
+            elif item.op == DISCOVERY_COMMIT:
+                if not self.discovery_cache.commit(node_id, item.set_hash):
+                    self.logger.warning(f"Node {node_id} committed discovery set {item.set_hash:08x} it did not "
+                                        f"check, or that was too large to cache")
+        return bytes(out)
 
-    def _handle_connection(self, node_id: int, sock: socket.socket):
+    async def _handle_connection(self, node_id: int, reader: asyncio.StreamReader,
+                                 writer: asyncio.StreamWriter, proxy: Optional[KeepaliveProxy]) -> None:
+        priority = StreamPriority()
         while True:
             try:
-                data = sock.recv(MAX_SEND_SIZE)
+                # One packet at a time, however large the MQTT packet is. TCP holds back the rest
+                data = await reader.read(MAX_PACKET_SIZE)
                 if not data:
                     break
-                # Split data into chunks of MAX_SEND_SIZE
-                for i in range(0, len(data), MAX_SEND_SIZE):
-                    chunk = data[i:i + MAX_SEND_SIZE]
-                    self.can_server.send_packet(SendPacket(dst_addr=node_id, data=chunk))
+                if proxy is not None:
+                    data = proxy.from_broker(data)
+                    if not data:
+                        continue
+                await self.can_server.send_packet(SendPacket(node_id, data, priority.feed(data)))
             except Exception as e:
                 self.logger.error(f"Error receiving from TCP server for node {node_id}: {e}. Closing connection")
                 break
-        with self.lock:
-            if node_id in self.connections and self.connections[node_id] == sock:
-                del self.connections[node_id]
-        sock.close()
+        self._close_connection(node_id, writer)
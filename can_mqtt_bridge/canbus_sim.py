@@ -0,0 +1,447 @@
+"""Simulated CAN bus for running many nodes against the bridge without hardware.
+
+CanBusModel is a discrete-event model of the bus: frame length with bit stuffing, arbitration by identifier,
+error frames and the transmit error counter. It has no clock of its own, the caller advances it, so it is
+deterministic in tests.
+
+RealTimeCanBus drives the model with the wall clock and connects it to nodes: host-built firmware processes
+(esp_can_transport/host, h42_sim_node) over pipes, and python-can users such as IsotpCanServer through
+SimulatedCanBus.
+"""
+import collections
+import dataclasses
+import queue
+import random
+import struct
+import subprocess
+import threading
+import time
+from typing import Callable, Deque, Dict, List, Optional, Sequence
+
+import can
+
+CRC15_POLY = 0x4599
+# CRC delimiter, ACK slot, ACK delimiter and end of frame, never stuffed
+FRAME_TAIL_BITS = 1 + 1 + 1 + 7
+INTERMISSION_BITS = 3
+# Error flag and error delimiter. Flags of other nodes overlap the first one.
+ERROR_FRAME_BITS = 6 + 8
+# An error passive transmitter waits this long before it may start again
+SUSPEND_TRANSMISSION_BITS = 8
+# Transmit error counter thresholds and steps
+ERROR_PASSIVE_TEC = 128
+BUS_OFF_TEC = 256
+TEC_ERROR_STEP = 8
+# Recessive bits a bus-off node waits for before it may join again
+BUS_OFF_RECOVERY_BITS = 128 * 11
+
+CLASSIC_MAX_DATA = 8
+
+
+def _bits(value: int, width: int) -> List[int]:
+    return [(value >> i) & 1 for i in range(width - 1, -1, -1)]
+
+
+def crc15(bits: Sequence[int]) -> int:
+    crc = 0
+    for bit in bits:
+        feedback = bit ^ ((crc >> 14) & 1)
+        crc = (crc << 1) & 0x7FFF
+        if feedback:
+            crc ^= CRC15_POLY
+    return crc
+
+
+def stuffed_bits(bits: Sequence[int]) -> List[int]:
+    """Inserts the complement after every five equal bits, the stuff bit starts the next run."""
+    out: List[int] = []
+    run_bit, run = -1, 0
+    for bit in bits:
+        out.append(bit)
+        if bit == run_bit:
+            run += 1
+        else:
+            run_bit, run = bit, 1
+        if run == 5:
+            run_bit, run = 1 - bit, 1
+            out.append(run_bit)
+    return out
+
+
+def frame_header_bits(can_id: int, data: bytes, extended: bool = True) -> List[int]:
+    """Unstuffed bits from start of frame to the end of the data field of a data frame."""
+    if extended:
+        bits = [0] + _bits(can_id >> 18, 11) + [1, 1] + _bits(can_id & 0x3FFFF, 18) + [0, 0, 0]
+    else:
+        bits = [0] + _bits(can_id, 11) + [0, 0, 0]
+    bits += _bits(len(data), 4)
+    for b in data:
+        bits += _bits(b, 8)
+    return bits
+
+
+def frame_bits(can_id: int, data: bytes, extended: bool = True) -> int:
+    """Bus time of a data frame in bits, intermission included."""
+    bits = frame_header_bits(can_id, data, extended)
+    bits += _bits(crc15(bits), 15)
+    return len(stuffed_bits(bits)) + FRAME_TAIL_BITS + INTERMISSION_BITS
+
+
+@dataclasses.dataclass
+class Frame:
+    can_id: int
+    data: bytes
+    # Bus time it became ready to send, the head of its port's queue
+    ready: float = 0.0
+    attempts: int = 0
+
+
+@dataclasses.dataclass
+class PortStats:
+    frames_sent: int = 0
+    errors: int = 0
+    arbitration_lost: int = 0
+    bus_off_count: int = 0
+
+
+@dataclasses.dataclass
+class BusStats:
+    frames: int = 0
+    error_frames: int = 0
+    # Transmissions of several nodes with the same identifier and different data
+    collisions: int = 0
+    busy_time: float = 0.0
+
+
+class _Port:
+    def __init__(self) -> None:
+        # Transmit queue of the controller, only the head takes part in arbitration
+        self.queue: Deque[Frame] = collections.deque()
+        self.tec = 0
+        # Not before this bus time, after suspend transmission or bus-off
+        self.blocked_until = 0.0
+        self.stats = PortStats()
+
+
+DeliverFn = Callable[[Sequence[int], int, bytes, float], None]
+TxDoneFn = Callable[[int, int, bytes, float], None]
+
+
+class CanBusModel:
+    """Classic CAN bus with extended identifiers.
+
+    Frames a port submits leave in order. Whenever the bus goes idle the ready heads of all ports arbitrate
+    and the lowest identifier wins. Equal identifiers with different data, as when the random seed bits of
+    the identifier are the same or for address requests, which have none, end in an error frame while a
+    transmitter that sees the bit error is error active; see __arbitrate(). Random bit errors hit a
+    transmission with probability error_rate. A transmitter error counts 8 on its TEC and a
+    success takes 1 off; error passive transmitters suspend for 8 bits, bus-off ones sit out the recovery
+    time and start over with their queue intact.
+
+    on_deliver(src_ports, can_id, data, t) runs when a frame completes, for the ports that did not send it;
+    on_tx_done(port, can_id, data, t) tells each sender.
+    """
+
+    def __init__(self, bitrate: int, on_deliver: DeliverFn, on_tx_done: TxDoneFn,
+                 error_rate: float = 0.0, seed: int = 0) -> None:
+        self.bit_time = 1.0 / bitrate
+        self.stats = BusStats()
+        self.__on_deliver = on_deliver
+        self.__on_tx_done = on_tx_done
+        self.__error_rate = error_rate
+        self.__random = random.Random(seed)
+        self.__ports: List[_Port] = []
+        # Transmission on the bus: ports whose frame completes at __idle_at, ports that see an error then
+        self.__busy = False
+        self.__current: List[int] = []
+        self.__current_failed: List[int] = []
+        self.__idle_at = 0.0
+
+    def add_port(self) -> int:
+        self.__ports.append(_Port())
+        return len(self.__ports) - 1
+
+    def port_stats(self, port: int) -> PortStats:
+        return self.__ports[port].stats
+
+    def tec(self, port: int) -> int:
+        return self.__ports[port].tec
+
+    def submit(self, port: int, can_id: int, data: bytes, now: float) -> None:
+        if len(data) > CLASSIC_MAX_DATA:
+            raise ValueError(f"{len(data)} bytes do not fit a classic CAN frame")
+        q = self.__ports[port].queue
+        q.append(Frame(can_id, bytes(data), ready=now))
+
+    def pending(self, port: int) -> int:
+        return len(self.__ports[port].queue)
+
+    def next_event(self) -> Optional[float]:
+        """Bus time at which advance() has something to do."""
+        if self.__busy:
+            return self.__idle_at
+        return self.__next_start()
+
+    def advance(self, now: float) -> None:
+        """Runs the bus up to `now`."""
+        while True:
+            if self.__busy:
+                if self.__idle_at > now:
+                    return
+                self.__finish()
+                continue
+            start = self.__next_start()
+            if start is None or start > now:
+                return
+            self.__arbitrate(start)
+
+    def __ready_time(self, port: _Port) -> float:
+        return max(port.queue[0].ready, port.blocked_until)
+
+    def __next_start(self) -> Optional[float]:
+        ready = [self.__ready_time(p) for p in self.__ports if p.queue]
+        if not ready:
+            return None
+        return max(self.__idle_at, min(ready))
+
+    def __arbitrate(self, start: float) -> None:
+        contenders = [i for i, p in enumerate(self.__ports) if p.queue and self.__ready_time(p) <= start]
+        lowest = min(self.__ports[i].queue[0].can_id for i in contenders)
+        winners = [i for i in contenders if self.__ports[i].queue[0].can_id == lowest]
+        for i in contenders:
+            if i not in winners:
+                self.__ports[i].stats.arbitration_lost += 1
+        for i in winners:
+            self.__ports[i].queue[0].attempts += 1
+        frame = self.__ports[winners[0]].queue[0]
+        bits = frame_bits(frame.can_id, frame.data)
+
+        # Past the identifier, a transmitter sending recessive that reads dominant sees a bit error. An
+        # error active one destroys the frame with its error flag, an error passive one's flag is recessive
+        # and the frame goes on without it.
+        headers = {i: frame_header_bits(f.can_id, f.data) for i, f in ((i, self.__ports[i].queue[0])
+                                                                       for i in winners)}
+        senders, failed = list(winners), []
+        error_at: Optional[int] = None
+        if any(headers[i] != headers[winners[0]] for i in winners):
+            self.stats.collisions += 1
+        while error_at is None and any(headers[i] != headers[senders[0]] for i in senders):
+            b = next(b for b in range(len(headers[senders[0]])) if len({headers[i][b] for i in senders}) > 1)
+            losers = [i for i in senders if headers[i][b] == 1]
+            senders = [i for i in senders if headers[i][b] == 0]
+            failed += losers
+            if any(self.__ports[i].tec < ERROR_PASSIVE_TEC for i in losers):
+                error_at = b
+        if error_at is None and self.__error_rate > 0 and self.__random.random() < self.__error_rate:
+            error_at = self.__random.randrange(1, bits - FRAME_TAIL_BITS - INTERMISSION_BITS + 1)
+        if error_at is not None:
+            senders, failed = [], winners
+
+        self.__current = senders
+        self.__current_failed = failed
+        duration = bits if error_at is None else error_at + ERROR_FRAME_BITS + INTERMISSION_BITS
+        self.__busy = True
+        self.__idle_at = start + duration * self.bit_time
+        self.stats.busy_time += duration * self.bit_time
+
+    def __finish(self) -> None:
+        senders, self.__current = self.__current, []
+        failed, self.__current_failed = self.__current_failed, []
+        self.__busy = False
+        t = self.__idle_at
+        for i in failed:
+            self.__on_error(i, t)
+        if not senders:
+            self.stats.error_frames += 1
+            return
+        self.stats.frames += 1
+        frame = self.__ports[senders[0]].queue[0]
+        for i in senders:
+            port = self.__ports[i]
+            sent = port.queue.popleft()
+            port.tec = max(port.tec - 1, 0)
+            port.stats.frames_sent += 1
+            if port.queue:
+                port.queue[0].ready = max(port.queue[0].ready, t)
+            self.__on_tx_done(i, sent.can_id, sent.data, t)
+        self.__on_deliver(senders, frame.can_id, frame.data, t)
+
+    def __on_error(self, i: int, t: float) -> None:
+        port = self.__ports[i]
+        port.stats.errors += 1
+        port.tec += TEC_ERROR_STEP
+        if port.tec >= BUS_OFF_TEC:
+            port.stats.bus_off_count += 1
+            port.tec = 0
+            port.blocked_until = t + BUS_OFF_RECOVERY_BITS * self.bit_time
+        elif port.tec >= ERROR_PASSIVE_TEC:
+            port.blocked_until = t + SUSPEND_TRANSMISSION_BITS * self.bit_time
+
+
+# Pipe record between RealTimeCanBus and h42_sim_node, see esp_can_transport/host/sim/sim_node.c
+SIM_RECORD = struct.Struct('<IBB2x8s')
+SIM_RECORD_FRAME = 0
+SIM_RECORD_TX_DONE = 1
+# From a node, a measurement of its workload
+SIM_RECORD_REPORT = 2
+
+ReportFn = Callable[[int, bytes], None]
+
+
+class _Endpoint:
+    def deliver(self, can_id: int, data: bytes) -> None:
+        raise NotImplementedError
+
+    def tx_done(self, can_id: int, data: bytes) -> None:
+        pass
+
+    def close(self) -> None:
+        pass
+
+
+class RealTimeCanBus:
+    """Runs a CanBusModel against the wall clock in its own thread. Bus time 0 is start()."""
+
+    def __init__(self, bitrate: int, error_rate: float = 0.0, seed: int = 0) -> None:
+        self.model = CanBusModel(bitrate, self.__deliver, self.__tx_done, error_rate, seed)
+        self.__endpoints: Dict[int, _Endpoint] = {}
+        self.__cond = threading.Condition()
+        self.__thread: Optional[threading.Thread] = None
+        self.__running = False
+        self.__t0 = time.monotonic()
+
+    def now(self) -> float:
+        return time.monotonic() - self.__t0
+
+    def add_endpoint(self, endpoint: _Endpoint) -> int:
+        with self.__cond:
+            port = self.model.add_port()
+            self.__endpoints[port] = endpoint
+            return port
+
+    def add_python_port(self) -> 'SimulatedCanBus':
+        return SimulatedCanBus(self)
+
+    def add_process_port(self, argv: Sequence[str], on_report: Optional[ReportFn] = None) -> 'ProcessPort':
+        """on_report(port, data) runs on a reader thread for each SIM_RECORD_REPORT of the node."""
+        return ProcessPort(self, argv, on_report)
+
+    def stats(self) -> BusStats:
+        """A copy of the bus statistics so far."""
+        with self.__cond:
+            return dataclasses.replace(self.model.stats)
+
+    def submit(self, port: int, can_id: int, data: bytes) -> None:
+        with self.__cond:
+            self.model.submit(port, can_id, data, self.now())
+            self.__cond.notify()
+
+    def start(self) -> None:
+        self.__t0 = time.monotonic()
+        self.__running = True
+        self.__thread = threading.Thread(target=self.__run, name='can-bus-sim', daemon=True)
+        self.__thread.start()
+
+    def stop(self) -> None:
+        with self.__cond:
+            self.__running = False
+            self.__cond.notify()
+        if self.__thread is not None:
+            self.__thread.join()
+        for endpoint in list(self.__endpoints.values()):
+            endpoint.close()
+
+    def __run(self) -> None:
+        with self.__cond:
+            while self.__running:
+                self.model.advance(self.now())
+                deadline = self.model.next_event()
+                self.__cond.wait(None if deadline is None else max(deadline - self.now(), 0))
+
+    # Model callbacks, with __cond held
+    def __deliver(self, src_ports: Sequence[int], can_id: int, data: bytes, t: float) -> None:
+        for port, endpoint in self.__endpoints.items():
+            if port not in src_ports:
+                endpoint.deliver(can_id, data)
+
+    def __tx_done(self, port: int, can_id: int, data: bytes, t: float) -> None:
+        self.__endpoints[port].tx_done(can_id, data)
+
+
+class SimulatedCanBus(can.BusABC, _Endpoint):  # type: ignore[misc]
+    """python-can view of a RealTimeCanBus port. send() queues the frame at the controller and returns."""
+
+    def __init__(self, sim: RealTimeCanBus) -> None:
+        super().__init__(channel='h42-sim')
+        self.channel_info = 'h42 simulated CAN bus'
+        self.__sim = sim
+        self.__rx: 'queue.Queue[can.Message]' = queue.Queue()
+        self.__port = sim.add_endpoint(self)
+
+    def send(self, msg: can.Message, timeout: Optional[float] = None) -> None:
+        self.__sim.submit(self.__port, msg.arbitration_id, bytes(msg.data))
+
+    def _recv_internal(self, timeout: Optional[float]) -> 'tuple[Optional[can.Message], bool]':
+        try:
+            return self.__rx.get(timeout=timeout), False
+        except queue.Empty:
+            return None, False
+
+    def deliver(self, can_id: int, data: bytes) -> None:
+        self.__rx.put(can.Message(arbitration_id=can_id, data=data, is_extended_id=True,
+                                  timestamp=time.time()))
+
+
+class ProcessPort(_Endpoint):
+    """A node process on the bus. It sends SIM_RECORD_FRAME records on stdout and gets frames from other
+    nodes and SIM_RECORD_TX_DONE for its own on stdin, so it has one frame in the controller at a time. It may
+    also send SIM_RECORD_REPORT records, which go to on_report."""
+
+    def __init__(self, sim: RealTimeCanBus, argv: Sequence[str], on_report: Optional[ReportFn] = None) -> None:
+        self.__sim = sim
+        self.__on_report = on_report
+        self.__process = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                                          stderr=subprocess.DEVNULL)
+        self.__port = sim.add_endpoint(self)
+        self.__closed = False
+        self.__reader = threading.Thread(target=self.__read, name=f'sim-node-{self.__port}', daemon=True)
+        self.__reader.start()
+
+    @property
+    def port(self) -> int:
+        return self.__port
+
+    def __read(self) -> None:
+        assert self.__process.stdout is not None
+        while (record := self.__process.stdout.read(SIM_RECORD.size)) and len(record) == SIM_RECORD.size:
+            can_id, kind, dlc, data = SIM_RECORD.unpack(record)
+            if kind == SIM_RECORD_FRAME:
+                self.__sim.submit(self.__port, can_id, data[:dlc])
+            elif kind == SIM_RECORD_REPORT and self.__on_report is not None:
+                self.__on_report(self.__port, data[:dlc])
+
+    def __write(self, kind: int, can_id: int, data: bytes) -> None:
+        if self.__closed:
+            return
+        assert self.__process.stdin is not None
+        try:
+            self.__process.stdin.write(SIM_RECORD.pack(can_id, kind, len(data), data))
+            self.__process.stdin.flush()
+        except (BrokenPipeError, ValueError):
+            self.__closed = True
+
+    def deliver(self, can_id: int, data: bytes) -> None:
+        self.__write(SIM_RECORD_FRAME, can_id, data)
+
+    def tx_done(self, can_id: int, data: bytes) -> None:
+        self.__write(SIM_RECORD_TX_DONE, can_id, data)
+
+    def close(self) -> None:
+        self.__closed = True
+        if self.__process.stdin is not None:
+            self.__process.stdin.close()
+        try:
+            self.__process.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            self.__process.kill()
+            self.__process.wait()
@@ -0,0 +1,121 @@
+"""Discovery sets of nodes granted FEATURE_DISCOVERY_CACHE, see h42_can_discovery_check() in the firmware.
+
+A node checks for the hash of its discovery set after every CONNECT. On a miss it publishes its discovery configs and
+commits the hash, and the cache keeps the retained PUBLISH packets to config topics it saw in between. On a hit the
+node skips them and the bridge replays them to the broker in their place.
+"""
+from typing import Dict, Optional
+
+from mqtt_compact import MQTT_PUBLISH
+
+CONFIG_SUFFIX = b'/config'
+# Recording is given up on a node going past these
+MAX_RECORDED_PACKET = 8 * 1024
+MAX_RECORDED_SET = 64 * 1024
+
+
+class _Recording:
+    def __init__(self, set_hash: int) -> None:
+        self.set_hash = set_hash
+        self.buf = bytearray()
+        self.configs: Dict[bytes, bytes] = {}
+        self.size = 0
+
+
+class DiscoveryCache:
+    def __init__(self) -> None:
+        # Per node address, replayed after a check hits
+        self.__sets: Dict[int, bytes] = {}
+        self.__recording: Dict[int, _Recording] = {}
+
+    def check(self, node_addr: int, set_hash: int) -> Optional[bytes]:
+        """Returns the MQTT packets to send in place of the node's discovery configs on a hit. On a miss the node's
+        stream is recorded until commit()."""
+        cached = self.__sets.get(node_addr)
+        if cached is not None and int.from_bytes(cached[:4], 'big') == set_hash:
+            self.__recording.pop(node_addr, None)
+            return cached[4:]
+        self.__recording[node_addr] = _Recording(set_hash)
+        return None
+
+    def record(self, node_addr: int, data: bytes) -> None:
+        """The decoded MQTT stream of the node. The node checks and commits on packet boundaries."""
+        rec = self.__recording.get(node_addr)
+        if rec is None:
+            return
+        rec.buf += data
+        while rec.buf:
+            packet_len = _packet_len(rec.buf)
+            if packet_len is None or packet_len > MAX_RECORDED_PACKET:
+                if packet_len is not None or len(rec.buf) > MAX_RECORDED_PACKET:
+                    del self.__recording[node_addr]
+                return
+            if len(rec.buf) < packet_len:
+                return
+            self.__on_packet(rec, bytes(rec.buf[:packet_len]))
+            del rec.buf[:packet_len]
+            if rec.size > MAX_RECORDED_SET:
+                del self.__recording[node_addr]
+                return
+
+    def commit(self, node_addr: int, set_hash: int) -> bool:
+        """Keeps what was recorded since the check of set_hash. False if there is no such check."""
+        rec = self.__recording.pop(node_addr, None)
+        if rec is None or rec.set_hash != set_hash or rec.buf:
+            return False
+        replay = bytearray(set_hash.to_bytes(4, 'big'))
+        for topic, payload in rec.configs.items():
+            replay += _make_publish(topic, payload)
+        self.__sets[node_addr] = bytes(replay)
+        return True
+
+    @staticmethod
+    def __on_packet(rec: _Recording, packet: bytes) -> None:
+        first = packet[0]
+        if first >> 4 != MQTT_PUBLISH or not first & 0x01:
+            return
+        body = packet[_header_len(packet):]
+        topic_len = int.from_bytes(body[:2], 'big')
+        topic = body[2:2 + topic_len]
+        if not topic.endswith(CONFIG_SUFFIX):
+            return
+        qos = (first >> 1) & 0x03
+        payload = body[2 + topic_len + (2 if qos else 0):]
+        # An empty retained payload removes the config
+        old = rec.configs.pop(topic, None)
+        if old is not None:
+            rec.size -= len(topic) + len(old)
+        if payload:
+            rec.configs[topic] = payload
+            rec.size += len(topic) + len(payload)
+
+
+def _header_len(buf: bytes) -> int:
+    i = 1
+    while buf[i] & 0x80:
+        i += 1
+    return i + 1
+
+
+def _packet_len(buf: bytearray) -> Optional[int]:
+    """Length of the packet buf starts with, None until its fixed header is complete."""
+    remaining = 0
+    for i in range(1, min(len(buf), 5)):
+        remaining |= (buf[i] & 0x7F) << (7 * (i - 1))
+        if not buf[i] & 0x80:
+            return i + 1 + remaining
+    return None
+
+
+def _make_publish(topic: bytes, payload: bytes) -> bytes:
+    """QoS 0, so replayed packets never clash with the packet identifiers of the node."""
+    body = len(topic).to_bytes(2, 'big') + topic + payload
+    remaining = len(body)
+    header = bytearray([MQTT_PUBLISH << 4 | 0x01])
+    while True:
+        b = remaining & 0x7F
+        remaining >>= 7
+        header.append(b | (0x80 if remaining else 0))
+        if not remaining:
+            break
+    return bytes(header) + body
@@ -1,43 +1,182 @@
+import asyncio
+import collections
 import logging
-import queue
-import threading
+import time
+from typing import Deque, Optional, Sequence, Tuple
 
 import can
-import isotp
 
+import isotp_engine
 import msg
 import msg as h42msg
 import node
-from packet import RecvPacket, SendPacket
+from packet import MAX_PACKET_SIZE, RecvPacket, SendPacket
 
 
 class IsotpCanServer:
-    def __init__(self, bus: can.BusABC, logger: logging.Logger) -> None:
+    """Serves all nodes on a bus from one asyncio event loop, see run()."""
+
+    def __init__(self, bus: can.BusABC, logger: logging.Logger, can_fd: bool = False,
+                 rx_block_size: int = node.DEFAULT_RX_BLOCK_SIZE, rx_stmin_ms: int = node.DEFAULT_RX_STMIN_MS,
+                 compact_mqtt: bool = True, compress_mqtt: bool = True, discovery_cache: bool = True,
+                 keepalive_proxy: bool = True, broadcast: bool = True, bitrate: Optional[int] = None) -> None:
+        """Set can_fd when the bus can carry CAN FD frames, nodes that ask for them then get up to 64 byte
+        frames. rx_block_size and rx_stmin_ms are the flow control nodes get when sending to us. compact_mqtt
+        lets nodes that ask send topic aliases, compress_mqtt compressed PUBLISH packets, discovery_cache
+        discovery checks. The packets of such nodes are tagged with compact_mqtt. keepalive_proxy lets nodes leave
+        their broker keepalive to us, their packets are tagged with keepalive_proxy. broadcast lets nodes that ask
+        take send_broadcast(). bitrate paces our frames to the bus, so the scheduler in front of it (tx_scheduler.py)
+        decides their order rather than the controller's queue."""
         self.__bus = bus
         self.__logger = logger
-        self.__packet_recv_queue: queue.Queue[RecvPacket] = queue.Queue()
-        self.__node_registry = node.NodeRegistry(self.__my_txfn, self.__packet_recv_queue)
-        self.__recv_worker_thread = threading.Thread(target=self.__recv_worker, daemon=True)
-        self.__recv_worker_thread.start()
+        self.__max_frame_size = h42msg.FD_FRAME_SIZES[-1] if can_fd else h42msg.CLASSIC_FRAME_SIZE
+        self.__features = ((h42msg.FEATURE_COMPACT_MQTT if compact_mqtt else 0) |
+                           (h42msg.FEATURE_COMPRESSION if compress_mqtt else 0) |
+                           (h42msg.FEATURE_DISCOVERY_CACHE if discovery_cache else 0) |
+                           (h42msg.FEATURE_KEEPALIVE_PROXY if keepalive_proxy else 0) |
+                           (h42msg.FEATURE_BROADCAST if broadcast else 0))
+        self.__packet_recv_queue: asyncio.Queue[RecvPacket] = asyncio.Queue()
+        # ISO-TP sessions of all nodes, and the one timer for all of them
+        self.__isotp = isotp_engine.IsotpEngine(send_frame=self.__send_isotp_frame,
+                                                on_message=self.__on_isotp_message,
+                                                on_send_done=self.__on_isotp_send_done,
+                                                on_rx_error=self.__on_isotp_rx_error,
+                                                bitrate=bitrate)
+        self.__isotp_timer: Optional[asyncio.TimerHandle] = None
+        self.__isotp_timer_deadline: Optional[float] = None
+        self.__node_registry = node.NodeRegistry(self.__isotp, rx_block_size, rx_stmin_ms)
+        self.__isotp.add_broadcast_link(h42msg.ADDRESS_BROADCAST)
+        # One per queued broadcast with its priority, like Node's send waiters
+        self.__broadcast_waiters: Deque[Tuple[asyncio.Future[None], h42msg.Priority]] = collections.deque()
+
+    async def run(self) -> None:
+        """Receives and sends on the bus until cancelled."""
+        reader = can.AsyncBufferedReader()
+        # Reads the bus from the event loop if it has a file descriptor, from a single thread otherwise
+        notifier = can.Notifier(self.__bus, [reader], loop=asyncio.get_running_loop())
+        try:
+            await self.__recv_worker(reader)
+        finally:
+            notifier.stop()
+            if self.__isotp_timer is not None:
+                self.__isotp_timer.cancel()
 
-    def send_packet(self, packet: SendPacket) -> None:
+    async def send_packet(self, packet: SendPacket) -> None:
+        """Returns once the packet has been sent."""
         node = self.__node_registry.find_node_by_addr(packet.dst_addr)
         if node is None:
             raise ValueError(f"Node not found: {packet.dst_addr}")
-        node.send_packet(packet)
+        sent = node.send_packet(packet)
+        self.__arm_isotp_timer()
+        await sent
+
+    def accepts_broadcast(self, node_addr: int) -> bool:
+        n = self.__node_registry.find_node_by_addr(node_addr)
+        return n is not None and bool(n.features & h42msg.FEATURE_BROADCAST)
+
+    async def send_broadcast(self, dst_addrs: Sequence[int], data: bytes,
+                             priority: h42msg.Priority = h42msg.Priority.STATE) -> None:
+        """Sends data once to all of dst_addrs, which must accept broadcasts. Returns once it has been sent.
+
+        Nobody sends flow control for a broadcast, so its consecutive frames go out at the highest STmin any
+        node that takes broadcasts asked for, and a node that still misses one loses the message."""
+        message = bytes([len(dst_addrs)]) + bytes(dst_addrs) + data
+        if len(message) > MAX_PACKET_SIZE:
+            raise ValueError(f"Broadcast longer than {MAX_PACKET_SIZE} bytes with its targets")
+        for addr in dst_addrs:
+            if not self.accepts_broadcast(addr):
+                raise ValueError(f"Node {addr} does not take broadcasts")
+        stmin = max((n.stmin for n in self.__node_registry.nodes if n.features & h42msg.FEATURE_BROADCAST),
+                    key=isotp_engine.stmin_to_seconds, default=0)
+        self.__isotp.set_tx_stmin(h42msg.ADDRESS_BROADCAST, stmin)
+        sent = asyncio.get_running_loop().create_future()
+        self.__broadcast_waiters.append((sent, priority))
+        self.__isotp.send(h42msg.ADDRESS_BROADCAST, message, priority)
+        self.__arm_isotp_timer()
+        await sent
+
+    async def recv_packet(self) -> RecvPacket:
+        return await self.__packet_recv_queue.get()
 
-    def recv_packet(self) -> RecvPacket:
-        return self.__packet_recv_queue.get(block=True)
+    async def send_discovery_status(self, dst_addr: int, set_hash: int, cached: bool) -> None:
+        self.__bus.send(h42msg.make_discovery_status(dst_addr, set_hash, cached).can_msg)
+
+    def node_last_heard(self, node_addr: int) -> Optional[float]:
+        n = self.__node_registry.find_node_by_addr(node_addr)
+        return n.last_heard if n is not None else None
+
+    def __arm_isotp_timer(self) -> None:
+        """Points the timer at the engine's next deadline, after anything that may have changed it."""
+        deadline = self.__isotp.next_deadline()
+        if deadline == self.__isotp_timer_deadline:
+            return
+        if self.__isotp_timer is not None:
+            self.__isotp_timer.cancel()
+            self.__isotp_timer = None
+        self.__isotp_timer_deadline = deadline
+        if deadline is not None:
+            # The engine runs on time.monotonic, the loop clock may not
+            loop = asyncio.get_running_loop()
+            self.__isotp_timer = loop.call_later(max(deadline - time.monotonic(), 0), self.__on_isotp_timer)
+
+    def __on_isotp_timer(self) -> None:
+        self.__isotp_timer = None
+        self.__isotp_timer_deadline = None
+        self.__isotp.poll()
+        self.__arm_isotp_timer()
+
+    def __send_isotp_frame(self, node_addr: int, data: bytes) -> None:
+        msg_type = h42msg.MsgType.BROADCAST_DATA if node_addr == h42msg.ADDRESS_BROADCAST else h42msg.MsgType.ISOTP
+        # Flow control goes first, it holds up the node's transfer. Our own frames take the priority of the message
+        if isotp_engine.is_flow_control(data):
+            priority = h42msg.Priority.CONTROL
+        elif node_addr == h42msg.ADDRESS_BROADCAST:
+            priority = self.__broadcast_waiters[0][1]
+        else:
+            n = self.__node_registry.find_node_by_addr(node_addr)
+            priority = n.tx_priority if n is not None else h42msg.Priority.STATE
+        # python-can works the DLC out from the data
+        m = can.Message(
+            arbitration_id=h42msg.make_can_id(msg_type, h42msg.ADDRESS_MASTER, node_addr, priority),
+            data=data,
+            is_extended_id=True,
+            is_fd=len(data) > h42msg.CLASSIC_FRAME_SIZE)
+        self.__bus.send(m)
 
-    def __recv_worker(self) -> None:
+    def __on_isotp_message(self, node_addr: int, data: bytes) -> None:
+        n = self.__node_registry.find_node_by_addr(node_addr)
+        assert n is not None
+        n.on_message()
+        compact = bool(n.features & (h42msg.FEATURE_COMPACT_MQTT | h42msg.FEATURE_COMPRESSION |
+                                     h42msg.FEATURE_DISCOVERY_CACHE))
+        keepalive_proxy = bool(n.features & h42msg.FEATURE_KEEPALIVE_PROXY)
+        self.__packet_recv_queue.put_nowait(RecvPacket(node_addr, data, compact_mqtt=compact,
+                                                       keepalive_proxy=keepalive_proxy))
+
+    def __on_isotp_send_done(self, node_addr: int, error: Optional[isotp_engine.IsotpError]) -> None:
+        if node_addr == h42msg.ADDRESS_BROADCAST:
+            # Without flow control a broadcast does not fail
+            waiter = self.__broadcast_waiters.popleft()[0]
+            if not waiter.done():
+                waiter.set_result(None)
+            return
+        n = self.__node_registry.find_node_by_addr(node_addr)
+        assert n is not None
+        if error is not None:
+            self.__logger.warning(f"Send to node {node_addr} failed: {error}")
+        n.on_send_done(error)
+
+    def __on_isotp_rx_error(self, node_addr: int, error: isotp_engine.IsotpError) -> None:
+        n = self.__node_registry.find_node_by_addr(node_addr)
+        assert n is not None
+        self.__logger.warning(f"Receive from node {node_addr} failed: {error}")
+        n.on_rx_error(error)
+
+    async def __recv_worker(self, reader: can.AsyncBufferedReader) -> None:
         while True:
-            try:
-                bus_msg = self.__bus.recv(1.0)
-            except Exception as exc:
-                self.__logger.warning(f"Error receiving CAN message: {exc}")
-                continue
+            bus_msg = await reader.get_message()
             # Validate the received CAN message
-            if bus_msg is None or bus_msg.is_remote_frame:
+            if bus_msg.is_remote_frame:
                 continue
             if bus_msg.is_error_frame:
                 self.__logger.warning("Error frame received")
@@ -50,7 +189,7 @@ class IsotpCanServer:
             if h42_msg.type == h42msg.MsgType.ADDRESS_REQUEST:
                 self.__handle_address_request(h42_msg)
                 continue
-            if h42_msg.type != h42msg.MsgType.ISOTP:
+            if h42_msg.type not in (h42msg.MsgType.ISOTP, h42msg.MsgType.LINK_PARAMS):
                 self.__logger.warning(f"Unexpected packet type: {h42_msg.type}")
                 continue
             if h42_msg.dst_addr != h42msg.ADDRESS_MASTER:
@@ -61,15 +200,13 @@ class IsotpCanServer:
             if src_node is None:
                 self.__handle_unknown_node(node_addr=h42_msg.src_addr)
                 continue
-            isotp_msg = isotp.CanMessage(arbitration_id=bus_msg.arbitration_id,
-                                         data=bus_msg.data,
-                                         dlc=bus_msg.dlc,
-                                         extended_id=bus_msg.is_extended_id)
-
-            # Clear out randomness and suppress the source address to match the mask in the isotp layer
-            isotp_msg.arbitration_id &= ~0x1FE0FF00
-
-            src_node.on_received_can_msg(isotp_msg)
+            src_node.on_frame()
+            if h42_msg.type == h42msg.MsgType.LINK_PARAMS:
+                self.__handle_link_params(src_node, h42_msg)
+                continue
+            # Straight into the node's session, the priority and random seed bits don't matter here
+            self.__isotp.on_frame(src_node.addr, bytes(bus_msg.data))
+            self.__arm_isotp_timer()
 
     def __handle_address_request(self, m: h42msg.Msg) -> None:
         addr_req = m.as_address_request
@@ -88,15 +225,22 @@ class IsotpCanServer:
             resp = h42msg.make_address_response(1, 0, addr_req.node_mac)
         self.__bus.send(resp.can_msg)
 
+    def __handle_link_params(self, src_node: node.Node, m: h42msg.Msg) -> None:
+        params = m.as_link_params
+        self.__logger.info(f"Node {src_node.addr} proposes block size {params.block_size}, stmin {params.stmin}, "
+                           f"frames up to {params.frame_size} bytes, features 0x{params.features:02x}")
+        frame_size = max((s for s in h42msg.FD_FRAME_SIZES if s <= min(params.frame_size, self.__max_frame_size)),
+                         default=h42msg.CLASSIC_FRAME_SIZE)
+        src_node.set_frame_size(frame_size)
+        features = params.features & self.__features
+        src_node.set_features(features)
+        src_node.set_stmin(params.stmin)
+        # The node knows how fast it can receive. We only tell it how fast it may send to us.
+        resp = h42msg.make_link_params(src_node.addr, params.block_size, params.stmin, src_node.rx_stmin_base,
+                                       frame_size, features)
+        self.__bus.send(resp.can_msg)
+
     def __handle_unknown_node(self, node_addr: int) -> None:
         self.__logger.warning(f"Message from unknown node: {node_addr}. Requesting it to get a new address.")
         m = msg.make_address_request_request(node_address=node_addr)
         self.__bus.send(m.can_msg)
-
-    def __my_txfn(self, msg: isotp.CanMessage) -> None:
-        m = can.Message(
-            arbitration_id=msg.arbitration_id,
-            data=msg.data,
-            dlc=msg.dlc,
-            is_extended_id=msg.is_extended_id)
-        self.__bus.send(m)
@@ -0,0 +1,443 @@
+import collections
+import enum
+import math
+import time
+from typing import Callable, Deque, Dict, List, Optional, Tuple
+
+from tx_scheduler import TxScheduler
+
+# Frame lengths a CAN FD controller can send
+_FRAME_LENGTHS = (8, 12, 16, 20, 24, 32, 48, 64)
+
+FLOW_CONTROL_TIMEOUT = 2.0
+CONSECUTIVE_FRAME_TIMEOUT = 1.0
+MAX_MESSAGE_SIZE = 0xFFFF
+
+_PCI_SINGLE = 0x0
+_PCI_FIRST = 0x1
+_PCI_CONSECUTIVE = 0x2
+_PCI_FLOW_CONTROL = 0x3
+
+_FS_CONTINUE = 0
+_FS_WAIT = 1
+_FS_OVERFLOW = 2
+
+# Timer key of the scheduler's pacing, past the two per link
+_PACE_KEY = 256 << 1
+
+
+class IsotpError(Exception):
+    pass
+
+
+class WrongSequenceNumberError(IsotpError):
+    pass
+
+
+class ConsecutiveFrameTimeoutError(IsotpError):
+    pass
+
+
+class FlowControlTimeoutError(IsotpError):
+    pass
+
+
+class OverflowReportedError(IsotpError):
+    """The receiver has no room for the message."""
+
+
+def is_flow_control(frame: bytes) -> bool:
+    return bool(frame) and frame[0] >> 4 == _PCI_FLOW_CONTROL
+
+
+def stmin_to_seconds(stmin: int) -> float:
+    if stmin <= 0x7F:
+        return stmin / 1000
+    if 0xF1 <= stmin <= 0xF9:
+        return (stmin - 0xF0) / 10000
+    # Reserved values mean the longest separation time
+    return 0.127
+
+
+def stmin_from_ms(ms: int) -> int:
+    return min(max(ms, 0), 0x7F)
+
+
+def _frame_length(length: int) -> int:
+    """Smallest valid CAN frame length holding length bytes."""
+    if length <= 8:
+        return length
+    return next(n for n in _FRAME_LENGTHS if n >= length)
+
+
+def _pad(frame: bytes) -> bytes:
+    return frame + b'\xCC' * (_frame_length(len(frame)) - len(frame))
+
+
+class TimerWheel:
+    """Hashed timing wheel with one slot per tick. Scheduling and cancelling are O(1), advancing visits each
+    elapsed slot once. Keys have at most one timer."""
+
+    def __init__(self, tick: float = 0.001, slots: int = 1024, now: float = 0.0) -> None:
+        self.__tick = tick
+        self.__slots: List[Dict[int, int]] = [{} for _ in range(slots)]
+        self.__due: Dict[int, int] = {}
+        # Next tick to look at
+        self.__current = int(now / tick)
+
+    def schedule(self, key: int, deadline: float) -> None:
+        self.cancel(key)
+        due = max(math.ceil(deadline / self.__tick), self.__current)
+        self.__slots[due % len(self.__slots)][key] = due
+        self.__due[key] = due
+
+    def cancel(self, key: int) -> None:
+        due = self.__due.pop(key, None)
+        if due is not None:
+            del self.__slots[due % len(self.__slots)][key]
+
+    def advance(self, now: float) -> List[int]:
+        """Returns the keys whose deadline has passed, in no particular order."""
+        last = int(now / self.__tick)
+        expired = []
+        if self.__due:
+            # A full turn visits every slot, so longer gaps cost no more than that
+            for tick in range(self.__current, self.__current + min(last - self.__current + 1, len(self.__slots))):
+                slot = self.__slots[tick % len(self.__slots)]
+                for key in [k for k, due in slot.items() if due <= last]:
+                    del slot[key]
+                    del self.__due[key]
+                    expired.append(key)
+        self.__current = max(self.__current, last + 1)
+        return expired
+
+    def next_deadline(self) -> Optional[float]:
+        if not self.__due:
+            return None
+        return min(self.__due.values()) * self.__tick
+
+
+class _TxState(enum.Enum):
+    IDLE = 0
+    WAIT_FC = 1
+    SEND_CF = 2
+
+
+class _Link:
+    __slots__ = ('tx_queue', 'tx_state', 'tx_data', 'tx_priority', 'tx_offset', 'tx_sn', 'tx_bs_remain', 'tx_stmin',
+                 'tx_frame_size', 'rx_active', 'rx_data', 'rx_size', 'rx_sn', 'rx_bs_count', 'rx_frame_size',
+                 'rx_block_size', 'rx_stmin', 'tx_flow_control')
+
+    def __init__(self, block_size: int, stmin: int) -> None:
+        # Messages with their priority
+        self.tx_queue: Deque[Tuple[bytes, int]] = collections.deque()
+        self.tx_state = _TxState.IDLE
+        self.tx_data = b''
+        self.tx_priority = 0
+        self.tx_offset = 0
+        self.tx_sn = 0
+        self.tx_bs_remain = 0
+        self.tx_stmin = 0.0
+        self.tx_frame_size = 8
+        self.rx_active = False
+        self.rx_data = bytearray()
+        self.rx_size = 0
+        self.rx_sn = 0
+        self.rx_bs_count = 0
+        self.rx_frame_size = 8
+        self.rx_block_size = block_size
+        self.rx_stmin = stmin
+        self.tx_flow_control = True
+
+
+class IsotpEngine:
+    """ISO-TP sessions with every node on the bus, in one table indexed by node address. The timers of all
+    sessions share one TimerWheel, so the owner only needs a single timer: call poll() at next_deadline().
+    Which session sends the next frame is up to one TxScheduler, flow control aside: that goes out at once.
+
+    The engine does not know about CAN IDs. send_frame gets the node address and the frame data, and frames
+    from a node are handed to on_frame with its address.
+    """
+
+    def __init__(self,
+                 send_frame: Callable[[int, bytes], None],
+                 on_message: Callable[[int, bytes], None],
+                 on_send_done: Callable[[int, Optional[IsotpError]], None],
+                 on_rx_error: Callable[[int, IsotpError], None],
+                 clock: Callable[[], float] = time.monotonic,
+                 bitrate: Optional[int] = None) -> None:
+        """bitrate paces frames to the bus, see TxScheduler."""
+        self.__send_frame = send_frame
+        self.__on_message = on_message
+        self.__on_send_done = on_send_done
+        self.__on_rx_error = on_rx_error
+        self.__clock = clock
+        self.__links: List[Optional[_Link]] = [None] * 256
+        self.__timers = TimerWheel(now=clock())
+        self.__scheduler = TxScheduler(bitrate)
+        self.__pumping = False
+
+    def add_link(self, addr: int, block_size: int, stmin: int) -> None:
+        """block_size and stmin (ISO-TP encoding) are sent in our flow control frames."""
+        self.__links[addr] = _Link(block_size, stmin)
+        # Anything the link had ready went with it
+        self.__scheduler.set_idle(addr)
+
+    def add_broadcast_link(self, addr: int) -> None:
+        """A link that only sends, with classic frames and without waiting for flow control: consecutive frames
+        go out at the separation time of set_tx_stmin()."""
+        link = _Link(0, 0)
+        link.tx_flow_control = False
+        self.__links[addr] = link
+        self.__scheduler.set_idle(addr)
+
+    def set_tx_stmin(self, addr: int, stmin: int) -> None:
+        """Separation time (ISO-TP encoding) of a broadcast link, used from the next message on."""
+        link = self.__link(addr)
+        if link.tx_flow_control:
+            raise ValueError(f"Link to node {addr} takes its separation time from flow control")
+        link.tx_stmin = stmin_to_seconds(stmin)
+
+    def set_flow_params(self, addr: int, block_size: int, stmin: int) -> None:
+        """Used from the next flow control frame on."""
+        link = self.__link(addr)
+        link.rx_block_size = block_size
+        link.rx_stmin = stmin
+
+    def set_frame_size(self, addr: int, frame_size: int) -> None:
+        """CAN frame length to send with, above 8 bytes for CAN FD. Used from the next message on."""
+        if frame_size not in _FRAME_LENGTHS:
+            raise ValueError(f"Invalid frame size {frame_size}")
+        self.__link(addr).tx_frame_size = frame_size
+
+    def send(self, addr: int, data: bytes, priority: int = 0) -> None:
+        """Queues a message, on_send_done reports each message in order. priority picks the scheduler lane of its
+        frames, 0 is the most urgent."""
+        if len(data) > MAX_MESSAGE_SIZE:
+            raise ValueError(f"Message longer than {MAX_MESSAGE_SIZE} bytes")
+        link = self.__link(addr)
+        link.tx_queue.append((bytes(data), priority))
+        if link.tx_state == _TxState.IDLE and len(link.tx_queue) == 1:
+            self.__scheduler.set_ready(addr, priority)
+        self.__pump()
+
+    def on_frame(self, addr: int, data: bytes) -> None:
+        link = self.__links[addr]
+        if link is None or len(data) < 1:
+            return
+        pci = data[0] >> 4
+        if pci == _PCI_SINGLE:
+            self.__on_single_frame(addr, link, data)
+        elif pci == _PCI_FIRST:
+            self.__on_first_frame(addr, link, data)
+        elif pci == _PCI_CONSECUTIVE:
+            self.__on_consecutive_frame(addr, link, data)
+        elif pci == _PCI_FLOW_CONTROL:
+            self.__on_flow_control(addr, link, data)
+        self.__pump()
+
+    def poll(self) -> None:
+        """Sends frames that are due and handles timeouts."""
+        for key in self.__timers.advance(self.__clock()):
+            if key == _PACE_KEY:
+                continue
+            addr, is_rx = key >> 1, key & 1
+            link = self.__links[addr]
+            assert link is not None
+            if is_rx:
+                link.rx_active = False
+                self.__on_rx_error(addr, ConsecutiveFrameTimeoutError(f"No consecutive frame from node {addr}"))
+            elif link.tx_state == _TxState.WAIT_FC:
+                self.__finish_send(addr, link, FlowControlTimeoutError(f"No flow control from node {addr}"))
+            elif link.tx_state == _TxState.SEND_CF:
+                self.__scheduler.set_ready(addr, link.tx_priority)
+        self.__pump()
+
+    def next_deadline(self) -> Optional[float]:
+        """Clock time poll() has to run at, None when no session waits for anything."""
+        return self.__timers.next_deadline()
+
+    def __link(self, addr: int) -> _Link:
+        link = self.__links[addr]
+        if link is None:
+            raise ValueError(f"No link to node {addr}")
+        return link
+
+    # Sending
+
+    def __pump(self) -> None:
+        """Sends frames in the scheduler's order while the bus has room."""
+        if self.__pumping:
+            # A callback queued more, the loop below gets to it
+            return
+        self.__pumping = True
+        try:
+            while self.__scheduler.has_ready():
+                hold = self.__scheduler.hold_until(self.__clock())
+                if hold is not None:
+                    self.__timers.schedule(_PACE_KEY, hold)
+                    return
+                addr = self.__scheduler.next()
+                assert addr is not None
+                link = self.__links[addr]
+                assert link is not None
+                if link.tx_state == _TxState.IDLE:
+                    self.__start_send(addr, link)
+                else:
+                    self.__send_consecutive_frame(addr, link)
+        finally:
+            self.__pumping = False
+
+    def __emit(self, addr: int, frame: bytes, in_turn: bool = True) -> None:
+        self.__send_frame(addr, frame)
+        self.__scheduler.on_sent(addr if in_turn else None, len(frame), self.__clock())
+
+    def __start_send(self, addr: int, link: _Link) -> None:
+        """Sends the first frame of the next queued message."""
+        data, link.tx_priority = link.tx_queue.popleft()
+        frame_size = link.tx_frame_size
+        single_capacity = 7 if frame_size == 8 else frame_size - 2
+        if len(data) <= 7:
+            self.__emit(addr, _pad(bytes([len(data)]) + data))
+            self.__finish_send(addr, link, None)
+            return
+        if len(data) <= single_capacity:
+            # CAN FD escape sequence, the length goes in the second byte
+            self.__emit(addr, _pad(bytes([0, len(data)]) + data))
+            self.__finish_send(addr, link, None)
+            return
+        if len(data) <= 0xFFF:
+            header = bytes([_PCI_FIRST << 4 | len(data) >> 8, len(data) & 0xFF])
+        else:
+            # Escape sequence for messages above 4095 bytes
+            header = bytes([_PCI_FIRST << 4, 0]) + len(data).to_bytes(4, 'big')
+        first_length = frame_size - len(header)
+        self.__emit(addr, header + data[:first_length])
+        link.tx_data = data
+        link.tx_offset = first_length
+        link.tx_sn = 1
+        if not link.tx_flow_control:
+            link.tx_bs_remain = 0
+            link.tx_state = _TxState.SEND_CF
+            self.__wait_stmin(addr, link)
+            return
+        link.tx_state = _TxState.WAIT_FC
+        self.__scheduler.set_idle(addr)
+        self.__timers.schedule(addr << 1, self.__clock() + FLOW_CONTROL_TIMEOUT)
+
+    def __on_flow_control(self, addr: int, link: _Link, data: bytes) -> None:
+        if link.tx_state != _TxState.WAIT_FC or len(data) < 3:
+            return
+        status = data[0] & 0x0F
+        if status == _FS_OVERFLOW:
+            self.__finish_send(addr, link, OverflowReportedError(f"Node {addr} can't take {len(link.tx_data)} bytes"))
+        elif status == _FS_WAIT:
+            self.__timers.schedule(addr << 1, self.__clock() + FLOW_CONTROL_TIMEOUT)
+        elif status == _FS_CONTINUE:
+            link.tx_bs_remain = data[1]
+            link.tx_stmin = stmin_to_seconds(data[2])
+            link.tx_state = _TxState.SEND_CF
+            self.__timers.cancel(addr << 1)
+            self.__scheduler.set_ready(addr, link.tx_priority)
+
+    def __send_consecutive_frame(self, addr: int, link: _Link) -> None:
+        chunk = link.tx_frame_size - 1
+        cf = bytes([_PCI_CONSECUTIVE << 4 | link.tx_sn]) + link.tx_data[link.tx_offset:link.tx_offset + chunk]
+        self.__emit(addr, _pad(cf))
+        link.tx_offset += chunk
+        link.tx_sn = (link.tx_sn + 1) & 0x0F
+        if link.tx_offset >= len(link.tx_data):
+            self.__finish_send(addr, link, None)
+            return
+        if link.tx_bs_remain > 0:
+            link.tx_bs_remain -= 1
+            if link.tx_bs_remain == 0:
+                link.tx_state = _TxState.WAIT_FC
+                self.__scheduler.set_idle(addr)
+                self.__timers.schedule(addr << 1, self.__clock() + FLOW_CONTROL_TIMEOUT)
+                return
+        self.__wait_stmin(addr, link)
+
+    def __wait_stmin(self, addr: int, link: _Link) -> None:
+        """The next consecutive frame is ready once the separation time is over."""
+        if link.tx_stmin > 0:
+            self.__scheduler.set_idle(addr)
+            self.__timers.schedule(addr << 1, self.__clock() + link.tx_stmin)
+        else:
+            self.__scheduler.set_ready(addr, link.tx_priority)
+
+    def __finish_send(self, addr: int, link: _Link, error: Optional[IsotpError]) -> None:
+        self.__timers.cancel(addr << 1)
+        link.tx_state = _TxState.IDLE
+        link.tx_data = b''
+        if link.tx_queue:
+            self.__scheduler.set_ready(addr, link.tx_queue[0][1])
+        else:
+            self.__scheduler.set_idle(addr)
+        self.__on_send_done(addr, error)
+
+    # Receiving
+
+    def __on_single_frame(self, addr: int, link: _Link, data: bytes) -> None:
+        length, start = data[0] & 0x0F, 1
+        if length == 0 and len(data) > 8:
+            length, start = data[1], 2
+        if length == 0 or length > len(data) - start:
+            return
+        # A new message replaces one in progress
+        self.__stop_receive(addr, link)
+        self.__on_message(addr, bytes(data[start:start + length]))
+
+    def __on_first_frame(self, addr: int, link: _Link, data: bytes) -> None:
+        if len(data) < 8 or _frame_length(len(data)) != len(data):
+            return
+        length, start = (data[0] & 0x0F) << 8 | data[1], 2
+        if length == 0:
+            length, start = int.from_bytes(data[2:6], 'big'), 6
+        if length <= (7 if len(data) == 8 else len(data) - 2):
+            return
+        self.__stop_receive(addr, link)
+        if length > MAX_MESSAGE_SIZE:
+            self.__emit(addr, bytes([_PCI_FLOW_CONTROL << 4 | _FS_OVERFLOW, 0, 0]), in_turn=False)
+            return
+        link.rx_active = True
+        link.rx_data = bytearray(data[start:])
+        link.rx_size = length
+        link.rx_sn = 1
+        link.rx_frame_size = len(data)
+        self.__send_flow_control(addr, link)
+
+    def __on_consecutive_frame(self, addr: int, link: _Link, data: bytes) -> None:
+        if not link.rx_active:
+            return
+        if data[0] & 0x0F != link.rx_sn:
+            self.__stop_receive(addr, link)
+            self.__on_rx_error(addr, WrongSequenceNumberError(f"Node {addr} skipped a consecutive frame"))
+            return
+        wanted = min(link.rx_size - len(link.rx_data), link.rx_frame_size - 1)
+        if len(data) - 1 < wanted:
+            return
+        link.rx_data += data[1:1 + wanted]
+        link.rx_sn = (link.rx_sn + 1) & 0x0F
+        if len(link.rx_data) >= link.rx_size:
+            message = bytes(link.rx_data)
+            self.__stop_receive(addr, link)
+            self.__on_message(addr, message)
+            return
+        if link.rx_bs_count > 0:
+            link.rx_bs_count -= 1
+            if link.rx_bs_count == 0:
+                self.__send_flow_control(addr, link)
+                return
+        self.__timers.schedule(addr << 1 | 1, self.__clock() + CONSECUTIVE_FRAME_TIMEOUT)
+
+    def __send_flow_control(self, addr: int, link: _Link) -> None:
+        link.rx_bs_count = link.rx_block_size
+        self.__emit(addr, bytes([_PCI_FLOW_CONTROL << 4 | _FS_CONTINUE, link.rx_block_size, link.rx_stmin]),
+                    in_turn=False)
+        self.__timers.schedule(addr << 1 | 1, self.__clock() + CONSECUTIVE_FRAME_TIMEOUT)
+
+    def __stop_receive(self, addr: int, link: _Link) -> None:
+        self.__timers.cancel(addr << 1 | 1)
+        link.rx_active = False
+        link.rx_data = bytearray()
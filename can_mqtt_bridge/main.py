@@ -1,6 +1,8 @@
+import asyncio
 import logging
 import sys
 from io import TextIOWrapper
+from typing import Optional, Sequence
 
 import can
 
@@ -8,6 +10,7 @@ import can_tcp_bridge
 import isotp_can_server
 import mqttdbg
 from can_server import CanServer
+from msg import Priority
 from packet import SendPacket, RecvPacket
 
 
@@ -24,10 +27,13 @@ def make_logger() -> logging.Logger:
     return logger
 
 
+BITRATE = 20000
+
+
 def check_slcan_dongle() -> can.BusABC:
     # Attempt to initialize the SLCAN interface
     # Adjust 'slcan0' to match your system's interface name (e.g., 'COM3' on Windows)
-    bus = can.interface.Bus(interface='slcan', channel='/dev/ttyACM0', bitrate=20000)
+    bus = can.interface.Bus(interface='slcan', channel='/dev/ttyACM0', bitrate=BITRATE)
     print("SLCAN dongle detected and initialized successfully!")
     return bus
 
@@ -36,30 +42,47 @@ class DgbShim:
     def __init__(self, srv: CanServer):
         self.srv = srv
 
-    def send_packet(self, packet: SendPacket):
+    async def send_packet(self, packet: SendPacket):
         print("-----------------")
         print(f"Server -> Node {packet.dst_addr}")
         mqttdbg.print_mqtt_message(packet.data)
-        self.srv.send_packet(packet)
+        await self.srv.send_packet(packet)
 
-    def recv_packet(self) -> RecvPacket:
-        p = self.srv.recv_packet()
+    async def recv_packet(self) -> RecvPacket:
+        p = await self.srv.recv_packet()
         print("-----------------")
         print(f"Node {p.src_addr} -> Server")
         mqttdbg.print_mqtt_message(p.data)
         return p
 
+    async def send_discovery_status(self, dst_addr: int, set_hash: int, cached: bool) -> None:
+        await self.srv.send_discovery_status(dst_addr, set_hash, cached)
+
+    def node_last_heard(self, node_addr: int) -> Optional[float]:
+        return self.srv.node_last_heard(node_addr)
+
+    def accepts_broadcast(self, node_addr: int) -> bool:
+        return self.srv.accepts_broadcast(node_addr)
+
+    async def send_broadcast(self, dst_addrs: Sequence[int], data: bytes, priority: Priority = Priority.STATE) -> None:
+        print("-----------------")
+        print(f"Server -> Nodes {list(dst_addrs)}")
+        mqttdbg.print_mqtt_message(data)
+        await self.srv.send_broadcast(dst_addrs, data, priority)
+
 
-def app_main(bus: can.BusABC) -> None:
+async def app_main(bus: can.BusABC) -> None:
     log = make_logger()
-    can_srv = isotp_can_server.IsotpCanServer(bus, log)
+    can_srv = isotp_can_server.IsotpCanServer(bus, log, bitrate=BITRATE)
     can_srv_shimmed = DgbShim(can_srv)
-    bridge = can_tcp_bridge.CanTcpBridge(can_srv_shimmed, "192.168.0.62", 1883, log)
-    bridge.run()
+    # multiplex=True carries all nodes over one broker connection
+    bridge = can_tcp_bridge.CanTcpBridge(can_srv_shimmed, "192.168.0.62", 1883, log, multiplex=False)
+    # Everything runs on this one event loop
+    await asyncio.gather(can_srv.run(), bridge.run())
 
 
 if __name__ == "__main__":
     bus = check_slcan_dongle()
     if bus:
-        app_main(bus)
+        asyncio.run(app_main(bus))
         bus.shutdown()
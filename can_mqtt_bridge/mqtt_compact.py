@@ -0,0 +1,267 @@
+"""Compact MQTT encoding of the node to bridge stream, see h42_mqtt_compact.h in the firmware.
+
+Nodes the bridge granted FEATURE_COMPACT_MQTT send PUBLISH topics as 2 byte aliases. Two packet types MQTT 3.1.1
+reserves carry them:
+
+    REGISTER          0x00, remaining length, 2 byte alias, topic
+    Compact PUBLISH   0xF0 | PUBLISH flags, remaining length, 2 byte alias, packet identifier and payload
+
+Aliases are valid until the next CONNECT. Nodes granted FEATURE_COMPRESSION send large PUBLISH packets as a compact
+PUBLISH with alias ALIAS_COMPRESSED, followed by everything after the PUBLISH fixed header compressed against
+DICTIONARY, see lz_decompress(). Nodes granted FEATURE_DISCOVERY_CACHE put DISCOVERY packets in their stream:
+
+    DISCOVERY         0x01, remaining length 5, DISCOVERY_CHECK or DISCOVERY_COMMIT, 4 byte discovery set hash
+
+Everything else is plain MQTT.
+"""
+from typing import Dict, List, NamedTuple, Optional, Union
+
+MQTT_CONNECT = 1
+MQTT_PUBLISH = 3
+COMPACT_REGISTER = 0x00
+COMPACT_DISCOVERY = 0x01
+COMPACT_PUBLISH = 0xF0
+ALIAS_COMPRESSED = 0xFFFF
+
+LZ_MATCH_MIN = 4
+
+# Does the bridge have this discovery set?
+DISCOVERY_CHECK = 0
+# The node sent this discovery set since its check
+DISCOVERY_COMMIT = 1
+
+# DICTIONARY in h42_mqtt_compact.c, byte for byte
+DICTIONARY = (
+    b'homeassistant/binary_sensor/'
+    b'homeassistant/sensor/'
+    b'homeassistant/switch/'
+    b'homeassistant/light/'
+    b'homeassistant/button/'
+    b'homeassistant/number/'
+    b'homeassistant/select/'
+    b'homeassistant/text_sensor/'
+    b'/config'
+    b'/state'
+    b'/command'
+    b'/status'
+    b'{"dev_cla":"temperature","unit_of_meas":"\xc2\xb0C"'
+    b',"dev_cla":"humidity","unit_of_meas":"%"'
+    b',"dev_cla":"voltage","unit_of_meas":"V"'
+    b',"dev_cla":"current","unit_of_meas":"A"'
+    b',"dev_cla":"power","unit_of_meas":"W"'
+    b',"dev_cla":"battery"'
+    b',"stat_cla":"measurement"'
+    b',"stat_cla":"total_increasing"'
+    b',"ent_cat":"diagnostic"'
+    b',"ent_cat":"config"'
+    b',"ic":"mdi:'
+    b',"pl_on":"ON","pl_off":"OFF"'
+    b',"exp_aft":'
+    b',"frc_upd":true'
+    b',"min":0,"max":100,"step":1,"mode":"auto"'
+    b',"ops":["'
+    b',"json_attr_t":"'
+    b',"val_tpl":"{{ value_json.'
+    b',"schema":"json","clrm":true,"sup_clrm":["brightness"]'
+    b',"brightness":true'
+    b'{"name":"'
+    b'","stat_t":"'
+    b'/state","cmd_t":"'
+    b'/command","avty_t":"'
+    b'/status","uniq_id":"ESP'
+    b'","obj_id":"'
+    b'","dev":{"ids":"'
+    b'","name":"'
+    b'","sw":"2024.'
+    b' (ESPHome 2024.'
+    b'","mdl":"esp32-c3-devkitm-1"'
+    b',"mdl":"esp32dev"'
+    b',"mf":"Espressif"'
+    b',"sa":"'
+    b',"cns":[["mac","'
+    b'"]]}}'
+    b'{"device_class":"'
+    b'","unit_of_measurement":"'
+    b'","state_class":"measurement"'
+    b',"entity_category":"diagnostic"'
+    b',"icon":"mdi:'
+    b',"state_topic":"'
+    b'/state","command_topic":"'
+    b'/command","availability_topic":"'
+    b'/status","unique_id":"ESP'
+    b'","object_id":"'
+    b'","device":{"identifiers":"'
+    b'","sw_version":"'
+    b'","model":"'
+    b'","manufacturer":"Espressif"'
+    b',"suggested_area":"'
+    b',"connections":[["mac","'
+)
+
+# Remaining length takes at most 4 bytes
+MAX_HEADER_SIZE = 5
+
+
+class CompactDecoderError(ValueError):
+    pass
+
+
+def encode_remaining_length(value: int) -> bytes:
+    out = bytearray()
+    while True:
+        b = value & 0x7F
+        value >>= 7
+        out.append(b | 0x80 if value else b)
+        if not value:
+            return bytes(out)
+
+
+def lz_decompress(data: bytes) -> bytes:
+    """Tokens starting with a tag byte T. T < 0x80: T + 1 literal bytes follow. T >= 0x80: copy (T & 0x7F) + 4
+    bytes from a 2 byte big endian distance back in DICTIONARY followed by the output so far, the copy may overlap
+    itself."""
+    window = bytearray(DICTIONARY)
+    pos = 0
+    while pos < len(data):
+        tag = data[pos]
+        pos += 1
+        if tag < 0x80:
+            if pos + tag + 1 > len(data):
+                raise CompactDecoderError("Truncated literals")
+            window += data[pos:pos + tag + 1]
+            pos += tag + 1
+            continue
+        if pos + 2 > len(data):
+            raise CompactDecoderError("Truncated match")
+        distance = int.from_bytes(data[pos:pos + 2], 'big')
+        pos += 2
+        if distance == 0 or distance > len(window):
+            raise CompactDecoderError(f"Match distance {distance} out of range")
+        start = len(window) - distance
+        for i in range((tag & 0x7F) + LZ_MATCH_MIN):
+            window.append(window[start + i])
+    return bytes(window[len(DICTIONARY):])
+
+
+class Discovery(NamedTuple):
+    """A DISCOVERY packet."""
+    op: int
+    set_hash: int
+
+
+class CompactDecoder:
+    """Turns one node's compact stream back into MQTT. The stream may be cut anywhere, feed() returns what can be
+    passed on so far. Payloads are passed on as they come, only headers, REGISTERs and compressed packets are held
+    back."""
+
+    def __init__(self) -> None:
+        self.__aliases: Dict[int, bytes] = {}
+        self.__buf = bytearray()
+        # Bytes of the current packet left to pass through, None while reading a header
+        self.__body_left: Optional[int] = None
+        # After an error, until the node starts over
+        self.__lost = False
+
+    def feed(self, data: bytes) -> bytes:
+        """Raises CompactDecoderError for a stream that can't be decoded. Everything after that is dropped until
+        data starts with a CONNECT, esp-mqtt writes each packet on its own. DISCOVERY packets are dropped."""
+        return b''.join(item for item in self.feed_items(data) if isinstance(item, bytes))
+
+    def feed_items(self, data: bytes) -> List[Union[bytes, Discovery]]:
+        """Like feed(), with the DISCOVERY packets in between the MQTT bytes."""
+        if self.__lost:
+            if not data or data[0] >> 4 != MQTT_CONNECT:
+                return []
+            self.__lost = False
+        try:
+            return self.__decode(data)
+        except CompactDecoderError:
+            self.__lost = True
+            self.__buf.clear()
+            self.__body_left = None
+            raise
+
+    def __decode(self, data: bytes) -> List[Union[bytes, Discovery]]:
+        self.__buf += data
+        items: List[Union[bytes, Discovery]] = []
+        out = bytearray()
+        while self.__buf:
+            if self.__body_left is not None:
+                n = min(self.__body_left, len(self.__buf))
+                out += self.__buf[:n]
+                del self.__buf[:n]
+                self.__body_left -= n
+                if self.__body_left == 0:
+                    self.__body_left = None
+                continue
+            header = self.__parse_header()
+            if header is None:
+                break
+            first, header_len, remaining = header
+            kind = first >> 4
+            if first == COMPACT_REGISTER:
+                if len(self.__buf) < header_len + remaining:
+                    break
+                if remaining < 2:
+                    raise CompactDecoderError("REGISTER without an alias")
+                body = bytes(self.__buf[header_len:header_len + remaining])
+                self.__aliases[int.from_bytes(body[:2], 'big')] = body[2:]
+                del self.__buf[:header_len + remaining]
+            elif first == COMPACT_DISCOVERY:
+                if len(self.__buf) < header_len + remaining:
+                    break
+                if remaining != 5:
+                    raise CompactDecoderError(f"DISCOVERY of {remaining} bytes")
+                body = bytes(self.__buf[header_len:header_len + remaining])
+                del self.__buf[:header_len + remaining]
+                if out:
+                    items.append(bytes(out))
+                    out.clear()
+                items.append(Discovery(body[0], int.from_bytes(body[1:], 'big')))
+            elif first & 0xF0 == COMPACT_PUBLISH:
+                if len(self.__buf) < header_len + 2:
+                    break
+                if remaining < 2:
+                    raise CompactDecoderError("Compact PUBLISH without an alias")
+                alias = int.from_bytes(self.__buf[header_len:header_len + 2], 'big')
+                if alias == ALIAS_COMPRESSED:
+                    if len(self.__buf) < header_len + remaining:
+                        break
+                    body = lz_decompress(bytes(self.__buf[header_len + 2:header_len + remaining]))
+                    out.append((MQTT_PUBLISH << 4) | (first & 0x0F))
+                    out += encode_remaining_length(len(body))
+                    out += body
+                    del self.__buf[:header_len + remaining]
+                    continue
+                topic = self.__aliases.get(alias)
+                if topic is None:
+                    raise CompactDecoderError(f"Unknown topic alias {alias}")
+                out.append((MQTT_PUBLISH << 4) | (first & 0x0F))
+                out += encode_remaining_length(remaining + len(topic))
+                out += len(topic).to_bytes(2, 'big') + topic
+                del self.__buf[:header_len + 2]
+                self.__start_body(remaining - 2)
+            else:
+                if kind == MQTT_CONNECT:
+                    self.__aliases.clear()
+                out += self.__buf[:header_len]
+                del self.__buf[:header_len]
+                self.__start_body(remaining)
+        if out:
+            items.append(bytes(out))
+        return items
+
+    def __start_body(self, length: int) -> None:
+        self.__body_left = length if length > 0 else None
+
+    def __parse_header(self) -> Optional[tuple[int, int, int]]:
+        """First byte, header length and remaining length, None until the header is complete."""
+        remaining = 0
+        for i in range(1, MAX_HEADER_SIZE):
+            if i >= len(self.__buf):
+                return None
+            b = self.__buf[i]
+            remaining |= (b & 0x7F) << (7 * (i - 1))
+            if not b & 0x80:
+                return self.__buf[0], i + 1, remaining
+        raise CompactDecoderError("Malformed remaining length")
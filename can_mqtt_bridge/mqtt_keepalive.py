@@ -0,0 +1,140 @@
+"""Keepalive of the broker sessions of nodes granted FEATURE_KEEPALIVE_PROXY, see h42_can.h in the firmware.
+
+Such a node answers most of esp-mqtt's PINGREQs itself and sends one through to the broker only every
+KEEPALIVE_PROXY_FACTOR keepalive periods. The bridge pings the broker in between on the node's behalf and drops the
+PINGRESPs to its own pings. Whether the node is still there it tells from the frames the node puts on the bus.
+"""
+import collections
+import time
+from typing import Callable, Deque, Optional, Tuple
+
+from mqtt_compact import MQTT_CONNECT
+
+MQTT_PINGREQ = 12
+MQTT_PINGRESP = 13
+PINGREQ = bytes([MQTT_PINGREQ << 4, 0])
+
+# H42_MQTT_KEEPALIVE_PROXY_FACTOR in the firmware
+KEEPALIVE_PROXY_FACTOR = 4
+
+
+def fixed_header(buf: bytearray) -> Optional[Tuple[int, int]]:
+    """Length of the fixed header buf starts with and the remaining length, None until it is complete."""
+    remaining = 0
+    for i in range(1, min(len(buf), 5)):
+        remaining |= (buf[i] & 0x7F) << (7 * (i - 1))
+        if not buf[i] & 0x80:
+            return i + 1, remaining
+    if len(buf) >= 5:
+        raise ValueError("Remaining length longer than 4 bytes")
+    return None
+
+
+class PacketStream:
+    """Cuts an MQTT stream into packets on the fly. Only the fixed header and up to HEAD_SIZE bytes of a packet
+    are held back, until keep() has decided whether the packet goes on."""
+    HEAD_SIZE = 12
+
+    def __init__(self, keep: Callable[[int, bytes], bool]) -> None:
+        """keep gets the first byte of each packet and the start of its variable header."""
+        self.__keep = keep
+        self.__buf = bytearray()
+        # Bytes of the current packet still to come, and whether they go on
+        self.__left = 0
+        self.__pass = True
+        # After a malformed packet everything goes on unseen
+        self.__lost = False
+
+    @property
+    def at_boundary(self) -> bool:
+        """Whatever came out so far ends with a whole packet."""
+        return not self.__lost and not self.__buf and self.__left == 0
+
+    def feed(self, data: bytes) -> bytes:
+        if self.__lost:
+            return data
+        out = bytearray()
+        self.__buf += data
+        while self.__buf:
+            if self.__left:
+                n = min(self.__left, len(self.__buf))
+                if self.__pass:
+                    out += self.__buf[:n]
+                del self.__buf[:n]
+                self.__left -= n
+                continue
+            try:
+                fixed = fixed_header(self.__buf)
+            except ValueError:
+                self.__lost = True
+                out += self.__buf
+                self.__buf.clear()
+                break
+            if fixed is None:
+                break
+            header_len, remaining = fixed
+            head_len = header_len + min(remaining, self.HEAD_SIZE)
+            if len(self.__buf) < head_len:
+                break
+            self.__pass = self.__keep(self.__buf[0], bytes(self.__buf[header_len:head_len]))
+            if self.__pass:
+                out += self.__buf[:head_len]
+            del self.__buf[:head_len]
+            self.__left = remaining - (head_len - header_len)
+        return bytes(out)
+
+
+class KeepaliveProxy:
+    """One TCP connection to the broker on behalf of a node."""
+
+    def __init__(self) -> None:
+        # From the node's CONNECT, 0 before it or if the node asked for none
+        self.keepalive_s = 0
+        self.__up = PacketStream(self.__on_node_packet)
+        self.__down = PacketStream(self.__on_broker_packet)
+        # Per PINGREQ the broker has yet to answer, whether the bridge sent it
+        self.__pings: Deque[bool] = collections.deque()
+        self.__last_to_broker = time.monotonic()
+
+    def from_node(self, data: bytes) -> bytes:
+        """The node's stream on its way to the broker."""
+        out = self.__up.feed(data)
+        if out:
+            self.__last_to_broker = time.monotonic()
+        return out
+
+    def from_broker(self, data: bytes) -> bytes:
+        """The broker's stream on its way to the node, without the answers to ping()."""
+        return self.__down.feed(data)
+
+    def ping(self, now: float) -> Optional[bytes]:
+        """A PINGREQ to send to the broker now, if one is due and the node's stream is between two packets."""
+        if not self.keepalive_s or now - self.__last_to_broker < self.keepalive_s / 2 or not self.__up.at_boundary:
+            return None
+        self.__pings.append(True)
+        self.__last_to_broker = now
+        return PINGREQ
+
+    def node_lost(self, now: float, last_heard: Optional[float]) -> bool:
+        """The node has been silent on the bus for longer than it may be. The broker would have dropped it by now."""
+        if not self.keepalive_s:
+            return False
+        timeout = (KEEPALIVE_PROXY_FACTOR + 1.5) * self.keepalive_s
+        return last_heard is None or now - last_heard > timeout
+
+    def __on_node_packet(self, first: int, head: bytes) -> bool:
+        packet_type = first >> 4
+        if packet_type == MQTT_CONNECT:
+            # Protocol name, level and flags come first
+            pos = 2 + int.from_bytes(head[:2], 'big') + 2
+            if len(head) >= pos + 2:
+                self.keepalive_s = int.from_bytes(head[pos:pos + 2], 'big')
+            self.__pings.clear()
+        elif packet_type == MQTT_PINGREQ:
+            self.__pings.append(False)
+        return True
+
+    def __on_broker_packet(self, first: int, head: bytes) -> bool:
+        if first >> 4 == MQTT_PINGRESP and self.__pings:
+            return not self.__pings.popleft()
+        return True
@@ -0,0 +1,449 @@
+"""All nodes over one broker session, see CanTcpBridge(multiplex=True).
+
+The bridge ends the MQTT session of each node itself. It answers CONNECT, PINGREQ and UNSUBSCRIBE, and carries the
+rest over a single session of its own to the broker, with the packet identifiers of the nodes swapped for ones unique on
+that session and back in the answers. PUBLISH packets from the broker go to every node with a matching subscription,
+those that are the same for several nodes marked as such for the bridge to broadcast.
+
+A session has one last will only, so the bridge publishes a node's will itself once the node is gone from the bus or
+its stream is broken. Nodes keep their sessions while the broker connection is down. Subscriptions are made again on
+the new one and what the broker did not acknowledge, the nodes send again.
+
+Subscriptions go to the broker with QoS 1 at most, so it never sends QoS 2. The bridge acknowledges PUBLISH packets
+from the broker and passes them on with packet identifiers of its own per node, the acknowledgements of which it drops.
+"""
+import time
+from typing import Callable, Dict, Iterator, List, NamedTuple, Optional, Tuple
+
+from mqtt_compact import MQTT_CONNECT, MQTT_PUBLISH, encode_remaining_length
+from mqtt_keepalive import KEEPALIVE_PROXY_FACTOR, MQTT_PINGREQ, MQTT_PINGRESP, PINGREQ, fixed_header
+from mqttdbg import read_string, read_uint16
+
+MQTT_CONNACK = 2
+MQTT_PUBACK = 4
+MQTT_PUBREC = 5
+MQTT_PUBREL = 6
+MQTT_PUBCOMP = 7
+MQTT_SUBSCRIBE = 8
+MQTT_SUBACK = 9
+MQTT_UNSUBSCRIBE = 10
+MQTT_UNSUBACK = 11
+MQTT_DISCONNECT = 14
+
+SUBACK_FAILURE = 0x80
+MAX_QOS = 1
+# A node sending a larger packet loses its session
+MAX_NODE_PACKET = 64 * 1024
+
+CONNACK = bytes([MQTT_CONNACK << 4, 2, 0, 0])
+PINGRESP = bytes([MQTT_PINGRESP << 4, 0])
+
+
+class MuxOutput:
+    """What is to be sent after feeding the multiplexer."""
+
+    def __init__(self) -> None:
+        self.broker = bytearray()
+        # In order, what goes to one node or the same to several, each whole MQTT packets
+        self.node_items: List[Tuple[Tuple[int, ...], bytearray]] = []
+        # Nodes whose session the bridge ended, with their last will published if they had one
+        self.lost: List[int] = []
+
+    @property
+    def nodes(self) -> Dict[int, bytes]:
+        """Per node address, everything for the node."""
+        nodes: Dict[int, bytearray] = {}
+        for node_addrs, data in self.node_items:
+            for node_addr in node_addrs:
+                nodes.setdefault(node_addr, bytearray()).extend(data)
+        return {node_addr: bytes(data) for node_addr, data in nodes.items()}
+
+    def to_node(self, node_addr: int, packet: bytes) -> None:
+        self.to_nodes((node_addr,), packet)
+
+    def to_nodes(self, node_addrs: Tuple[int, ...], packet: bytes) -> None:
+        if self.node_items and self.node_items[-1][0] == node_addrs:
+            self.node_items[-1][1].extend(packet)
+        else:
+            self.node_items.append((node_addrs, bytearray(packet)))
+
+
+class _Will(NamedTuple):
+    topic: str
+    message: bytes
+    qos: int
+    retain: bool
+
+
+class _Node:
+    def __init__(self, keepalive_s: int, will: Optional[_Will], keepalive_proxy: bool) -> None:
+        self.keepalive_s = keepalive_s
+        self.will = will
+        self.keepalive_proxy = keepalive_proxy
+        # Topic filter -> QoS the node asked for
+        self.filters: Dict[str, int] = {}
+        # The node got its CONNACK
+        self.connected = False
+        # Of the PUBLISH packets from the broker
+        self.next_id = 0
+
+
+class _Pending(NamedTuple):
+    """A packet identifier in use on the broker session. node_addr is None for packets of the bridge itself."""
+    node_addr: Optional[int]
+    packet_id: int
+    # For a SUBSCRIBE, the QoS the node asked for per topic filter
+    qos: Tuple[int, ...] = ()
+
+
+def topic_matches(topic_filter: str, topic: str) -> bool:
+    if topic.startswith('$') and topic_filter[:1] in ('+', '#'):
+        return False
+    filter_levels = topic_filter.split('/')
+    topic_levels = topic.split('/')
+    for i, level in enumerate(filter_levels):
+        if level == '#':
+            return True
+        if i >= len(topic_levels) or (level != '+' and level != topic_levels[i]):
+            return False
+    return len(filter_levels) == len(topic_levels)
+
+
+def _packet(first: int, body: bytes) -> bytes:
+    return bytes([first]) + encode_remaining_length(len(body)) + body
+
+
+def _ack(packet_type: int, packet_id: int) -> bytes:
+    # PUBREL has flags 0b0010
+    return _packet(packet_type << 4 | (0x02 if packet_type == MQTT_PUBREL else 0), packet_id.to_bytes(2, 'big'))
+
+
+def _string(s: str) -> bytes:
+    data = s.encode()
+    return len(data).to_bytes(2, 'big') + data
+
+
+def _publish(topic: str, payload: bytes, qos: int, retain: bool, packet_id: int) -> bytes:
+    body = _string(topic) + (packet_id.to_bytes(2, 'big') if qos else b'') + payload
+    return _packet(MQTT_PUBLISH << 4 | qos << 1 | int(retain), body)
+
+
+def _split(buf: bytearray, max_len: Optional[int] = None) -> Iterator[Tuple[bytes, int]]:
+    """Takes the whole packets off buf, with the length of their fixed header. Raises ValueError on a malformed one."""
+    while True:
+        fixed = fixed_header(buf)
+        if fixed is None:
+            return
+        header_len, remaining = fixed
+        if max_len is not None and header_len + remaining > max_len:
+            raise ValueError(f"Packet of {header_len + remaining} bytes")
+        if len(buf) < header_len + remaining:
+            return
+        packet = bytes(buf[:header_len + remaining])
+        del buf[:header_len + remaining]
+        yield packet, header_len
+
+
+class MqttMux:
+    def __init__(self, client_id: str, keepalive_s: int) -> None:
+        self.client_id = client_id
+        self.keepalive_s = keepalive_s
+        self.__nodes: Dict[int, _Node] = {}
+        # Per node address, the start of a packet yet to arrive
+        self.__node_bufs: Dict[int, bytearray] = {}
+        self.__broker_buf = bytearray()
+        # The broker accepted the session
+        self.__up = False
+        # Per packet identifier on the broker session, and the other way round for those of the nodes
+        self.__pending: Dict[int, _Pending] = {}
+        self.__ids: Dict[Tuple[int, int], int] = {}
+        self.__next_id = 0
+        # Answered once the broker connection is back
+        self.__deferred_subacks: List[_Pending] = []
+        self.__deferred_wills = bytearray()
+        self.__last_to_broker = time.monotonic()
+        self.__ping_sent: Optional[float] = None
+
+    def connect(self) -> bytes:
+        """The CONNECT to start a new broker connection with."""
+        self.__broker_buf.clear()
+        body = _string('MQTT') + bytes([4, 0x02]) + self.keepalive_s.to_bytes(2, 'big') + _string(self.client_id)
+        self.__last_to_broker = time.monotonic()
+        self.__ping_sent = None
+        return _packet(MQTT_CONNECT << 4, body)
+
+    def broker_lost(self) -> None:
+        self.__up = False
+        self.__deferred_subacks += [p for p in self.__pending.values() if p.node_addr is not None and p.qos]
+        self.__pending.clear()
+        self.__ids.clear()
+
+    def ping(self, now: float) -> Optional[bytes]:
+        """A PINGREQ to send to the broker now, if one is due."""
+        if not self.__up or self.__ping_sent is not None or now - self.__last_to_broker < self.keepalive_s / 2:
+            return None
+        self.__ping_sent = now
+        self.__last_to_broker = now
+        return PINGREQ
+
+    def broker_silent(self, now: float) -> bool:
+        """The broker has not answered a ping for a keepalive period."""
+        return self.__ping_sent is not None and now - self.__ping_sent > self.keepalive_s
+
+    def from_node(self, node_addr: int, data: bytes, keepalive_proxy: bool = False) -> MuxOutput:
+        """The MQTT stream of a node. keepalive_proxy as in RecvPacket."""
+        out = MuxOutput()
+        buf = self.__node_bufs.setdefault(node_addr, bytearray())
+        buf += data
+        try:
+            for packet, header_len in _split(buf, MAX_NODE_PACKET):
+                self.__on_node_packet(node_addr, packet, header_len, keepalive_proxy, out)
+        except (ValueError, IndexError):
+            # A new CONNECT after the node gave up on this session starts over where the data does
+            buf.clear()
+            self.__end_node(node_addr, out, True)
+        return self.__sent(out)
+
+    def from_broker(self, data: bytes) -> MuxOutput:
+        """Raises ValueError on a malformed stream or when the broker refuses the session."""
+        out = MuxOutput()
+        self.__broker_buf += data
+        for packet, header_len in _split(self.__broker_buf):
+            self.__on_broker_packet(packet, header_len, out)
+        return self.__sent(out)
+
+    def expire(self, now: float, last_heard: Callable[[int], Optional[float]]) -> MuxOutput:
+        """Ends the sessions of the nodes gone from the bus, like the broker does for a node past its keepalive.
+        last_heard as CanServer.node_last_heard()."""
+        out = MuxOutput()
+        for node_addr, node in list(self.__nodes.items()):
+            if not node.keepalive_s:
+                continue
+            factor = KEEPALIVE_PROXY_FACTOR + 1.5 if node.keepalive_proxy else 1.5
+            heard = last_heard(node_addr)
+            if heard is None or now - heard > factor * node.keepalive_s:
+                self.__end_node(node_addr, out, True)
+        return self.__sent(out)
+
+    def __sent(self, out: MuxOutput) -> MuxOutput:
+        if out.broker:
+            self.__last_to_broker = time.monotonic()
+        return out
+
+    def __allocate(self, pending: _Pending) -> Optional[int]:
+        for _ in range(0xFFFF):
+            self.__next_id = self.__next_id % 0xFFFF + 1
+            if self.__next_id not in self.__pending:
+                self.__pending[self.__next_id] = pending
+                if pending.node_addr is not None:
+                    self.__ids[(pending.node_addr, pending.packet_id)] = self.__next_id
+                return self.__next_id
+        return None
+
+    def __release(self, packet_id: int) -> Optional[_Pending]:
+        pending = self.__pending.pop(packet_id, None)
+        if pending is not None and pending.node_addr is not None:
+            self.__ids.pop((pending.node_addr, pending.packet_id), None)
+        return pending
+
+    def __on_node_packet(self, node_addr: int, packet: bytes, header_len: int, keepalive_proxy: bool,
+                         out: MuxOutput) -> None:
+        packet_type = packet[0] >> 4
+        if packet_type == MQTT_CONNECT:
+            # The node starts over, without its old session's subscriptions
+            self.__end_node(node_addr, out, False)
+            node = self.__nodes[node_addr] = self.__parse_connect(packet, header_len, keepalive_proxy)
+            if self.__up:
+                node.connected = True
+                out.to_node(node_addr, CONNACK)
+            return
+        node = self.__nodes.get(node_addr)
+        if node is None:
+            # Rest of a session from before the bridge started. The node gets no PINGRESP and reconnects
+            return
+        body = packet[header_len:]
+        if packet_type == MQTT_PUBLISH:
+            qos = (packet[0] >> 1) & 0x03
+            if not self.__up:
+                return
+            if not qos:
+                out.broker += packet
+                return
+            pos = 2 + int.from_bytes(body[:2], 'big')
+            packet_id, _ = read_uint16(body, pos)
+            broker_id = self.__allocate(_Pending(node_addr, packet_id))
+            if broker_id is not None:
+                out.broker += packet[:header_len] + body[:pos] + broker_id.to_bytes(2, 'big') + body[pos + 2:]
+        elif packet_type == MQTT_PUBREL:
+            packet_id, _ = read_uint16(body, 0)
+            broker_id = self.__ids.get((node_addr, packet_id))
+            if broker_id is None:
+                # The broker connection the PUBLISH went over is gone
+                out.to_node(node_addr, _ack(MQTT_PUBCOMP, packet_id))
+            else:
+                out.broker += _ack(MQTT_PUBREL, broker_id)
+        elif packet_type == MQTT_SUBSCRIBE:
+            packet_id, pos = read_uint16(body, 0)
+            filters = []
+            while pos < len(body):
+                topic_filter, pos = read_string(body, pos)
+                filters.append((topic_filter, min(body[pos] & 0x03, MAX_QOS)))
+                pos += 1
+            node.filters.update(filters)
+            pending = _Pending(node_addr, packet_id, tuple(qos for _, qos in filters))
+            if not self.__up:
+                self.__deferred_subacks.append(pending)
+                return
+            broker_id = self.__allocate(pending)
+            if broker_id is not None:
+                out.broker += self.__subscribe(broker_id, [topic_filter for topic_filter, _ in filters])
+        elif packet_type == MQTT_UNSUBSCRIBE:
+            packet_id, pos = read_uint16(body, 0)
+            filters = []
+            while pos < len(body):
+                topic_filter, pos = read_string(body, pos)
+                node.filters.pop(topic_filter, None)
+                filters.append(topic_filter)
+            self.__unsubscribe(filters, out)
+            out.to_node(node_addr, _ack(MQTT_UNSUBACK, packet_id))
+        elif packet_type == MQTT_PINGREQ:
+            out.to_node(node_addr, PINGRESP)
+        elif packet_type == MQTT_DISCONNECT:
+            self.__end_node(node_addr, out, False)
+        # PUBACK and PUBREC answer the bridge's own PUBLISH packets
+
+    @staticmethod
+    def __parse_connect(packet: bytes, header_len: int, keepalive_proxy: bool) -> _Node:
+        """Client identifier and credentials are the bridge's own on the broker session."""
+        _, pos = read_string(packet, header_len)
+        # Protocol level
+        pos += 1
+        flags = packet[pos]
+        keepalive_s, pos = read_uint16(packet, pos + 1)
+        _, pos = read_string(packet, pos)
+        will = None
+        if flags & 0x04:
+            topic, pos = read_string(packet, pos)
+            message_len, pos = read_uint16(packet, pos)
+            will = _Will(topic, packet[pos:pos + message_len], (flags >> 3) & 0x03, bool(flags & 0x20))
+        return _Node(keepalive_s, will, keepalive_proxy)
+
+    def __end_node(self, node_addr: int, out: MuxOutput, publish_will: bool) -> None:
+        node = self.__nodes.pop(node_addr, None)
+        if node is None:
+            return
+        # Answers still to come are not for the node's next session
+        for packet_id, pending in self.__pending.items():
+            if pending.node_addr == node_addr:
+                self.__pending[packet_id] = _Pending(None, 0)
+        self.__ids = {key: broker_id for key, broker_id in self.__ids.items() if key[0] != node_addr}
+        self.__deferred_subacks = [p for p in self.__deferred_subacks if p.node_addr != node_addr]
+        self.__unsubscribe(list(node.filters), out)
+        if not publish_will:
+            return
+        out.lost.append(node_addr)
+        if node.will is None:
+            return
+        if self.__up:
+            out.broker += self.__publish_will(node.will)
+        else:
+            # QoS 0, a packet identifier is only to be had once the session is up
+            self.__deferred_wills += _publish(node.will.topic, node.will.message, 0, node.will.retain, 0)
+
+    def __publish_will(self, will: _Will) -> bytes:
+        broker_id = self.__allocate(_Pending(None, 0)) if will.qos else 0
+        if broker_id is None:
+            return b''
+        return _publish(will.topic, will.message, will.qos, will.retain, broker_id)
+
+    def __subscribe(self, packet_id: int, filters: List[str]) -> bytes:
+        """With the highest QoS any node asked for, a new subscription to a filter replaces the old one."""
+        body = bytearray(packet_id.to_bytes(2, 'big'))
+        for topic_filter in filters:
+            body += _string(topic_filter)
+            body.append(max(node.filters.get(topic_filter, 0) for node in self.__nodes.values()))
+        return _packet(MQTT_SUBSCRIBE << 4 | 0x02, bytes(body))
+
+    def __unsubscribe(self, filters: List[str], out: MuxOutput) -> None:
+        unused = [f for f in filters if not any(f in node.filters for node in self.__nodes.values())]
+        if not unused or not self.__up:
+            return
+        broker_id = self.__allocate(_Pending(None, 0))
+        if broker_id is not None:
+            body = broker_id.to_bytes(2, 'big') + b''.join(_string(f) for f in unused)
+            out.broker += _packet(MQTT_UNSUBSCRIBE << 4 | 0x02, body)
+
+    def __on_broker_packet(self, packet: bytes, header_len: int, out: MuxOutput) -> None:
+        packet_type = packet[0] >> 4
+        body = packet[header_len:]
+        if packet_type == MQTT_CONNACK:
+            if len(body) < 2 or body[1] != 0:
+                raise ValueError(f"Broker refused the session: {body.hex()}")
+            self.__on_broker_up(out)
+        elif packet_type == MQTT_PUBLISH:
+            self.__on_broker_publish(packet[0], body, out)
+        elif packet_type == MQTT_PUBREL:
+            # Of a QoS 2 PUBLISH, though subscriptions ask for QoS 1 at most
+            out.broker += _ack(MQTT_PUBCOMP, read_uint16(body, 0)[0])
+        elif packet_type in (MQTT_PUBACK, MQTT_PUBREC, MQTT_PUBCOMP, MQTT_SUBACK, MQTT_UNSUBACK):
+            packet_id, _ = read_uint16(body, 0)
+            if packet_type == MQTT_PUBREC:
+                pending = self.__pending.get(packet_id)
+            else:
+                pending = self.__release(packet_id)
+            if pending is None:
+                return
+            if pending.node_addr is None:
+                if packet_type == MQTT_PUBREC:
+                    out.broker += _ack(MQTT_PUBREL, packet_id)
+            elif packet_type == MQTT_SUBACK:
+                codes = bytes(c if c == SUBACK_FAILURE else min(c, qos) for c, qos in zip(body[2:], pending.qos))
+                out.to_node(pending.node_addr, _packet(MQTT_SUBACK << 4, pending.packet_id.to_bytes(2, 'big') + codes))
+            elif packet_type != MQTT_UNSUBACK:
+                out.to_node(pending.node_addr, _ack(packet_type, pending.packet_id))
+        elif packet_type == MQTT_PINGRESP:
+            self.__ping_sent = None
+
+    def __on_broker_up(self, out: MuxOutput) -> None:
+        self.__up = True
+        filters = sorted({f for node in self.__nodes.values() for f in node.filters})
+        if filters:
+            broker_id = self.__allocate(_Pending(None, 0))
+            if broker_id is not None:
+                out.broker += self.__subscribe(broker_id, filters)
+        out.broker += self.__deferred_wills
+        self.__deferred_wills.clear()
+        for node_addr, node in self.__nodes.items():
+            if not node.connected:
+                node.connected = True
+                out.to_node(node_addr, CONNACK)
+        # Covered by the subscriptions just made
+        for pending in self.__deferred_subacks:
+            assert pending.node_addr is not None
+            out.to_node(pending.node_addr, _packet(MQTT_SUBACK << 4, pending.packet_id.to_bytes(2, 'big') +
+                                                   bytes(pending.qos)))
+        self.__deferred_subacks.clear()
+
+    def __on_broker_publish(self, first: int, body: bytes, out: MuxOutput) -> None:
+        qos = (first >> 1) & 0x03
+        topic, pos = read_string(body, 0)
+        if qos:
+            packet_id, pos = read_uint16(body, pos)
+            out.broker += _ack(MQTT_PUBACK if qos == 1 else MQTT_PUBREC, packet_id)
+        payload = body[pos:]
+        # QoS 0 copies are all the same, the bridge may send them once
+        qos0_addrs = []
+        for node_addr, node in self.__nodes.items():
+            if not node.connected:
+                continue
+            granted = [q for f, q in node.filters.items() if topic_matches(f, topic)]
+            if not granted:
+                continue
+            node_qos = min(qos, max(granted))
+            if not node_qos:
+                qos0_addrs.append(node_addr)
+                continue
+            node.next_id = node.next_id % 0xFFFF + 1
+            out.to_node(node_addr, _publish(topic, payload, node_qos, bool(first & 0x01), node.next_id))
+        if qos0_addrs:
+            out.to_nodes(tuple(qos0_addrs), _publish(topic, payload, 0, bool(first & 0x01), 0))
@@ -0,0 +1,101 @@
+"""Priority classes of MQTT packets, h42_mqtt_priority.h in the firmware.
+
+Both ends put the MQTT packets they send in classes by packet type and topic, and send the ISO-TP messages carrying
+them with that priority in the CAN ID, so a command wins the bus over a node pushing its discovery configs:
+  CONTROL: everything but PUBLISH
+  COMMAND: PUBLISH to a topic ending in /command or /set
+  BULK: PUBLISH to a topic ending in /config, Home Assistant discovery, or /debug, ESPHome's logs
+  STATE: any other PUBLISH
+"""
+from typing import Optional, Tuple
+
+from mqtt_compact import MQTT_PUBLISH
+from mqtt_keepalive import fixed_header
+from msg import Priority
+
+_COMMAND_SUFFIXES = (b'/command', b'/set')
+_BULK_SUFFIXES = (b'/config', b'/debug')
+
+
+def _topic(packet: bytes) -> Optional[Tuple[int, int]]:
+    """Where the topic of a PUBLISH starts and ends, None until packet holds its length."""
+    try:
+        header = fixed_header(bytearray(packet[:5]))
+    except ValueError:
+        return None
+    if header is None or header[0] + 2 > len(packet):
+        return None
+    start = header[0] + 2
+    return start, start + (packet[start - 2] << 8 | packet[start - 1])
+
+
+def packet_priority(packet: bytes) -> Priority:
+    """Class of an MQTT packet, whole or at least up to its topic. A PUBLISH cut short before the end of its topic
+    is STATE."""
+    if not packet or packet[0] >> 4 != MQTT_PUBLISH:
+        return Priority.CONTROL
+    topic = _topic(packet)
+    if topic is None or topic[1] > len(packet):
+        return Priority.STATE
+    name = bytes(packet[topic[0]:topic[1]])
+    if name.endswith(_COMMAND_SUFFIXES):
+        return Priority.COMMAND
+    if name.endswith(_BULK_SUFFIXES):
+        return Priority.BULK
+    return Priority.STATE
+
+
+class StreamPriority:
+    """Classes the pieces an MQTT stream is cut into for sending. A piece takes the most urgent class of the packets
+    it carries bytes of, so packets keep their order and a command never waits behind its own piece. Only the start
+    of a packet is held on to, until its class is known."""
+
+    def __init__(self) -> None:
+        # Start of the current packet while its class is not known yet
+        self.__head = bytearray()
+        # Class of the current packet once known, and how many of its bytes are still to come
+        self.__priority: Optional[Priority] = None
+        self.__left = 0
+
+    def feed(self, data: bytes) -> Priority:
+        """Class of the next piece of the stream."""
+        result: Optional[Priority] = None
+        pos = 0
+        while pos < len(data):
+            if self.__priority is None:
+                self.__head.append(data[pos])
+                pos += 1
+                if not self.__classify():
+                    continue
+            else:
+                n = min(self.__left, len(data) - pos)
+                self.__left -= n
+                pos += n
+            assert self.__priority is not None
+            result = self.__priority if result is None else min(result, self.__priority)
+            if self.__left == 0:
+                self.__priority = None
+        if self.__head:
+            # The piece ends before the packet's class is known
+            head = packet_priority(self.__head)
+            result = head if result is None else min(result, head)
+        return Priority.STATE if result is None else result
+
+    def __classify(self) -> bool:
+        """Works out the class of the current packet once its head says enough."""
+        try:
+            header = fixed_header(self.__head)
+        except ValueError:
+            # Not MQTT, send it as it comes
+            header = (len(self.__head), 0)
+        if header is None:
+            return False
+        total = header[0] + header[1]
+        if len(self.__head) < total and self.__head[0] >> 4 == MQTT_PUBLISH:
+            topic = _topic(self.__head)
+            if topic is None or topic[1] > len(self.__head):
+                return False
+        self.__priority = packet_priority(self.__head)
+        self.__left = total - len(self.__head)
+        self.__head.clear()
+        return True
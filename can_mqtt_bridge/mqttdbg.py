@@ -67,6 +67,7 @@ def print_mqtt_message(buffer: bytes) -> None:
     """
     # Define MQTT message type names
     message_types = {
+        0: "REGISTER or DISCOVERY (compact, see mqtt_compact.py)",
         1: "CONNECT",
         2: "CONNACK",
         3: "PUBLISH",
@@ -81,6 +82,7 @@ def print_mqtt_message(buffer: bytes) -> None:
         12: "PINGREQ",
         13: "PINGRESP",
         14: "DISCONNECT",
+        15: "PUBLISH (compact)",
     }
 
     # Start parsing the fixed header
@@ -1,4 +1,4 @@
-from enum import Enum
+from enum import Enum, IntEnum
 
 import can
 
@@ -7,16 +7,49 @@ from node_mac import NodeMac
 ADDRESS_BROADCAST = 0xFF
 ADDRESS_MASTER = 0x00
 
+CLASSIC_FRAME_SIZE = 8
+# Frame lengths a CAN FD controller can send
+FD_FRAME_SIZES = (8, 12, 16, 20, 24, 32, 48, 64)
+
+# Optional features negotiated with the link params, H42_CAN_FEATURE_* in the firmware.
+# The node's MQTT stream uses the topic aliases of mqtt_compact.py.
+FEATURE_COMPACT_MQTT = 0x01
+# The node's MQTT stream uses the compressed PUBLISH packets of mqtt_compact.py.
+FEATURE_COMPRESSION = 0x02
+# The node checks its discovery set against discovery_cache.py, with the DISCOVERY packets of mqtt_compact.py.
+FEATURE_DISCOVERY_CACHE = 0x04
+# The bridge keeps the node's broker session alive, see mqtt_keepalive.py.
+FEATURE_KEEPALIVE_PROXY = 0x08
+# The node takes MQTT packets for several nodes sent once as BROADCAST_DATA, see IsotpCanServer.send_broadcast().
+FEATURE_BROADCAST = 0x10
+
 
 class MsgType(Enum):
     ISOTP = 0
+    LINK_PARAMS = 1
+    DISCOVERY_STATUS = 2
+    BROADCAST_DATA = 3
     ADDRESS_REQUEST = 5
     ADDRESS_RESPONSE = 6
     UNKNOWN = 99
 
 
-def make_can_id(t: MsgType, src: int, dst: int) -> int:
-    return t.value << 16 | src << 8 | dst
+class Priority(IntEnum):
+    """Top bits of the CAN ID, H42_CAN_PRIORITY_* in the firmware. The lowest value wins bus arbitration.
+    mqtt_priority.py sorts MQTT packets into them."""
+    CONTROL = 0  # Link management, flow control and MQTT packets other than PUBLISH
+    COMMAND = 1  # PUBLISH to a command topic
+    STATE = 2  # Any other PUBLISH
+    BULK = 3  # PUBLISH of discovery configs and logs
+
+
+PRIORITY_SHIFT = 26
+# Receivers ignore these bits
+PRIORITY_MASK = 0x7 << PRIORITY_SHIFT
+
+
+def make_can_id(t: MsgType, src: int, dst: int, priority: Priority = Priority.CONTROL) -> int:
+    return priority << PRIORITY_SHIFT | t.value << 16 | src << 8 | dst
 
 
 class _MsgBase:
@@ -51,6 +84,33 @@ class _MsgAddressRequest(_MsgBase):
         return NodeMac(self.can_msg.data[:6])
 
 
+class _MsgLinkParams(_MsgBase):
+    """Flow control a node proposes to receive with."""
+
+    def __init__(self, can_msg: can.Message) -> None:
+        super().__init__(can_msg)
+        assert self.type == MsgType.LINK_PARAMS
+        assert can_msg.dlc >= 2
+
+    @property
+    def block_size(self) -> int:
+        return int(self.can_msg.data[0])
+
+    @property
+    def stmin(self) -> int:
+        return int(self.can_msg.data[1])
+
+    @property
+    def frame_size(self) -> int:
+        """Largest CAN frame the node handles, classic CAN when it does not say."""
+        return int(self.can_msg.data[2]) if self.can_msg.dlc >= 3 else CLASSIC_FRAME_SIZE
+
+    @property
+    def features(self) -> int:
+        """FEATURE_* bits the node would like to use."""
+        return int(self.can_msg.data[3]) if self.can_msg.dlc >= 4 else 0
+
+
 class Msg(_MsgBase):
     def __init__(self, can_msg: can.Message) -> None:
         super().__init__(can_msg)
@@ -59,6 +119,10 @@ class Msg(_MsgBase):
     def as_address_request(self) -> _MsgAddressRequest:
         return _MsgAddressRequest(self.can_msg)
 
+    @property
+    def as_link_params(self) -> _MsgLinkParams:
+        return _MsgLinkParams(self.can_msg)
+
 
 def make_address_response(status_code: int, new_address: int, node_mac: NodeMac) -> Msg:
     assert 0 <= status_code <= 0xFF
@@ -78,3 +142,38 @@ def make_address_request_request(node_address: int) -> Msg:
         is_extended_id=True,
         dlc=0)
     )
+
+
+def make_link_params(node_address: int, block_size: int, stmin: int, tx_stmin_floor: int,
+                     frame_size: int = CLASSIC_FRAME_SIZE, features: int = 0) -> Msg:
+    """Flow control the node must ask for, the lowest STmin it may send with, the CAN frame length both
+    sides use and the features granted. STmin values use the ISO-TP encoding. The frame length is left out
+    for classic CAN and the features when there are none, for nodes that predate them."""
+    assert ADDRESS_MASTER < node_address < ADDRESS_BROADCAST
+    assert 0 <= block_size <= 0xFF and 0 <= stmin <= 0xFF and 0 <= tx_stmin_floor <= 0xFF
+    assert frame_size in FD_FRAME_SIZES
+    assert 0 <= features <= 0xFF
+    data = bytes([block_size, stmin, tx_stmin_floor])
+    if frame_size != CLASSIC_FRAME_SIZE or features:
+        data += bytes([frame_size])
+    if features:
+        data += bytes([features])
+    return Msg(can.Message(
+        arbitration_id=make_can_id(MsgType.LINK_PARAMS, ADDRESS_MASTER, node_address),
+        is_extended_id=True,
+        dlc=len(data),
+        data=data
+    ))
+
+
+def make_discovery_status(node_address: int, set_hash: int, cached: bool) -> Msg:
+    """Answer to a node's discovery check: whether the bridge has the set and replayed it."""
+    assert ADDRESS_MASTER < node_address < ADDRESS_BROADCAST
+    assert 0 <= set_hash <= 0xFFFFFFFF
+    data = bytes([1 if cached else 0]) + set_hash.to_bytes(4, 'big')
+    return Msg(can.Message(
+        arbitration_id=make_can_id(MsgType.DISCOVERY_STATUS, ADDRESS_MASTER, node_address),
+        is_extended_id=True,
+        dlc=len(data),
+        data=data
+    ))
@@ -1,40 +1,72 @@
-import functools
-import queue
-import threading
-from typing import Optional
-
-import isotp
-from typing_extensions import Callable
+import asyncio
+import collections
+import time
+from typing import Deque, Optional, Tuple
 
+import isotp_engine
+from msg import Priority
 from node_mac import NodeMac
-from packet import Packet, RecvPacket, SendPacket
+from packet import SendPacket
 
 MIN_NODE_ADDR = 1
 MAX_NODE_ADDR = 254
 
+# Flow control the bridge asks of nodes before any consecutive frames are lost
+DEFAULT_RX_BLOCK_SIZE = 8
+DEFAULT_RX_STMIN_MS = 2
+
+
+class StminBackoff:
+    """Separation time asked of a sender. Doubles while consecutive frames get lost, and steps back
+    towards the base value after RECOVER_AFTER messages are received intact."""
+    MAX_MS = 20
+    RECOVER_AFTER = 16
+
+    def __init__(self, base_ms: int) -> None:
+        self.__base = base_ms
+        self.__value = base_ms
+        self.__clean = 0
+
+    @property
+    def base(self) -> int:
+        return self.__base
+
+    @property
+    def value(self) -> int:
+        return self.__value
+
+    def on_error(self) -> int:
+        self.__clean = 0
+        self.__value = min(max(self.__value * 2, 1), self.MAX_MS)
+        return self.__value
+
+    def on_success(self) -> int:
+        if self.__value > self.__base:
+            self.__clean += 1
+            if self.__clean >= self.RECOVER_AFTER:
+                self.__clean = 0
+                self.__value -= 1
+        return self.__value
+
 
 class Node:
-    def __init__(self,
-                 node_mac: NodeMac,
-                 node_addr: int,
-                 send_func: Callable[[isotp.CanMessage], None],
-                 recv_packet_queue: queue.Queue[RecvPacket]) -> None:
+    """One node on the bus. Its ISO-TP session lives in the IsotpEngine shared by all nodes, which reports back
+    through the on_* methods."""
+
+    def __init__(self, node_mac: NodeMac, node_addr: int, engine: isotp_engine.IsotpEngine,
+                 rx_block_size: int = DEFAULT_RX_BLOCK_SIZE, rx_stmin_ms: int = DEFAULT_RX_STMIN_MS) -> None:
         self.__mac = node_mac
         self.__addr = node_addr
-        self.__send_func = send_func
-        self.__recv_msg_queue: queue.Queue[isotp.CanMessage] = queue.Queue()
-        self.__recv_packet_queue = recv_packet_queue
-        isotp_addr = isotp.Address(isotp.AddressingMode.Normal_29bits, rxid=0x0, txid=node_addr)
-        partial_rxfn = functools.partial(Node.__my_rxfn, self)
-        params = {
-            'blocking_send': True,
-            'stmin': 2,
-            'rx_flowcontrol_timeout': 2000
-        }
-        self.__isotp = isotp.TransportLayer(rxfn=partial_rxfn, txfn=send_func, address=isotp_addr, params=params)
-        self.__isotp.start()
-        self.__recv_worker_thread = threading.Thread(target=self.__recv_worker, daemon=True)
-        self.__recv_worker_thread.start()
+        self.__engine = engine
+        self.__frame_size = 8
+        self.__features = 0
+        self.__stmin = 0
+        # One per queued packet with its priority, the engine reports sends in order
+        self.__send_waiters: Deque[Tuple[asyncio.Future[None], Priority]] = collections.deque()
+        self.__rx_block_size = rx_block_size
+        self.__rx_stmin = StminBackoff(rx_stmin_ms)
+        self.__last_heard = time.monotonic()
+        engine.add_link(node_addr, rx_block_size, isotp_engine.stmin_from_ms(self.__rx_stmin.value))
 
     @property
     def mac(self) -> NodeMac:
@@ -44,41 +76,87 @@ class Node:
     def addr(self) -> int:
         return self.__addr
 
-    def on_received_can_msg(self, isotp_msg: isotp.CanMessage) -> None:
-        self.__recv_msg_queue.put(isotp_msg)
+    @property
+    def rx_stmin_base(self) -> int:
+        return self.__rx_stmin.base
+
+    @property
+    def frame_size(self) -> int:
+        return self.__frame_size
+
+    def set_frame_size(self, frame_size: int) -> None:
+        """CAN frame length to send with, anything above 8 bytes sends CAN FD frames."""
+        self.__engine.set_frame_size(self.__addr, frame_size)
+        self.__frame_size = frame_size
 
-    def recv_packet(self) -> Packet:
-        return self.__recv_packet_queue.get(block=True)
+    @property
+    def features(self) -> int:
+        """msg.FEATURE_* bits granted with the last link params."""
+        return self.__features
 
-    def send_packet(self, packet: SendPacket) -> None:
+    def set_features(self, features: int) -> None:
+        self.__features = features
+
+    @property
+    def stmin(self) -> int:
+        """Separation time the node asked to receive with, ISO-TP encoding."""
+        return self.__stmin
+
+    def set_stmin(self, stmin: int) -> None:
+        self.__stmin = stmin
+
+    @property
+    def last_heard(self) -> float:
+        """time.monotonic() of the last frame from the node."""
+        return self.__last_heard
+
+    @property
+    def tx_priority(self) -> Priority:
+        """Priority of the packet being sent to the node."""
+        return self.__send_waiters[0][1] if self.__send_waiters else Priority.STATE
+
+    def on_frame(self) -> None:
+        self.__last_heard = time.monotonic()
+
+    def send_packet(self, packet: SendPacket) -> asyncio.Future[None]:
+        """Queues the packet. The future completes once it has been sent."""
         if packet.dst_addr != self.__addr:
             raise ValueError(f"Packet destination address {packet.dst_addr} does not match node address {self.__addr}")
-        self.__isotp.send(packet.data)
-
-    def __recv_worker(self) -> None:
-        while True:
-            isotp_msg = self.__isotp.recv(block=True, timeout=1.0)
-            if isotp_msg is None:
-                continue
-            self.__recv_packet_queue.put(RecvPacket(self.__addr, isotp_msg))
-
-    def __my_rxfn(self, timeout: float) -> Optional[isotp.CanMessage]:
-        try:
-            return self.__recv_msg_queue.get(block=True, timeout=timeout)
-        except queue.Empty:
-            return None
+        waiter = asyncio.get_running_loop().create_future()
+        self.__send_waiters.append((waiter, packet.priority))
+        self.__engine.send(self.__addr, packet.data, packet.priority)
+        return waiter
+
+    def on_send_done(self, error: Optional[isotp_engine.IsotpError]) -> None:
+        waiter = self.__send_waiters.popleft()[0]
+        if waiter.done():
+            return
+        if error is None:
+            waiter.set_result(None)
+        else:
+            waiter.set_exception(error)
+
+    def on_message(self) -> None:
+        self.__set_rx_stmin(self.__rx_stmin.on_success())
+
+    def on_rx_error(self, error: isotp_engine.IsotpError) -> None:
+        # Both mean we missed consecutive frames, so ask the node to slow down in the next flow control
+        if isinstance(error, (isotp_engine.WrongSequenceNumberError, isotp_engine.ConsecutiveFrameTimeoutError)):
+            self.__set_rx_stmin(self.__rx_stmin.on_error())
+
+    def __set_rx_stmin(self, stmin: int) -> None:
+        self.__engine.set_flow_params(self.__addr, self.__rx_block_size, isotp_engine.stmin_from_ms(stmin))
 
 
 class NodeRegistry:
     MAX_NODES = 254
 
-    def __init__(
-            self,
-            send_func: Callable[[isotp.CanMessage], None],
-            recv_packet_queue: queue.Queue[RecvPacket]) -> None:
+    def __init__(self, engine: isotp_engine.IsotpEngine, rx_block_size: int = DEFAULT_RX_BLOCK_SIZE,
+                 rx_stmin_ms: int = DEFAULT_RX_STMIN_MS) -> None:
         self.__nodes: list[Node] = []
-        self.__send_func = send_func
-        self.__recv_packet_queue = recv_packet_queue
+        self.__engine = engine
+        self.__rx_block_size = rx_block_size
+        self.__rx_stmin_ms = rx_stmin_ms
 
     def add_node(self, node_mac: NodeMac) -> Node:
         for node in self.__nodes:
@@ -86,10 +164,14 @@ class NodeRegistry:
                 raise RuntimeError(f"Node with MAC {node_mac} already exists.")
         if len(self.__nodes) >= self.MAX_NODES:
             raise RuntimeError("No more addresses. Overwriting old nodes is not implemented yet.")
-        n = Node(node_mac, self.__get_next_node_addr(), self.__send_func, self.__recv_packet_queue)
+        n = Node(node_mac, self.__get_next_node_addr(), self.__engine, self.__rx_block_size, self.__rx_stmin_ms)
         self.__nodes.append(n)
         return n
 
+    @property
+    def nodes(self) -> list[Node]:
+        return list(self.__nodes)
+
     def find_node_by_mac(self, node_mac: NodeMac) -> Node | None:
         for node in self.__nodes:
             if node.mac == node_mac:
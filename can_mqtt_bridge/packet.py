@@ -1,7 +1,15 @@
+from msg import Priority
+
+# Largest ISO-TP message a node takes (ISOTP_BUFSIZE in the firmware). Packets are segments of the
+# MQTT byte stream, so MQTT packets of any size are cut into as many packets as needed. A broadcast to several
+# nodes carries its target addresses in this too.
+MAX_PACKET_SIZE = 4095
+
+
 class Packet:
     def __init__(self, data: bytes) -> None:
-        if len(data) > 4095:
-            raise ValueError("Packet longer than 4095 bytes")
+        if len(data) > MAX_PACKET_SIZE:
+            raise ValueError(f"Packet longer than {MAX_PACKET_SIZE} bytes")
         self.data = data
 
     @property
@@ -10,12 +18,18 @@ class Packet:
 
 
 class RecvPacket(Packet):
-    def __init__(self, src_addr: int, data: bytes) -> None:
+    def __init__(self, src_addr: int, data: bytes, compact_mqtt: bool = False, keepalive_proxy: bool = False) -> None:
+        """compact_mqtt is set when the node's stream uses the encoding of mqtt_compact.py, keepalive_proxy when the
+        node leaves keeping its broker session alive to us (mqtt_keepalive.py)."""
         super().__init__(data)
         self.src_addr = src_addr
+        self.compact_mqtt = compact_mqtt
+        self.keepalive_proxy = keepalive_proxy
 
 
 class SendPacket(Packet):
-    def __init__(self, dst_addr: int, data: bytes) -> None:
+    def __init__(self, dst_addr: int, data: bytes, priority: Priority = Priority.STATE) -> None:
+        """priority goes in the CAN ID of the frames carrying the packet, see mqtt_priority.py."""
         super().__init__(data)
         self.dst_addr = dst_addr
+        self.priority = priority
@@ -0,0 +1,168 @@
+"""Runs the bridge's CAN side against simulated nodes on a simulated bus and reports throughput and latency.
+
+Each node is an h42_sim_node process, the firmware transport built for the host (see esp_can_transport/host).
+Once connected it sends a packet of --size bytes every --period-ms, stamped with its send time, and this
+measures how long the packets take to come out of IsotpCanServer.recv_packet().
+
+    python3 sim_main.py --nodes 50 --duration 60
+"""
+import argparse
+import asyncio
+import dataclasses
+import json
+import logging
+import math
+import os
+import struct
+import sys
+import time
+from typing import Dict, List, Optional, Sequence
+
+import canbus_sim
+import isotp_can_server
+
+DEFAULT_NODE_BINARY = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                   '..', 'esp_can_transport', 'host', 'build', 'h42_sim_node')
+# Sequence number, CLOCK_MONOTONIC send time in microseconds and node index, see sim_node.c
+NODE_PAYLOAD_HEADER = struct.Struct('<IQH')
+
+
+@dataclasses.dataclass
+class SimConfig:
+    nodes: int = 10
+    bitrate: int = 20000
+    duration: float = 30.0
+    size: int = 32
+    period_ms: int = 5000
+    error_rate: float = 0.0
+    seed: int = 1
+    # Flow control the nodes propose for receiving
+    rx_block_size: int = 8
+    rx_st_min_us: int = 2000
+    # Nodes power up one after the other, this far apart. Address requests have no random identifier bits,
+    # so nodes that ask at the same time collide until the losers are error passive or bus-off.
+    join_interval_ms: int = 200
+    node_binary: str = DEFAULT_NODE_BINARY
+
+
+@dataclasses.dataclass
+class SimResult:
+    nodes_connected: int
+    packets: int
+    payload_bytes: int
+    elapsed: float
+    # Send to receive, in milliseconds
+    latencies_ms: List[float]
+    bus: canbus_sim.BusStats
+
+    @property
+    def throughput(self) -> float:
+        """Payload bytes per second."""
+        return self.payload_bytes / self.elapsed if self.elapsed > 0 else 0.0
+
+    @property
+    def utilization(self) -> float:
+        """Share of the time the bus was busy, error frames included."""
+        return self.bus.busy_time / self.elapsed if self.elapsed > 0 else 0.0
+
+    def summary(self) -> Dict[str, object]:
+        return {
+            'nodes_connected': self.nodes_connected,
+            'packets': self.packets,
+            'payload_bytes': self.payload_bytes,
+            'elapsed_s': round(self.elapsed, 3),
+            'throughput_bytes_per_s': round(self.throughput, 1),
+            'latency_ms': {f'p{p}': percentile(self.latencies_ms, p) for p in (50, 90, 99, 100)},
+            'bus_frames': self.bus.frames,
+            'bus_frames_per_s': round(self.bus.frames / self.elapsed, 1) if self.elapsed > 0 else 0.0,
+            'bus_error_frames': self.bus.error_frames,
+            'bus_collisions': self.bus.collisions,
+            'bus_utilization': round(self.utilization, 4),
+        }
+
+
+def percentile(values: Sequence[float], p: float) -> Optional[float]:
+    """Nearest-rank percentile, None without values."""
+    if not values:
+        return None
+    ordered = sorted(values)
+    rank = min(max(math.ceil(len(ordered) * p / 100.0) - 1, 0), len(ordered) - 1)
+    return round(ordered[rank], 3)
+
+
+def node_argv(config: SimConfig, index: int) -> List[str]:
+    return [config.node_binary, '--index', str(index), '--size', str(config.size),
+            '--period-ms', str(config.period_ms), '--seed', str(config.seed),
+            '--rx-block-size', str(config.rx_block_size), '--rx-st-min-us', str(config.rx_st_min_us)]
+
+
+async def run_simulation(config: SimConfig, logger: logging.Logger) -> SimResult:
+    sim = canbus_sim.RealTimeCanBus(config.bitrate, config.error_rate, config.seed)
+    sim.start()
+    bus = sim.add_python_port()
+    server = isotp_can_server.IsotpCanServer(bus, logger, bitrate=config.bitrate)
+    server_task = asyncio.create_task(server.run())
+    for i in range(config.nodes):
+        if i > 0:
+            await asyncio.sleep(config.join_interval_ms / 1000.0)
+        sim.add_process_port(node_argv(config, i))
+
+    latencies: List[float] = []
+    senders = set()
+    payload_bytes = 0
+    start = time.monotonic()
+    try:
+        while (remaining := config.duration - (time.monotonic() - start)) > 0:
+            try:
+                packet = await asyncio.wait_for(server.recv_packet(), remaining)
+            except asyncio.TimeoutError:
+                break
+            now_us = time.monotonic_ns() // 1000
+            if packet.len < NODE_PAYLOAD_HEADER.size:
+                logger.warning(f"Short packet from node {packet.src_addr}")
+                continue
+            _, sent_us, _ = NODE_PAYLOAD_HEADER.unpack_from(packet.data)
+            latencies.append((now_us - sent_us) / 1000.0)
+            senders.add(packet.src_addr)
+            payload_bytes += packet.len
+    finally:
+        elapsed = time.monotonic() - start
+        server_task.cancel()
+        try:
+            await server_task
+        except asyncio.CancelledError:
+            pass
+        sim.stop()
+        bus.shutdown()
+    return SimResult(len(senders), len(latencies), payload_bytes, elapsed, latencies, sim.stats())
+
+
+def parse_args(argv: Sequence[str]) -> SimConfig:
+    defaults = SimConfig()
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--nodes', type=int, default=defaults.nodes)
+    parser.add_argument('--bitrate', type=int, default=defaults.bitrate)
+    parser.add_argument('--duration', type=float, default=defaults.duration, help="seconds")
+    parser.add_argument('--size', type=int, default=defaults.size, help="packet size of the nodes")
+    parser.add_argument('--period-ms', type=int, default=defaults.period_ms, help="send period of each node")
+    parser.add_argument('--error-rate', type=float, default=defaults.error_rate,
+                        help="chance of a bit error hitting a frame")
+    parser.add_argument('--seed', type=int, default=defaults.seed)
+    parser.add_argument('--rx-block-size', type=int, default=defaults.rx_block_size)
+    parser.add_argument('--rx-st-min-us', type=int, default=defaults.rx_st_min_us)
+    parser.add_argument('--join-interval-ms', type=int, default=defaults.join_interval_ms,
+                        help="time between node power-ups")
+    parser.add_argument('--node-binary', default=os.environ.get('H42_SIM_NODE', defaults.node_binary))
+    args = parser.parse_args(argv)
+    return SimConfig(**{f.name: getattr(args, f.name) for f in dataclasses.fields(SimConfig)})
+
+
+def main(argv: Sequence[str]) -> None:
+    config = parse_args(argv)
+    logging.basicConfig(level=logging.WARNING, stream=sys.stderr)
+    result = asyncio.run(run_simulation(config, logging.getLogger('sim')))
+    print(json.dumps({'config': dataclasses.asdict(config), 'result': result.summary()}, indent=2))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
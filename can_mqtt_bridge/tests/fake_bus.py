@@ -1,5 +1,5 @@
 import queue
-from typing import Optional, Tuple
+from typing import List, Optional, Tuple
 
 import can
 from can import BusABC
@@ -9,9 +9,12 @@ class FakeBus(BusABC):
     def __init__(self) -> None:
         self._recv_queue: queue.Queue[can.Message] = queue.Queue()
         self._sent_queue: queue.Queue[can.Message] = queue.Queue()
+        # Every frame in bus order, flagged True if it was sent by the node.
+        self.log: List[Tuple[bool, can.Message]] = []
         super().__init__(channel="fake")
 
     def send(self, msg: can.Message, timeout: Optional[float] = None) -> None:
+        self.log.append((False, msg))
         self._sent_queue.put(msg)
         # print("daemon sent - ", hex(msg.arbitration_id))
 
@@ -25,6 +28,7 @@ class FakeBus(BusABC):
             return None, False
 
     def node_send(self, msg: can.Message) -> None:
+        self.log.append((True, msg))
         self._recv_queue.put(msg)
         # print("node sent - ", hex(msg.arbitration_id))
 
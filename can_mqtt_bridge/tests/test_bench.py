@@ -0,0 +1,62 @@
+import asyncio
+import logging
+import os
+import unittest
+
+import bench
+import sim_main
+
+
+class TestStubBroker(unittest.IsolatedAsyncioTestCase):
+    async def test_acks(self) -> None:
+        broker = bench.StubBroker()
+        port = await broker.start()
+        reader, writer = await asyncio.open_connection('127.0.0.1', port)
+        try:
+            connect = bytes([0x10, 14, 0, 4]) + b'MQTT' + bytes([4, 2, 0, 60, 0, 2]) + b'id'
+            writer.write(connect)
+            self.assertEqual(bytes([0x20, 2, 0, 0]), await reader.readexactly(4))
+            # QoS 1 gets its packet id back, QoS 0 nothing
+            writer.write(bytes([0x32, 8, 0, 1]) + b't' + bytes([0x12, 0x34]) + b'abc')
+            writer.write(bytes([0x30, 4, 0, 1]) + b't' + b'x')
+            writer.write(bytes([0xC0, 0]))
+            self.assertEqual(bytes([0x40, 2, 0x12, 0x34]), await reader.readexactly(4))
+            self.assertEqual(bytes([0xD0, 0]), await reader.readexactly(2))
+            self.assertEqual(2, broker.publishes)
+        finally:
+            writer.close()
+            await broker.close()
+
+
+class TestCompare(unittest.TestCase):
+    def test_compare(self) -> None:
+        case = {'payload_size': 16, 'block_size': 8, 'stmin_ms': 0}
+        old = {'revision': 'a', 'cases': [{'case': case, 'result': {'latency_ms': {'p50': 100.0, 'p99': 200.0},
+                                                                    'payload_bytes_per_s': 100.0}}]}
+        new = {'revision': 'b', 'cases': [{'case': case, 'result': {'latency_ms': {'p50': 50.0, 'p99': 201.0},
+                                                                    'payload_bytes_per_s': 80.0}},
+                                          {'case': dict(case, payload_size=32), 'result': {}}]}
+        lines = bench.compare(old, new)
+        self.assertEqual('a -> b', lines[0])
+        self.assertEqual(5, len(lines))
+        self.assertIn('latency_ms.p50', lines[2])
+        self.assertTrue(lines[2].endswith('(-50.0%) better'))
+        self.assertTrue(lines[3].endswith('(+0.5%)'))
+        self.assertTrue(lines[4].endswith('(-20.0%) WORSE'))
+
+
+@unittest.skipUnless(os.path.exists(os.environ.get('H42_SIM_NODE', sim_main.DEFAULT_NODE_BINARY)),
+                     "h42_sim_node not built, see esp_can_transport/host")
+class TestBench(unittest.TestCase):
+    def test_case(self) -> None:
+        config = bench.BenchConfig(warmup=2.0, duration=2.0,
+                                   node_binary=os.environ.get('H42_SIM_NODE', sim_main.DEFAULT_NODE_BINARY))
+        result = asyncio.run(bench.run_case(config, bench.BenchCase(payload_size=100, block_size=4, stmin_ms=1),
+                                            logging.getLogger('test')))
+        self.assertEqual(1, result['nodes_publishing'])
+        self.assertGreater(result['publishes'], 5)
+        self.assertGreater(result['bus_utilization'], 0.5)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,108 @@
+import asyncio
+import unittest
+import uuid
+from typing import List
+
+import can
+import isotp
+
+import isotp_can_server
+from msg import MsgType, Priority
+from packet import SendPacket
+from test_isotp_daemon import make_can_msg, make_logger, parse_can_id
+
+
+def make_virtual_bus(channel: str) -> can.BusABC:
+    # python-can's in-process bus, every other bus on the same channel sees what is sent
+    return can.Bus(interface='virtual', channel=channel, protocol=can.CanProtocol.CAN_FD)
+
+
+def drain(bus: can.BusABC) -> List[can.Message]:
+    frames = []
+    while (m := bus.recv(0)) is not None:
+        frames.append(m)
+    return frames
+
+
+class TestCanFd(unittest.IsolatedAsyncioTestCase):
+    def setUp(self) -> None:
+        channel = f'h42-{uuid.uuid4()}'
+        self.server_bus = make_virtual_bus(channel)
+        self.node_bus = make_virtual_bus(channel)
+        self.sniffer_bus = make_virtual_bus(channel)
+        # Cleanups run last in first out, so the buses go after the daemon and node stacks
+        self.addCleanup(self.server_bus.shutdown)
+        self.addCleanup(self.node_bus.shutdown)
+        self.addCleanup(self.sniffer_bus.shutdown)
+
+    def start_daemon(self, can_fd: bool) -> isotp_can_server.IsotpCanServer:
+        daemon = isotp_can_server.IsotpCanServer(bus=self.server_bus, logger=make_logger(), can_fd=can_fd)
+        task = asyncio.create_task(daemon.run())
+        self.addCleanup(task.cancel)
+        return daemon
+
+    async def connect_node(self, frame_size: int) -> int:
+        """Obtains an address and proposes frame_size the way the firmware does. Returns the node address."""
+        self.node_bus.send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
+        m = await asyncio.to_thread(self.node_bus.recv, 5)
+        assert m is not None
+        node_addr = int(m.data[7])
+        self.node_bus.send(make_can_msg(MsgType.LINK_PARAMS, node_addr, 0x00, bytes([8, 0, frame_size])))
+        m = await asyncio.to_thread(self.node_bus.recv, 5)
+        assert m is not None
+        self.assertEqual(MsgType.LINK_PARAMS, parse_can_id(m.arbitration_id)[0])
+        self.reply = bytes(m.data)
+        return node_addr
+
+    def make_node_stack(self, node_addr: int, frame_size: int) -> isotp.CanStack:
+        """The stack matches whole CAN IDs, so packets for it are sent with the priority bits clear."""
+        isotp_addr = isotp.Address(isotp.AddressingMode.Normal_29bits, rxid=node_addr, txid=(node_addr << 8))
+        stack = isotp.CanStack(self.node_bus, address=isotp_addr, params={
+            'blocking_send': True,
+            'can_fd': frame_size > 8,
+            'tx_data_length': frame_size,
+        })
+        stack.start()
+        self.addCleanup(stack.stop)
+        return stack
+
+    async def test_fd_transfer(self) -> None:
+        daemon = self.start_daemon(can_fd=True)
+        node_addr = await self.connect_node(64)
+        self.assertEqual(self.reply[3], 64)
+        stack = self.make_node_stack(node_addr, 64)
+        drain(self.sniffer_bus)
+
+        down_data = bytes(range(256)) * 15
+        sender = asyncio.create_task(daemon.send_packet(SendPacket(node_addr, down_data, Priority.CONTROL)))
+        self.assertEqual(down_data, await asyncio.to_thread(stack.recv, block=True, timeout=10))
+        await sender
+        # Escape sequence single frame, more than 7 bytes in one frame
+        up_data = b'S' * 40
+        await asyncio.to_thread(stack.send, up_data)
+        self.assertEqual(up_data, (await daemon.recv_packet()).data)
+
+        frames = drain(self.sniffer_bus)
+        server_frames = [m for m in frames if parse_can_id(m.arbitration_id)[2] == node_addr]
+        self.assertTrue(all(m.is_fd for m in server_frames))
+        # First frame plus 61 consecutive frames of 63 bytes
+        self.assertLessEqual(len(server_frames), 1 + 61)
+        self.assertEqual(64, max(len(m.data) for m in server_frames))
+
+    async def test_classic_bus_refuses_fd(self) -> None:
+        daemon = self.start_daemon(can_fd=False)
+        node_addr = await self.connect_node(64)
+        # No frame size in the reply means classic CAN
+        self.assertEqual(len(self.reply), 3)
+        stack = self.make_node_stack(node_addr, 8)
+        drain(self.sniffer_bus)
+
+        data = b'X' * 300
+        sender = asyncio.create_task(daemon.send_packet(SendPacket(node_addr, data, Priority.CONTROL)))
+        self.assertEqual(data, await asyncio.to_thread(stack.recv, block=True, timeout=10))
+        await sender
+        self.assertFalse(any(m.is_fd or len(m.data) > 8 for m in drain(self.sniffer_bus)))
+
+
+if __name__ == '__main__':
+    unittest.main()
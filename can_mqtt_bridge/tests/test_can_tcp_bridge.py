@@ -0,0 +1,241 @@
+import asyncio
+import logging
+import time
+import unittest
+from typing import Dict, List, Optional, Sequence, Set, Tuple
+
+from can_tcp_bridge import CanTcpBridge
+from msg import Priority
+from packet import MAX_PACKET_SIZE, RecvPacket, SendPacket
+
+
+class FakeCanServer:
+    def __init__(self) -> None:
+        self.from_nodes: asyncio.Queue[RecvPacket] = asyncio.Queue()
+        self.sent: List[SendPacket] = []
+        self.discovery_status: asyncio.Queue[Tuple[int, int, bool]] = asyncio.Queue()
+        self.last_heard: Dict[int, float] = {}
+        self.broadcast_nodes: Set[int] = set()
+        self.broadcasts: List[Tuple[Tuple[int, ...], bytes]] = []
+
+    async def recv_packet(self) -> RecvPacket:
+        return await self.from_nodes.get()
+
+    async def send_packet(self, p: SendPacket) -> None:
+        self.sent.append(p)
+
+    async def send_discovery_status(self, dst_addr: int, set_hash: int, cached: bool) -> None:
+        self.discovery_status.put_nowait((dst_addr, set_hash, cached))
+
+    def node_last_heard(self, node_addr: int) -> Optional[float]:
+        return self.last_heard.get(node_addr)
+
+    def accepts_broadcast(self, node_addr: int) -> bool:
+        return node_addr in self.broadcast_nodes
+
+    async def send_broadcast(self, dst_addrs: Sequence[int], data: bytes, priority: Priority = Priority.STATE) -> None:
+        self.broadcasts.append((tuple(dst_addrs), data))
+
+
+class TestCanTcpBridge(unittest.IsolatedAsyncioTestCase):
+    async def test_large_stream(self) -> None:
+        connected: asyncio.Queue[tuple[asyncio.StreamReader, asyncio.StreamWriter]] = asyncio.Queue()
+
+        async def on_connect(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+            await connected.put((reader, writer))
+
+        tcp_server = await asyncio.start_server(on_connect, '127.0.0.1', 0)
+        self.addAsyncCleanup(tcp_server.wait_closed)
+        self.addCleanup(tcp_server.close)
+        host, port = tcp_server.sockets[0].getsockname()[:2]
+        can_server = FakeCanServer()
+        bridge = CanTcpBridge(can_server, host, port, logging.getLogger(__name__))
+        bridge_task = asyncio.create_task(bridge.run())
+        self.addCleanup(bridge_task.cancel)
+
+        # The node side of the stream arrives as packets and leaves as one TCP stream
+        up = [bytes([i]) * MAX_PACKET_SIZE for i in range(3)]
+        for p in up:
+            can_server.from_nodes.put_nowait(RecvPacket(1, p))
+        reader, writer = await asyncio.wait_for(connected.get(), 5)
+        self.assertEqual(b''.join(up), await asyncio.wait_for(reader.readexactly(len(up) * MAX_PACKET_SIZE), 5))
+
+        # An MQTT packet much larger than a node packet goes out in segments
+        down = bytes(range(256)) * 200
+        writer.write(down)
+        await writer.drain()
+        writer.close()
+        async with asyncio.timeout(5):
+            while sum(p.len for p in can_server.sent) < len(down):
+                await asyncio.sleep(0.01)
+        self.assertTrue(all(p.dst_addr == 1 and p.len <= MAX_PACKET_SIZE for p in can_server.sent))
+        self.assertEqual(down, b''.join(p.data for p in can_server.sent))
+
+    async def test_compact_mqtt(self) -> None:
+        connected: asyncio.Queue[tuple[asyncio.StreamReader, asyncio.StreamWriter]] = asyncio.Queue()
+
+        async def on_connect(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+            await connected.put((reader, writer))
+
+        tcp_server = await asyncio.start_server(on_connect, '127.0.0.1', 0)
+        self.addAsyncCleanup(tcp_server.wait_closed)
+        self.addCleanup(tcp_server.close)
+        host, port = tcp_server.sockets[0].getsockname()[:2]
+        can_server = FakeCanServer()
+        bridge = CanTcpBridge(can_server, host, port, logging.getLogger(__name__))
+        bridge_task = asyncio.create_task(bridge.run())
+        self.addCleanup(bridge_task.cancel)
+
+        # The REGISTER never reaches the broker
+        connect = bytes([0x10, 0x02, 0x00, 0x00])
+        can_server.from_nodes.put_nowait(RecvPacket(1, connect, compact_mqtt=True))
+        can_server.from_nodes.put_nowait(RecvPacket(1, b'\x00\x05\x00\x00a/b', compact_mqtt=True))
+        can_server.from_nodes.put_nowait(RecvPacket(1, b'\xF0\x04\x00\x00on', compact_mqtt=True))
+        reader, _ = await asyncio.wait_for(connected.get(), 5)
+        expected = connect + b'\x30\x07\x00\x03a/bon'
+        self.assertEqual(expected, await asyncio.wait_for(reader.readexactly(len(expected)), 5))
+
+    async def test_discovery_cache(self) -> None:
+        connected: asyncio.Queue[tuple[asyncio.StreamReader, asyncio.StreamWriter]] = asyncio.Queue()
+
+        async def on_connect(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+            await connected.put((reader, writer))
+
+        tcp_server = await asyncio.start_server(on_connect, '127.0.0.1', 0)
+        self.addAsyncCleanup(tcp_server.wait_closed)
+        self.addCleanup(tcp_server.close)
+        host, port = tcp_server.sockets[0].getsockname()[:2]
+        can_server = FakeCanServer()
+        bridge = CanTcpBridge(can_server, host, port, logging.getLogger(__name__))
+        bridge_task = asyncio.create_task(bridge.run())
+        self.addCleanup(bridge_task.cancel)
+
+        connect = bytes([0x10, 0x02, 0x00, 0x00])
+        check = b'\x01\x05\x00\xCA\xFE\x00\x01'
+        commit = b'\x01\x05\x01\xCA\xFE\x00\x01'
+        # Retained QoS 1, the replay is QoS 0
+        config = b'\x33\x0E\x00\x08a/config\x00\x01{}'
+        state = b'\x31\x06\x00\x03a/s1'
+
+        # A miss: the node sends its configs and they go to the broker as they are
+        can_server.from_nodes.put_nowait(RecvPacket(1, connect + check, compact_mqtt=True))
+        can_server.from_nodes.put_nowait(RecvPacket(1, config + state + commit, compact_mqtt=True))
+        reader, writer = await asyncio.wait_for(connected.get(), 5)
+        expected = connect + config + state
+        self.assertEqual(expected, await asyncio.wait_for(reader.readexactly(len(expected)), 5))
+        self.assertEqual((1, 0xCAFE0001, False), await asyncio.wait_for(can_server.discovery_status.get(), 5))
+
+        # A hit after the node reconnects: the bridge sends the configs in its place
+        writer.close()
+        async with asyncio.timeout(5):
+            while 1 in bridge.connections:
+                await asyncio.sleep(0.01)
+        can_server.from_nodes.put_nowait(RecvPacket(1, connect + check + state, compact_mqtt=True))
+        self.assertEqual((1, 0xCAFE0001, True), await asyncio.wait_for(can_server.discovery_status.get(), 5))
+        reader, writer = await asyncio.wait_for(connected.get(), 5)
+        expected = connect + b'\x31\x0C\x00\x08a/config{}' + state
+        self.assertEqual(expected, await asyncio.wait_for(reader.readexactly(len(expected)), 5))
+        writer.close()
+
+    async def test_keepalive_proxy(self) -> None:
+        connected: asyncio.Queue[tuple[asyncio.StreamReader, asyncio.StreamWriter]] = asyncio.Queue()
+
+        async def on_connect(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+            await connected.put((reader, writer))
+
+        tcp_server = await asyncio.start_server(on_connect, '127.0.0.1', 0)
+        self.addAsyncCleanup(tcp_server.wait_closed)
+        self.addCleanup(tcp_server.close)
+        host, port = tcp_server.sockets[0].getsockname()[:2]
+        can_server = FakeCanServer()
+        bridge = CanTcpBridge(can_server, host, port, logging.getLogger(__name__))
+        bridge.KEEPALIVE_TICK_S = 0.05
+        bridge_task = asyncio.create_task(bridge.run())
+        self.addCleanup(bridge_task.cancel)
+
+        # Keepalive 1 s
+        connect = bytes([0x10, 0x0C, 0x00, 0x04]) + b'MQTT' + bytes([0x04, 0x02, 0x00, 0x01, 0x00, 0x00])
+        pingreq = bytes([0xC0, 0x00])
+        pingresp = bytes([0xD0, 0x00])
+        can_server.last_heard[1] = time.monotonic()
+        can_server.from_nodes.put_nowait(RecvPacket(1, connect, keepalive_proxy=True))
+        reader, writer = await asyncio.wait_for(connected.get(), 5)
+        self.assertEqual(connect, await asyncio.wait_for(reader.readexactly(len(connect)), 5))
+
+        # The bridge pings on its own after half the keepalive, the answer stays off the bus
+        self.assertEqual(pingreq, await asyncio.wait_for(reader.readexactly(2), 5))
+        writer.write(pingresp)
+        # The node's own pings still get theirs
+        can_server.from_nodes.put_nowait(RecvPacket(1, pingreq, keepalive_proxy=True))
+        self.assertEqual(pingreq, await asyncio.wait_for(reader.readexactly(2), 5))
+        writer.write(pingresp)
+        async with asyncio.timeout(5):
+            while not can_server.sent:
+                await asyncio.sleep(0.01)
+        self.assertEqual([pingresp], [p.data for p in can_server.sent])
+
+        # Silent on the bus for too long: the bridge hangs up like the broker would have
+        can_server.last_heard[1] = time.monotonic() - 60
+        self.assertEqual(b'', await asyncio.wait_for(reader.read(), 5))
+        self.assertNotIn(1, bridge.connections)
+        writer.close()
+
+    async def test_multiplex(self) -> None:
+        connected: asyncio.Queue[tuple[asyncio.StreamReader, asyncio.StreamWriter]] = asyncio.Queue()
+
+        async def on_connect(reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+            await connected.put((reader, writer))
+
+        tcp_server = await asyncio.start_server(on_connect, '127.0.0.1', 0)
+        self.addAsyncCleanup(tcp_server.wait_closed)
+        self.addCleanup(tcp_server.close)
+        host, port = tcp_server.sockets[0].getsockname()[:2]
+        can_server = FakeCanServer()
+        bridge = CanTcpBridge(can_server, host, port, logging.getLogger(__name__), multiplex=True)
+        bridge_task = asyncio.create_task(bridge.run())
+        self.addCleanup(bridge_task.cancel)
+
+        # The bridge opens its session before any node shows up
+        reader, writer = await asyncio.wait_for(connected.get(), 5)
+        self.addCleanup(writer.close)
+        connect = await asyncio.wait_for(reader.readexactly(2 + 12 + len(CanTcpBridge.MUX_CLIENT_ID)), 5)
+        self.assertEqual(b'\x10', connect[:1])
+        self.assertTrue(connect.endswith(CanTcpBridge.MUX_CLIENT_ID.encode()))
+        connack = bytes([0x20, 0x02, 0x00, 0x00])
+        writer.write(connack)
+
+        # Nodes are answered by the bridge and share its connection
+        node_connect = bytes([0x10, 0x0C, 0x00, 0x04]) + b'MQTT' + bytes([0x04, 0x02, 0x00, 0x0A, 0x00, 0x00])
+        publish = b'\x30\x07\x00\x03a/bon'
+        for node_id in (1, 2, 3):
+            can_server.last_heard[node_id] = time.monotonic()
+            can_server.from_nodes.put_nowait(RecvPacket(node_id, node_connect))
+        async with asyncio.timeout(5):
+            while len(can_server.sent) < 3:
+                await asyncio.sleep(0.01)
+        self.assertEqual({(1, connack), (2, connack), (3, connack)}, {(p.dst_addr, p.data) for p in can_server.sent})
+        for node_id in (1, 2):
+            can_server.from_nodes.put_nowait(RecvPacket(node_id, publish))
+        self.assertEqual(publish * 2, await asyncio.wait_for(reader.readexactly(2 * len(publish)), 5))
+        self.assertTrue(connected.empty())
+
+        # A PUBLISH for several nodes goes once to those taking broadcasts
+        can_server.broadcast_nodes = {1, 2}
+        for node_id in (1, 2, 3):
+            can_server.from_nodes.put_nowait(RecvPacket(node_id, b'\x82\x08\x00\x01\x00\x03a/#\x00'))
+            subscribe = await asyncio.wait_for(reader.readexactly(10), 5)
+            writer.write(b'\x90\x03' + subscribe[2:4] + b'\x00')
+        async with asyncio.timeout(5):
+            while len(can_server.sent) < 6:
+                await asyncio.sleep(0.01)
+        del can_server.sent[:]
+        writer.write(publish)
+        async with asyncio.timeout(5):
+            while not can_server.sent or not can_server.broadcasts:
+                await asyncio.sleep(0.01)
+        self.assertEqual([((1, 2), publish)], can_server.broadcasts)
+        self.assertEqual([(3, publish)], [(p.dst_addr, p.data) for p in can_server.sent])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,188 @@
+import asyncio
+import logging
+import os
+import unittest
+from typing import List, Sequence, Tuple
+
+import can
+
+import canbus_sim
+import sim_main
+from canbus_sim import CanBusModel
+
+BITRATE = 20000
+ID = 0x0001FF00
+
+
+class Recorder:
+    """A model plus everything it reported."""
+
+    def __init__(self, ports: int, error_rate: float = 0.0, seed: int = 0) -> None:
+        self.delivered: List[Tuple[Tuple[int, ...], int, bytes, float]] = []
+        self.tx_done: List[Tuple[int, int, bytes, float]] = []
+        self.model = CanBusModel(BITRATE, self.__deliver, lambda *a: self.tx_done.append(a), error_rate, seed)
+        self.ports = [self.model.add_port() for _ in range(ports)]
+
+    def __deliver(self, src_ports: Sequence[int], can_id: int, data: bytes, t: float) -> None:
+        self.delivered.append((tuple(src_ports), can_id, data, t))
+
+
+class TestFrameBits(unittest.TestCase):
+    def test_stuffing(self) -> None:
+        self.assertEqual([0, 0, 0, 0, 0, 1], canbus_sim.stuffed_bits([0] * 5))
+        # The stuff bit counts towards the next run
+        self.assertEqual([1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 1], canbus_sim.stuffed_bits([1] * 5 + [0] * 4))
+        self.assertEqual([0, 1, 0, 1], canbus_sim.stuffed_bits([0, 1, 0, 1]))
+
+    def test_frame_length(self) -> None:
+        for size in range(9):
+            data = bytes(range(size))
+            # SOF, identifier, SRR, IDE, RTR, r1, r0, DLC, data and CRC, then the tail
+            unstuffed = 1 + 11 + 1 + 1 + 18 + 1 + 2 + 4 + 8 * size + 15
+            tail = canbus_sim.FRAME_TAIL_BITS + canbus_sim.INTERMISSION_BITS
+            bits = canbus_sim.frame_bits(ID, data)
+            self.assertGreaterEqual(bits, unstuffed + tail)
+            self.assertLessEqual(bits, unstuffed + (unstuffed - 1) // 4 + tail)
+        # All zeros stuffs the most
+        self.assertGreater(canbus_sim.frame_bits(0, bytes(8)), canbus_sim.frame_bits(0, bytes([0x55] * 8)))
+
+
+class TestCanBusModel(unittest.TestCase):
+    def test_frame_time(self) -> None:
+        r = Recorder(2)
+        r.model.submit(r.ports[0], ID, b'12345678', now=1.0)
+        r.model.advance(1.0)
+        self.assertEqual([], r.tx_done)
+        end = 1.0 + canbus_sim.frame_bits(ID, b'12345678') / BITRATE
+        self.assertAlmostEqual(end, r.model.next_event())
+        r.model.advance(end)
+        self.assertEqual([(r.ports[0], ID, b'12345678', end)], r.tx_done)
+        self.assertEqual([((r.ports[0],), ID, b'12345678', end)], r.delivered)
+        self.assertIsNone(r.model.next_event())
+        self.assertAlmostEqual(end - 1.0, r.model.stats.busy_time)
+
+    def test_lowest_id_wins(self) -> None:
+        r = Recorder(3)
+        for port, can_id in zip(r.ports, (0x300, 0x100, 0x200)):
+            r.model.submit(port, can_id, b'x', now=0.0)
+        r.model.advance(1.0)
+        self.assertEqual([0x100, 0x200, 0x300], [d[1] for d in r.delivered])
+        self.assertEqual(2, r.model.port_stats(r.ports[0]).arbitration_lost)
+        self.assertEqual(0, r.model.port_stats(r.ports[1]).arbitration_lost)
+        self.assertEqual(3, r.model.stats.frames)
+
+    def test_port_order_kept(self) -> None:
+        r = Recorder(1)
+        for can_id in (0x300, 0x100, 0x200):
+            r.model.submit(r.ports[0], can_id, b'', now=0.0)
+        r.model.advance(1.0)
+        self.assertEqual([0x300, 0x100, 0x200], [d[1] for d in r.delivered])
+
+    def test_frame_ready_later_waits(self) -> None:
+        r = Recorder(2)
+        r.model.submit(r.ports[0], 0x300, b'', now=0.0)
+        r.model.advance(0.0)
+        # Arbitration is over, the lower identifier has to wait for the bus
+        r.model.submit(r.ports[1], 0x100, b'', now=0.0001)
+        r.model.advance(1.0)
+        self.assertEqual([0x300, 0x100], [d[1] for d in r.delivered])
+
+    def test_identical_frames(self) -> None:
+        r = Recorder(3)
+        r.model.submit(r.ports[0], ID, b'same', now=0.0)
+        r.model.submit(r.ports[1], ID, b'same', now=0.0)
+        r.model.advance(1.0)
+        self.assertEqual(1, r.model.stats.frames)
+        self.assertEqual(0, r.model.stats.collisions)
+        self.assertEqual({r.ports[0], r.ports[1]}, {t[0] for t in r.tx_done})
+        self.assertEqual([(r.ports[0], r.ports[1])], [d[0] for d in r.delivered])
+
+    def test_collision(self) -> None:
+        r = Recorder(4)
+        for i, port in enumerate(r.ports):
+            r.model.submit(port, ID, bytes([0x40, i]), now=0.0)
+        r.model.advance(10.0)
+        # Error frames until the losers are error passive, then the dominant data gets through
+        self.assertGreater(r.model.stats.error_frames, 0)
+        self.assertGreater(r.model.stats.collisions, 0)
+        self.assertEqual([bytes([0x40, i]) for i in range(4)], [d[2] for d in r.delivered])
+        for port in r.ports:
+            self.assertGreater(r.model.port_stats(port).errors, 0)
+            self.assertEqual(1, r.model.port_stats(port).frames_sent)
+        self.assertEqual(0, r.model.port_stats(r.ports[0]).bus_off_count)
+
+    def test_bus_off(self) -> None:
+        r = Recorder(1, error_rate=1.0)
+        r.model.submit(r.ports[0], ID, b'', now=0.0)
+        stats = r.model.port_stats(r.ports[0])
+        while stats.bus_off_count == 0:
+            t = r.model.next_event()
+            assert t is not None
+            r.model.advance(t)
+        self.assertEqual([], r.tx_done)
+        self.assertEqual(canbus_sim.BUS_OFF_TEC // canbus_sim.TEC_ERROR_STEP, stats.errors)
+        self.assertEqual(0, r.model.tec(r.ports[0]))
+        self.assertEqual(1, r.model.pending(r.ports[0]))
+        # Then a long gap for the recovery
+        next_event = r.model.next_event()
+        assert next_event is not None
+        self.assertAlmostEqual(t + canbus_sim.BUS_OFF_RECOVERY_BITS / BITRATE, next_event)
+
+    def test_error_rate(self) -> None:
+        def run(seed: int) -> canbus_sim.BusStats:
+            r = Recorder(2, error_rate=0.2, seed=seed)
+            for i in range(200):
+                r.model.submit(r.ports[i % 2], ID + i % 2, bytes([i & 0xFF]), now=0.0)
+            r.model.advance(100.0)
+            self.assertEqual(200, len(r.delivered))
+            return r.model.stats
+
+        stats = run(seed=7)
+        self.assertEqual(stats, run(seed=7))
+        self.assertEqual(200, stats.frames)
+        # 200 frames at a 20% error rate take about 50 error frames
+        self.assertGreater(stats.error_frames, 20)
+        self.assertLess(stats.error_frames, 100)
+
+    def test_classic_frames_only(self) -> None:
+        r = Recorder(1)
+        with self.assertRaises(ValueError):
+            r.model.submit(r.ports[0], ID, bytes(9), now=0.0)
+
+
+class TestRealTimeCanBus(unittest.TestCase):
+    def test_python_ports(self) -> None:
+        sim = canbus_sim.RealTimeCanBus(BITRATE)
+        sim.start()
+        try:
+            a = sim.add_python_port()
+            b = sim.add_python_port()
+            a.send(can.Message(arbitration_id=ID, data=b'hello', is_extended_id=True))
+            m = b.recv(timeout=1.0)
+            self.assertIsNotNone(m)
+            assert m is not None
+            self.assertEqual(ID, m.arbitration_id)
+            self.assertEqual(b'hello', bytes(m.data))
+            # A node does not hear itself
+            self.assertIsNone(a.recv(timeout=0.1))
+            self.assertEqual(1, sim.model.stats.frames)
+        finally:
+            sim.stop()
+
+
+@unittest.skipUnless(os.path.exists(os.environ.get('H42_SIM_NODE', sim_main.DEFAULT_NODE_BINARY)),
+                     "h42_sim_node not built, see esp_can_transport/host")
+class TestSimulation(unittest.TestCase):
+    def test_nodes_reach_bridge(self) -> None:
+        config = sim_main.SimConfig(nodes=3, duration=8.0, size=40, period_ms=500,
+                                    node_binary=os.environ.get('H42_SIM_NODE', sim_main.DEFAULT_NODE_BINARY))
+        result = asyncio.run(sim_main.run_simulation(config, logging.getLogger('test')))
+        self.assertEqual(3, result.nodes_connected)
+        self.assertGreater(result.packets, 10)
+        self.assertEqual(result.packets * 40, result.payload_bytes)
+        self.assertGreater(result.utilization, 0.0)
+        self.assertEqual(0, result.bus.error_frames)
+
+
+if __name__ == '__main__':
+    unittest.main()
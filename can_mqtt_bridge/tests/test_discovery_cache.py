@@ -0,0 +1,51 @@
+import unittest
+
+from discovery_cache import MAX_RECORDED_SET, DiscoveryCache
+
+CONNACK_LIKE = bytes([0x20, 0x02, 0x00, 0x00])
+
+
+def publish(topic: bytes, payload: bytes, flags: int = 0x01) -> bytes:
+    body = len(topic).to_bytes(2, 'big') + topic + (b'\x00\x01' if flags & 0x06 else b'') + payload
+    assert len(body) < 128
+    return bytes([0x30 | flags, len(body)]) + body
+
+
+class TestDiscoveryCache(unittest.TestCase):
+    def test_record_and_replay(self) -> None:
+        cache = DiscoveryCache()
+        self.assertIsNone(cache.check(1, 7))
+        stream = (publish(b'ha/a/config', b'{"a":1}', flags=0x03) +
+                  publish(b'ha/b/config', b'{"b":1}') +
+                  # Not retained, not a config, and a config removed again
+                  publish(b'ha/c/config', b'{"c":1}', flags=0x00) +
+                  publish(b'ha/a/state', b'1') +
+                  publish(b'ha/b/config', b'') +
+                  CONNACK_LIKE)
+        # Cut anywhere
+        for i in range(len(stream)):
+            cache.record(1, stream[i:i + 1])
+        self.assertTrue(cache.commit(1, 7))
+        self.assertEqual(publish(b'ha/a/config', b'{"a":1}'), cache.check(1, 7))
+        # Another set, or another node, misses
+        self.assertIsNone(cache.check(1, 8))
+        self.assertIsNone(cache.check(2, 7))
+
+    def test_commit_needs_check(self) -> None:
+        cache = DiscoveryCache()
+        self.assertFalse(cache.commit(1, 7))
+        cache.check(1, 7)
+        self.assertFalse(cache.commit(1, 8))
+        self.assertIsNone(cache.check(1, 8))
+
+    def test_too_large(self) -> None:
+        cache = DiscoveryCache()
+        cache.check(1, 7)
+        for i in range(MAX_RECORDED_SET // 100 + 1):
+            cache.record(1, publish(b'ha/%d/config' % i, b'x' * 100))
+        self.assertFalse(cache.commit(1, 7))
+        self.assertIsNone(cache.check(1, 7))
+
+
+if __name__ == '__main__':
+    unittest.main()
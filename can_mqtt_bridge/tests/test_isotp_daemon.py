@@ -1,15 +1,19 @@
+import asyncio
 import functools
 import logging
 import queue
 import sys
+import time
 import unittest
 from typing import Tuple, Optional
 
 import can
 import isotp
 
+import isotp_can_server
+import node
 from fake_bus import FakeBus
-from msg import MsgType
+from msg import PRIORITY_MASK, PRIORITY_SHIFT, MsgType, Priority
 from packet import SendPacket
 
 
@@ -38,7 +42,9 @@ def parse_can_id(can_id: int) -> Tuple[MsgType, int, int]:
 def __rxfn(bus: FakeBus, timeout: float) -> Optional[isotp.CanMessage]:
     try:
         m = bus.node_recv(timeout)
-        return isotp.CanMessage(arbitration_id=m.arbitration_id, data=m.data, dlc=m.dlc, extended_id=m.is_extended_id)
+        # Like the firmware, the node ignores the priority bits
+        return isotp.CanMessage(arbitration_id=m.arbitration_id & ~PRIORITY_MASK, data=m.data, dlc=m.dlc,
+                                extended_id=m.is_extended_id)
     except queue.Empty:
         return None
 
@@ -62,33 +68,126 @@ def make_node_isotp_transport(node_addr: int, bus: FakeBus) -> isotp.TransportLa
     return transport
 
 
-class TestIsotpDaemon(unittest.TestCase):
-    def test_isotp_daemon_address_request(self) -> None:
+class TestIsotpDaemon(unittest.IsolatedAsyncioTestCase):
+    def start_daemon(self, can_bus: FakeBus) -> isotp_can_server.IsotpCanServer:
+        daemon = isotp_can_server.IsotpCanServer(bus=can_bus, logger=make_logger())
+        task = asyncio.create_task(daemon.run())
+        self.addCleanup(task.cancel)
+        return daemon
+
+    async def test_isotp_daemon_address_request(self) -> None:
         can_bus = FakeBus()
-        daemon = isotp_daemon.IsotpCanServer(bus=can_bus, logger=make_logger())
+        self.start_daemon(can_bus)
         # Send address request
         can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
         # Receive address response
-        m = can_bus.node_recv()
+        m = await asyncio.to_thread(can_bus.node_recv)
         t, src, dst = parse_can_id(m.arbitration_id)
         self.assertEqual(MsgType.ADDRESS_RESPONSE, t)
         self.assertEqual(src, 0x00)
         self.assertEqual(dst, 0xFF)
         self.assertEqual(m.data[7], 0x01)  # The node new address
 
-    def test_isotp_send_receive(self) -> None:
+    async def test_isotp_send_receive(self) -> None:
         can_bus = FakeBus()
-        daemon = isotp_daemon.IsotpCanServer(bus=can_bus, logger=make_logger())
+        daemon = self.start_daemon(can_bus)
         can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
-        m = can_bus.node_recv()
+        m = await asyncio.to_thread(can_bus.node_recv)
         node_addr = m.data[7]
         node_transport = make_node_isotp_transport(node_addr, can_bus)
         data = b'X' * 2048
         # Daemon sends data to node
-        daemon.send_packet(SendPacket(dst_addr=node_addr, data=data))
-        recv_data = node_transport.recv(block=True)
+        await daemon.send_packet(SendPacket(dst_addr=node_addr, data=data))
+        recv_data = await asyncio.to_thread(node_transport.recv, block=True)
         self.assertEqual(data, recv_data)
         # Node sends data to daemon
-        node_transport.send(data)
-        recv_packet = daemon.recv_packet()
+        await asyncio.to_thread(node_transport.send, data)
+        recv_packet = await daemon.recv_packet()
         self.assertEqual(data, recv_packet.data)
+
+    async def test_isotp_full_duplex(self) -> None:
+        can_bus = FakeBus()
+        daemon = self.start_daemon(can_bus)
+        can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
+        m = await asyncio.to_thread(can_bus.node_recv)
+        node_addr = m.data[7]
+        node_transport = make_node_isotp_transport(node_addr, can_bus)
+        down_data = bytes(range(256)) * 8
+        up_data = bytes(reversed(down_data))
+        # Both sides start a large transfer at the same time
+        down = asyncio.create_task(daemon.send_packet(SendPacket(dst_addr=node_addr, data=down_data)))
+        up = asyncio.create_task(asyncio.to_thread(node_transport.send, up_data))
+        self.assertEqual(down_data, await asyncio.to_thread(node_transport.recv, block=True, timeout=10))
+        self.assertEqual(up_data, (await daemon.recv_packet()).data)
+        await down
+        await up
+        # Consecutive frames of the two transfers must have interleaved on the bus
+        down_cf = [i for i, (from_node, m) in enumerate(can_bus.log) if not from_node and m.data[0] >> 4 == 2]
+        up_cf = [i for i, (from_node, m) in enumerate(can_bus.log) if from_node and m.data[0] >> 4 == 2]
+        self.assertLess(down_cf[0], up_cf[-1])
+        self.assertLess(up_cf[0], down_cf[-1])
+
+    async def test_link_params(self) -> None:
+        can_bus = FakeBus()
+        self.start_daemon(can_bus)
+        can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
+        node_addr = (await asyncio.to_thread(can_bus.node_recv)).data[7]
+        # Node proposes BS 0, STmin 500 us
+        can_bus.node_send(make_can_msg(MsgType.LINK_PARAMS, node_addr, 0x00, b'\x00\xF5'))
+        m = await asyncio.to_thread(can_bus.node_recv)
+        t, src, dst = parse_can_id(m.arbitration_id)
+        self.assertEqual(MsgType.LINK_PARAMS, t)
+        self.assertEqual(src, 0x00)
+        self.assertEqual(dst, node_addr)
+        self.assertEqual(bytes(m.data), bytes([0x00, 0xF5, node.DEFAULT_RX_STMIN_MS]))
+
+    async def test_link_features(self) -> None:
+        can_bus = FakeBus()
+        daemon = self.start_daemon(can_bus)
+        can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
+        node_addr = (await asyncio.to_thread(can_bus.node_recv)).data[7]
+        # Compact MQTT, compression, the discovery cache and a feature the bridge does not know
+        can_bus.node_send(make_can_msg(MsgType.LINK_PARAMS, node_addr, 0x00, b'\x08\x02\x08\x87'))
+        m = await asyncio.to_thread(can_bus.node_recv)
+        self.assertEqual(bytes(m.data), bytes([0x08, 0x02, node.DEFAULT_RX_STMIN_MS, 8, 0x07]))
+        can_bus.node_send(make_can_msg(MsgType.ISOTP, node_addr, 0x00, b'\x02ab'))
+        packet = await daemon.recv_packet()
+        self.assertEqual(b'ab', packet.data)
+        self.assertTrue(packet.compact_mqtt)
+
+    async def test_broadcast(self) -> None:
+        can_bus = FakeBus()
+        daemon = self.start_daemon(can_bus)
+        addrs = []
+        # Both take broadcasts, the second asks for STmin 5 ms
+        for mac, stmin in ((b'\x01\x02\x03\x04\x05\x06', 2), (b'\x01\x02\x03\x04\x05\x07', 5)):
+            can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, mac))
+            addrs.append((await asyncio.to_thread(can_bus.node_recv)).data[7])
+            can_bus.node_send(make_can_msg(MsgType.LINK_PARAMS, addrs[-1], 0x00, bytes([8, stmin, 8, 0x10])))
+            await asyncio.to_thread(can_bus.node_recv)
+        self.assertTrue(daemon.accepts_broadcast(addrs[1]))
+        data = bytes(range(30))
+        start = time.monotonic()
+        await daemon.send_broadcast(addrs, data)
+        # Consecutive frames at the slowest node's separation time
+        self.assertGreaterEqual(time.monotonic() - start, 4 * 0.005)
+        frames = [await asyncio.to_thread(can_bus.node_recv) for _ in range(5)]
+        for m in frames:
+            self.assertEqual((MsgType.BROADCAST_DATA, 0x00, 0xFF), parse_can_id(m.arbitration_id))
+        message = bytes(frames[0].data[2:]) + b''.join(bytes(m.data[1:]) for m in frames[1:])
+        self.assertEqual(bytes([0x10, 33]), bytes(frames[0].data[:2]))
+        self.assertEqual(bytes([2]) + bytes(addrs) + data, message[:33])
+
+    async def test_priority(self) -> None:
+        can_bus = FakeBus()
+        daemon = self.start_daemon(can_bus)
+        can_bus.node_send(make_can_msg(MsgType.ADDRESS_REQUEST, 0xFF, 0x00, b'\x01\x02\x03\x04\x05\x06'))
+        node_addr = (await asyncio.to_thread(can_bus.node_recv)).data[7]
+        await daemon.send_packet(SendPacket(node_addr, b'\x30\x05\x00\x03a/b', Priority.COMMAND))
+        m = await asyncio.to_thread(can_bus.node_recv)
+        self.assertEqual(Priority.COMMAND << PRIORITY_SHIFT | node_addr, m.arbitration_id)
+        # Flow control for the node's transfer goes first, whatever we are sending
+        can_bus.node_send(make_can_msg(MsgType.ISOTP, node_addr, 0x00, bytes([0x10, 20]) + b'X' * 6))
+        m = await asyncio.to_thread(can_bus.node_recv)
+        self.assertEqual(0x30, m.data[0] & 0xF0)
+        self.assertEqual(node_addr, m.arbitration_id)
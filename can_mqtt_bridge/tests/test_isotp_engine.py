@@ -0,0 +1,252 @@
+import collections
+import unittest
+from typing import Callable, Deque, List, Optional, Tuple
+
+import isotp_engine
+from isotp_engine import IsotpEngine, IsotpError, TimerWheel
+from tx_scheduler import max_frame_bits
+
+NODE_ADDRS = (1, 2, 254)
+MASTER = 0
+
+
+class Clock:
+    def __init__(self) -> None:
+        self.now = 1000.0
+
+    def __call__(self) -> float:
+        return self.now
+
+
+class Endpoint:
+    """An engine plus everything it reported."""
+
+    def __init__(self, clock: Clock, outbox: Deque[Tuple[int, bytes]], bitrate: Optional[int] = None) -> None:
+        self.messages: List[Tuple[int, bytes]] = []
+        self.sent: List[Tuple[int, Optional[IsotpError]]] = []
+        self.rx_errors: List[Tuple[int, IsotpError]] = []
+        self.frames: List[bytes] = []
+        self.frame_addrs: List[int] = []
+        self.__outbox = outbox
+        self.engine = IsotpEngine(send_frame=self.__send_frame,
+                                  on_message=lambda a, d: self.messages.append((a, d)),
+                                  on_send_done=lambda a, e: self.sent.append((a, e)),
+                                  on_rx_error=lambda a, e: self.rx_errors.append((a, e)),
+                                  clock=clock,
+                                  bitrate=bitrate)
+
+    def __send_frame(self, addr: int, data: bytes) -> None:
+        self.frames.append(data)
+        self.frame_addrs.append(addr)
+        self.__outbox.append((addr, data))
+
+
+class Bus:
+    """The bridge engine with one link per node, and one engine per node with a link to the master."""
+
+    def __init__(self, block_size: int = 8, stmin: int = 0, bitrate: Optional[int] = None) -> None:
+        """bitrate paces the bridge engine."""
+        self.clock = Clock()
+        self.to_nodes: Deque[Tuple[int, bytes]] = collections.deque()
+        self.master = Endpoint(self.clock, self.to_nodes, bitrate)
+        self.nodes = {}
+        for addr in NODE_ADDRS:
+            self.master.engine.add_link(addr, block_size, stmin)
+            outbox: Deque[Tuple[int, bytes]] = collections.deque()
+            self.nodes[addr] = (Endpoint(self.clock, outbox), outbox)
+            self.nodes[addr][0].engine.add_link(MASTER, block_size, stmin)
+        self.lost: Optional[int] = None
+
+    def node(self, addr: int) -> Endpoint:
+        return self.nodes[addr][0]
+
+    def pump(self, step: float = 0.001, max_time: float = 60) -> None:
+        """Delivers frames and moves the clock on until nothing is left to do."""
+        end = self.clock.now + max_time
+        while self.clock.now < end:
+            moved = False
+            while self.to_nodes:
+                addr, data = self.to_nodes.popleft()
+                self.__deliver(lambda: self.node(addr).engine.on_frame(MASTER, data))
+                moved = True
+            for addr, (node, outbox) in self.nodes.items():
+                while outbox:
+                    data = outbox.popleft()[1]
+                    self.__deliver(lambda: self.master.engine.on_frame(addr, data))
+                    moved = True
+            if moved:
+                continue
+            deadlines = [d for d in [self.master.engine.next_deadline()] +
+                         [n.engine.next_deadline() for n, _ in self.nodes.values()] if d is not None]
+            if not deadlines:
+                return
+            self.clock.now = max(self.clock.now + step, min(deadlines))
+            self.master.engine.poll()
+            for node, _ in self.nodes.values():
+                node.engine.poll()
+
+    def __deliver(self, deliver: Callable[[], None]) -> None:
+        if self.lost == 0:
+            self.lost = None
+            return
+        if self.lost is not None:
+            self.lost -= 1
+        deliver()
+
+
+def payload(size: int) -> bytes:
+    return bytes(i * 7 & 0xFF for i in range(size))
+
+
+class TestTimerWheel(unittest.TestCase):
+    def test_schedule_cancel(self) -> None:
+        wheel = TimerWheel(tick=0.001, slots=16, now=0.0)
+        wheel.schedule(1, 0.005)
+        wheel.schedule(2, 0.020)  # Past one turn of the wheel
+        wheel.schedule(3, 0.003)
+        wheel.cancel(3)
+        self.assertAlmostEqual(wheel.next_deadline() or 0, 0.005)
+        self.assertEqual(wheel.advance(0.004), [])
+        self.assertEqual(wheel.advance(0.005), [1])
+        self.assertEqual(wheel.advance(0.019), [])
+        self.assertEqual(wheel.advance(0.020), [2])
+        self.assertIsNone(wheel.next_deadline())
+
+    def test_long_gap(self) -> None:
+        wheel = TimerWheel(tick=0.001, slots=16, now=0.0)
+        wheel.schedule(1, 0.002)
+        wheel.schedule(2, 0.100)
+        self.assertEqual(sorted(wheel.advance(10.0)), [1, 2])
+        # Deadlines in the past fire on the next tick
+        wheel.schedule(3, 5.0)
+        self.assertAlmostEqual(wheel.next_deadline() or 0, 10.001)
+        self.assertEqual(wheel.advance(10.001), [3])
+
+
+class TestIsotpEngine(unittest.TestCase):
+    def test_sizes(self) -> None:
+        bus = Bus()
+        for size in (1, 7, 8, 62, 4095, 4096, 20000, isotp_engine.MAX_MESSAGE_SIZE):
+            bus.master.engine.send(1, payload(size))
+            bus.node(1).engine.send(MASTER, payload(size)[::-1])
+            bus.pump()
+            self.assertEqual(bus.node(1).messages[-1], (MASTER, payload(size)))
+            self.assertEqual(bus.master.messages[-1], (1, payload(size)[::-1]))
+        self.assertTrue(all(e is None for _, e in bus.master.sent + bus.node(1).sent))
+        self.assertTrue(all(len(f) <= 8 for f in bus.master.frames))
+
+    def test_can_fd(self) -> None:
+        bus = Bus(block_size=0)
+        bus.master.engine.set_frame_size(1, 64)
+        for size in (40, 62, 63, 3000, 5000):
+            bus.master.engine.send(1, payload(size))
+            bus.pump()
+            self.assertEqual(bus.node(1).messages[-1], (MASTER, payload(size)))
+        self.assertEqual(max(len(f) for f in bus.master.frames), 64)
+        self.assertTrue(all(len(f) in (1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64) for f in bus.master.frames))
+        # Escape sequence single frame
+        self.assertEqual(bus.master.frames[0][:2], bytes([0, 40]))
+
+    def test_sessions_interleave(self) -> None:
+        bus = Bus(stmin=5)
+        for addr in NODE_ADDRS:
+            bus.master.engine.send(addr, payload(500 + addr))
+        bus.pump()
+        for addr in NODE_ADDRS:
+            self.assertEqual(bus.node(addr).messages, [(MASTER, payload(500 + addr))])
+        self.assertEqual([a for a, _ in bus.master.sent], sorted(NODE_ADDRS))
+
+    def test_stmin(self) -> None:
+        bus = Bus(block_size=0, stmin=10)
+        start = bus.clock.now
+        bus.master.engine.send(1, payload(7 + 6 + 7 * 10))
+        bus.pump()
+        self.assertEqual(bus.node(1).messages, [(MASTER, payload(83))])
+        # First frame, then 11 consecutive frames 10 ms apart
+        self.assertGreaterEqual(bus.clock.now - start, 0.100)
+
+    def test_broadcast_link(self) -> None:
+        clock = Clock()
+        outbox: Deque[Tuple[int, bytes]] = collections.deque()
+        master = Endpoint(clock, outbox)
+        master.engine.add_broadcast_link(0xFF)
+        master.engine.set_tx_stmin(0xFF, 5)
+        node = Endpoint(clock, collections.deque())
+        node.engine.add_link(MASTER, 8, 0)
+        start = clock.now
+        master.engine.send(0xFF, payload(100))
+        master.engine.send(0xFF, payload(3))
+        # No flow control, the consecutive frames follow 5 ms apart
+        while (deadline := master.engine.next_deadline()) is not None:
+            clock.now = max(clock.now, deadline)
+            master.engine.poll()
+        for addr, data in outbox:
+            self.assertEqual(0xFF, addr)
+            node.engine.on_frame(MASTER, data)
+        self.assertEqual([(MASTER, payload(100)), (MASTER, payload(3))], node.messages)
+        self.assertEqual([(0xFF, None), (0xFF, None)], master.sent)
+        self.assertGreaterEqual(clock.now - start, 14 * 0.005)
+        # Other links take it from flow control
+        with self.assertRaises(ValueError):
+            Bus().master.engine.set_tx_stmin(1, 5)
+
+    def test_scheduler_interleaves(self) -> None:
+        bus = Bus(block_size=0, bitrate=20000)
+        start = bus.clock.now
+        for addr in NODE_ADDRS:
+            bus.master.engine.send(addr, payload(300), priority=2)
+        bus.pump()
+        for addr in NODE_ADDRS:
+            self.assertEqual(bus.node(addr).messages, [(MASTER, payload(300))])
+        # Without flow control holding them back the nodes take turns, a consecutive frame each
+        cf_addrs = [a for a, f in zip(bus.master.frame_addrs, bus.master.frames) if f[0] >> 4 == 2]
+        self.assertEqual(list(NODE_ADDRS) * (len(cf_addrs) // len(NODE_ADDRS)), cf_addrs)
+        # At the bus's pace, a couple of frames ahead
+        self.assertGreaterEqual(bus.clock.now - start, (len(bus.master.frames) - 3) * max_frame_bits(8) / 20000)
+
+    def test_scheduler_lanes(self) -> None:
+        bus = Bus(block_size=0, bitrate=20000)
+        bus.master.engine.send(1, payload(300), priority=3)
+        bus.master.engine.send(2, payload(300), priority=1)
+        bus.pump()
+        cf_addrs = [a for a, f in zip(bus.master.frame_addrs, bus.master.frames) if f[0] >> 4 == 2]
+        count = len(cf_addrs) // 2
+        self.assertEqual([2] * count + [1] * count, cf_addrs)
+
+    def test_flow_control_timeout(self) -> None:
+        bus = Bus()
+        bus.master.engine.send(1, payload(100))
+        bus.master.engine.send(1, payload(3))
+        bus.to_nodes.clear()
+        bus.pump()
+        self.assertIsInstance(bus.master.sent[0][1], isotp_engine.FlowControlTimeoutError)
+        # The next message still goes out
+        self.assertIsNone(bus.master.sent[1][1])
+        self.assertEqual(bus.node(1).messages, [(MASTER, payload(3))])
+
+    def test_lost_consecutive_frame(self) -> None:
+        bus = Bus()
+        bus.node(2).engine.send(MASTER, payload(100))
+        # First frame, flow control, then the first consecutive frame is lost
+        bus.lost = 2
+        bus.pump()
+        self.assertEqual(bus.master.messages, [])
+        self.assertIsInstance(bus.master.rx_errors[0][1], isotp_engine.WrongSequenceNumberError)
+        bus.node(2).engine.send(MASTER, payload(100))
+        bus.pump()
+        self.assertEqual(bus.master.messages, [(2, payload(100))])
+
+    def test_consecutive_frame_timeout(self) -> None:
+        bus = Bus()
+        bus.master.engine.on_frame(1, bytes([0x10, 20]) + payload(6))
+        bus.pump()
+        self.assertIsInstance(bus.master.rx_errors[0][1], isotp_engine.ConsecutiveFrameTimeoutError)
+
+    def test_overflow(self) -> None:
+        bus = Bus()
+        bus.master.engine.on_frame(1, bytes([0x10, 0, 0, 1, 0, 0, 0, 0]))
+        self.assertEqual(bus.to_nodes.popleft(), (1, bytes([0x32, 0, 0])))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,128 @@
+import codecs
+import os
+import re
+import unittest
+
+from mqtt_compact import (ALIAS_COMPRESSED, DICTIONARY, DISCOVERY_CHECK, DISCOVERY_COMMIT, CompactDecoder,
+                          CompactDecoderError, Discovery, encode_remaining_length, lz_decompress)
+
+CONNECT = bytes([0x10, 0x02, 0x00, 0x00])
+PINGREQ = bytes([0xC0, 0x00])
+DISCOVERY = (b'{"name":"Water level","stat_t":"van/sensor/water_level/state","avty_t":"van/status",'
+             b'"uniq_id":"ESPsensorwater_level","dev":{"ids":"a0b1c2d3e4f5","name":"van","mf":"Espressif",'
+             b'"cns":[["mac","a0b1c2d3e4f5"]]}}')
+# h42_mqtt_compress(DISCOVERY) in the firmware
+DISCOVERY_COMPRESSED = bytes.fromhex(
+    '85024e0a5761746572206c6576656c8802590276616e8405390077800022005f81002285011485025c81002891025f82003e87003d8c02'
+    '640b6130623163326433653466358602700176618003238d022b8a022489003b800230')
+FIRMWARE_SOURCE = os.path.join(os.path.dirname(__file__), '..', '..', 'esp_can_transport', 'can_transport', 'lib',
+                               'h42_mqtt_compact.c')
+
+
+def publish(flags: int, topic: bytes, packet_id: int, payload: bytes) -> bytes:
+    body = len(topic).to_bytes(2, 'big') + topic
+    if flags & 0x06:
+        body += packet_id.to_bytes(2, 'big')
+    body += payload
+    return bytes([0x30 | flags]) + encode_remaining_length(len(body)) + body
+
+
+def register(alias: int, topic: bytes) -> bytes:
+    return bytes([0x00]) + encode_remaining_length(2 + len(topic)) + alias.to_bytes(2, 'big') + topic
+
+
+def compact_publish(flags: int, alias: int, rest: bytes) -> bytes:
+    return bytes([0xF0 | flags]) + encode_remaining_length(2 + len(rest)) + alias.to_bytes(2, 'big') + rest
+
+
+class TestCompactDecoder(unittest.TestCase):
+    def test_remaining_length(self) -> None:
+        self.assertEqual(b'\x00', encode_remaining_length(0))
+        self.assertEqual(b'\x7F', encode_remaining_length(127))
+        self.assertEqual(b'\x80\x01', encode_remaining_length(128))
+        self.assertEqual(b'\xFF\xFF\xFF\x7F', encode_remaining_length(268435455))
+
+    def test_expand(self) -> None:
+        # What the firmware encoder sends, see test_mqtt_compact.c
+        stream = (CONNECT + register(0, b'h42/state') + compact_publish(0x03, 0, b'\x12\x34ON') +
+                  compact_publish(0x00, 0, b'OFF') + PINGREQ)
+        expected = (CONNECT + publish(0x03, b'h42/state', 0x1234, b'ON') + publish(0x00, b'h42/state', 0, b'OFF') +
+                    PINGREQ)
+        self.assertEqual(expected, CompactDecoder().feed(stream))
+
+    def test_any_cut(self) -> None:
+        topic = b'homeassistant/switch/mqtt_can_test-1234/state'
+        stream = (CONNECT + publish(0x02, b'plain/topic', 1, b'x') + register(0, topic) +
+                  compact_publish(0x02, 0, b'\x00\x02' + b'y' * 300) + PINGREQ)
+        expected = CompactDecoder().feed(stream)
+        self.assertIn(publish(0x02, topic, 2, b'y' * 300), expected)
+        for step in range(1, 20):
+            decoder = CompactDecoder()
+            out = b''.join(decoder.feed(stream[i:i + step]) for i in range(0, len(stream), step))
+            self.assertEqual(expected, out)
+
+    def test_connect_resets_aliases(self) -> None:
+        decoder = CompactDecoder()
+        decoder.feed(CONNECT + register(0, b'a'))
+        with self.assertRaises(CompactDecoderError):
+            decoder.feed(CONNECT + compact_publish(0, 0, b''))
+
+    def test_lost_until_connect(self) -> None:
+        decoder = CompactDecoder()
+        with self.assertRaises(CompactDecoderError):
+            decoder.feed(compact_publish(0, 7, b'1'))
+        self.assertEqual(b'', decoder.feed(register(7, b'a') + compact_publish(0, 7, b'1')))
+        self.assertEqual(b'', decoder.feed(PINGREQ))
+        self.assertEqual(CONNECT + PINGREQ, decoder.feed(CONNECT + PINGREQ))
+
+    def test_compressed_publish(self) -> None:
+        topic = b'homeassistant/sensor/van/water_level/config'
+        body = len(topic).to_bytes(2, 'big') + topic + b'\x00\x07' + DISCOVERY
+        # Everything after the fixed header, as literals only
+        packed = b''.join(bytes([len(body[i:i + 128]) - 1]) + body[i:i + 128] for i in range(0, len(body), 128))
+        stream = CONNECT + compact_publish(0x02, ALIAS_COMPRESSED, packed) + PINGREQ
+        expected = CONNECT + bytes([0x32]) + encode_remaining_length(len(body)) + body + PINGREQ
+        for step in (1, 3, len(stream)):
+            decoder = CompactDecoder()
+            out = b''.join(decoder.feed(stream[i:i + step]) for i in range(0, len(stream), step))
+            self.assertEqual(expected, out)
+
+        with self.assertRaises(CompactDecoderError):
+            CompactDecoder().feed(CONNECT + compact_publish(0x02, ALIAS_COMPRESSED, b'\x05abc'))
+
+    def test_discovery(self) -> None:
+        decoder = CompactDecoder()
+        self.assertEqual([CONNECT], decoder.feed_items(CONNECT + b'\x01\x05\x00\x12'))
+        self.assertEqual([Discovery(DISCOVERY_CHECK, 0x12345678), PINGREQ, Discovery(DISCOVERY_COMMIT, 0x12345678)],
+                         decoder.feed_items(b'\x34\x56\x78' + PINGREQ + b'\x01\x05\x01\x12\x34\x56\x78'))
+        # feed() leaves them out
+        self.assertEqual(PINGREQ, decoder.feed(b'\x01\x05\x00\x00\x00\x00\x00' + PINGREQ))
+
+        with self.assertRaises(CompactDecoderError):
+            CompactDecoder().feed(CONNECT + b'\x01\x01\x00')
+
+
+class TestLz(unittest.TestCase):
+    def test_decompress(self) -> None:
+        self.assertEqual(DISCOVERY, lz_decompress(DISCOVERY_COMPRESSED))
+        self.assertEqual(b'', lz_decompress(b''))
+        # Overlapping copy
+        self.assertEqual(b'ababababab', lz_decompress(b'\x01ab\x84\x00\x02'))
+
+    def test_malformed(self) -> None:
+        for data in (b'\x05abc', b'\x80\x00', b'\x80\x00\x00', (len(DICTIONARY) + 1).to_bytes(3, 'big')):
+            with self.assertRaises(CompactDecoderError):
+                lz_decompress(data)
+
+    @unittest.skipUnless(os.path.exists(FIRMWARE_SOURCE), "firmware source not available")
+    def test_dictionary_matches_firmware(self) -> None:
+        with open(FIRMWARE_SOURCE) as f:
+            source = f.read()
+        block = source[source.index('DICTIONARY[] ='):]
+        block = block[:block.index(';')]
+        pieces = re.findall(r'"((?:[^"\\]|\\.)*)"', block)
+        self.assertEqual(DICTIONARY, b''.join(codecs.escape_decode(p)[0] for p in pieces))
+
+
+if __name__ == '__main__':
+    unittest.main()
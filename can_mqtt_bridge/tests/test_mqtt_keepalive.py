@@ -0,0 +1,72 @@
+import unittest
+from typing import List, Tuple
+
+from mqtt_keepalive import KEEPALIVE_PROXY_FACTOR, PINGREQ, KeepaliveProxy, PacketStream
+
+# Keepalive 10 s
+CONNECT = bytes([0x10, 0x0C, 0x00, 0x04]) + b'MQTT' + bytes([0x04, 0x02, 0x00, 0x0A, 0x00, 0x00])
+PINGRESP = bytes([0xD0, 0x00])
+PUBLISH = bytes([0x30, 0x14, 0x00, 0x03]) + b'a/b' + b'x' * 15
+
+
+class TestPacketStream(unittest.TestCase):
+    def test_any_cut(self) -> None:
+        stream = CONNECT + PUBLISH + PINGREQ + bytes([0x30, 0x80, 0x01]) + b'\x00\x01a' + b'y' * 125
+        for step in (1, 2, 5, len(stream)):
+            seen: List[Tuple[int, bytes]] = []
+
+            def keep(first: int, head: bytes) -> bool:
+                seen.append((first, head))
+                return first != 0x30
+
+            packets = PacketStream(keep)
+            out = b''.join(packets.feed(stream[i:i + step]) for i in range(0, len(stream), step))
+            self.assertEqual(CONNECT + PINGREQ, out)
+            self.assertEqual([0x10, 0x30, 0xC0, 0x30], [first for first, _ in seen])
+            self.assertEqual(CONNECT[2:14], seen[0][1])
+            self.assertEqual(b'', seen[2][1])
+            self.assertTrue(packets.at_boundary)
+
+    def test_at_boundary(self) -> None:
+        packets = PacketStream(lambda first, head: True)
+        self.assertEqual(PUBLISH[:14], packets.feed(PUBLISH[:14]))
+        self.assertFalse(packets.at_boundary)
+        packets.feed(PUBLISH[14:])
+        self.assertTrue(packets.at_boundary)
+
+    def test_malformed(self) -> None:
+        packets = PacketStream(lambda first, head: False)
+        self.assertEqual(b'\x30\xFF\xFF\xFF\xFF\x01', packets.feed(b'\x30\xFF\xFF\xFF\xFF\x01'))
+        self.assertEqual(PINGREQ, packets.feed(PINGREQ))
+        self.assertFalse(packets.at_boundary)
+
+
+class TestKeepaliveProxy(unittest.TestCase):
+    def test_pings(self) -> None:
+        proxy = KeepaliveProxy()
+        self.assertIsNone(proxy.ping(1e9))
+        self.assertEqual(CONNECT, proxy.from_node(CONNECT))
+        self.assertEqual(10, proxy.keepalive_s)
+        # Only half a keepalive after the last packet to the broker
+        self.assertIsNone(proxy.ping(0))
+        self.assertEqual(PINGREQ, proxy.ping(1e9))
+        # Not in the middle of a packet of the node
+        proxy.from_node(PUBLISH[:5])
+        self.assertIsNone(proxy.ping(2e9))
+        proxy.from_node(PUBLISH[5:] + PINGREQ)
+        # The broker answers in order: ours, then the node's
+        self.assertEqual(PUBLISH + PINGRESP, proxy.from_broker(PINGRESP + PUBLISH + PINGRESP))
+        self.assertEqual(PINGRESP, proxy.from_broker(PINGRESP))
+
+    def test_node_lost(self) -> None:
+        proxy = KeepaliveProxy()
+        self.assertFalse(proxy.node_lost(1e9, None))
+        proxy.from_node(CONNECT)
+        timeout = (KEEPALIVE_PROXY_FACTOR + 1.5) * 10
+        self.assertFalse(proxy.node_lost(100 + timeout, 100))
+        self.assertTrue(proxy.node_lost(101 + timeout, 100))
+        self.assertTrue(proxy.node_lost(100, None))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,148 @@
+import unittest
+
+from mqtt_mux import MqttMux, topic_matches
+
+CONNACK = bytes([0x20, 0x02, 0x00, 0x00])
+PINGREQ = bytes([0xC0, 0x00])
+PINGRESP = bytes([0xD0, 0x00])
+# Keepalive 10 s
+CONNECT = bytes([0x10, 0x0E, 0x00, 0x04]) + b'MQTT' + bytes([0x04, 0x02, 0x00, 0x0A, 0x00, 0x02]) + b'n1'
+# Will 'n/s' 'offline', retained QoS 1
+CONNECT_WILL = (bytes([0x10, 0x1C, 0x00, 0x04]) + b'MQTT' + bytes([0x04, 0x2E, 0x00, 0x0A, 0x00, 0x02]) + b'n1' +
+                b'\x00\x03n/s\x00\x07offline')
+
+
+def publish_qos1(packet_id: int, payload: bytes = b'') -> bytes:
+    return bytes([0x32, 0x07 + len(payload), 0x00, 0x03]) + b'a/b' + packet_id.to_bytes(2, 'big') + payload
+
+
+def up(mux: MqttMux) -> None:
+    mux.connect()
+    mux.from_broker(CONNACK)
+
+
+class TestMqttMux(unittest.TestCase):
+    def test_topic_matches(self) -> None:
+        self.assertTrue(topic_matches('a/b', 'a/b'))
+        self.assertTrue(topic_matches('a/+', 'a/b'))
+        self.assertTrue(topic_matches('a/#', 'a'))
+        self.assertTrue(topic_matches('#', 'a/b/c'))
+        self.assertFalse(topic_matches('a/+', 'a/b/c'))
+        self.assertFalse(topic_matches('a/b', 'a'))
+        self.assertFalse(topic_matches('#', '$SYS/x'))
+
+    def test_packet_ids(self) -> None:
+        mux = MqttMux('bridge', 60)
+        up(mux)
+        self.assertEqual({1: CONNACK}, mux.from_node(1, CONNECT).nodes)
+        self.assertEqual({2: CONNACK}, mux.from_node(2, CONNECT).nodes)
+        # Both nodes use id 1, on the broker session they differ
+        out = mux.from_node(1, publish_qos1(1))
+        self.assertEqual(publish_qos1(1), out.broker)
+        out = mux.from_node(2, publish_qos1(1)[:5])
+        self.assertEqual(b'', out.broker)
+        out = mux.from_node(2, publish_qos1(1)[5:] + PINGREQ)
+        self.assertEqual(publish_qos1(2), out.broker)
+        self.assertEqual({2: PINGRESP}, out.nodes)
+        self.assertEqual({2: bytes([0x40, 0x02, 0x00, 0x01])}, mux.from_broker(bytes([0x40, 0x02, 0x00, 0x02])).nodes)
+        self.assertEqual({1: bytes([0x40, 0x02, 0x00, 0x01])}, mux.from_broker(bytes([0x40, 0x02, 0x00, 0x01])).nodes)
+
+    def test_subscriptions(self) -> None:
+        mux = MqttMux('bridge', 60)
+        up(mux)
+        mux.from_node(1, CONNECT)
+        mux.from_node(2, CONNECT)
+        # The broker gets the highest QoS asked for
+        out = mux.from_node(1, bytes([0x82, 0x08, 0x00, 0x05, 0x00, 0x03]) + b'a/#' + b'\x01')
+        self.assertEqual(bytes([0x82, 0x08, 0x00, 0x01, 0x00, 0x03]) + b'a/#' + b'\x01', out.broker)
+        out = mux.from_node(2, bytes([0x82, 0x08, 0x00, 0x07, 0x00, 0x03]) + b'a/b' + b'\x00')
+        self.assertEqual(bytes([0x82, 0x08, 0x00, 0x02, 0x00, 0x03]) + b'a/b' + b'\x00', out.broker)
+        out = mux.from_broker(bytes([0x90, 0x03, 0x00, 0x01, 0x01, 0x90, 0x03, 0x00, 0x02, 0x00]))
+        self.assertEqual({1: bytes([0x90, 0x03, 0x00, 0x05, 0x01]), 2: bytes([0x90, 0x03, 0x00, 0x07, 0x00])},
+                         out.nodes)
+
+        # Acknowledged by the bridge, and to each node with its QoS
+        out = mux.from_broker(publish_qos1(9, b'on'))
+        self.assertEqual(bytes([0x40, 0x02, 0x00, 0x09]), out.broker)
+        self.assertEqual({1: bytes([0x32, 0x09, 0x00, 0x03]) + b'a/b\x00\x01on',
+                          2: bytes([0x30, 0x07, 0x00, 0x03]) + b'a/bon'}, out.nodes)
+        self.assertEqual({}, mux.from_node(1, bytes([0x40, 0x02, 0x00, 0x01])).nodes)
+
+        # Answered by the bridge, and unsubscribed once no node has the filter
+        out = mux.from_node(2, bytes([0xA2, 0x07, 0x00, 0x08, 0x00, 0x03]) + b'a/b')
+        self.assertEqual({2: bytes([0xB0, 0x02, 0x00, 0x08])}, out.nodes)
+        self.assertEqual(bytes([0xA2, 0x07, 0x00, 0x03, 0x00, 0x03]) + b'a/b', out.broker)
+        self.assertEqual({}, mux.from_broker(bytes([0xB0, 0x02, 0x00, 0x03])).nodes)
+        out = mux.from_broker(bytes([0x30, 0x07, 0x00, 0x03]) + b'a/bon')
+        self.assertEqual([1], list(out.nodes))
+
+    def test_shared_publish(self) -> None:
+        mux = MqttMux('bridge', 60)
+        up(mux)
+        for node_addr, qos in ((1, 0), (2, 1), (3, 0)):
+            mux.from_node(node_addr, CONNECT)
+            mux.from_node(node_addr, bytes([0x82, 0x08, 0x00, 0x01, 0x00, 0x03]) + b'a/b' + bytes([qos]))
+        # The QoS 0 copies are one and the same
+        out = mux.from_broker(publish_qos1(9, b'on'))
+        self.assertEqual([((2,), bytearray(b'\x32\x09\x00\x03a/b\x00\x01on')),
+                          ((1, 3), bytearray(b'\x30\x07\x00\x03a/bon'))], out.node_items)
+        self.assertEqual(out.nodes[1], out.nodes[3])
+
+    def test_last_will(self) -> None:
+        mux = MqttMux('bridge', 60)
+        up(mux)
+        mux.from_node(1, CONNECT_WILL)
+        mux.from_node(2, CONNECT_WILL)
+        mux.from_node(3, CONNECT_WILL)
+        # Not on a clean disconnect
+        out = mux.from_node(1, bytes([0xE0, 0x00]))
+        self.assertEqual(b'', out.broker)
+        self.assertEqual([], out.lost)
+
+        will = bytes([0x33, 0x0E, 0x00, 0x03]) + b'n/s\x00\x01offline'
+        out = mux.expire(100.0, {2: 99.0, 3: 80.0}.get)
+        self.assertEqual([3], out.lost)
+        self.assertEqual(will, out.broker)
+        self.assertEqual({}, mux.from_broker(bytes([0x40, 0x02, 0x00, 0x01])).nodes)
+
+        out = mux.from_node(2, b'\x30\xFF\xFF\xFF\xFF\x01')
+        self.assertEqual([2], out.lost)
+        self.assertEqual(will.replace(b'\x00\x01offline', b'\x00\x02offline'), out.broker)
+
+    def test_broker_lost(self) -> None:
+        mux = MqttMux('bridge', 60)
+        mux.connect()
+        # The node waits for the broker
+        self.assertEqual({}, mux.from_node(1, CONNECT).nodes)
+        out = mux.from_broker(CONNACK)
+        self.assertEqual({1: CONNACK}, out.nodes)
+        subscribe = bytes([0x82, 0x08, 0x00, 0x01, 0x00, 0x03]) + b'a/b' + b'\x01'
+        self.assertEqual(subscribe, mux.from_node(1, subscribe).broker)
+
+        # Made again on the new connection, and the node gets its SUBACK from that
+        mux.broker_lost()
+        self.assertEqual(b'', mux.from_node(1, publish_qos1(3)).broker)
+        self.assertEqual({1: PINGRESP}, mux.from_node(1, PINGREQ).nodes)
+        mux.connect()
+        out = mux.from_broker(CONNACK)
+        self.assertEqual(bytes([0x82, 0x08, 0x00, 0x02, 0x00, 0x03]) + b'a/b' + b'\x01', out.broker)
+        self.assertEqual({1: bytes([0x90, 0x03, 0x00, 0x01, 0x01])}, out.nodes)
+
+        with self.assertRaises(ValueError):
+            mux.from_broker(bytes([0x20, 0x02, 0x00, 0x05]))
+
+    def test_ping(self) -> None:
+        mux = MqttMux('bridge', 60)
+        up(mux)
+        now = 1e9
+        self.assertEqual(PINGREQ, mux.ping(now))
+        self.assertIsNone(mux.ping(now + 60))
+        self.assertFalse(mux.broker_silent(now + 30))
+        self.assertTrue(mux.broker_silent(now + 61))
+        mux.from_broker(PINGRESP)
+        self.assertFalse(mux.broker_silent(now + 61))
+        self.assertIsNone(mux.ping(now + 10))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,64 @@
+import unittest
+
+from msg import Priority
+from mqtt_priority import StreamPriority, packet_priority
+
+
+def publish(topic: bytes, payload: bytes = b'x') -> bytes:
+    body = len(topic).to_bytes(2, 'big') + topic + payload
+    assert len(body) < 0x80 * 0x80
+    length = bytes([len(body)]) if len(body) < 0x80 else bytes([len(body) & 0x7F | 0x80, len(body) >> 7])
+    return bytes([0x30]) + length + body
+
+
+CONFIG = publish(b'homeassistant/sensor/n/t/config', b'{}' * 100)
+COMMAND = publish(b'n/switch/relay/command', b'ON')
+STATE = publish(b'n/sensor/t/state', b'21.5')
+PINGRESP = bytes([0xD0, 0x00])
+
+
+class TestPacketPriority(unittest.TestCase):
+    def test_classes(self) -> None:
+        self.assertEqual(Priority.BULK, packet_priority(CONFIG))
+        self.assertEqual(Priority.BULK, packet_priority(publish(b'n/debug')))
+        self.assertEqual(Priority.COMMAND, packet_priority(COMMAND))
+        self.assertEqual(Priority.COMMAND, packet_priority(publish(b'n/light/l/set')))
+        self.assertEqual(Priority.STATE, packet_priority(STATE))
+        self.assertEqual(Priority.CONTROL, packet_priority(PINGRESP))
+        # SUBACK
+        self.assertEqual(Priority.CONTROL, packet_priority(bytes([0x90, 0x03, 0x00, 0x01, 0x00])))
+
+    def test_short(self) -> None:
+        self.assertEqual(Priority.STATE, packet_priority(COMMAND[:10]))
+        self.assertEqual(Priority.STATE, packet_priority(COMMAND[:3]))
+        # Up to the topic is enough
+        self.assertEqual(Priority.COMMAND, packet_priority(COMMAND[:-2]))
+
+
+class TestStreamPriority(unittest.TestCase):
+    def test_pieces(self) -> None:
+        stream = StreamPriority()
+        # A command in the same piece as the end of a config sends the piece as a command
+        self.assertEqual(Priority.BULK, stream.feed(CONFIG[:100]))
+        self.assertEqual(Priority.COMMAND, stream.feed(CONFIG[100:] + COMMAND))
+        self.assertEqual(Priority.STATE, stream.feed(STATE))
+        self.assertEqual(Priority.CONTROL, stream.feed(STATE + PINGRESP))
+
+    def test_any_cut(self) -> None:
+        data = CONFIG + STATE + COMMAND + PINGRESP + CONFIG
+        command_end = len(CONFIG) + len(STATE) + len(COMMAND)
+        last_config = len(data) - len(CONFIG)
+        for step in (1, 2, 5, 17, len(data)):
+            stream = StreamPriority()
+            pieces = [(i, stream.feed(data[i:i + step])) for i in range(0, len(data), step)]
+            for start, priority in pieces:
+                if start < command_end <= start + step:
+                    self.assertLessEqual(priority, Priority.COMMAND)
+                if start < command_end + len(PINGRESP) <= start + step:
+                    self.assertEqual(Priority.CONTROL, priority)
+                # Past the topic of the last config
+                if start >= last_config + 40:
+                    self.assertEqual(Priority.BULK, priority)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -25,6 +25,58 @@ class TestMsg(unittest.TestCase):
         with self.assertRaises(Exception):
             _ = m.as_address_request
 
+    def test_link_params(self) -> None:
+        m = msg.Msg(can.Message(
+            arbitration_id=msg.make_can_id(msg.MsgType.LINK_PARAMS, 3, msg.ADDRESS_MASTER),
+            data=[0, 0xF5],
+            is_extended_id=True))
+        params = m.as_link_params
+        self.assertEqual(params.src_addr, 3)
+        self.assertEqual(params.block_size, 0)
+        self.assertEqual(params.stmin, 0xF5)
+
+        resp = msg.make_link_params(3, 0, 0xF5, 2)
+        self.assertEqual(resp.type, msg.MsgType.LINK_PARAMS)
+        self.assertEqual(resp.src_addr, msg.ADDRESS_MASTER)
+        self.assertEqual(resp.dst_addr, 3)
+        self.assertEqual(bytes(resp.can_msg.data), b'\x00\xF5\x02')
+        self.assertEqual(params.frame_size, msg.CLASSIC_FRAME_SIZE)
+
+    def test_link_params_can_fd(self) -> None:
+        m = msg.Msg(can.Message(
+            arbitration_id=msg.make_can_id(msg.MsgType.LINK_PARAMS, 3, msg.ADDRESS_MASTER),
+            data=[8, 2, 64],
+            is_extended_id=True))
+        self.assertEqual(m.as_link_params.frame_size, 64)
+
+        resp = msg.make_link_params(3, 8, 2, 2, 64)
+        self.assertEqual(bytes(resp.can_msg.data), b'\x08\x02\x02\x40')
+
+    def test_link_params_features(self) -> None:
+        m = msg.Msg(can.Message(
+            arbitration_id=msg.make_can_id(msg.MsgType.LINK_PARAMS, 3, msg.ADDRESS_MASTER),
+            data=[8, 2, 8, msg.FEATURE_COMPACT_MQTT],
+            is_extended_id=True))
+        self.assertEqual(m.as_link_params.features, msg.FEATURE_COMPACT_MQTT)
+        self.assertEqual(m.as_link_params.frame_size, msg.CLASSIC_FRAME_SIZE)
+
+        # The frame length has to be there for the features to follow
+        resp = msg.make_link_params(3, 8, 2, 2, features=msg.FEATURE_COMPACT_MQTT)
+        self.assertEqual(bytes(resp.can_msg.data), b'\x08\x02\x02\x08\x01')
+
+    def test_discovery_status(self) -> None:
+        m = msg.make_discovery_status(3, 0x12345678, True)
+        self.assertEqual(m.type, msg.MsgType.DISCOVERY_STATUS)
+        self.assertEqual(m.src_addr, msg.ADDRESS_MASTER)
+        self.assertEqual(m.dst_addr, 3)
+        self.assertEqual(bytes(m.can_msg.data), b'\x01\x12\x34\x56\x78')
+
+    def test_priority(self) -> None:
+        can_id = msg.make_can_id(msg.MsgType.ISOTP, msg.ADDRESS_MASTER, 3, msg.Priority.BULK)
+        self.assertEqual(0x0C000003, can_id)
+        m = msg.Msg(can.Message(arbitration_id=can_id, data=[0], is_extended_id=True))
+        self.assertEqual(m.type, msg.MsgType.ISOTP)
+        self.assertEqual(m.dst_addr, 3)
 
 if __name__ == '__main__':
     unittest.main()
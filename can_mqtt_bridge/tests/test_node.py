@@ -1,18 +1,20 @@
-import queue
 import unittest
 
-import isotp
-
+import isotp_engine
 import node
 import node_mac
 
 
-class TestNodeRegistry(unittest.TestCase):
-    def fake_send_func(self, msg: isotp.CanMessage) -> None:
-        pass
+def make_engine() -> isotp_engine.IsotpEngine:
+    return isotp_engine.IsotpEngine(send_frame=lambda addr, data: None,
+                                    on_message=lambda addr, data: None,
+                                    on_send_done=lambda addr, error: None,
+                                    on_rx_error=lambda addr, error: None)
 
+
+class TestNodeRegistry(unittest.TestCase):
     def test_add_find(self) -> None:
-        reg = node.NodeRegistry(self.fake_send_func, queue.Queue())
+        reg = node.NodeRegistry(make_engine())
         mac1 = node_mac.NodeMac(b'\x01\x02\x03\x04\x05\x06')
         mac2 = node_mac.NodeMac(b'\xFF\x02\x03\x04\x05\x06')
         reg.add_node(mac1)
@@ -27,12 +29,48 @@ class TestNodeRegistry(unittest.TestCase):
         self.assertIsNone(reg.find_node_by_addr(42))
 
     def test_add_duplicate(self) -> None:
-        reg = node.NodeRegistry(self.fake_send_func, queue.Queue())
+        reg = node.NodeRegistry(make_engine())
         mac1 = node_mac.NodeMac(b'\x01\x02\x03\x04\x05\x06')
         reg.add_node(mac1)
         with self.assertRaises(RuntimeError):
             reg.add_node(mac1)
 
+    def test_rx_flow_params(self) -> None:
+        frames = []
+        engine = isotp_engine.IsotpEngine(send_frame=lambda addr, data: frames.append((addr, data)),
+                                          on_message=lambda addr, data: None,
+                                          on_send_done=lambda addr, error: None,
+                                          on_rx_error=lambda addr, error: None)
+        reg = node.NodeRegistry(engine, rx_block_size=0, rx_stmin_ms=5)
+        n = reg.add_node(node_mac.NodeMac(b'\x01\x02\x03\x04\x05\x06'))
+        self.assertEqual(5, n.rx_stmin_base)
+        # A first frame gets the configured flow control
+        engine.on_frame(n.addr, bytes([0x10, 20]) + bytes(6))
+        self.assertEqual([(n.addr, bytes([0x30, 0, 5]))], frames)
+
+
+class TestStminBackoff(unittest.TestCase):
+    def test_backoff_and_recover(self) -> None:
+        b = node.StminBackoff(0)
+        self.assertEqual(b.on_error(), 1)
+        self.assertEqual(b.on_error(), 2)
+        for _ in range(node.StminBackoff.RECOVER_AFTER - 1):
+            self.assertEqual(b.on_success(), 2)
+        self.assertEqual(b.on_success(), 1)
+        for _ in range(node.StminBackoff.RECOVER_AFTER):
+            b.on_success()
+        self.assertEqual(b.value, 0)
+        # Never below the base value
+        for _ in range(node.StminBackoff.RECOVER_AFTER):
+            self.assertEqual(b.on_success(), 0)
+
+    def test_backoff_limit(self) -> None:
+        b = node.StminBackoff(2)
+        for _ in range(10):
+            b.on_error()
+        self.assertEqual(b.value, node.StminBackoff.MAX_MS)
+        self.assertEqual(b.base, 2)
+
 
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,73 @@
+import unittest
+from typing import Dict, List, Optional
+
+from tx_scheduler import TxScheduler, max_frame_bits
+
+
+def drain(scheduler: TxScheduler, frames: Dict[int, List[int]], now: float = 0.0) -> List[int]:
+    """Sends frames of the given lengths per key until none are left, returns the keys in sending order."""
+    order = []
+    while (key := scheduler.next()) is not None:
+        order.append(key)
+        scheduler.on_sent(key, frames[key].pop(0), now)
+        if not frames[key]:
+            scheduler.set_idle(key)
+    return order
+
+
+class TestTxScheduler(unittest.TestCase):
+    def test_round_robin(self) -> None:
+        scheduler = TxScheduler()
+        for key in (1, 2, 3):
+            scheduler.set_ready(key, 2)
+        order = drain(scheduler, {1: [8] * 4, 2: [8] * 2, 3: [8] * 3})
+        self.assertEqual([1, 2, 3, 1, 2, 3, 1, 3, 1], order)
+
+    def test_bytes_not_frames(self) -> None:
+        # A CAN FD session sends one 64 byte frame per eight turns of a classic one
+        scheduler = TxScheduler()
+        scheduler.set_ready(1, 2)
+        scheduler.set_ready(2, 2)
+        order = drain(scheduler, {1: [8] * 16, 2: [64] * 2})
+        self.assertEqual([1, 2] + [1] * 8 + [2] + [1] * 7, order)
+
+    def test_lanes(self) -> None:
+        scheduler = TxScheduler()
+        scheduler.set_ready(1, 3)
+        scheduler.set_ready(2, 2)
+        frames = {1: [8] * 3, 2: [8] * 2, 3: [8]}
+        self.assertEqual(2, scheduler.next())
+        scheduler.on_sent(2, frames[2].pop(0), 0)
+        # A more urgent session goes first as soon as it is ready
+        scheduler.set_ready(3, 0)
+        self.assertEqual([3, 2, 1, 1, 1], drain(scheduler, frames))
+
+    def test_idle(self) -> None:
+        scheduler = TxScheduler()
+        scheduler.set_ready(1, 2)
+        scheduler.set_idle(1)
+        scheduler.set_idle(1)
+        self.assertIsNone(scheduler.next())
+        self.assertFalse(scheduler.has_ready())
+        with self.assertRaises(ValueError):
+            scheduler.set_ready(1, 8)
+
+    def test_pacing(self) -> None:
+        scheduler = TxScheduler(bitrate=20000)
+        frame_time = max_frame_bits(8) / 20000
+        now = 10.0
+        sent = 0
+        while scheduler.hold_until(now) is None:
+            scheduler.on_sent(None, 8, now)
+            sent += 1
+        # Two frames waiting at the controller besides the one on the bus, room again once that has left
+        self.assertEqual(3, sent)
+        hold: Optional[float] = scheduler.hold_until(now)
+        assert hold is not None
+        self.assertAlmostEqual(now + frame_time, hold)
+        self.assertIsNone(scheduler.hold_until(hold + 1e-9))
+        self.assertIsNone(TxScheduler().hold_until(now))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,104 @@
+"""Order in which the bridge's ISO-TP sessions put their frames on the bus, see IsotpEngine.
+
+Sessions with a frame ready wait in one lane per priority, the CAN ID priority of msg.Priority. A lane only sends
+while all more urgent lanes are empty, as on the bus itself. Within a lane the sessions take turns by deficit round
+robin: each turn is worth QUANTUM bytes, so a session sending 8 byte frames gets one frame per turn and one sending
+64 byte CAN FD frames one every eighth turn. A node receiving a large transfer no longer holds the bus until it is
+done, the consecutive frames of all transfers go out interleaved.
+
+With a bitrate the scheduler also keeps count of the bus time of the frames it let go, and holds the rest back once
+TX_LEAD_FRAMES frames are waiting at the controller. Without, everything ready goes out at once, in turn order.
+"""
+import collections
+from typing import Deque, Dict, List, Optional
+
+# Bytes a session may send per turn, one classic frame
+QUANTUM = 8
+# Classic frames' worth of bus time handed to the controller ahead of the bus, so it never idles between frames
+TX_LEAD_FRAMES = 2
+# At least this much too, IsotpEngine's timers tick in milliseconds
+MIN_LEAD_S = 0.002
+# The 3 bit priority field of the CAN ID
+LANES = 8
+
+
+def max_frame_bits(length: int) -> int:
+    """Upper bound of the bus time of an extended data frame in bits, worst case bit stuffing and intermission
+    included. CAN FD data phases are faster, so it errs long for those."""
+    # Start of frame to CRC, 39 + 15 bits before the data, are stuffed. A stuff bit follows every four bits at most
+    stuffed = 54 + 8 * length
+    return stuffed + (stuffed - 1) // 4 + 1 + 2 + 7 + 3
+
+
+class _Lane:
+    __slots__ = ('active', 'deficit')
+
+    def __init__(self) -> None:
+        # Sessions with a frame ready, the one whose turn it is first
+        self.active: Deque[int] = collections.deque()
+        self.deficit: Dict[int, int] = {}
+
+
+class TxScheduler:
+    """Sessions are keys, usually node addresses. The owner says which have a frame ready with set_ready() and
+    set_idle(), asks next() whose frame goes next, and reports each frame it sent with on_sent()."""
+
+    def __init__(self, bitrate: Optional[int] = None) -> None:
+        self.__lanes: List[_Lane] = [_Lane() for _ in range(LANES)]
+        self.__lane_of: Dict[int, int] = {}
+        self.__bit_time = 1.0 / bitrate if bitrate else 0.0
+        self.__lead = max(TX_LEAD_FRAMES * max_frame_bits(8) * self.__bit_time, MIN_LEAD_S)
+        # When the frames let go so far will have left, as far as we can tell
+        self.__bus_free = 0.0
+
+    def set_ready(self, key: int, priority: int) -> None:
+        """key has a frame to send now, priority 0 is the most urgent."""
+        if not 0 <= priority < LANES:
+            raise ValueError(f"Invalid priority {priority}")
+        current = self.__lane_of.get(key)
+        if current == priority:
+            return
+        if current is not None:
+            self.set_idle(key)
+        lane = self.__lanes[priority]
+        lane.active.append(key)
+        lane.deficit[key] = QUANTUM
+        self.__lane_of[key] = priority
+
+    def set_idle(self, key: int) -> None:
+        """key has nothing to send now. It loses what is left of its turn."""
+        priority = self.__lane_of.pop(key, None)
+        if priority is None:
+            return
+        lane = self.__lanes[priority]
+        lane.active.remove(key)
+        del lane.deficit[key]
+
+    def has_ready(self) -> bool:
+        return bool(self.__lane_of)
+
+    def next(self) -> Optional[int]:
+        """Whose frame goes next, None when no key has one ready."""
+        for lane in self.__lanes:
+            while lane.active:
+                key = lane.active[0]
+                if lane.deficit[key] > 0:
+                    return key
+                # Turn over, the next one starts with the quantum
+                lane.deficit[key] += QUANTUM
+                lane.active.rotate(-1)
+        return None
+
+    def on_sent(self, key: Optional[int], length: int, now: float) -> None:
+        """A frame of length bytes went to the bus. key is None for frames sent out of turn, such as flow control,
+        which still take their bus time."""
+        if key is not None and key in self.__lane_of:
+            self.__lanes[self.__lane_of[key]].deficit[key] -= length
+        if self.__bit_time:
+            self.__bus_free = max(self.__bus_free, now) + max_frame_bits(length) * self.__bit_time
+
+    def hold_until(self, now: float) -> Optional[float]:
+        """When the bus has room for the next frame, None when it has room now."""
+        if not self.__bit_time or self.__bus_free - now <= self.__lead:
+            return None
+        return self.__bus_free - self.__lead
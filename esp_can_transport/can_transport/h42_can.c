@@ -1,57 +1,241 @@
 #include "h42_can.h"
 
 #include "h42_can_daemon.h"
+#include "h42_mqtt_compact.h"
+#include "h42_mqtt_keepalive.h"
+#include "h42_mqtt_priority.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
 #include <driver/twai.h>
 #include <nvs_flash.h>
+#include <stdlib.h>
 
-#define CAN_TRANSPORT_SPEED TWAI_TIMING_CONFIG_20KBITS()
-#define CAN_TRANSPORT_TX_GPIO 21
-#define CAN_TRANSPORT_RX_GPIO 20
+// Encoded output goes to the daemon in pieces of this size.
+#define COMPACT_OUT_SIZE 512
 
 typedef struct h42_can_transport {
-  h42_can_address_t address;
+  h42_can_config_t config;
   bool initialized;
+  // Keeps discovery packets from other tasks out of esp-mqtt's writes.
+  SemaphoreHandle_t write_lock;
+  // Only esp-mqtt's task writes. NULL unless compact_mqtt or compress_mqtt.
+  h42_mqtt_compact_encoder_t *compact;
+  uint8_t compact_out[COMPACT_OUT_SIZE];
+  // Only esp-mqtt's task uses it.
+  h42_mqtt_keepalive_t keepalive;
+  // Of esp-mqtt's writes, only its task uses it.
+  h42_mqtt_priority_stream_t priority_stream;
   // esp_transport_handle_t esp_transport;
 } h42_can_transport_t;
 static h42_can_transport_t g_can_transport = {0};
 
+static esp_err_t can_transport_timing_config(uint32_t bitrate,
+                                             twai_timing_config_t *t_config) {
+  switch (bitrate) {
+  case 20000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_20KBITS();
+    return ESP_OK;
+  case 25000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_25KBITS();
+    return ESP_OK;
+  case 50000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_50KBITS();
+    return ESP_OK;
+  case 100000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_100KBITS();
+    return ESP_OK;
+  case 125000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_125KBITS();
+    return ESP_OK;
+  case 250000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_250KBITS();
+    return ESP_OK;
+  case 500000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_500KBITS();
+    return ESP_OK;
+  case 800000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_800KBITS();
+    return ESP_OK;
+  case 1000000:
+    *t_config = (twai_timing_config_t)TWAI_TIMING_CONFIG_1MBITS();
+    return ESP_OK;
+  default:
+    return ESP_ERR_INVALID_ARG;
+  }
+}
+
 /**
- * @note In msg_id and mask the lower 11 bits matter. Don't shift left, the
- * function will do it.
+ * @brief Single acceptance filter for frames the node has to see.
+ *
+ * @details In the extended frame layout the 29 ID bits sit in bits 31..3 of
+ * code and mask, and mask bits set to 1 are don't care. The source address
+ * must be the master. Once we have an address, destination bits that are 1 in
+ * it must be 1 too. One filter can't match "our address or broadcast"
+ * exactly, but this passes both, drops the traffic of most other nodes, and
+ * the daemon still checks the exact address.
  */
-static esp_err_t can_transport_twai_driver_install() {
-  const twai_timing_config_t t_config = CAN_TRANSPORT_SPEED;
+static twai_filter_config_t
+can_transport_filter_config(h42_can_address_t address) {
+  if (!g_can_transport.config.hw_filter) {
+    return (twai_filter_config_t)TWAI_FILTER_CONFIG_ACCEPT_ALL();
+  }
+  uint32_t id_code = H42_CAN_ADDRESS_MASTER << 8;
+  uint32_t id_mask = 0x1FFF00FF; // Everything but the source address
+  if (address != H42_CAN_ADDRESS_BROADCAST) {
+    id_code |= address;
+    id_mask &= ~(uint32_t)address;
+  }
+  return (twai_filter_config_t){
+      .acceptance_code = id_code << 3,
+      .acceptance_mask = (id_mask << 3) | 0x7,
+      .single_filter = true,
+  };
+}
 
-  const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+static esp_err_t can_transport_twai_driver_install(h42_can_address_t address) {
+  const h42_can_config_t *config = &g_can_transport.config;
+  twai_timing_config_t t_config;
+  esp_err_t err = can_transport_timing_config(config->bitrate, &t_config);
+  if (err != ESP_OK) {
+    return err;
+  }
 
-  const twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(
-      CAN_TRANSPORT_TX_GPIO, CAN_TRANSPORT_RX_GPIO, TWAI_MODE_NORMAL);
+  const twai_filter_config_t f_config = can_transport_filter_config(address);
+
+  const twai_general_config_t g_config =
+      TWAI_GENERAL_CONFIG_DEFAULT((gpio_num_t)config->tx_gpio,
+                                  (gpio_num_t)config->rx_gpio, TWAI_MODE_NORMAL);
 
   return twai_driver_install(&g_config, &t_config, &f_config);
 }
 
+/**
+ * @brief The legacy TWAI driver only takes a filter at install time, so
+ * reinstall it.
+ */
+static esp_err_t can_transport_set_address_filter(h42_can_address_t address) {
+  // Fails in bus-off state, where uninstalling is allowed anyway.
+  twai_stop();
+  esp_err_t err = twai_driver_uninstall();
+  if (err != ESP_OK) {
+    return err;
+  }
+  err = can_transport_twai_driver_install(address);
+  if (err != ESP_OK) {
+    return err;
+  }
+  return twai_start();
+}
+
 static int can_transport_connect(esp_transport_handle_t t, const char *host,
                                  int port, int timeout_ms) {
+  // esp-mqtt gives up on a connection after a failed or short write, the new
+  // one starts with a CONNECT.
+  if (g_can_transport.compact != NULL) {
+    h42_mqtt_compact_encoder_init(g_can_transport.compact);
+  }
+  h42_mqtt_keepalive_init(&g_can_transport.keepalive);
+  h42_mqtt_priority_stream_init(&g_can_transport.priority_stream);
   // Wait until the OverCAN daemon has obtained an address
   esp_err_t res = h42_can_daemon_connect(timeout_ms);
   return res == ESP_OK ? 0 : -1;
 }
 
+/**
+ * @brief Write through the compact MQTT encoder.
+ *
+ * @details The encoder runs ahead of the daemon and can't take input back.
+ * Nothing sent yet still returns 0, which ends the connection like any other
+ * write timeout.
+ */
+static int can_transport_write_compact(const uint8_t *buffer, int len,
+                                       h42_can_priority_t priority,
+                                       int timeout_ms) {
+  h42_can_transport_t *t = &g_can_transport;
+  const uint8_t features = h42_can_daemon_link_features();
+  const uint8_t modes =
+      ((features & H42_CAN_FEATURE_COMPACT_MQTT) ? H42_MQTT_COMPACT_ALIASES
+                                                 : 0) |
+      ((features & H42_CAN_FEATURE_COMPRESSION) ? H42_MQTT_COMPACT_COMPRESS
+                                                : 0);
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  bool sent = false;
+  int consumed = 0;
+  for (;;) {
+    uint32_t out_len = 0;
+    consumed += h42_mqtt_compact_encode(t->compact, modes, buffer + consumed,
+                                        len - consumed, t->compact_out,
+                                        sizeof(t->compact_out), &out_len);
+    if (out_len == 0) {
+      // Everything consumed and nothing left to send.
+      break;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    int remaining_ms = elapsed < timeout ? pdTICKS_TO_MS(timeout - elapsed) : 0;
+    uint32_t written = 0;
+    esp_err_t err = h42_can_daemon_write_priority(
+        t->compact_out, out_len, priority, &written, remaining_ms);
+    if (err == ESP_ERR_TIMEOUT && written == 0 && !sent) {
+      return 0;
+    }
+    if (err != ESP_OK) {
+      return -1;
+    }
+    sent = true;
+  }
+  return len;
+}
+
+static int can_transport_write_locked(const char *buffer, int len,
+                                      int timeout_ms) {
+  // esp-mqtt writes a PUBLISH larger than its out buffer in several pieces,
+  // the ones after the first keep its class.
+  const h42_can_priority_t priority = h42_mqtt_priority_stream_feed(
+      &g_can_transport.priority_stream, (const uint8_t *)buffer, len);
+  if (g_can_transport.compact != NULL) {
+    return can_transport_write_compact((const uint8_t *)buffer, len, priority,
+                                       timeout_ms);
+  }
+  // esp-mqtt does not retry short writes, so the whole buffer goes out here,
+  // whatever the packet size limit.
+  uint32_t written = 0;
+  esp_err_t err = h42_can_daemon_write_priority(
+      (const uint8_t *)buffer, len, priority, &written, timeout_ms);
+  if (err == ESP_ERR_TIMEOUT && written == 0) {
+    return 0;
+  }
+  // Part of an MQTT packet is lost otherwise, the connection can't go on.
+  return err == ESP_OK ? len : -1;
+}
+
 static int can_transport_write(esp_transport_handle_t t, const char *buffer,
                                int len, int timeout_ms) {
-  len = len > h42_max_packet_size() ? h42_max_packet_size() : len;
-  if (h42_can_daemon_send((const uint8_t *)buffer, len, timeout_ms) != ESP_OK) {
-    return -1;
+  if ((h42_can_daemon_link_features() & H42_CAN_FEATURE_KEEPALIVE_PROXY) &&
+      h42_mqtt_keepalive_on_write(&g_can_transport.keepalive,
+                                  (const uint8_t *)buffer, len,
+                                  pdTICKS_TO_MS(xTaskGetTickCount()))) {
+    return len;
   }
-  return len;
+  if (xSemaphoreTake(g_can_transport.write_lock, pdMS_TO_TICKS(timeout_ms)) !=
+      pdTRUE) {
+    return 0;
+  }
+  int res = can_transport_write_locked(buffer, len, timeout_ms);
+  xSemaphoreGive(g_can_transport.write_lock);
+  return res;
 }
 
 static int can_transport_read(esp_transport_handle_t t, char *buffer, int len,
                               int timeout_ms) {
-  uint32_t recv_len = 0;
+  h42_mqtt_keepalive_t *keepalive = &g_can_transport.keepalive;
+  uint32_t recv_len =
+      h42_mqtt_keepalive_read(keepalive, (uint8_t *)buffer, len);
+  if (recv_len > 0) {
+    return recv_len;
+  }
   esp_err_t err =
       h42_can_daemon_recv((uint8_t *)buffer, len, &recv_len, timeout_ms);
   if (err == ESP_ERR_TIMEOUT) {
@@ -61,15 +245,24 @@ static int can_transport_read(esp_transport_handle_t t, char *buffer, int len,
   if (err != ESP_OK) {
     return -1;
   }
+  h42_mqtt_keepalive_on_read(keepalive, (const uint8_t *)buffer, recv_len);
   return recv_len;
 }
 
 static int can_transport_poll_read(esp_transport_handle_t t, int timeout_ms) {
+  if (g_can_transport.keepalive.pingresp_left > 0) {
+    return 1;
+  }
   return h42_can_daemon_poll_read(timeout_ms) == ESP_OK ? 1 : 0;
 }
 
 static int can_transport_poll_write(esp_transport_handle_t t, int timeout_ms) {
-  return h42_can_daemon_poll_write(timeout_ms) == ESP_OK ? 1 : 0;
+  esp_err_t err = h42_can_daemon_poll_write(timeout_ms);
+  if (err == ESP_ERR_TIMEOUT) {
+    return 0;
+  }
+  // A failed async send left a hole in the stream.
+  return err == ESP_OK ? 1 : -1;
 }
 
 static int can_transport_destroy(esp_transport_handle_t t) {
@@ -80,7 +273,57 @@ static int can_transport_destroy(esp_transport_handle_t t) {
   return 0;
 }
 
-esp_err_t h42_can_init() {
+/**
+ * @brief Put a DISCOVERY packet into the MQTT stream, between two of
+ * esp-mqtt's packets.
+ */
+static esp_err_t can_transport_write_discovery(uint8_t op, uint32_t set_hash,
+                                               int timeout_ms) {
+  h42_can_transport_t *t = &g_can_transport;
+  if (!t->initialized ||
+      !(h42_can_daemon_link_features() & H42_CAN_FEATURE_DISCOVERY_CACHE)) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+  if (xSemaphoreTake(t->write_lock, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  esp_err_t err = ESP_ERR_INVALID_STATE;
+  // esp-mqtt writes a PUBLISH larger than its out buffer in several pieces,
+  // and may be in the middle of one. The caller tries again later.
+  if (h42_mqtt_priority_stream_idle(&t->priority_stream) &&
+      (t->compact == NULL || h42_mqtt_compact_idle(t->compact))) {
+    uint8_t packet[H42_MQTT_COMPACT_DISCOVERY_SIZE];
+    h42_mqtt_compact_discovery(op, set_hash, packet);
+    uint32_t written = 0;
+    err = h42_can_daemon_write_priority(packet, sizeof(packet),
+                                        H42_CAN_PRIORITY_CONTROL, &written,
+                                        timeout_ms);
+  }
+  xSemaphoreGive(t->write_lock);
+  return err;
+}
+
+esp_err_t h42_can_discovery_check(uint32_t set_hash, bool *cached,
+                                  int timeout_ms) {
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  *cached = false;
+  esp_err_t err = can_transport_write_discovery(
+      H42_MQTT_COMPACT_DISCOVERY_CHECK, set_hash, timeout_ms);
+  if (err != ESP_OK) {
+    return err;
+  }
+  TickType_t elapsed = xTaskGetTickCount() - start;
+  int remaining_ms = elapsed < timeout ? pdTICKS_TO_MS(timeout - elapsed) : 0;
+  return h42_can_daemon_wait_discovery_status(set_hash, cached, remaining_ms);
+}
+
+esp_err_t h42_can_discovery_commit(uint32_t set_hash, int timeout_ms) {
+  return can_transport_write_discovery(H42_MQTT_COMPACT_DISCOVERY_COMMIT,
+                                       set_hash, timeout_ms);
+}
+
+esp_err_t h42_can_init(const h42_can_config_t *config) {
   esp_err_t err;
   h42_can_transport_t *t = &g_can_transport;
 
@@ -88,9 +331,15 @@ esp_err_t h42_can_init() {
     // Already initialized
     return ESP_OK;
   }
+  if (config != NULL) {
+    t->config = *config;
+  } else {
+    t->config = (h42_can_config_t)H42_CAN_CONFIG_DEFAULT();
+  }
 
-  // Init TWAI
-  err = can_transport_twai_driver_install();
+  // Init TWAI. Until the daemon has an address, the filter only checks that
+  // frames come from the master.
+  err = can_transport_twai_driver_install(H42_CAN_ADDRESS_BROADCAST);
   if (err != ESP_OK) {
     goto error;
   }
@@ -100,7 +349,38 @@ esp_err_t h42_can_init() {
   }
 
   // Start the CAN transport daemon
-  err = h42_can_daemon_start();
+  h42_can_daemon_config_t daemon_config = t->config.daemon;
+  t->write_lock = xSemaphoreCreateMutex();
+  if (t->write_lock == NULL) {
+    err = ESP_ERR_NO_MEM;
+    goto error;
+  }
+  if (t->config.compact_mqtt || t->config.compress_mqtt) {
+    t->compact = malloc(sizeof(*t->compact));
+    if (t->compact == NULL) {
+      err = ESP_ERR_NO_MEM;
+      goto error;
+    }
+    h42_mqtt_compact_encoder_init(t->compact);
+  }
+  if (t->config.compact_mqtt) {
+    daemon_config.features |= H42_CAN_FEATURE_COMPACT_MQTT;
+  }
+  if (t->config.compress_mqtt) {
+    daemon_config.features |= H42_CAN_FEATURE_COMPRESSION;
+  }
+  if (t->config.discovery_cache) {
+    daemon_config.features |= H42_CAN_FEATURE_DISCOVERY_CACHE;
+  }
+  if (t->config.keepalive_proxy) {
+    daemon_config.features |= H42_CAN_FEATURE_KEEPALIVE_PROXY;
+  }
+  if (t->config.broadcast) {
+    daemon_config.features |= H42_CAN_FEATURE_BROADCAST;
+  }
+  daemon_config.set_address_filter =
+      t->config.hw_filter ? can_transport_set_address_filter : NULL;
+  err = h42_can_daemon_start(&daemon_config);
   if (err != ESP_OK) {
     goto error;
   }
@@ -109,6 +389,12 @@ esp_err_t h42_can_init() {
 
   return ESP_OK;
 error:
+  free(t->compact);
+  t->compact = NULL;
+  if (t->write_lock != NULL) {
+    vSemaphoreDelete(t->write_lock);
+    t->write_lock = NULL;
+  }
   twai_stop();
   twai_driver_uninstall();
   return err;
@@ -3,22 +3,33 @@
 #include "h42_packet_queue.h"
 
 #include "isotp.h"
+#include "isotp_user.h"
 
 #include <driver/twai.h>
 #include <esp_log.h>
 #include <esp_mac.h>
 #include <esp_random.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <nvs_flash.h>
+#include <stdatomic.h>
 #include <string.h>
 
 /*
 Arbitration ID format: (29 bits)
- | 8 bits random seed | 2 bits: unused | 3 bits: msg type | 8 bits: src address
-| 8 bits: destination address |
+ | 3 bits: priority | 5 bits random seed | 2 bits: unused | 3 bits: msg type
+| 8 bits: src address | 8 bits: destination address |
+
+  The priority is an h42_can_priority_t, so it decides arbitration between
+  nodes. ISO-TP frames carry the priority of the message they belong to, by
+  the MQTT packets in it, and flow control frames H42_CAN_PRIORITY_CONTROL, as
+  does everything else. The random seed of ISO-TP frames keeps frames with the
+  same priority from nodes that ended up with the same address apart, which
+  would otherwise destroy each other in arbitration. Receivers ignore both.
 
 
   MSG_TYPE_ADDRESS_REQUEST:
@@ -32,13 +43,52 @@ Arbitration ID format: (29 bits)
       6 bytes: node mac (chip id)
       1 byte: status: 0 - success, 1 - failure
       1 byte: on success - new node address
-*/
 
-#define H42_CAN_ADDRESS_MASTER 0x00
-#define H42_CAN_ADDRESS_BROADCAST 0xFF
+  MSG_TYPE_LINK_PARAMS:
+    Sent by a node to the master once it has an address, to propose the flow
+    control it wants to receive with.
+    Payload (2 to 4 bytes):
+      1 byte: block size
+      1 byte: STmin (ISO-TP encoding)
+      1 byte, optional: largest CAN frame the node handles, 8 (classic CAN,
+        assumed when missing) up to 64 (CAN FD)
+      1 byte, optional: H42_CAN_FEATURE_* bits the node would like to use
+    The master answers to the node with the flow control to use.
+    Payload (3 to 5 bytes):
+      1 byte: block size the node asks for in its flow control frames
+      1 byte: STmin the node asks for in its flow control frames
+      1 byte: lowest STmin the node may send with
+      1 byte, optional: CAN frame length both sides send with, 8 when missing
+      1 byte, optional: the requested features the master supports, none
+        when missing
+    A master that does not answer leaves the node on its configured receive
+    parameters and ISO_TP_DEFAULT_ST_MIN_US for sending.
+
+  MSG_TYPE_BROADCAST_DATA:
+    Sent by the master to H42_CAN_ADDRESS_BROADCAST with part of the MQTT
+    stream of several nodes that granted H42_CAN_FEATURE_BROADCAST, at a
+    point where each of their streams is between two packets. Single, first
+    and consecutive frames as in ISO-TP, classic CAN frames only, but nobody
+    sends flow control: the master keeps to the highest STmin the nodes ask
+    for. A lost frame loses the message. Message:
+      1 byte: number of target addresses N
+      N bytes: target node addresses
+      the rest: data for each target, as if sent to it alone
+
+  MSG_TYPE_DISCOVERY_STATUS:
+    Sent by the master to a node with H42_CAN_FEATURE_DISCOVERY_CACHE, in
+    answer to the discovery check in its MQTT stream (h42_mqtt_compact.h).
+    Payload (5 bytes):
+      1 byte: 1 - the master has the set and replayed it to the broker,
+        0 - the node has to send it
+      4 bytes: hash of the discovery set, big endian
+*/
 
 typedef enum {
   MSG_TYPE_PACKET_ISOTP = 0,
+  MSG_TYPE_LINK_PARAMS = 1,
+  MSG_TYPE_DISCOVERY_STATUS = 2,
+  MSG_TYPE_BROADCAST_DATA = 3,
   MSG_TYPE_ADDRESS_REQUEST = 5,
   MSG_TYPE_ADDRESS_RESPONSE = 6,
 } h42_can_msg_type_t;
@@ -47,29 +97,101 @@ typedef enum {
   DAEMON_STATE_OBTAINING_ADDRESS = (1 << 0),
   DAEMON_STATE_SERVING = (1 << 1),
 } h42_can_daemon_state_t;
+#define DAEMON_STATE_MASK (DAEMON_STATE_OBTAINING_ADDRESS | DAEMON_STATE_SERVING)
+// Set next to DAEMON_STATE_SERVING once the master answered the link params.
+#define DAEMON_LINK_PARAMS_DONE (1 << 2)
+// How long h42_can_daemon_connect() waits for that when the node asks for
+// features. Masters that predate link params never answer.
+#define LINK_PARAMS_WAIT_MS 1000
+// An answer to a discovery check is in discovery_status.
+#define DAEMON_DISCOVERY_STATUS (1 << 3)
 
 #define ISOTP_BUFSIZE 4095
 
+#define IN_PACKET_QUEUE_MAX_PACKETS 32
+#define IN_PACKET_QUEUE_MAX_BYTES (16 * 1024)
+#define OUT_PACKET_POOL_MAX_BYTES (8 * 1024)
+// CAN frames handed from the bus task to the daemon task.
+#define RX_FRAME_QUEUE_DEPTH 32
+// How often the bus task looks for filter changes when the bus is quiet.
+// Only used with a hardware address filter.
+#define BUS_TASK_FILTER_POLL_MS 1000
+
+// Receive STmin back-off while consecutive frames are being lost.
+#define RX_ST_MIN_BACKOFF_MAX_US 20000
+#define RX_ST_MIN_RECOVER_PACKETS 16
+#define RX_ST_MIN_RECOVER_STEP_US 1000
+
+// Wakes a task blocked in h42_can_daemon_send(). A bit, not the notification
+// value, since the same task may wait on in_packet_queue, which has a bit of
+// its own.
+#define SEND_DONE_NOTIFY_BIT (1u << 0)
+// Wakes a task blocked in h42_can_daemon_poll_write() or waiting for an
+// out_packet_pool block.
+#define TX_SLOT_NOTIFY_BIT (1u << 1)
+// A task waiting for a block looks again this often, in case another task
+// took the waiter slot.
+#define TX_BLOCK_WAIT_MAX_MS 10
+
+// Item of out_packet_queue. Only the reference travels through the queue.
 typedef struct h42_out_packet {
-  uint8_t data[ISOTP_BUFSIZE];
-  uint32_t size;
+  h42_packet_handle_t packet;
+  // Task waiting for completion. NULL for async sends.
   TaskHandle_t sender;
+  // Where the sender wants the result, on its stack.
+  esp_err_t *result;
+  h42_can_priority_t priority;
 } h42_out_packet_t;
 
 typedef struct h42_can_daemon {
+  h42_can_daemon_config_t config;
   EventGroupHandle_t state;
   h42_can_address_t address;
   h42_packet_queue_handle_t in_packet_queue;
+  h42_packet_pool_handle_t in_packet_pool;
   h42_packet_handle_t last_popped_packet;
   int last_popped_packet_read_pos;
 
+  QueueHandle_t rx_frame_queue;
+  uint32_t rx_frame_drops;
+  // Address filter requests from the daemon task to the bus task.
+  QueueHandle_t filter_request_queue;
+  SemaphoreHandle_t filter_done;
+  h42_can_address_t filter_address;
+
   IsoTpLink isotp_link;
-  uint8_t isotp_recv_internal_buf[ISOTP_BUFSIZE];
-  uint8_t isotp_send_internal_buf[ISOTP_BUFSIZE];
-  uint8_t isotp_recv_buf[ISOTP_BUFSIZE];
+  // Packet the ISO-TP link is currently reassembling into.
+  h42_packet_handle_t isotp_recv_packet;
+  // MSG_TYPE_BROADCAST_DATA message being reassembled, its full size and the
+  // sequence number of the next consecutive frame.
+  h42_packet_handle_t bcast_packet;
+  uint16_t bcast_size;
+  uint8_t bcast_sn;
   uint8_t isotp_last_send_status;
+  int isotp_last_receive_result;
+  // Flow control in use. rx_st_min_us backs off from rx_st_min_base_us when
+  // frames are lost.
+  uint8_t rx_block_size;
+  uint32_t rx_st_min_base_us;
+  uint32_t rx_st_min_us;
+  uint32_t rx_clean_packets;
+  uint32_t tx_st_min_floor_us;
+  // H42_CAN_FEATURE_* bits the master granted, read by other tasks.
+  _Atomic uint8_t link_features;
+  // Last MSG_TYPE_DISCOVERY_STATUS: the set hash, and bit 32 when cached.
+  _Atomic uint64_t discovery_status;
+  // Wakes the daemon when isotp_poll() is due.
+  esp_timer_handle_t isotp_timer;
 
   QueueHandle_t out_packet_queue;
+  // Task in h42_can_daemon_poll_write() or waiting for an out_packet_pool
+  // block, taken and notified when the daemon frees a slot of
+  // out_packet_queue or a block.
+  _Atomic(TaskHandle_t) tx_slot_waiter;
+  // First async send that failed since the last connect. The writer gets it
+  // from its next send or poll_write, the stream has a hole from there on.
+  _Atomic esp_err_t tx_error;
+  h42_packet_pool_handle_t out_packet_pool;
   TaskHandle_t daemon_task;
 } h42_can_daemon_t;
 static h42_can_daemon_t g_daemon = {0};
@@ -82,6 +204,12 @@ static inline uint32_t _msg_make_id(h42_can_msg_type_t req_type,
   return ((req_type & 7) << 16) | (src_addr << 8) | dst_addr;
 }
 
+static inline uint32_t _msg_id_with_priority(uint32_t id,
+                                             h42_can_priority_t priority) {
+  return (id & ~H42_CAN_ID_PRIORITY_MASK) |
+         ((uint32_t)priority << H42_CAN_ID_PRIORITY_SHIFT);
+}
+
 static inline h42_can_msg_type_t _msg_type(const twai_message_t *msg) {
   return (h42_can_msg_type_t)((msg->identifier >> 16) & 7);
 }
@@ -94,12 +222,277 @@ static inline h42_can_address_t _msg_src_addr(const twai_message_t *msg) {
   return (h42_can_address_t)((msg->identifier >> 8) & 0xFF);
 }
 
+/**
+ * @brief Wake the daemon task. It sleeps until it is told there is work to do
+ * or the ISO-TP link has a timer due.
+ */
+static void _daemon_wake(h42_can_daemon_t *daemon) {
+  if (daemon->daemon_task != NULL) {
+    xTaskNotifyGive(daemon->daemon_task);
+  }
+}
+
+/**
+ * @brief ISO-TP receive buffer provider.
+ *
+ * @details Frames are reassembled directly into the packet that is later
+ * pushed to in_packet_queue, so a received message is copied only once. A
+ * packet handed out earlier but not completed (timeout, wrong SN, aborted by a
+ * new first frame) is reused if it is large enough.
+ */
+static uint8_t *_daemon_isotp_recv_buffer(void *arg, uint16_t size) {
+  h42_can_daemon_t *daemon = (h42_can_daemon_t *)arg;
+
+  if (daemon->isotp_recv_packet != NULL &&
+      h42_packet_capacity(daemon->isotp_recv_packet) < size) {
+    h42_packet_free(&daemon->isotp_recv_packet);
+  }
+  if (daemon->isotp_recv_packet == NULL) {
+    // Without a block the link holds the master with FC WAIT and asks again
+    // until the reader has freed one.
+    daemon->isotp_recv_packet =
+        h42_packet_pool_alloc(daemon->in_packet_pool, size);
+    if (daemon->isotp_recv_packet == NULL) {
+      return NULL;
+    }
+  }
+  return h42_packet_data(daemon->isotp_recv_packet);
+}
+
+static void _daemon_apply_flow_params(h42_can_daemon_t *daemon) {
+  isotp_set_flow_params(&daemon->isotp_link, daemon->rx_block_size,
+                        daemon->rx_st_min_us, daemon->tx_st_min_floor_us);
+}
+
+/**
+ * @brief Go back to the configured flow control until the master answers
+ * our MSG_TYPE_LINK_PARAMS.
+ */
+static void _daemon_reset_flow_params(h42_can_daemon_t *daemon) {
+  daemon->rx_block_size = daemon->config.rx_block_size;
+  daemon->rx_st_min_base_us = daemon->config.rx_st_min_us;
+  daemon->rx_st_min_us = daemon->config.rx_st_min_us;
+  daemon->rx_clean_packets = 0;
+  daemon->tx_st_min_floor_us = ISO_TP_DEFAULT_ST_MIN_US;
+  atomic_store(&daemon->link_features, 0);
+}
+
 static void _daemon_isotp_reset(h42_can_daemon_t *daemon) {
-  isotp_init_link(&daemon->isotp_link, 0x000, daemon->isotp_send_internal_buf,
-                  sizeof(daemon->isotp_send_internal_buf),
-                  daemon->isotp_recv_internal_buf,
-                  sizeof(daemon->isotp_recv_internal_buf));
+  // Both directions work in place: sends go out straight from the
+  // out_packet_queue packet, receives land in packets from in_packet_pool.
+  isotp_init_link(&daemon->isotp_link, 0x000, NULL, 0, NULL, 0);
+  isotp_set_receive_buffer_provider(&daemon->isotp_link,
+                                    _daemon_isotp_recv_buffer, daemon);
+  _daemon_apply_flow_params(daemon);
   daemon->isotp_last_send_status = ISOTP_SEND_STATUS_IDLE;
+  daemon->isotp_last_receive_result = ISOTP_PROTOCOL_RESULT_OK;
+}
+
+/**
+ * @brief Adapt the STmin we ask of the master to how well we keep up.
+ *
+ * @details Losing consecutive frames doubles STmin. Every
+ * RX_ST_MIN_RECOVER_PACKETS messages received intact take it one step back
+ * towards the negotiated value. The master sees the new value in our next
+ * flow control frame.
+ */
+static void _daemon_rx_flow_feedback(h42_can_daemon_t *daemon, bool overrun) {
+  uint32_t st_min_us = daemon->rx_st_min_us;
+  if (overrun) {
+    daemon->rx_clean_packets = 0;
+    st_min_us = st_min_us < 1000 ? 1000 : st_min_us * 2;
+    if (st_min_us > RX_ST_MIN_BACKOFF_MAX_US) {
+      st_min_us = RX_ST_MIN_BACKOFF_MAX_US;
+    }
+  } else {
+    if (st_min_us <= daemon->rx_st_min_base_us ||
+        ++daemon->rx_clean_packets < RX_ST_MIN_RECOVER_PACKETS) {
+      return;
+    }
+    daemon->rx_clean_packets = 0;
+    st_min_us =
+        st_min_us > daemon->rx_st_min_base_us + RX_ST_MIN_RECOVER_STEP_US
+            ? st_min_us - RX_ST_MIN_RECOVER_STEP_US
+            : daemon->rx_st_min_base_us;
+  }
+  if (st_min_us != daemon->rx_st_min_us) {
+    ESP_LOGI(TAG, "Receive STmin %d -> %d us", (int)daemon->rx_st_min_us,
+             (int)st_min_us);
+    daemon->rx_st_min_us = st_min_us;
+    _daemon_apply_flow_params(daemon);
+  }
+}
+
+static void _daemon_check_rx_result(h42_can_daemon_t *daemon) {
+  int result = daemon->isotp_link.receive_protocol_result;
+  if (result == daemon->isotp_last_receive_result) {
+    return;
+  }
+  daemon->isotp_last_receive_result = result;
+  // A new first frame resets the result, so each failed transfer counts once.
+  if (result == ISOTP_PROTOCOL_RESULT_WRONG_SN ||
+      result == ISOTP_PROTOCOL_RESULT_TIMEOUT_CR) {
+    _daemon_rx_flow_feedback(daemon, true);
+  }
+}
+
+static void _daemon_propose_link_params(h42_can_daemon_t *daemon) {
+  twai_message_t msg = {
+      .identifier = _msg_make_id(MSG_TYPE_LINK_PARAMS, daemon->address,
+                                 H42_CAN_ADDRESS_MASTER),
+      .extd = 1,
+      // Masters that predate features get the payload they know.
+      .data_length_code = daemon->config.features != 0 ? 4 : 3,
+      // The TWAI controller only does classic CAN frames.
+      .data = {daemon->config.rx_block_size,
+               isotp_us_to_st_min(daemon->config.rx_st_min_us),
+               TWAI_FRAME_MAX_DLC, daemon->config.features},
+  };
+  esp_err_t err = twai_transmit(&msg, pdMS_TO_TICKS(100));
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to propose link params (%d)", err);
+  }
+}
+
+static void _daemon_on_link_params(h42_can_daemon_t *daemon,
+                                   const twai_message_t *msg) {
+  if (msg->data_length_code < 3) {
+    ESP_LOGW(TAG, "Link params too short (%d)", msg->data_length_code);
+    return;
+  }
+  daemon->rx_block_size = msg->data[0];
+  daemon->rx_st_min_base_us = isotp_st_min_to_us(msg->data[1]);
+  daemon->rx_st_min_us = daemon->rx_st_min_base_us;
+  daemon->rx_clean_packets = 0;
+  daemon->tx_st_min_floor_us = isotp_st_min_to_us(msg->data[2]);
+  ESP_LOGI(TAG, "Link params: rx bs %d stmin %d us, tx stmin >= %d us",
+           daemon->rx_block_size, (int)daemon->rx_st_min_us,
+           (int)daemon->tx_st_min_floor_us);
+  _daemon_apply_flow_params(daemon);
+  if (msg->data_length_code >= 4 &&
+      isotp_set_frame_size(&daemon->isotp_link, msg->data[3]) !=
+          ISOTP_RET_OK) {
+    ESP_LOGW(TAG, "Can't use %d byte frames", msg->data[3]);
+  }
+  if (msg->data_length_code >= 5) {
+    uint8_t features = msg->data[4] & daemon->config.features;
+    ESP_LOGI(TAG, "Link features: 0x%02x", features);
+    atomic_store(&daemon->link_features, features);
+  }
+  xEventGroupSetBits(daemon->state, DAEMON_LINK_PARAMS_DONE);
+}
+
+static void _daemon_on_discovery_status(h42_can_daemon_t *daemon,
+                                        const twai_message_t *msg) {
+  if (msg->data_length_code < 5) {
+    ESP_LOGW(TAG, "Discovery status too short (%d)", msg->data_length_code);
+    return;
+  }
+  uint32_t set_hash = ((uint32_t)msg->data[1] << 24) |
+                      ((uint32_t)msg->data[2] << 16) |
+                      ((uint32_t)msg->data[3] << 8) | msg->data[4];
+  atomic_store(&daemon->discovery_status,
+               ((uint64_t)(msg->data[0] != 0) << 32) | set_hash);
+  xEventGroupSetBits(daemon->state, DAEMON_DISCOVERY_STATUS);
+}
+
+/**
+ * @brief Queue a complete broadcast message for the reader, without the
+ * target list, if we are one of the targets.
+ */
+static void _daemon_on_broadcast_packet(h42_can_daemon_t *daemon,
+                                        h42_packet_handle_t pkt) {
+  uint8_t *data = h42_packet_data(pkt);
+  uint32_t size = h42_packet_size(pkt);
+  uint32_t header_size = 1 + (uint32_t)data[0];
+  if (header_size >= size ||
+      memchr(&data[1], daemon->address, data[0]) == NULL) {
+    h42_packet_free(&pkt);
+    return;
+  }
+  memmove(data, data + header_size, size - header_size);
+  h42_packet_set_size(pkt, size - header_size);
+  if (!h42_packet_queue_push_acquire(daemon->in_packet_queue, &pkt)) {
+    ESP_LOGE(TAG, "Failed to enqueue broadcast packet");
+    h42_packet_free(&pkt);
+  }
+}
+
+static void _daemon_on_broadcast_data(h42_can_daemon_t *daemon,
+                                      const twai_message_t *msg) {
+  const uint8_t *data = msg->data;
+  const uint8_t len = msg->data_length_code;
+  if (len < 1 || !(atomic_load(&daemon->link_features) &
+                   H42_CAN_FEATURE_BROADCAST)) {
+    return;
+  }
+  uint8_t pci = data[0] >> 4;
+  if (pci <= 1 && daemon->bcast_packet != NULL) {
+    // A new message aborts the one in progress.
+    h42_packet_free(&daemon->bcast_packet);
+  }
+  if (pci == 0) { // Single frame
+    uint8_t size = data[0] & 0x0F;
+    if (size == 0 || size > len - 1) {
+      return;
+    }
+    h42_packet_handle_t pkt =
+        h42_packet_pool_alloc(daemon->in_packet_pool, size);
+    if (pkt == NULL) {
+      ESP_LOGE(TAG, "Failed to allocate broadcast packet");
+      return;
+    }
+    h42_packet_append_data(pkt, &data[1], size);
+    _daemon_on_broadcast_packet(daemon, pkt);
+  } else if (pci == 1) { // First frame
+    uint16_t size = ((data[0] & 0x0F) << 8) | data[1];
+    if (len < 8 || size < 8) {
+      return;
+    }
+    daemon->bcast_packet = h42_packet_pool_alloc(daemon->in_packet_pool, size);
+    if (daemon->bcast_packet == NULL) {
+      ESP_LOGE(TAG, "Failed to allocate broadcast packet");
+      return;
+    }
+    h42_packet_append_data(daemon->bcast_packet, &data[2], 6);
+    daemon->bcast_size = size;
+    daemon->bcast_sn = 1;
+  } else if (pci == 2 && daemon->bcast_packet != NULL) { // Consecutive frame
+    if ((data[0] & 0x0F) != daemon->bcast_sn) {
+      ESP_LOGW(TAG, "Lost part of a broadcast");
+      h42_packet_free(&daemon->bcast_packet);
+      return;
+    }
+    uint32_t received = h42_packet_size(daemon->bcast_packet);
+    uint32_t chunk = daemon->bcast_size - received;
+    if (chunk > len - 1) {
+      chunk = len - 1;
+    }
+    h42_packet_append_data(daemon->bcast_packet, &data[1], chunk);
+    daemon->bcast_sn = (daemon->bcast_sn + 1) & 0x0F;
+    if (received + chunk == daemon->bcast_size) {
+      h42_packet_handle_t pkt = daemon->bcast_packet;
+      daemon->bcast_packet = NULL;
+      _daemon_on_broadcast_packet(daemon, pkt);
+    }
+  }
+}
+
+/**
+ * @brief Have the bus task narrow the hardware filter to `address`.
+ *
+ * @details The driver has to be reinstalled for that, so the bus task does it
+ * between two alert waits while we, the only other driver user, wait here.
+ * Frames still in the driver queues are lost.
+ */
+static void _daemon_set_address_filter(h42_can_daemon_t *daemon,
+                                       h42_can_address_t address) {
+  if (daemon->config.set_address_filter == NULL ||
+      daemon->filter_address == address) {
+    return;
+  }
+  xQueueOverwrite(daemon->filter_request_queue, &address);
+  xSemaphoreTake(daemon->filter_done, portMAX_DELAY);
 }
 
 /**
@@ -119,7 +512,12 @@ static esp_err_t _daemon_obtain_address(h42_can_daemon_t *daemon) {
   ESP_LOGI(TAG, "Obtaining address...");
 
   // Reset ISOTP link. If there were packets in flight, too bad.
+  _daemon_reset_flow_params(daemon);
   _daemon_isotp_reset(daemon);
+  if (daemon->bcast_packet != NULL) {
+    h42_packet_free(&daemon->bcast_packet);
+  }
+  _daemon_set_address_filter(daemon, H42_CAN_ADDRESS_BROADCAST);
 
   for (;;) {
     // Wait 0-250ms so we don't collide with other nodes if there was a
@@ -139,9 +537,9 @@ static esp_err_t _daemon_obtain_address(h42_can_daemon_t *daemon) {
     twai_message_t rx_message;
     TickType_t resp_wait_start = xTaskGetTickCount();
     for (;;) {
-      err = twai_receive(&rx_message, pdMS_TO_TICKS(1000));
-      if (err != ESP_OK) {
-        ESP_LOGW(TAG, "Failed to receive address response (%d)", err);
+      if (xQueueReceive(daemon->rx_frame_queue, &rx_message,
+                        pdMS_TO_TICKS(1000)) != pdTRUE) {
+        ESP_LOGW(TAG, "No address response yet");
       } else {
         if (rx_message.rtr || !rx_message.extd) {
           ESP_LOGW(TAG, "Undesired message received. RTR: %d, EXTD: %d",
@@ -170,6 +568,8 @@ static esp_err_t _daemon_obtain_address(h42_can_daemon_t *daemon) {
               MSG_TYPE_PACKET_ISOTP, daemon->address, H42_CAN_ADDRESS_MASTER);
 
           ESP_LOGI(TAG, "Address received: %d", daemon->address);
+          _daemon_set_address_filter(daemon, daemon->address);
+          _daemon_propose_link_params(daemon);
           return ESP_OK;
         }
       }
@@ -184,12 +584,13 @@ static esp_err_t _daemon_obtain_address(h42_can_daemon_t *daemon) {
 
 static esp_err_t _daemon_on_packet_received(h42_can_daemon_t *daemon,
                                             uint32_t data_size) {
-  h42_packet_handle_t pkt = h42_packet_alloc(data_size);
-  if (pkt == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate packet");
-    return ESP_ERR_NO_MEM;
+  h42_packet_handle_t pkt = daemon->isotp_recv_packet;
+  daemon->isotp_recv_packet = NULL;
+  if (!h42_packet_set_size(pkt, data_size)) {
+    ESP_LOGE(TAG, "Received packet does not fit its buffer");
+    h42_packet_free(&pkt);
+    return ESP_ERR_INVALID_SIZE;
   }
-  h42_packet_append_data(pkt, daemon->isotp_recv_buf, data_size);
   if (!h42_packet_queue_push_acquire(daemon->in_packet_queue, &pkt)) {
     ESP_LOGE(TAG,
              "Failed to enqueue received packet. No one is listening to it?");
@@ -200,7 +601,8 @@ static esp_err_t _daemon_on_packet_received(h42_can_daemon_t *daemon,
 }
 
 static h42_can_daemon_state_t _daemon_get_state(h42_can_daemon_t *daemon) {
-  return (h42_can_daemon_state_t)xEventGroupGetBits(daemon->state);
+  return (h42_can_daemon_state_t)(xEventGroupGetBits(daemon->state) &
+                                  DAEMON_STATE_MASK);
 }
 
 static void _daemon_set_state(h42_can_daemon_t *daemon,
@@ -209,31 +611,72 @@ static void _daemon_set_state(h42_can_daemon_t *daemon,
   xEventGroupSetBits(daemon->state, (EventBits_t)state);
 }
 
+// The link is full duplex: a send may start while a receive is in progress.
+// Consecutive frames and flow control of both directions interleave freely.
+static void _daemon_wake_tx_waiter(h42_can_daemon_t *daemon) {
+  TaskHandle_t waiter = atomic_exchange(&daemon->tx_slot_waiter, NULL);
+  if (waiter != NULL) {
+    xTaskNotify(waiter, TX_SLOT_NOTIFY_BIT, eSetBits);
+  }
+}
+
 static bool _daemon_out_packet_queue_pop(h42_can_daemon_t *daemon,
                                          h42_out_packet_t *item) {
-  return daemon->isotp_link.send_status != ISOTP_SEND_STATUS_INPROGRESS &&
-         daemon->isotp_link.receive_status != ISOTP_RECEIVE_STATUS_INPROGRESS &&
-         xQueueReceive(daemon->out_packet_queue, item, 0) == pdTRUE;
+  if (daemon->isotp_link.send_status == ISOTP_SEND_STATUS_INPROGRESS ||
+      xQueueReceive(daemon->out_packet_queue, item, 0) != pdTRUE) {
+    return false;
+  }
+  _daemon_wake_tx_waiter(daemon);
+  return true;
 }
 
-static void _out_packet_send_finish(h42_out_packet_t *out_packet,
+static void _out_packet_send_finish(h42_can_daemon_t *daemon,
+                                    h42_out_packet_t *out_packet,
                                     esp_err_t err) {
-  if (out_packet->sender == NULL) {
+  if (out_packet->packet == NULL) {
     return;
   }
-  if (xTaskNotify(out_packet->sender, (uint32_t)err,
-                  eSetValueWithoutOverwrite) != pdPASS) {
-    ESP_LOGE(TAG, "Failed to notify sender task");
+  ESP_LOGI(TAG, "Packet sent. size: %d, err: %d",
+           (int)h42_packet_size(out_packet->packet), err);
+  h42_packet_free(&out_packet->packet);
+  _daemon_wake_tx_waiter(daemon);
+
+  if (out_packet->sender == NULL) {
+    // Async send, the writer has moved on. Keep the first error for it.
+    esp_err_t no_error = ESP_OK;
+    if (err != ESP_OK) {
+      atomic_compare_exchange_strong(&daemon->tx_error, &no_error, err);
+    }
+    return;
   }
+  *out_packet->result = err;
+  xTaskNotify(out_packet->sender, SEND_DONE_NOTIFY_BIT, eSetBits);
   out_packet->sender = NULL;
-  ESP_LOGI(TAG, "Packet sent. size: %d, err: %d", (int)out_packet->size, err);
 }
 
 /**
  * h42_can_daemon_recv_packet
  *
+ * @details Lends the next received packet to the caller without copying it.
+ * The caller must release it with h42_packet_free(). Must not be mixed with
+ * h42_can_daemon_recv() while that one holds a partially read packet.
+ */
+esp_err_t h42_can_daemon_recv_packet(h42_packet_handle_t *packet,
+                                     int timeout_ms) {
+  h42_can_daemon_t *daemon = &g_daemon;
+  assert(packet != NULL && daemon->last_popped_packet == NULL);
+
+  *packet = h42_packet_queue_pop_release(daemon->in_packet_queue, timeout_ms);
+  return *packet != NULL ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+/**
+ * h42_can_daemon_recv
+ *
  * @details We assume there is only one task that calls this function, so no
- * synchronization is needed.
+ * synchronization is needed. It is also the one consumer in_packet_queue
+ * allows, the daemon task being the producer; h42_can_daemon_recv_packet()
+ * and h42_can_daemon_poll_read() belong to the same task.
  */
 esp_err_t h42_can_daemon_recv(uint8_t *buf, uint32_t buf_size,
                               uint32_t *recv_size, int timeout_ms) {
@@ -268,59 +711,162 @@ esp_err_t h42_can_daemon_recv(uint8_t *buf, uint32_t buf_size,
   return ESP_OK;
 }
 
+/**
+ * @brief Take an out_packet_pool block, waiting for the daemon to free one.
+ *
+ * @details The pool limits the bytes waiting to be sent. There is no heap
+ * fallback, a writer that runs it dry is held back like by a full queue.
+ */
+static h42_packet_handle_t _daemon_alloc_out_packet(h42_can_daemon_t *daemon,
+                                                    uint32_t size,
+                                                    int timeout_ms) {
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  h42_packet_handle_t packet;
+
+  for (;;) {
+    // Registered before looking, so a block freed in between still wakes us.
+    atomic_store(&daemon->tx_slot_waiter, self);
+    packet = h42_packet_pool_alloc(daemon->out_packet_pool, size);
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (packet != NULL || elapsed >= timeout) {
+      break;
+    }
+    TickType_t wait = timeout - elapsed;
+    if (wait > pdMS_TO_TICKS(TX_BLOCK_WAIT_MAX_MS)) {
+      wait = pdMS_TO_TICKS(TX_BLOCK_WAIT_MAX_MS);
+    }
+    xTaskNotifyWait(0, TX_SLOT_NOTIFY_BIT, NULL, wait);
+  }
+  atomic_store(&daemon->tx_slot_waiter, NULL);
+  return packet;
+}
+
 esp_err_t h42_can_daemon_send(const uint8_t *buf, uint32_t buf_size,
                               int timeout_ms) {
+  return h42_can_daemon_send_priority(buf, buf_size, H42_CAN_PRIORITY_STATE,
+                                      timeout_ms);
+}
+
+esp_err_t h42_can_daemon_send_priority(const uint8_t *buf, uint32_t buf_size,
+                                       h42_can_priority_t priority,
+                                       int timeout_ms) {
   h42_can_daemon_t *daemon = &g_daemon;
   if (_daemon_get_state(daemon) != DAEMON_STATE_SERVING) {
     return ESP_ERR_INVALID_STATE;
   }
+  esp_err_t tx_error = atomic_load(&daemon->tx_error);
+  if (tx_error != ESP_OK) {
+    return tx_error;
+  }
   if (buf_size > ISOTP_BUFSIZE) {
     return ESP_ERR_INVALID_SIZE;
   }
-  h42_out_packet_t *out_packet =
-      (h42_out_packet_t *)malloc(sizeof(h42_out_packet_t));
-  if (out_packet == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate send item");
-    return ESP_ERR_NO_MEM;
-  }
-
-  out_packet->size = buf_size;
-  out_packet->sender = xTaskGetCurrentTaskHandle();
-  memcpy(out_packet->data, buf, buf_size);
 
   // Edge case: The sender task is the daemon task itself.
   // This may happen if logging over mqtt is enabled.
   // We just drop such messages as it otherwise may cause an endless loop.
-  if (out_packet->sender == daemon->daemon_task) {
-    free(out_packet);
+  TaskHandle_t sender = xTaskGetCurrentTaskHandle();
+  if (sender == daemon->daemon_task) {
     return ESP_OK;
   }
 
-  BaseType_t res = xQueueSend(daemon->out_packet_queue, out_packet,
-                              pdMS_TO_TICKS(timeout_ms));
-  free(out_packet);
+  // The caller's buffer is reused as soon as we return, so this is the one
+  // copy on the send path.
+  const TickType_t start = xTaskGetTickCount();
+  esp_err_t result = ESP_FAIL;
+  h42_out_packet_t out_packet = {
+      .packet = _daemon_alloc_out_packet(daemon, buf_size, timeout_ms),
+      .sender = daemon->config.tx_async ? NULL : sender,
+      .result = &result,
+      .priority = priority,
+  };
+  if (out_packet.packet == NULL) {
+    return ESP_ERR_TIMEOUT;
+  }
+  h42_packet_append_data(out_packet.packet, buf, buf_size);
+
+  TickType_t elapsed = xTaskGetTickCount() - start;
+  TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  BaseType_t res = xQueueSend(daemon->out_packet_queue, &out_packet,
+                              elapsed < timeout ? timeout - elapsed : 0);
   if (res != pdTRUE) {
     ESP_LOGE(TAG, "Failed to queue send item (%d)", res);
+    h42_packet_free(&out_packet.packet);
     return ESP_ERR_TIMEOUT;
   }
+  _daemon_wake(daemon);
+
+  if (out_packet.sender == NULL) {
+    // Async mode. Like a TCP send buffer, a failure is reported by the next
+    // send or poll_write.
+    return ESP_OK;
+  }
 
   // Wait for the send to complete
-  uint32_t notif_val;
-  // ESP_LOGI(TAG, "Waiting for send completion notification");
-  if (xTaskNotifyWait(0, 0, &notif_val, portMAX_DELAY) != pdPASS) {
-    ESP_LOGE(TAG, "Failed to wait for send completion notification");
-    return ESP_FAIL;
+  uint32_t notif_val = 0;
+  while (!(notif_val & SEND_DONE_NOTIFY_BIT)) {
+    xTaskNotifyWait(0, SEND_DONE_NOTIFY_BIT, &notif_val, portMAX_DELAY);
   }
-  return (esp_err_t)notif_val;
+  return result;
+}
+
+/**
+ * h42_can_daemon_write
+ *
+ * @details Packets are segments of a byte stream, the master joins them back
+ * in order, so where the stream is cut does not matter.
+ */
+esp_err_t h42_can_daemon_write(const uint8_t *buf, uint32_t buf_size,
+                               uint32_t *written, int timeout_ms) {
+  return h42_can_daemon_write_priority(buf, buf_size, H42_CAN_PRIORITY_STATE,
+                                       written, timeout_ms);
+}
+
+esp_err_t h42_can_daemon_write_priority(const uint8_t *buf, uint32_t buf_size,
+                                        h42_can_priority_t priority,
+                                        uint32_t *written, int timeout_ms) {
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  esp_err_t err = ESP_OK;
+
+  *written = 0;
+  while (*written < buf_size) {
+    uint32_t segment_size = buf_size - *written;
+    if (segment_size > h42_max_packet_size()) {
+      segment_size = h42_max_packet_size();
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    int remaining_ms = elapsed < timeout ? pdTICKS_TO_MS(timeout - elapsed) : 0;
+    err = h42_can_daemon_send_priority(buf + *written, segment_size, priority,
+                                       remaining_ms);
+    if (err != ESP_OK) {
+      break;
+    }
+    *written += segment_size;
+  }
+  return err;
 }
 
 esp_err_t h42_can_daemon_connect(int timeout_ms) {
   h42_can_daemon_t *daemon = &g_daemon;
   _daemon_set_state(daemon, DAEMON_STATE_OBTAINING_ADDRESS);
+  _daemon_wake(daemon);
   EventBits_t bits =
       xEventGroupWaitBits(daemon->state, DAEMON_STATE_SERVING, pdFALSE, pdTRUE,
                           pdMS_TO_TICKS(timeout_ms));
-  return (bits & DAEMON_STATE_SERVING) ? ESP_OK : ESP_ERR_TIMEOUT;
+  if (!(bits & DAEMON_STATE_SERVING)) {
+    return ESP_ERR_TIMEOUT;
+  }
+  // Sends of the old connection are done with, see vTaskCanTransportDaemon.
+  atomic_store(&daemon->tx_error, ESP_OK);
+  // Whoever connects is about to write, which may depend on the features.
+  if (daemon->config.features != 0) {
+    xEventGroupWaitBits(daemon->state, DAEMON_LINK_PARAMS_DONE, pdFALSE,
+                        pdTRUE, pdMS_TO_TICKS(LINK_PARAMS_WAIT_MS));
+  }
+  return ESP_OK;
 }
 
 esp_err_t h42_can_daemon_poll_read(int timeout_ms) {
@@ -331,63 +877,274 @@ esp_err_t h42_can_daemon_poll_read(int timeout_ms) {
              : ESP_ERR_TIMEOUT;
 }
 
+/**
+ * h42_can_daemon_poll_write
+ *
+ * @details Returns as soon as the daemon takes a packet off out_packet_queue,
+ * or at once with the error of a failed async send. Like
+ * h42_can_daemon_recv(), for one writing task.
+ */
 esp_err_t h42_can_daemon_poll_write(int timeout_ms) {
   h42_can_daemon_t *daemon = &g_daemon;
+  esp_err_t tx_error = atomic_load(&daemon->tx_error);
+  if (tx_error != ESP_OK) {
+    return tx_error;
+  }
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  esp_err_t err = ESP_OK;
 
-  // I don't know how to wait for a free slot in a queue without polling.
-  TickType_t startTicks = xTaskGetTickCount();
-  while (uxQueueSpacesAvailable(daemon->out_packet_queue) == 0) {
-    if (xTaskGetTickCount() - startTicks > pdMS_TO_TICKS(timeout_ms)) {
-      return ESP_ERR_TIMEOUT;
+  for (;;) {
+    // Registered before looking, so a slot freed in between still wakes us.
+    atomic_store(&daemon->tx_slot_waiter, self);
+    if (uxQueueSpacesAvailable(daemon->out_packet_queue) > 0) {
+      break;
     }
-    vTaskDelay(pdMS_TO_TICKS(10));
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout) {
+      err = ESP_ERR_TIMEOUT;
+      break;
+    }
+    xTaskNotifyWait(0, TX_SLOT_NOTIFY_BIT, NULL, timeout - elapsed);
   }
-  return ESP_OK;
+  atomic_store(&daemon->tx_slot_waiter, NULL);
+  return err;
 }
 
 uint16_t h42_max_packet_size() { return ISOTP_BUFSIZE - 1; }
 
+uint8_t h42_can_daemon_link_features(void) {
+  return atomic_load(&g_daemon.link_features);
+}
+
+esp_err_t h42_can_daemon_wait_discovery_status(uint32_t set_hash, bool *cached,
+                                               int timeout_ms) {
+  h42_can_daemon_t *daemon = &g_daemon;
+  const TickType_t start = xTaskGetTickCount();
+  const TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  for (;;) {
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout) {
+      return ESP_ERR_TIMEOUT;
+    }
+    EventBits_t bits =
+        xEventGroupWaitBits(daemon->state, DAEMON_DISCOVERY_STATUS, pdTRUE,
+                            pdTRUE, timeout - elapsed);
+    if (!(bits & DAEMON_DISCOVERY_STATUS)) {
+      return ESP_ERR_TIMEOUT;
+    }
+    uint64_t status = atomic_load(&daemon->discovery_status);
+    if ((uint32_t)status == set_hash) {
+      *cached = (status >> 32) != 0;
+      return ESP_OK;
+    }
+  }
+}
+
+void h42_can_daemon_get_rx_pool_stats(h42_packet_pool_stats_t *stats) {
+  h42_packet_pool_get_stats(g_daemon.in_packet_pool, stats);
+}
+
 /**
- * vTaskCanTransportDaemonBusWatchdog
+ * vTaskCanBusIo
  *
- * @brief Watchdog task for the CAN bus
+ * @brief Bus task. Moves received frames to the daemon and watches the bus
+ * state. Both are driven by TWAI alerts, so the task only runs when the bus
+ * has something to say.
  */
-static const char *WDTAG = "bus-watchdog";
+static const char *BUSTAG = "can-bus";
 static const uint32_t H42_TWAI_ALERT_FLAGS =
-    TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_ERR_PASS |
+    TWAI_ALERT_RX_DATA | TWAI_ALERT_ABOVE_ERR_WARN | TWAI_ALERT_ERR_PASS |
     TWAI_ALERT_BELOW_ERR_WARN | TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_BUS_OFF;
-void vTaskCanBusWatchdog(void *pvParameters) {
-  ESP_LOGI(WDTAG, "Bus Watchdog task started");
+
+static void _bus_forward_rx_frames(h42_can_daemon_t *daemon) {
+  twai_message_t rx_message;
+  uint32_t forwarded = 0;
+  uint32_t dropped = 0;
+  while (twai_receive(&rx_message, 0) == ESP_OK) {
+    // Never block here: the daemon may itself be blocked in twai_transmit()
+    // waiting for a bus-off recovery that only this task can start.
+    if (xQueueSend(daemon->rx_frame_queue, &rx_message, 0) == pdTRUE) {
+      forwarded++;
+    } else {
+      dropped++;
+    }
+  }
+  if (dropped > 0) {
+    daemon->rx_frame_drops += dropped;
+    ESP_LOGW(BUSTAG, "Daemon is behind, dropped %d frames (%d total)",
+             (int)dropped, (int)daemon->rx_frame_drops);
+  }
+  if (forwarded > 0) {
+    _daemon_wake(daemon);
+  }
+}
+
+static void _bus_apply_filter_request(h42_can_daemon_t *daemon) {
+  h42_can_address_t address;
+  if (xQueueReceive(daemon->filter_request_queue, &address, 0) != pdTRUE) {
+    return;
+  }
+  esp_err_t err = daemon->config.set_address_filter(address);
+  if (err != ESP_OK) {
+    ESP_LOGE(BUSTAG, "Failed to set address filter (%d)", err);
+  } else {
+    daemon->filter_address = address;
+  }
+  // The reinstalled driver starts with its default alerts.
   twai_reconfigure_alerts(H42_TWAI_ALERT_FLAGS, NULL);
+  _bus_forward_rx_frames(daemon);
+  xSemaphoreGive(daemon->filter_done);
+}
+
+void vTaskCanBusIo(void *pvParameters) {
+  h42_can_daemon_t *daemon = (h42_can_daemon_t *)pvParameters;
+  ESP_LOGI(BUSTAG, "Bus task started");
+  twai_reconfigure_alerts(H42_TWAI_ALERT_FLAGS, NULL);
+  // Frames received before the alert was enabled do not raise it.
+  _bus_forward_rx_frames(daemon);
+  // Filter requests can't interrupt the alert wait, so it has to time out
+  // now and then to pick them up.
+  const TickType_t alert_wait = daemon->config.set_address_filter != NULL
+                                    ? pdMS_TO_TICKS(BUS_TASK_FILTER_POLL_MS)
+                                    : portMAX_DELAY;
   for (;;) {
     uint32_t alerts;
-    twai_read_alerts(&alerts, portMAX_DELAY);
+    esp_err_t err = twai_read_alerts(&alerts, alert_wait);
+    if (err == ESP_ERR_TIMEOUT) {
+      _bus_apply_filter_request(daemon);
+      continue;
+    }
+    if (err != ESP_OK) {
+      ESP_LOGE(BUSTAG, "CAN driver is not installed");
+      vTaskDelay(pdMS_TO_TICKS(10 * 1000));
+      continue;
+    }
+    if (alerts & TWAI_ALERT_RX_DATA) {
+      _bus_forward_rx_frames(daemon);
+    }
     if (alerts & TWAI_ALERT_ABOVE_ERR_WARN) {
-      ESP_LOGI(WDTAG, "Above warning level");
+      ESP_LOGI(BUSTAG, "Above warning level");
     }
     if (alerts & TWAI_ALERT_ERR_PASS) {
-      ESP_LOGI(WDTAG, "Entered Error Passive state");
+      ESP_LOGI(BUSTAG, "Entered Error Passive state");
     }
     if (alerts & TWAI_ALERT_ERR_ACTIVE) {
-      ESP_LOGI(WDTAG, "Returned to Error Active state");
+      ESP_LOGI(BUSTAG, "Returned to Error Active state");
     }
     if (alerts & TWAI_ALERT_BELOW_ERR_WARN) {
-      ESP_LOGI(WDTAG, "Below warning level");
+      ESP_LOGI(BUSTAG, "Below warning level");
     }
     if (alerts & TWAI_ALERT_BUS_OFF) {
-      ESP_LOGI(WDTAG, "Bus Off state, initiating recovery");
+      ESP_LOGI(BUSTAG, "Bus Off state, initiating recovery");
 
       twai_reconfigure_alerts(TWAI_ALERT_BUS_RECOVERED, NULL);
       twai_initiate_recovery(); // Needs 128 occurrences of bus free signal
     }
     if (alerts & TWAI_ALERT_BUS_RECOVERED) {
-      ESP_LOGI(WDTAG, "Bus Recovered");
+      ESP_LOGI(BUSTAG, "Bus Recovered");
       if (twai_start() != ESP_OK) {
-        ESP_LOGE(WDTAG, "Failed to start TWAI after recovery");
+        ESP_LOGE(BUSTAG, "Failed to start TWAI after recovery");
       }
       twai_reconfigure_alerts(H42_TWAI_ALERT_FLAGS, NULL);
     }
+    _bus_apply_filter_request(daemon);
+  }
+}
+
+static void _daemon_isotp_timer_cb(void *arg) {
+  _daemon_wake((h42_can_daemon_t *)arg);
+}
+
+/**
+ * @brief Schedule the next isotp_poll().
+ *
+ * @details Consecutive frames are due every STmin (0-2 ms), well below the
+ * FreeRTOS tick, so the deadline is kept by a one-shot esp_timer that wakes
+ * the daemon instead of by the notification wait timeout.
+ *
+ * @return How long the daemon may wait for a notification.
+ */
+static TickType_t _daemon_schedule_poll(h42_can_daemon_t *daemon) {
+  uint32_t deadline_us;
+  // Not running is fine. A timer that fired just now only costs an extra
+  // loop.
+  esp_timer_stop(daemon->isotp_timer);
+  if (isotp_next_poll_us(&daemon->isotp_link, &deadline_us) != ISOTP_RET_OK) {
+    // Idle link. Only a frame or a send request can give us work.
+    return portMAX_DELAY;
+  }
+  int32_t wait_us = (int32_t)(deadline_us - isotp_user_get_us());
+  if (wait_us <= 0) {
+    return 0;
+  }
+  if (esp_timer_start_once(daemon->isotp_timer, (uint64_t)wait_us) != ESP_OK) {
+    // Fall back to tick resolution. Round up, waking early would only spin.
+    const uint32_t tick_us = portTICK_PERIOD_MS * 1000;
+    return (TickType_t)((wait_us + tick_us - 1) / tick_us);
+  }
+  return portMAX_DELAY;
+}
+
+/**
+ * @brief Feed one received frame to the daemon.
+ *
+ * @return false if the master asked us to obtain a new address.
+ */
+static bool _daemon_on_can_frame(h42_can_daemon_t *daemon,
+                                 const twai_message_t *rx_message) {
+  h42_can_address_t dst_address = _msg_dst_addr(rx_message);
+  if (_msg_src_addr(rx_message) != H42_CAN_ADDRESS_MASTER) {
+    // Only interested in messages from the master
+    return true;
+  }
+  if (dst_address != daemon->address &&
+      dst_address != H42_CAN_ADDRESS_BROADCAST) {
+    // This message is for someone else.
+    return true;
+  }
+  if (_msg_type(rx_message) == MSG_TYPE_ADDRESS_REQUEST) {
+    // Master asked us to obtain a new address
+    _daemon_set_state(daemon, DAEMON_STATE_OBTAINING_ADDRESS);
+    return false;
+  }
+  if (dst_address == H42_CAN_ADDRESS_BROADCAST &&
+      _msg_type(rx_message) == MSG_TYPE_BROADCAST_DATA) {
+    _daemon_on_broadcast_data(daemon, rx_message);
+    return true;
+  }
+  if (dst_address == H42_CAN_ADDRESS_BROADCAST) {
+    // Not expecting any other broadcast messages
+    ESP_LOGW(TAG, "Received unexpected broadcast message that is not "
+                  "address request");
+    return true;
+  }
+  if (_msg_type(rx_message) == MSG_TYPE_LINK_PARAMS) {
+    _daemon_on_link_params(daemon, rx_message);
+    return true;
+  }
+  if (_msg_type(rx_message) == MSG_TYPE_DISCOVERY_STATUS) {
+    _daemon_on_discovery_status(daemon, rx_message);
+    return true;
+  }
+  isotp_on_can_message(&daemon->isotp_link, rx_message->data,
+                       rx_message->data_length_code);
+  _daemon_check_rx_result(daemon);
+
+  // Collect a completed message before the next frame, which may start a
+  // new one in the same buffer.
+  uint8_t *payload;
+  uint16_t out_size;
+  if (isotp_receive_in_place(&daemon->isotp_link, &payload, &out_size) ==
+      ISOTP_RET_OK) {
+    // payload points into daemon->isotp_recv_packet, so there is nothing to
+    // copy.
+    (void)payload;
+    _daemon_on_packet_received(daemon, out_size);
+    _daemon_rx_flow_feedback(daemon, false);
   }
+  return true;
 }
 
 // ISOTP
@@ -400,8 +1157,15 @@ void vTaskCanTransportDaemon(void *pvParameters) {
   h42_out_packet_t send_item = {0};
   for (;;) {
     if (_daemon_get_state(daemon) == DAEMON_STATE_OBTAINING_ADDRESS) {
+      // The transfer in progress goes with the link, and packets queued for
+      // the old address must not end up in the new connection's stream.
+      _out_packet_send_finish(daemon, &send_item, ESP_FAIL);
       err = _daemon_obtain_address(daemon);
       if (err == ESP_OK) {
+        h42_out_packet_t item;
+        while (_daemon_out_packet_queue_pop(daemon, &item)) {
+          _out_packet_send_finish(daemon, &item, ESP_FAIL);
+        }
         _daemon_set_state(daemon, DAEMON_STATE_SERVING);
       } else {
         // Never actually happens.
@@ -411,55 +1175,23 @@ void vTaskCanTransportDaemon(void *pvParameters) {
       }
     }
 
-    // Enter ISO-TP
-    // Spin faster if we are sending
-    uint32_t recv_timeout =
-        daemon->isotp_link.send_status == ISOTP_SEND_STATUS_INPROGRESS ? 5 : 50;
-    esp_err_t err = twai_receive(&rx_message, pdMS_TO_TICKS(recv_timeout));
-    if (err == ESP_OK) {
-      h42_can_address_t dst_address = _msg_dst_addr(&rx_message);
-      if (_msg_src_addr(&rx_message) != H42_CAN_ADDRESS_MASTER) {
-        // Only interested in messages from the master
-        continue;
-      }
-      if (dst_address != daemon->address &&
-          dst_address != H42_CAN_ADDRESS_BROADCAST) {
-        // This message is for someone else.
-        continue;
-      }
-      if (_msg_type(&rx_message) == MSG_TYPE_ADDRESS_REQUEST) {
-        // Master asked us to obtain a new address
-        _daemon_set_state(daemon, DAEMON_STATE_OBTAINING_ADDRESS);
-        // If there is a packet in progress - it will fail.
-        _out_packet_send_finish(&send_item, ESP_FAIL);
-        continue;
-      }
-      if (dst_address == H42_CAN_ADDRESS_BROADCAST) {
-        // Not expecting any other broadcast messages
-        ESP_LOGW(TAG, "Received unexpected broadcast message that is not "
-                      "address request");
-        continue;
-      }
-      isotp_on_can_message(&daemon->isotp_link, rx_message.data,
-                           rx_message.data_length_code);
+    // Sleep until a frame arrives, a packet is queued for sending or the
+    // ISO-TP link has a frame or timeout due.
+    ulTaskNotifyTake(pdTRUE, _daemon_schedule_poll(daemon));
 
-    } else if (err == ESP_ERR_INVALID_STATE) {
-      ESP_LOGE(TAG, "CAN driver is not installed");
-      vTaskDelay(pdMS_TO_TICKS(10 * 1000));
+    bool serving = true;
+    while (serving &&
+           xQueueReceive(daemon->rx_frame_queue, &rx_message, 0) == pdTRUE) {
+      serving = _daemon_on_can_frame(daemon, &rx_message);
+    }
+    if (!serving) {
+      // If there is a packet in progress - it will fail.
+      _out_packet_send_finish(daemon, &send_item, ESP_FAIL);
+      continue;
     }
 
     isotp_poll(&daemon->isotp_link);
-    uint16_t out_size;
-    int ret = isotp_receive(&daemon->isotp_link, daemon->isotp_recv_buf,
-                            sizeof(daemon->isotp_recv_buf), &out_size);
-    if (ret == ISOTP_RET_OK) {
-      // We have received an ISOTP message!
-      // debug stuff!!
-      // uint16_t i = daemon->isotp_recv_buf[0] | (daemon->isotp_recv_buf[1]
-      // <<8); ESP_LOGI(TAG, "Packet received. Size: %d", out_size); end of
-      // debug stuff
-      _daemon_on_packet_received(daemon, out_size);
-    }
+    _daemon_check_rx_result(daemon);
 
     if (daemon->isotp_last_send_status == ISOTP_SEND_STATUS_INPROGRESS &&
         daemon->isotp_link.send_status != ISOTP_SEND_STATUS_INPROGRESS) {
@@ -471,21 +1203,30 @@ void vTaskCanTransportDaemon(void *pvParameters) {
         ESP_LOGE(TAG, "Failed to send. send_protocol_result:%d",
                  daemon->isotp_link.send_protocol_result);
       }
-      _out_packet_send_finish(&send_item, esp_err);
+      _out_packet_send_finish(daemon, &send_item, esp_err);
     }
     daemon->isotp_last_send_status = daemon->isotp_link.send_status;
 
     // Check if we have something to send
     if (_daemon_out_packet_queue_pop(daemon, &send_item)) {
-      ret = isotp_send(&daemon->isotp_link, send_item.data, send_item.size);
+      // The link streams consecutive frames straight from the packet, which
+      // is kept in send_item until the transfer completes.
+      uint16_t send_size = h42_packet_size(send_item.packet);
+      daemon->isotp_link.send_arbitration_id = _msg_id_with_priority(
+          daemon->isotp_link.send_arbitration_id, send_item.priority);
+      int ret = isotp_send_in_place(
+          &daemon->isotp_link, h42_packet_data(send_item.packet), send_size);
       if (ret != ISOTP_RET_OK) {
         ESP_LOGE(TAG, "isotp_send failed (%d)", ret);
-        _out_packet_send_finish(&send_item, ESP_FAIL);
-      } else if (send_item.size < 8) {
+        _out_packet_send_finish(daemon, &send_item, ESP_FAIL);
+      } else if (daemon->isotp_link.send_status !=
+                 ISOTP_SEND_STATUS_INPROGRESS) {
         // Send is done in one packet.
-        assert(daemon->isotp_link.send_status != ISOTP_SEND_STATUS_INPROGRESS);
-        _out_packet_send_finish(&send_item, ESP_OK);
+        _out_packet_send_finish(daemon, &send_item, ESP_OK);
       }
+      // The flow control may arrive and the last consecutive frame go out
+      // within the next wake, so completion is checked against this.
+      daemon->isotp_last_send_status = daemon->isotp_link.send_status;
     }
   }
   vTaskDelete(NULL);
@@ -493,19 +1234,39 @@ void vTaskCanTransportDaemon(void *pvParameters) {
 /**
  * h42_can_daemon_start
  */
-esp_err_t h42_can_daemon_start() {
+esp_err_t h42_can_daemon_start(const h42_can_daemon_config_t *config) {
   h42_can_daemon_t *daemon = &g_daemon;
 
   ESP_LOGI(TAG, "Starting CAN transport daemon");
+  if (config == NULL || config->tx_queue_depth == 0 ||
+      config->rx_st_min_us > 127000) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  daemon->config = *config;
+  _daemon_reset_flow_params(daemon);
 
   // Initialize in packet queue
-  daemon->in_packet_queue = h42_packet_queue_create(32, 16 * 1024);
+  daemon->in_packet_queue = h42_packet_queue_create(
+      IN_PACKET_QUEUE_MAX_PACKETS, IN_PACKET_QUEUE_MAX_BYTES);
   if (daemon->in_packet_queue == NULL) {
     ESP_LOGE(TAG, "Failed to create packet queue");
     return ESP_ERR_NO_MEM;
   }
+  // Sized for a full queue plus the packets being reassembled, unicast and
+  // broadcast, and the one lent to the reader. A mix of medium packets may run
+  // a class out before the byte budget, the master then waits, see
+  // _daemon_isotp_recv_buffer().
+  daemon->in_packet_pool =
+      h42_packet_pool_create(IN_PACKET_QUEUE_MAX_PACKETS + 3,
+                             IN_PACKET_QUEUE_MAX_BYTES, ISOTP_BUFSIZE);
+  if (daemon->in_packet_pool == NULL) {
+    ESP_LOGE(TAG, "Failed to create packet pool");
+    return ESP_ERR_NO_MEM;
+  }
   daemon->last_popped_packet = NULL;
   daemon->last_popped_packet_read_pos = 0;
+  daemon->isotp_recv_packet = NULL;
+  daemon->bcast_packet = NULL;
 
   // Initialize state
   daemon->state = xEventGroupCreate();
@@ -517,29 +1278,62 @@ esp_err_t h42_can_daemon_start() {
 
   // Initialize ISO-TP
   _daemon_isotp_reset(daemon);
+  daemon->rx_frame_queue =
+      xQueueCreate(RX_FRAME_QUEUE_DEPTH, sizeof(twai_message_t));
+  if (daemon->rx_frame_queue == NULL) {
+    ESP_LOGE(TAG, "Failed to create rx frame queue");
+    return ESP_ERR_NO_MEM;
+  }
+  daemon->rx_frame_drops = 0;
+  daemon->filter_request_queue = xQueueCreate(1, sizeof(h42_can_address_t));
+  daemon->filter_done = xSemaphoreCreateBinary();
+  if (daemon->filter_request_queue == NULL || daemon->filter_done == NULL) {
+    ESP_LOGE(TAG, "Failed to create address filter queue");
+    return ESP_ERR_NO_MEM;
+  }
+  // The driver is installed without an address.
+  daemon->filter_address = H42_CAN_ADDRESS_BROADCAST;
+  const esp_timer_create_args_t isotp_timer_args = {
+      .callback = _daemon_isotp_timer_cb,
+      .arg = daemon,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = "h42_isotp",
+  };
+  if (esp_timer_create(&isotp_timer_args, &daemon->isotp_timer) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to create ISO-TP timer");
+    return ESP_ERR_NO_MEM;
+  }
 
-  // Init send queue
-  daemon->out_packet_queue = xQueueCreate(1, sizeof(h42_out_packet_t));
+  // Init send queue. One more packet than the queue holds is in flight.
+  daemon->out_packet_queue =
+      xQueueCreate(config->tx_queue_depth, sizeof(h42_out_packet_t));
   if (daemon->out_packet_queue == NULL) {
     ESP_LOGE(TAG, "Failed to create send queue");
-    vTaskDelete(NULL);
+    return ESP_ERR_NO_MEM;
   }
-
-  ESP_LOGI(TAG, "Queue created. Item size: %d", sizeof(h42_out_packet_t));
-
-  // Start the watchdog task
-  if (xTaskCreate(vTaskCanBusWatchdog, "can_bus_watchdog", 4096, daemon, 5,
-                  NULL) != pdPASS) {
-    ESP_LOGE(TAG, "Failed start bus watchdog task");
+  daemon->out_packet_pool = h42_packet_pool_create(
+      config->tx_queue_depth + 1, OUT_PACKET_POOL_MAX_BYTES, ISOTP_BUFSIZE);
+  if (daemon->out_packet_pool == NULL) {
+    ESP_LOGE(TAG, "Failed to create send packet pool");
     return ESP_ERR_NO_MEM;
   }
 
+  ESP_LOGI(TAG, "Send queue created. Depth: %d, async: %d",
+           (int)config->tx_queue_depth, config->tx_async);
+
   // Start the daemon task
   if (xTaskCreate(vTaskCanTransportDaemon, "can_transport_daemon",
-                  4096 + sizeof(h42_out_packet_t), daemon, 5, NULL) != pdPASS) {
+                  4096, daemon, 5, &daemon->daemon_task) != pdPASS) {
     ESP_LOGE(TAG, "Failed start transport daemon task");
     return ESP_ERR_NO_MEM;
   }
 
+  // Start the bus task
+  if (xTaskCreate(vTaskCanBusIo, "can_bus_io", 4096, daemon, 5, NULL) !=
+      pdPASS) {
+    ESP_LOGE(TAG, "Failed start bus task");
+    return ESP_ERR_NO_MEM;
+  }
+
   return ESP_OK;
 }
@@ -1,3 +1,4 @@
+#include "h42_can_types.h"
 #include "isotp.h"
 #include "isotp_defines.h"
 #include "isotp_user.h"
@@ -7,6 +8,7 @@
 #include <driver/twai.h>
 #include <esp_log.h>
 #include <esp_random.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
@@ -27,8 +29,16 @@ int isotp_user_send_can(const uint32_t arbitration_id, const uint8_t *data,
       .data_length_code = size,
   };
 
-  uint32_t r = esp_random() & 0x1FE00000;
-  tx_message.identifier |= r;
+  if (size > TWAI_FRAME_MAX_DLC) {
+    ESP_LOGE(TAG, "TWAI can't send %d byte CAN FD frames", size);
+    return ISOTP_RET_LENGTH;
+  }
+
+  // Flow control holds up the other side's transfer, so it goes first.
+  if (size > 0 && (data[0] >> 4) == ISOTP_PCI_TYPE_FLOW_CONTROL_FRAME) {
+    tx_message.identifier &= ~H42_CAN_ID_PRIORITY_MASK;
+  }
+  tx_message.identifier |= esp_random() & H42_CAN_ID_RANDOM_MASK;
 
   memcpy(tx_message.data, data, size);
   esp_err_t err = twai_transmit(&tx_message, portMAX_DELAY);
@@ -39,7 +49,6 @@ int isotp_user_send_can(const uint32_t arbitration_id, const uint8_t *data,
   return ISOTP_RET_OK;
 }
 
-uint32_t isotp_user_get_us(void) {
-  TickType_t t = xTaskGetTickCount();
-  return pdTICKS_TO_MS(t) * 1000;
-}
+// Microsecond clock, so STmin is not rounded up to FreeRTOS ticks. isotp-c
+// compares times with wraparound, so truncating to 32 bits is fine.
+uint32_t isotp_user_get_us(void) { return (uint32_t)esp_timer_get_time(); }
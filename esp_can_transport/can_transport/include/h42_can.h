@@ -1,17 +1,102 @@
 #pragma once
 
+#include "h42_can_daemon.h"
 #include "h42_can_types.h"
 
 #include <esp_err.h>
 #include <esp_transport.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-esp_err_t h42_can_init();
+typedef struct h42_can_config {
+  // Bus speed in bit/s. One of 20000, 25000, 50000, 100000, 125000, 250000,
+  // 500000, 800000 or 1000000.
+  uint32_t bitrate;
+  int tx_gpio;
+  int rx_gpio;
+  // Program the TWAI acceptance filter to frames from the master to this
+  // node, so traffic of other nodes never reaches the daemon.
+  bool hw_filter;
+  // Send PUBLISH topics as 2 byte aliases if the master supports it, see
+  // h42_mqtt_compact.h.
+  bool compact_mqtt;
+  // Compress PUBLISH packets with large payloads, like Home Assistant
+  // discovery configs, if the master supports it. Costs about 3.5 KB of heap
+  // together with compact_mqtt.
+  bool compress_mqtt;
+  // Let the master cache Home Assistant discovery configs, see
+  // h42_can_discovery_check().
+  bool discovery_cache;
+  // Answer most PINGREQs on the node and leave the broker keepalive to the
+  // master, if it supports it, see h42_mqtt_keepalive.h.
+  bool keepalive_proxy;
+  // Take MQTT packets the master has for several nodes from one broadcast,
+  // if it supports it.
+  bool broadcast;
+  h42_can_daemon_config_t daemon;
+} h42_can_config_t;
+
+// esp-mqtt treats the transport like a TCP socket, a completed write only
+// means the data was buffered. Hence the async sends. A send that fails later
+// fails the next write, and esp-mqtt reconnects.
+#define H42_CAN_CONFIG_DEFAULT()                                               \
+  {                                                                            \
+      .bitrate = 20000,                                                        \
+      .tx_gpio = 21,                                                           \
+      .rx_gpio = 20,                                                           \
+      .hw_filter = false,                                                      \
+      .compact_mqtt = false,                                                   \
+      .compress_mqtt = false,                                                  \
+      .discovery_cache = false,                                                \
+      .keepalive_proxy = false,                                                \
+      .broadcast = false,                                                      \
+      .daemon =                                                                \
+          {                                                                    \
+              .tx_queue_depth = 4,                                             \
+              .tx_async = true,                                                \
+              .rx_block_size = 8,                                              \
+              .rx_st_min_us = 2000,                                            \
+              .features = 0,                                                   \
+              .set_address_filter = NULL,                                      \
+          },                                                                   \
+  }
+
+/**
+ * @brief Install the TWAI driver and start the daemon.
+ *
+ * @details Only the first call does anything, later ones return ESP_OK. This
+ * lets an application pass its config before esp-mqtt calls h42_can_init(NULL)
+ * when it creates the transport.
+ *
+ * @param config NULL for H42_CAN_CONFIG_DEFAULT(). daemon.set_address_filter
+ * is filled in from hw_filter.
+ */
+esp_err_t h42_can_init(const h42_can_config_t *config);
 esp_transport_handle_t h42_can_make_esp_transport();
 
+/**
+ * @brief Ask the master whether it has the node's discovery set.
+ *
+ * @details Call once the MQTT connection is up, before sending discovery.
+ * set_hash has to change whenever any discovery config could. If the master
+ * has the set it replays it to the broker itself and `cached` is set: skip
+ * sending discovery. Otherwise send it as usual and call
+ * h42_can_discovery_commit() once all of it has been published. The master
+ * records retained PUBLISH packets to topics ending in /config in between.
+ *
+ * @return ESP_ERR_NOT_SUPPORTED without discovery_cache or a master that
+ * supports it, ESP_ERR_TIMEOUT if the master did not answer,
+ * ESP_ERR_INVALID_STATE while esp-mqtt is part way through writing a packet:
+ * try again.
+ */
+esp_err_t h42_can_discovery_check(uint32_t set_hash, bool *cached,
+                                  int timeout_ms);
+// The discovery set of the last h42_can_discovery_check() has been published.
+esp_err_t h42_can_discovery_commit(uint32_t set_hash, int timeout_ms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,19 +4,80 @@
 extern "C" {
 #endif
 #include "h42_can_types.h"
+#include "h42_packet_queue.h"
 #include <esp_err.h>
+#include <stdbool.h>
 
-esp_err_t h42_can_daemon_start();
+typedef struct h42_can_daemon_config {
+  // Number of packets that can wait behind the one being transmitted.
+  uint32_t tx_queue_depth;
+  // If true h42_can_daemon_send() returns once the packet is queued instead
+  // of waiting for the ISO-TP transfer to complete. A transfer that fails
+  // then fails every send and poll_write until the next connect.
+  bool tx_async;
+  // Flow control this node proposes to the master for receiving. The master
+  // may override it, and the STmin backs off while frames are being lost.
+  // A block size of 0 lets the master send a whole message without waiting.
+  uint8_t rx_block_size;
+  uint32_t rx_st_min_us;
+  // H42_CAN_FEATURE_* bits to ask the master for with the link params.
+  uint8_t features;
+  // Called by the bus task, while no other task uses the TWAI driver, to
+  // narrow the hardware acceptance filter to frames for `address`.
+  // H42_CAN_ADDRESS_BROADCAST means no address has been assigned yet. NULL
+  // keeps the filter the driver was installed with.
+  esp_err_t (*set_address_filter)(h42_can_address_t address);
+} h42_can_daemon_config_t;
+
+#define H42_CAN_DAEMON_CONFIG_DEFAULT()                                        \
+  {                                                                            \
+      .tx_queue_depth = 4,                                                     \
+      .tx_async = false,                                                       \
+      .rx_block_size = 8,                                                      \
+      .rx_st_min_us = 2000,                                                    \
+      .features = 0,                                                           \
+      .set_address_filter = NULL,                                              \
+  }
+
+esp_err_t h42_can_daemon_start(const h42_can_daemon_config_t *config);
 esp_err_t h42_can_daemon_recv(uint8_t *buf, uint32_t buf_size,
                                   uint32_t *recv_size, int timeout_ms);
+// Zero-copy receive. Caller owns the packet and must h42_packet_free() it.
+esp_err_t h42_can_daemon_recv_packet(h42_packet_handle_t *packet,
+                                     int timeout_ms);
+// With H42_CAN_PRIORITY_STATE.
 esp_err_t h42_can_daemon_send(const uint8_t *buf, uint32_t buf_size,
                                   int timeout_ms);
+// The packet's frames go out with `priority` in their CAN ID. Packets still
+// leave in the order they are sent.
+esp_err_t h42_can_daemon_send_priority(const uint8_t *buf, uint32_t buf_size,
+                                       h42_can_priority_t priority,
+                                       int timeout_ms);
+// Stream write of any size. buf goes out as consecutive packets of at most
+// h42_max_packet_size() bytes, so only one packet is buffered at a time. On
+// error `written` tells how much of buf was sent before.
+esp_err_t h42_can_daemon_write(const uint8_t *buf, uint32_t buf_size,
+                               uint32_t *written, int timeout_ms);
+esp_err_t h42_can_daemon_write_priority(const uint8_t *buf, uint32_t buf_size,
+                                        h42_can_priority_t priority,
+                                        uint32_t *written, int timeout_ms);
 esp_err_t h42_can_daemon_connect(int timeout_ms);
 // Needed for esp_transport
 esp_err_t h42_can_daemon_poll_read(int timeout_ms);
 esp_err_t h42_can_daemon_poll_write(int timeout_ms);
 
 uint16_t h42_max_packet_size();
+// Features the master granted for the current address, 0 until it answered
+// the link params.
+uint8_t h42_can_daemon_link_features(void);
+/**
+ * @brief Wait for the master's answer to a discovery check of set_hash.
+ *
+ * @details Answers for other hashes are dropped. One waiting task at a time.
+ */
+esp_err_t h42_can_daemon_wait_discovery_status(uint32_t set_hash, bool *cached,
+                                               int timeout_ms);
+void h42_can_daemon_get_rx_pool_stats(h42_packet_pool_stats_t *stats);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
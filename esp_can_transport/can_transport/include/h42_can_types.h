@@ -3,3 +3,42 @@
 #include <stdint.h>
 
 typedef uint8_t h42_can_address_t;
+
+#define H42_CAN_ADDRESS_MASTER 0x00
+#define H42_CAN_ADDRESS_BROADCAST 0xFF
+
+// Arbitration priority of a frame, the top bits of its CAN ID. The lowest
+// value wins arbitration, so a switch toggled on one node goes out before the
+// discovery configs another node is sending.
+typedef enum {
+  // Link management, ISO-TP flow control and MQTT packets other than PUBLISH.
+  H42_CAN_PRIORITY_CONTROL = 0,
+  // PUBLISH to a command topic, something a user just asked for.
+  H42_CAN_PRIORITY_COMMAND = 1,
+  // Any other PUBLISH.
+  H42_CAN_PRIORITY_STATE = 2,
+  // Discovery configs and logs.
+  H42_CAN_PRIORITY_BULK = 3,
+} h42_can_priority_t;
+
+#define H42_CAN_ID_PRIORITY_SHIFT 26
+#define H42_CAN_ID_PRIORITY_MASK (0x7u << H42_CAN_ID_PRIORITY_SHIFT)
+// Random bits below the priority, see h42_can_daemon.c.
+#define H42_CAN_ID_RANDOM_MASK (0x1Fu << 21)
+
+// Optional protocol features, negotiated with MSG_TYPE_LINK_PARAMS.
+// The MQTT stream to the master uses topic aliases of h42_mqtt_compact.h.
+#define H42_CAN_FEATURE_COMPACT_MQTT (1u << 0)
+// The MQTT stream to the master uses compressed PUBLISH packets of
+// h42_mqtt_compact.h.
+#define H42_CAN_FEATURE_COMPRESSION (1u << 1)
+// The master caches the node's Home Assistant discovery configs and replays
+// them to the broker when the node's discovery set hash matches, see
+// h42_can_discovery_check().
+#define H42_CAN_FEATURE_DISCOVERY_CACHE (1u << 2)
+// The master keeps the node's broker session alive, the node only pings now
+// and then, see h42_mqtt_keepalive.h.
+#define H42_CAN_FEATURE_KEEPALIVE_PROXY (1u << 3)
+// The master may send MQTT packets meant for several nodes once, as
+// MSG_TYPE_BROADCAST_DATA, instead of a copy to each.
+#define H42_CAN_FEATURE_BROADCAST (1u << 4)
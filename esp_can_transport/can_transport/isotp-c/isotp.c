@@ -7,7 +7,7 @@
 ///////////////////////////////////////////////////////
 
 /* st_min to microsecond */
-static uint8_t isotp_us_to_st_min(uint32_t us) {
+uint8_t isotp_us_to_st_min(uint32_t us) {
     if (us <= 127000) {
         if (us >= 100 && us <= 900) {
             return (uint8_t)(0xF0 + (us / 100));
@@ -20,7 +20,7 @@ static uint8_t isotp_us_to_st_min(uint32_t us) {
 }
 
 /* st_min to usec  */
-static uint32_t isotp_st_min_to_us(uint8_t st_min) {
+uint32_t isotp_st_min_to_us(uint8_t st_min) {
     if (st_min <= 0x7F) {
         return st_min * 1000;
     } else if (st_min >= 0xF1 && st_min <= 0xF9) {
@@ -29,6 +29,42 @@ static uint32_t isotp_st_min_to_us(uint8_t st_min) {
     return 0;
 }
 
+/* smallest valid CAN frame length holding len bytes */
+static uint8_t isotp_frame_length(uint8_t len) {
+    static const uint8_t fd_lengths[] = {12, 16, 20, 24, 32, 48, 64};
+    uint8_t i;
+
+    if (len <= 8) {
+        return len;
+    }
+    for (i = 0; i < sizeof(fd_lengths) - 1; i++) {
+        if (len <= fd_lengths[i]) {
+            break;
+        }
+    }
+    return fd_lengths[i];
+}
+
+/* pads a frame of len bytes to a length the CAN controller can send */
+static uint8_t isotp_pad_frame(IsoTpCanMessage *message, uint8_t len) {
+    uint8_t size = len;
+
+#ifdef ISO_TP_FRAME_PADDING
+    if (size < 8) {
+        size = 8;
+    }
+#endif
+    size = isotp_frame_length(size);
+    (void) memset(message->as.data_array.ptr + len, ISO_TP_FRAME_PADDING_VALUE, size - len);
+
+    return size;
+}
+
+/* largest payload sent as a single frame, frames above 8 bytes carry the length in a second byte */
+static uint16_t isotp_single_frame_capacity(const IsoTpLink *link) {
+    return link->send_frame_size > 8 ? link->send_frame_size - 2 : 7;
+}
+
 static int isotp_send_flow_control(const IsoTpLink* link, uint8_t flow_status, uint8_t block_size, uint32_t st_min_us) {
 
     IsoTpCanMessage message;
@@ -42,12 +78,7 @@ static int isotp_send_flow_control(const IsoTpLink* link, uint8_t flow_status, u
     message.as.flow_control.STmin = isotp_us_to_st_min(st_min_us);
 
     /* send message */
-#ifdef ISO_TP_FRAME_PADDING
-    (void) memset(message.as.flow_control.reserve, ISO_TP_FRAME_PADDING_VALUE, sizeof(message.as.flow_control.reserve));
-    size = sizeof(message);
-#else
-    size = 3;
-#endif
+    size = isotp_pad_frame(&message, 3);
 
     ret = isotp_user_send_can(link->send_arbitration_id, message.as.data_array.ptr, size
     #if defined (ISO_TP_USER_SEND_CAN_ARG)
@@ -63,23 +94,27 @@ static int isotp_send_single_frame(const IsoTpLink* link, uint32_t id) {
 
     IsoTpCanMessage message;
     int ret;
+    uint8_t header;
     uint8_t size = 0;
 
-    /* multi frame message length must greater than 7  */
-    assert(link->send_size <= 7);
+    /* multi frame message length must greater than the single frame capacity */
+    assert(link->send_size <= isotp_single_frame_capacity(link));
 
     /* setup message  */
     message.as.single_frame.type = ISOTP_PCI_TYPE_SINGLE;
-    message.as.single_frame.SF_DL = (uint8_t) link->send_size;
-    (void) memcpy(message.as.single_frame.data, link->send_buffer, link->send_size);
+    if (link->send_size <= 7) {
+        message.as.single_frame.SF_DL = (uint8_t) link->send_size;
+        header = 1;
+    } else {
+        /* CAN FD escape sequence: SF_DL 0, the length follows in the second byte */
+        message.as.single_frame.SF_DL = 0;
+        message.as.data_array.ptr[1] = (uint8_t) link->send_size;
+        header = 2;
+    }
+    (void) memcpy(message.as.data_array.ptr + header, link->send_buffer, link->send_size);
 
     /* send message */
-#ifdef ISO_TP_FRAME_PADDING
-    (void) memset(message.as.single_frame.data + link->send_size, ISO_TP_FRAME_PADDING_VALUE, sizeof(message.as.single_frame.data) - link->send_size);
-    size = sizeof(message);
-#else
-    size = link->send_size + (uint8_t)1;
-#endif
+    size = isotp_pad_frame(&message, (uint8_t) (header + link->send_size));
 
     ret = isotp_user_send_can(link->send_arbitration_id, message.as.data_array.ptr, size
     #if defined (ISO_TP_USER_SEND_CAN_ARG)
@@ -93,26 +128,41 @@ static int isotp_send_single_frame(const IsoTpLink* link, uint32_t id) {
 static int isotp_send_first_frame(IsoTpLink* link, uint32_t id) {
     
     IsoTpCanMessage message;
+    uint8_t header;
+    uint8_t data_length;
     int ret;
 
-    /* multi frame message length must greater than 7  */
-    assert(link->send_size > 7);
+    /* multi frame message length must greater than the single frame capacity */
+    assert(link->send_size > isotp_single_frame_capacity(link));
 
     /* setup message  */
     message.as.first_frame.type = ISOTP_PCI_TYPE_FIRST_FRAME;
-    message.as.first_frame.FF_DL_low = (uint8_t) link->send_size;
-    message.as.first_frame.FF_DL_high = (uint8_t) (0x0F & (link->send_size >> 8));
-    (void) memcpy(message.as.first_frame.data, link->send_buffer, sizeof(message.as.first_frame.data));
+    if (link->send_size <= 0xFFF) {
+        message.as.first_frame.FF_DL_low = (uint8_t) link->send_size;
+        message.as.first_frame.FF_DL_high = (uint8_t) (0x0F & (link->send_size >> 8));
+        header = 2;
+    } else {
+        /* escape sequence: FF_DL 0, the length follows as 32 bit big endian */
+        message.as.first_frame.FF_DL_low = 0;
+        message.as.first_frame.FF_DL_high = 0;
+        message.as.data_array.ptr[2] = 0;
+        message.as.data_array.ptr[3] = 0;
+        message.as.data_array.ptr[4] = (uint8_t) (link->send_size >> 8);
+        message.as.data_array.ptr[5] = (uint8_t) link->send_size;
+        header = 6;
+    }
+    data_length = link->send_frame_size - header;
+    (void) memcpy(message.as.data_array.ptr + header, link->send_buffer, data_length);
 
     /* send message */
-    ret = isotp_user_send_can(id, message.as.data_array.ptr, sizeof(message) 
+    ret = isotp_user_send_can(id, message.as.data_array.ptr, link->send_frame_size
     #if defined (ISO_TP_USER_SEND_CAN_ARG)
     ,link->user_send_can_arg
     #endif
 
     );
     if (ISOTP_RET_OK == ret) {
-        link->send_offset += sizeof(message.as.first_frame.data);
+        link->send_offset += data_length;
         link->send_sn = 1;
     }
 
@@ -126,25 +176,20 @@ static int isotp_send_consecutive_frame(IsoTpLink* link) {
     int ret;
     uint8_t size = 0;
 
-    /* multi frame message length must greater than 7  */
-    assert(link->send_size > 7);
+    /* multi frame message length must greater than the single frame capacity */
+    assert(link->send_size > isotp_single_frame_capacity(link));
 
     /* setup message  */
     message.as.consecutive_frame.type = TSOTP_PCI_TYPE_CONSECUTIVE_FRAME;
     message.as.consecutive_frame.SN = link->send_sn;
     data_length = link->send_size - link->send_offset;
-    if (data_length > sizeof(message.as.consecutive_frame.data)) {
-        data_length = sizeof(message.as.consecutive_frame.data);
+    if (data_length > link->send_frame_size - 1) {
+        data_length = link->send_frame_size - 1;
     }
-    (void) memcpy(message.as.consecutive_frame.data, link->send_buffer + link->send_offset, data_length);
+    (void) memcpy(message.as.data_array.ptr + 1, link->send_buffer + link->send_offset, data_length);
 
     /* send message */
-#ifdef ISO_TP_FRAME_PADDING
-    (void) memset(message.as.consecutive_frame.data + data_length, ISO_TP_FRAME_PADDING_VALUE, sizeof(message.as.consecutive_frame.data) - data_length);
-    size = sizeof(message);
-#else
-    size = data_length + 1;
-#endif
+    size = isotp_pad_frame(&message, (uint8_t) (data_length + 1));
 
     ret = isotp_user_send_can(link->send_arbitration_id,
             message.as.data_array.ptr, size
@@ -163,47 +208,99 @@ static int isotp_send_consecutive_frame(IsoTpLink* link) {
     return ret;
 }
 
+static int isotp_acquire_receive_buffer(IsoTpLink* link, uint16_t size) {
+    uint8_t* buffer;
+
+    if (NULL == link->receive_buffer_provider) {
+        return size > link->receive_buf_size ? ISOTP_RET_OVERFLOW : ISOTP_RET_OK;
+    }
+
+    buffer = link->receive_buffer_provider(link->receive_buffer_provider_arg, size);
+    if (NULL == buffer) {
+        return ISOTP_RET_NOSPACE;
+    }
+    link->receive_buffer = buffer;
+    link->receive_buf_size = size;
+
+    return ISOTP_RET_OK;
+}
+
 static int isotp_receive_single_frame(IsoTpLink* link, const IsoTpCanMessage* message, uint8_t len) {
+    uint8_t header = 1;
+    uint8_t payload_length = message->as.single_frame.SF_DL;
+
+    /* CAN FD escape sequence, the length is in the second byte */
+    if (0 == payload_length && len > 8) {
+        payload_length = message->as.data_array.ptr[1];
+        header = 2;
+    }
+
     /* check data length */
-    if ((0 == message->as.single_frame.SF_DL) || (message->as.single_frame.SF_DL > (len - 1))) {
+    if ((0 == payload_length) || (payload_length > (len - header))) {
         isotp_user_debug("Single-frame length too small.");
         return ISOTP_RET_LENGTH;
     }
 
+    if (ISOTP_RET_OK != isotp_acquire_receive_buffer(link, payload_length)) {
+        isotp_user_debug("Single-frame too large for receiving buffer.");
+        return ISOTP_RET_OVERFLOW;
+    }
+
     /* copying data */
-    (void) memcpy(link->receive_buffer, message->as.single_frame.data, message->as.single_frame.SF_DL);
-    link->receive_size = message->as.single_frame.SF_DL;
+    (void) memcpy(link->receive_buffer, message->as.data_array.ptr + header, payload_length);
+    link->receive_size = payload_length;
     
     return ISOTP_RET_OK;
 }
 
 static int isotp_receive_first_frame(IsoTpLink *link, IsoTpCanMessage *message, uint8_t len) {
-    uint16_t payload_length;
+    uint32_t payload_length;
+    uint8_t header = 2;
+    const uint8_t *ptr = message->as.data_array.ptr;
 
-    if (8 != len) {
-        isotp_user_debug("First frame should be 8 bytes in length.");
+    if (len < 8 || isotp_frame_length(len) != len) {
+        isotp_user_debug("First frame should be a full 8 byte or CAN FD frame.");
         return ISOTP_RET_LENGTH;
     }
 
     /* check data length */
     payload_length = message->as.first_frame.FF_DL_high;
-    payload_length = (uint16_t)(payload_length << 8) + message->as.first_frame.FF_DL_low;
+    payload_length = (payload_length << 8) + message->as.first_frame.FF_DL_low;
+
+    /* escape sequence for messages above 4095 bytes */
+    if (0 == payload_length) {
+        payload_length = ((uint32_t) ptr[2] << 24) | ((uint32_t) ptr[3] << 16) | ((uint32_t) ptr[4] << 8) | ptr[5];
+        header = 6;
+    }
 
     /* should not use multiple frame transmition */
-    if (payload_length <= 7) {
+    if (payload_length <= (len > 8 ? len - 2u : 7u)) {
         isotp_user_debug("Should not use multiple frame transmission.");
         return ISOTP_RET_LENGTH;
     }
-    
-    if (payload_length > link->receive_buf_size) {
+
+    if (payload_length > UINT16_MAX) {
         isotp_user_debug("Multi-frame response too large for receiving buffer.");
         return ISOTP_RET_OVERFLOW;
     }
+    switch (isotp_acquire_receive_buffer(link, (uint16_t) payload_length)) {
+        case ISOTP_RET_OK:
+            break;
+        case ISOTP_RET_NOSPACE:
+            /* keep the frame until the provider has a buffer */
+            (void) memcpy(link->receive_wait_frame, ptr, len);
+            link->receive_wait_frame_len = len;
+            return ISOTP_RET_NOSPACE;
+        default:
+            isotp_user_debug("Multi-frame response too large for receiving buffer.");
+            return ISOTP_RET_OVERFLOW;
+    }
     
     /* copying data */
-    (void) memcpy(link->receive_buffer, message->as.first_frame.data, sizeof(message->as.first_frame.data));
-    link->receive_size = payload_length;
-    link->receive_offset = sizeof(message->as.first_frame.data);
+    (void) memcpy(link->receive_buffer, ptr + header, len - header);
+    link->receive_size = (uint16_t) payload_length;
+    link->receive_offset = len - header;
+    link->receive_frame_size = len;
     link->receive_sn = 1;
 
     return ISOTP_RET_OK;
@@ -219,8 +316,8 @@ static int isotp_receive_consecutive_frame(IsoTpLink *link, IsoTpCanMessage *mes
 
     /* check data length */
     remaining_bytes = link->receive_size - link->receive_offset;
-    if (remaining_bytes > sizeof(message->as.consecutive_frame.data)) {
-        remaining_bytes = sizeof(message->as.consecutive_frame.data);
+    if (remaining_bytes > link->receive_frame_size - 1) {
+        remaining_bytes = link->receive_frame_size - 1;
     }
     if (remaining_bytes > len - 1) {
         isotp_user_debug("Consecutive frame too short.");
@@ -228,7 +325,7 @@ static int isotp_receive_consecutive_frame(IsoTpLink *link, IsoTpCanMessage *mes
     }
 
     /* copying data */
-    (void) memcpy(link->receive_buffer + link->receive_offset, message->as.consecutive_frame.data, remaining_bytes);
+    (void) memcpy(link->receive_buffer + link->receive_offset, message->as.data_array.ptr + 1, remaining_bytes);
 
     link->receive_offset += remaining_bytes;
     if (++(link->receive_sn) > 0x0F) {
@@ -256,10 +353,44 @@ static int isotp_receive_flow_control_frame(IsoTpLink *link, IsoTpCanMessage *me
 ///                 PUBLIC FUNCTIONS                ///
 ///////////////////////////////////////////////////////
 
+/* ends the current send. A buffer lent by isotp_send_in_place goes back to the caller */
+static void isotp_send_end(IsoTpLink *link, uint8_t status) {
+    link->send_status = status;
+    if (link->send_in_place) {
+        link->send_buffer = NULL;
+        link->send_buf_size = 0;
+        link->send_in_place = 0;
+    }
+}
+
 int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size) {
     return isotp_send_with_id(link, link->send_arbitration_id, payload, size);
 }
 
+int isotp_send_in_place(IsoTpLink *link, uint8_t payload[], uint16_t size) {
+    if (link == 0x0) {
+        isotp_user_debug("Link is null!");
+        return ISOTP_RET_ERROR;
+    }
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        isotp_user_debug("Abort previous message, transmission in progress.\n");
+        return ISOTP_RET_INPROGRESS;
+    }
+
+    /* send straight from the caller's buffer */
+    link->send_buffer = payload;
+    link->send_buf_size = size;
+    link->send_in_place = 1;
+
+    int ret = isotp_send_with_id(link, link->send_arbitration_id, payload, size);
+    if (ISOTP_SEND_STATUS_INPROGRESS != link->send_status) {
+        /* single frame sent, or nothing */
+        isotp_send_end(link, link->send_status);
+    }
+    return ret;
+}
+
 int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], uint16_t size) {
     int ret;
 
@@ -289,9 +420,11 @@ int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], ui
     /* copy into local buffer */
     link->send_size = size;
     link->send_offset = 0;
-    (void) memcpy(link->send_buffer, payload, size);
+    if (payload != link->send_buffer) {
+        (void) memcpy(link->send_buffer, payload, size);
+    }
  
-    if (link->send_size < 8) {
+    if (link->send_size <= isotp_single_frame_capacity(link)) {
         /* send single frame */
         ret = isotp_send_single_frame(link, id);
     } else {
@@ -313,11 +446,59 @@ int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], ui
     return ret;
 }
 
+/* answers a first frame, the one held in receive_wait_frame when retried */
+static void isotp_handle_first_frame(IsoTpLink *link, IsoTpCanMessage *message, uint8_t len) {
+    int ret = isotp_receive_first_frame(link, message, len);
+    uint32_t now = isotp_user_get_us();
+
+    /* no buffer yet, hold the sender */
+    if (ISOTP_RET_NOSPACE == ret) {
+        if (ISOTP_RECEIVE_STATUS_WAIT != link->receive_status) {
+            link->receive_status = ISOTP_RECEIVE_STATUS_WAIT;
+            link->receive_wait_end = now + ISO_TP_RECEIVE_WAIT_MAX_US;
+            link->receive_timer_cr = now;
+        }
+        if (IsoTpTimeAfter(now, link->receive_wait_end)) {
+            isotp_user_debug("Receive buffer provider has no buffer available.");
+            ret = ISOTP_RET_OVERFLOW;
+        } else {
+            if (!IsoTpTimeAfter(link->receive_timer_cr, now)) {
+                isotp_send_flow_control(link, PCI_FLOW_STATUS_WAIT, 0, 0);
+                link->receive_timer_cr = now + ISO_TP_RECEIVE_WAIT_FC_US;
+            }
+            link->receive_timer_wait = now + ISO_TP_RECEIVE_WAIT_RETRY_US;
+            return;
+        }
+    }
+
+    /* if overflow happened */
+    if (ISOTP_RET_OVERFLOW == ret) {
+        /* update protocol result */
+        link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
+        /* change status */
+        link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+        /* send error message */
+        isotp_send_flow_control(link, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
+        return;
+    }
+
+    /* if receive successful */
+    if (ISOTP_RET_OK == ret) {
+        /* change status */
+        link->receive_status = ISOTP_RECEIVE_STATUS_INPROGRESS;
+        /* send fc frame */
+        link->receive_bs_count = link->receive_block_size;
+        isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, link->receive_st_min_us);
+        /* refresh timer cs */
+        link->receive_timer_cr = now + ISO_TP_DEFAULT_RESPONSE_TIMEOUT_US;
+    }
+}
+
 void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
     IsoTpCanMessage message;
     int ret;
     
-    if (len < 2 || len > 8) {
+    if (len < 2 || len > ISO_TP_MAX_FRAME_SIZE) {
         return;
     }
 
@@ -350,31 +531,13 @@ void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
                 link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_OK;
             }
 
-            /* handle message */
-            ret = isotp_receive_first_frame(link, &message, len);
-
-            /* if overflow happened */
-            if (ISOTP_RET_OVERFLOW == ret) {
-                /* update protocol result */
-                link->receive_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
-                /* change status */
+            /* a new message replaces one waiting for a buffer */
+            if (ISOTP_RECEIVE_STATUS_WAIT == link->receive_status) {
                 link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
-                /* send error message */
-                isotp_send_flow_control(link, PCI_FLOW_STATUS_OVERFLOW, 0, 0);
-                break;
             }
 
-            /* if receive successful */
-            if (ISOTP_RET_OK == ret) {
-                /* change status */
-                link->receive_status = ISOTP_RECEIVE_STATUS_INPROGRESS;
-                /* send fc frame */
-                link->receive_bs_count = ISO_TP_DEFAULT_BLOCK_SIZE;
-                isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN_US);
-                /* refresh timer cs */
-                link->receive_timer_cr = isotp_user_get_us() + ISO_TP_DEFAULT_RESPONSE_TIMEOUT_US;
-            }
-            
+            /* handle message */
+            isotp_handle_first_frame(link, &message, len);
             break;
         }
         case TSOTP_PCI_TYPE_CONSECUTIVE_FRAME: {
@@ -403,10 +566,10 @@ void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
                 if (link->receive_offset >= link->receive_size) {
                     link->receive_status = ISOTP_RECEIVE_STATUS_FULL;
                 } else {
-                    /* send fc when bs reaches limit */
-                    if (0 == --link->receive_bs_count) {
-                        link->receive_bs_count = ISO_TP_DEFAULT_BLOCK_SIZE;
-                        isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, ISO_TP_DEFAULT_ST_MIN_US);
+                    /* send fc when bs reaches limit, never if the sender was told bs 0 */
+                    if (0 != link->receive_bs_count && 0 == --link->receive_bs_count) {
+                        link->receive_bs_count = link->receive_block_size;
+                        isotp_send_flow_control(link, PCI_FLOW_STATUS_CONTINUE, link->receive_bs_count, link->receive_st_min_us);
                     }
                 }
             }
@@ -429,7 +592,7 @@ void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
                 /* overflow */
                 if (PCI_FLOW_STATUS_OVERFLOW == message.as.flow_control.FS) {
                     link->send_protocol_result = ISOTP_PROTOCOL_RESULT_BUFFER_OVFLW;
-                    link->send_status = ISOTP_SEND_STATUS_ERROR;
+                    isotp_send_end(link, ISOTP_SEND_STATUS_ERROR);
                 }
 
                 /* wait */
@@ -438,7 +601,7 @@ void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
                     /* wait exceed allowed count */
                     if (link->send_wtf_count > ISO_TP_MAX_WFT_NUMBER) {
                         link->send_protocol_result = ISOTP_PROTOCOL_RESULT_WFT_OVRN;
-                        link->send_status = ISOTP_SEND_STATUS_ERROR;
+                        isotp_send_end(link, ISOTP_SEND_STATUS_ERROR);
                     }
                 }
 
@@ -450,7 +613,7 @@ void isotp_on_can_message(IsoTpLink* link, const uint8_t* data, uint8_t len) {
                         link->send_bs_remain = message.as.flow_control.BS;
                     }
                     uint32_t message_st_min_us = isotp_st_min_to_us(message.as.flow_control.STmin);
-                    link->send_st_min_us = message_st_min_us > ISO_TP_DEFAULT_ST_MIN_US ? message_st_min_us : ISO_TP_DEFAULT_ST_MIN_US; // prefer as much st_min as possible for stability?
+                    link->send_st_min_us = message_st_min_us > link->send_st_min_floor_us ? message_st_min_us : link->send_st_min_floor_us; // prefer as much st_min as possible for stability?
                     link->send_wtf_count = 0;
                 }
             }
@@ -482,6 +645,30 @@ int isotp_receive(IsoTpLink *link, uint8_t *payload, const uint16_t payload_size
     return ISOTP_RET_OK;
 }
 
+int isotp_receive_in_place(IsoTpLink *link, uint8_t **payload, uint16_t *out_size) {
+    if (ISOTP_RECEIVE_STATUS_FULL != link->receive_status) {
+        return ISOTP_RET_NO_DATA;
+    }
+
+    *payload = link->receive_buffer;
+    *out_size = link->receive_size;
+
+    if (NULL != link->receive_buffer_provider) {
+        /* the buffer now belongs to the caller */
+        link->receive_buffer = NULL;
+        link->receive_buf_size = 0;
+    }
+
+    link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
+
+    return ISOTP_RET_OK;
+}
+
+void isotp_set_receive_buffer_provider(IsoTpLink *link, IsoTpReceiveBufferProvider provider, void *arg) {
+    link->receive_buffer_provider = provider;
+    link->receive_buffer_provider_arg = arg;
+}
+
 void isotp_init_link(IsoTpLink *link, uint32_t sendid, uint8_t *sendbuf, uint16_t sendbufsize, uint8_t *recvbuf, uint16_t recvbufsize) {
     memset(link, 0, sizeof(*link));
     link->receive_status = ISOTP_RECEIVE_STATUS_IDLE;
@@ -491,10 +678,74 @@ void isotp_init_link(IsoTpLink *link, uint32_t sendid, uint8_t *sendbuf, uint16_
     link->send_buf_size = sendbufsize;
     link->receive_buffer = recvbuf;
     link->receive_buf_size = recvbufsize;
+    link->send_frame_size = 8;
+    link->receive_block_size = ISO_TP_DEFAULT_BLOCK_SIZE;
+    link->receive_st_min_us = ISO_TP_DEFAULT_ST_MIN_US;
+    link->send_st_min_floor_us = ISO_TP_DEFAULT_ST_MIN_US;
     
     return;
 }
 
+void isotp_set_flow_params(IsoTpLink *link, uint8_t receive_block_size, uint32_t receive_st_min_us,
+                           uint32_t send_st_min_floor_us) {
+    link->receive_block_size = receive_block_size;
+    link->receive_st_min_us = receive_st_min_us;
+    link->send_st_min_floor_us = send_st_min_floor_us;
+}
+
+int isotp_set_frame_size(IsoTpLink *link, uint8_t frame_size) {
+    if (frame_size < 8 || frame_size > ISO_TP_MAX_FRAME_SIZE || isotp_frame_length(frame_size) != frame_size) {
+        isotp_user_debug("Invalid frame size.");
+        return ISOTP_RET_LENGTH;
+    }
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        return ISOTP_RET_INPROGRESS;
+    }
+
+    link->send_frame_size = frame_size;
+    return ISOTP_RET_OK;
+}
+
+int isotp_next_poll_us(const IsoTpLink *link, uint32_t *deadline_us) {
+    int has_deadline = 0;
+    uint32_t deadline = 0;
+
+    if (ISOTP_SEND_STATUS_INPROGRESS == link->send_status) {
+        /* waiting for flow control: only the bs timeout matters.
+         * timers fire once the clock is strictly after them, hence the + 1 */
+        deadline = link->send_timer_bs + 1;
+        if (ISOTP_INVALID_BS == link->send_bs_remain || link->send_bs_remain > 0) {
+            /* next consecutive frame, right away if there is no separation time */
+            uint32_t next_cf = 0 == link->send_st_min_us ? isotp_user_get_us() : link->send_timer_st + 1;
+            if (IsoTpTimeAfter(deadline, next_cf)) {
+                deadline = next_cf;
+            }
+        }
+        has_deadline = 1;
+    }
+
+    if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
+        if (!has_deadline || IsoTpTimeAfter(deadline, link->receive_timer_cr + 1)) {
+            deadline = link->receive_timer_cr + 1;
+        }
+        has_deadline = 1;
+    }
+
+    if (ISOTP_RECEIVE_STATUS_WAIT == link->receive_status) {
+        if (!has_deadline || IsoTpTimeAfter(deadline, link->receive_timer_wait + 1)) {
+            deadline = link->receive_timer_wait + 1;
+        }
+        has_deadline = 1;
+    }
+
+    if (!has_deadline) {
+        return ISOTP_RET_NO_DATA;
+    }
+    *deadline_us = deadline;
+    return ISOTP_RET_OK;
+}
+
 void isotp_poll(IsoTpLink *link) {
     int ret;
 
@@ -517,22 +768,32 @@ void isotp_poll(IsoTpLink *link) {
 
                 /* check if send finish */
                 if (link->send_offset >= link->send_size) {
-                    link->send_status = ISOTP_SEND_STATUS_IDLE;
+                    isotp_send_end(link, ISOTP_SEND_STATUS_IDLE);
                 }
             } else if (ISOTP_RET_NOSPACE == ret) {
                 /* shim reported that it isn't able to send a frame at present, retry on next call */
             } else {
-                link->send_status = ISOTP_SEND_STATUS_ERROR;
+                isotp_send_end(link, ISOTP_SEND_STATUS_ERROR);
             }
         }
 
         /* check timeout */
         if (IsoTpTimeAfter(isotp_user_get_us(), link->send_timer_bs)) {
             link->send_protocol_result = ISOTP_PROTOCOL_RESULT_TIMEOUT_BS;
-            link->send_status = ISOTP_SEND_STATUS_ERROR;
+            isotp_send_end(link, ISOTP_SEND_STATUS_ERROR);
         }
     }
 
+    /* ask the provider again for a buffer for the held first frame */
+    if (ISOTP_RECEIVE_STATUS_WAIT == link->receive_status &&
+        IsoTpTimeAfter(isotp_user_get_us(), link->receive_timer_wait)) {
+        IsoTpCanMessage message;
+        memcpy(message.as.data_array.ptr, link->receive_wait_frame, link->receive_wait_frame_len);
+        memset(message.as.data_array.ptr + link->receive_wait_frame_len, 0,
+               sizeof(message.as.data_array.ptr) - link->receive_wait_frame_len);
+        isotp_handle_first_frame(link, &message, link->receive_wait_frame_len);
+    }
+
     /* only polling when operation in progress */
     if (ISOTP_RECEIVE_STATUS_INPROGRESS == link->receive_status) {
         
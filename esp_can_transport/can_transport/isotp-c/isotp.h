@@ -14,6 +14,22 @@ extern "C" {
 #include "isotp_config.h"
 #include "isotp_user.h"
 
+/**
+ * @brief Callback used to obtain a receive buffer for an incoming message.
+ *
+ * Called on every single frame and first frame with the exact payload size of the message.
+ * The returned buffer replaces any previously provided buffer that has not been taken with
+ * @code isotp_receive_in_place @endcode yet, so the provider is expected to recycle it.
+ *
+ * @param arg The user argument passed to @code isotp_set_receive_buffer_provider @endcode.
+ * @param size The payload size of the incoming message.
+ *
+ * @return A buffer of at least @p size bytes, or NULL if no buffer is available. The sender of
+ * a multi-frame message is then held with FC WAIT and the provider asked again, see
+ * ISO_TP_RECEIVE_WAIT_FC_US. A single frame is dropped.
+ */
+typedef uint8_t* (*IsoTpReceiveBufferProvider)(void* arg, uint16_t size);
+
 /**
  * @brief Struct containing the data for linking an application to a CAN instance.
  * The data stored in this struct is used internally and may be used by software programs
@@ -27,10 +43,12 @@ typedef struct IsoTpLink {
     uint16_t                    send_buf_size;
     uint16_t                    send_size;
     uint16_t                    send_offset;
+    uint8_t                     send_frame_size; /* TX_DL, 8 for classic CAN, up to ISO_TP_MAX_FRAME_SIZE for CAN FD */
     /* multi-frame flags */
     uint8_t                     send_sn;
     uint16_t                    send_bs_remain; /* Remaining block size */
     uint32_t                    send_st_min_us; /* Separation Time between consecutive frames */
+    uint32_t                    send_st_min_floor_us; /* Lower bound applied to the STmin requested by the receiver */
     uint8_t                     send_wtf_count; /* Maximum number of FC.Wait frame transmissions  */
     uint32_t                    send_timer_st;  /* Last time send consecutive frame */    
     uint32_t                    send_timer_bs;  /* Time until reception of the next FlowControl N_PDU
@@ -38,6 +56,7 @@ typedef struct IsoTpLink {
                                                    end at receive FC */
     int                         send_protocol_result;
     uint8_t                     send_status;
+    uint8_t                     send_in_place;  /* send_buffer is the caller's until the send ends */
     /* receiver paramters */
     uint32_t                    receive_arbitration_id;
     /* message buffer */
@@ -45,14 +64,25 @@ typedef struct IsoTpLink {
     uint16_t                    receive_buf_size;
     uint16_t                    receive_size;
     uint16_t                    receive_offset;
+    uint8_t                     receive_frame_size; /* RX_DL, length of the first frame of the message */
     /* multi-frame control */
     uint8_t                     receive_sn;
     uint8_t                     receive_bs_count; /* Maximum number of FC.Wait frame transmissions  */
+    uint8_t                     receive_block_size; /* BS sent in flow control, 0 for no further flow control */
+    uint32_t                    receive_st_min_us; /* STmin sent in flow control */
     uint32_t                    receive_timer_cr; /* Time until transmission of the next ConsecutiveFrame N_PDU
                                                      start at sending FC, receive CF 
                                                      end at receive FC */
     int                         receive_protocol_result;
     uint8_t                     receive_status;                                                     
+    /* first frame held while waiting for a buffer, see ISO_TP_RECEIVE_WAIT_FC_US */
+    uint8_t                     receive_wait_frame[ISO_TP_MAX_FRAME_SIZE];
+    uint8_t                     receive_wait_frame_len;
+    uint32_t                    receive_timer_wait; /* next provider retry */
+    uint32_t                    receive_wait_end;
+    /* optional zero-copy receive buffer provider */
+    IsoTpReceiveBufferProvider  receive_buffer_provider;
+    void*                       receive_buffer_provider_arg;
 
 #if defined(ISO_TP_USER_SEND_CAN_ARG)
     void*                       user_send_can_arg;
@@ -73,6 +103,39 @@ void isotp_init_link(IsoTpLink *link, uint32_t sendid,
                      uint8_t *sendbuf, uint16_t sendbufsize,
                      uint8_t *recvbuf, uint16_t recvbufsize);
 
+/**
+ * @brief Converts between microseconds and the STmin byte used in flow control frames.
+ */
+uint8_t isotp_us_to_st_min(uint32_t us);
+uint32_t isotp_st_min_to_us(uint8_t st_min);
+
+/**
+ * @brief Sets the flow control parameters of a link at runtime.
+ *
+ * The link starts with ISO_TP_DEFAULT_BLOCK_SIZE and ISO_TP_DEFAULT_ST_MIN_US for all of them. New values
+ * are used from the next flow control frame sent or received, transfers in progress are not restarted.
+ *
+ * @param link The @code IsoTpLink @endcode instance used.
+ * @param receive_block_size Block size asked of the sender, 0 to let it send everything without further flow control.
+ * @param receive_st_min_us Separation time asked of the sender.
+ * @param send_st_min_floor_us Minimum separation time used when sending, whatever the receiver asks for.
+ */
+void isotp_set_flow_params(IsoTpLink *link, uint8_t receive_block_size, uint32_t receive_st_min_us,
+                           uint32_t send_st_min_floor_us);
+
+/**
+ * @brief Sets the CAN frame length used when sending (TX_DL).
+ *
+ * The link starts with 8 byte classic CAN frames. Lengths above 8 need a CAN FD capable isotp_user_send_can,
+ * single frames of up to frame_size - 2 bytes and first frames are then sent with the ISO 15765-2:2016 escape
+ * sequence where needed. Frames of any length up to ISO_TP_MAX_FRAME_SIZE are always accepted on receive.
+ *
+ * @param link The @code IsoTpLink @endcode instance used.
+ * @param frame_size 8, 12, 16, 20, 24, 32, 48 or 64, not above ISO_TP_MAX_FRAME_SIZE.
+ * @return ISOTP_RET_OK, ISOTP_RET_LENGTH for an invalid length or ISOTP_RET_INPROGRESS while a send is in progress.
+ */
+int isotp_set_frame_size(IsoTpLink *link, uint8_t frame_size);
+
 /**
  * @brief Polling function; call this function periodically to handle timeouts, send consecutive frames, etc.
  *
@@ -108,6 +171,16 @@ void isotp_on_can_message(IsoTpLink *link, const uint8_t *data, uint8_t len);
  */
 int isotp_send(IsoTpLink *link, const uint8_t payload[], uint16_t size);
 
+/**
+ * @brief See @link isotp_send @endlink, with the exception that the payload is not copied.
+ *
+ * The link sends directly from @p payload, which replaces the send buffer passed to
+ * @link isotp_init_link @endlink and must stay valid until send_status leaves
+ * ISOTP_SEND_STATUS_INPROGRESS. The link has no send buffer after that, so
+ * @link isotp_send @endlink fails until the next isotp_send_in_place.
+ */
+int isotp_send_in_place(IsoTpLink *link, uint8_t payload[], uint16_t size);
+
 /**
  * @brief See @link isotp_send @endlink, with the exception that this function is used only for functional addressing.
  */
@@ -126,6 +199,50 @@ int isotp_send_with_id(IsoTpLink *link, uint32_t id, const uint8_t payload[], ui
  */
 int isotp_receive(IsoTpLink *link, uint8_t *payload, const uint16_t payload_size, uint16_t *out_size);
 
+/**
+ * @brief Installs a callback which provides receive buffers sized for each incoming message.
+ *
+ * When a provider is set the buffer passed to @link isotp_init_link @endlink is not used for
+ * reception. Pass NULL to restore the default behaviour.
+ *
+ * @param link The @link IsoTpLink @endlink instance used to transceive data.
+ * @param provider The buffer provider callback.
+ * @param arg User argument passed to the provider.
+ */
+void isotp_set_receive_buffer_provider(IsoTpLink *link, IsoTpReceiveBufferProvider provider, void *arg);
+
+/**
+ * @brief Hands out a completely received message without copying it.
+ *
+ * The returned pointer refers to the link's receive buffer. If a receive buffer provider is
+ * installed, ownership of the buffer passes to the caller.
+ *
+ * @param link The @link IsoTpLink @endlink instance used to transceive data.
+ * @param payload A reference to a pointer which will point to the received data.
+ * @param out_size A reference to a variable which will contain the size of the received data.
+ *
+ * @return Possible return values:
+ *      - @link ISOTP_RET_OK @endlink
+ *      - @link ISOTP_RET_NO_DATA @endlink
+ */
+int isotp_receive_in_place(IsoTpLink *link, uint8_t **payload, uint16_t *out_size);
+
+/**
+ * @brief Reports when isotp_poll() next has work to do.
+ *
+ * Lets an event-driven caller sleep until the next consecutive frame is due or a timeout expires
+ * instead of polling periodically. Incoming CAN messages and new sends may move the deadline
+ * earlier, so it must be queried again after each of those.
+ *
+ * @param link The @link IsoTpLink @endlink instance used to transceive data.
+ * @param deadline_us Receives the isotp_user_get_us() time at which isotp_poll() should be called.
+ *
+ * @return Possible return values:
+ *      - @link ISOTP_RET_OK @endlink
+ *      - @link ISOTP_RET_NO_DATA @endlink if the link is idle and needs no polling
+ */
+int isotp_next_poll_us(const IsoTpLink *link, uint32_t *deadline_us);
+
 #ifdef __cplusplus
 }
 #endif
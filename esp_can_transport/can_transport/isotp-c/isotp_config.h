@@ -12,11 +12,25 @@
 //#define ISO_TP_DEFAULT_ST_MIN_US 0
 #define ISO_TP_DEFAULT_ST_MIN_US 2000
 
+/* Largest CAN frame the link handles, 8 for classic CAN only or 64 to allow CAN FD frames.
+ * Every IsoTpCanMessage on the stack is this large.
+ */
+#define ISO_TP_MAX_FRAME_SIZE 64
+
 /* This parameter indicate how many FC N_PDU WTs can be transmitted by the
  * receiver in a row.
  */
 #define ISO_TP_MAX_WFT_NUMBER 1
 
+/* A first frame the receive buffer provider has no buffer for is held with FC WAIT frames, one
+ * every ISO_TP_RECEIVE_WAIT_FC_US, well within the sender's FC timeout. The provider is asked
+ * again every ISO_TP_RECEIVE_WAIT_RETRY_US, and after ISO_TP_RECEIVE_WAIT_MAX_US the message is
+ * refused with FC OVERFLOW.
+ */
+#define ISO_TP_RECEIVE_WAIT_FC_US 1000000
+#define ISO_TP_RECEIVE_WAIT_RETRY_US 10000
+#define ISO_TP_RECEIVE_WAIT_MAX_US 10000000
+
 /* Private: The default timeout to use when waiting for a response during a
  * multi-frame send or receive.
  */
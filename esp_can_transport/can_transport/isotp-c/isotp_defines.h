@@ -2,6 +2,7 @@
 #define ISOTPC_USER_DEFINITIONS_H
 
 #include <stdint.h>
+#include "isotp_config.h"
 
 /**************************************************************
  * compiler specific defines
@@ -62,6 +63,7 @@ typedef enum {
     ISOTP_RECEIVE_STATUS_IDLE,
     ISOTP_RECEIVE_STATUS_INPROGRESS,
     ISOTP_RECEIVE_STATUS_FULL,
+    ISOTP_RECEIVE_STATUS_WAIT, /* first frame held with FC WAIT until the provider has a buffer */
 } IsoTpReceiveStatusTypes;
 
 /* can fram defination */
@@ -177,7 +179,7 @@ typedef struct {
 #endif
 
 typedef struct {
-    uint8_t ptr[8];
+    uint8_t ptr[ISO_TP_MAX_FRAME_SIZE];
 } IsoTpDataArray;
 
 typedef struct {
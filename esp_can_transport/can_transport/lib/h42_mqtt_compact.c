@@ -0,0 +1,539 @@
+#include "h42_mqtt_compact.h"
+
+#include <string.h>
+
+#define MQTT_CONNECT 1
+#define MQTT_PUBLISH 3
+#define COMPACT_REGISTER 0x00
+#define COMPACT_DISCOVERY 0x01
+#define COMPACT_PUBLISH 0xF0
+
+#define MQTT_VARINT_MAX_BYTES 4
+// Fixed header of a compact PUBLISH, alias included.
+#define COMPACT_HEADER_MAX (1 + MQTT_VARINT_MAX_BYTES + 2)
+
+#define LZ_LITERAL_MAX 128
+#define LZ_MATCH_MIN 4
+#define LZ_MATCH_MAX (0x7F + LZ_MATCH_MIN)
+#define LZ_DISTANCE_MAX 0xFFFF
+
+// What Home Assistant discovery configs are made of, as ESPHome sends them.
+// Abbreviated keys first, then the long ones for
+// `discovery_abbreviations: false`. mqtt_compact.py in the bridge has the same
+// bytes, any change breaks nodes and bridges that don't have it.
+// clang-format off
+static const char DICTIONARY[] =
+    "homeassistant/binary_sensor/"
+    "homeassistant/sensor/"
+    "homeassistant/switch/"
+    "homeassistant/light/"
+    "homeassistant/button/"
+    "homeassistant/number/"
+    "homeassistant/select/"
+    "homeassistant/text_sensor/"
+    "/config"
+    "/state"
+    "/command"
+    "/status"
+    "{\"dev_cla\":\"temperature\",\"unit_of_meas\":\"\xc2\xb0" "C\""
+    ",\"dev_cla\":\"humidity\",\"unit_of_meas\":\"%\""
+    ",\"dev_cla\":\"voltage\",\"unit_of_meas\":\"V\""
+    ",\"dev_cla\":\"current\",\"unit_of_meas\":\"A\""
+    ",\"dev_cla\":\"power\",\"unit_of_meas\":\"W\""
+    ",\"dev_cla\":\"battery\""
+    ",\"stat_cla\":\"measurement\""
+    ",\"stat_cla\":\"total_increasing\""
+    ",\"ent_cat\":\"diagnostic\""
+    ",\"ent_cat\":\"config\""
+    ",\"ic\":\"mdi:"
+    ",\"pl_on\":\"ON\",\"pl_off\":\"OFF\""
+    ",\"exp_aft\":"
+    ",\"frc_upd\":true"
+    ",\"min\":0,\"max\":100,\"step\":1,\"mode\":\"auto\""
+    ",\"ops\":[\""
+    ",\"json_attr_t\":\""
+    ",\"val_tpl\":\"{{ value_json."
+    ",\"schema\":\"json\",\"clrm\":true,\"sup_clrm\":[\"brightness\"]"
+    ",\"brightness\":true"
+    "{\"name\":\""
+    "\",\"stat_t\":\""
+    "/state\",\"cmd_t\":\""
+    "/command\",\"avty_t\":\""
+    "/status\",\"uniq_id\":\"ESP"
+    "\",\"obj_id\":\""
+    "\",\"dev\":{\"ids\":\""
+    "\",\"name\":\""
+    "\",\"sw\":\"2024."
+    " (ESPHome 2024."
+    "\",\"mdl\":\"esp32-c3-devkitm-1\""
+    ",\"mdl\":\"esp32dev\""
+    ",\"mf\":\"Espressif\""
+    ",\"sa\":\""
+    ",\"cns\":[[\"mac\",\""
+    "\"]]}}"
+    "{\"device_class\":\""
+    "\",\"unit_of_measurement\":\""
+    "\",\"state_class\":\"measurement\""
+    ",\"entity_category\":\"diagnostic\""
+    ",\"icon\":\"mdi:"
+    ",\"state_topic\":\""
+    "/state\",\"command_topic\":\""
+    "/command\",\"availability_topic\":\""
+    "/status\",\"unique_id\":\"ESP"
+    "\",\"object_id\":\""
+    "\",\"device\":{\"identifiers\":\""
+    "\",\"sw_version\":\""
+    "\",\"model\":\""
+    "\",\"manufacturer\":\"Espressif\""
+    ",\"suggested_area\":\""
+    ",\"connections\":[[\"mac\",\"";
+// clang-format on
+#define DICTIONARY_LEN (sizeof(DICTIONARY) - 1)
+
+enum {
+  // Reading the fixed header into held.
+  PARSER_STATE_HEADER,
+  // Reading the topic of a PUBLISH into held.
+  PARSER_STATE_TOPIC,
+  // Reading a whole PUBLISH that may be compressed into held.
+  PARSER_STATE_PACKET,
+  // Passing the rest of the packet through.
+  PARSER_STATE_BODY,
+  // The stream is not MQTT as we know it, pass everything through.
+  PARSER_STATE_RAW,
+};
+
+static uint32_t _put_varint(uint8_t *out, uint32_t value) {
+  uint32_t n = 0;
+  do {
+    uint8_t b = value & 0x7F;
+    value >>= 7;
+    out[n++] = value ? b | 0x80 : b;
+  } while (value);
+  return n;
+}
+
+static uint32_t _varint_len(uint32_t value) {
+  uint32_t n = 1;
+  while (value >>= 7) {
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Byte i of the dictionary followed by src.
+ */
+static inline uint8_t _window_at(const uint8_t *src, uint32_t i) {
+  return i < DICTIONARY_LEN ? (uint8_t)DICTIONARY[i] : src[i - DICTIONARY_LEN];
+}
+
+/**
+ * @brief Longest match for src[pos..], returns its length.
+ */
+static uint32_t _lz_find_match(const uint8_t *src, uint32_t src_len,
+                               uint32_t pos, uint32_t *distance) {
+  const uint32_t target = DICTIONARY_LEN + pos;
+  uint32_t max_len = src_len - pos;
+  if (max_len > LZ_MATCH_MAX) {
+    max_len = LZ_MATCH_MAX;
+  }
+  uint32_t best_len = 0;
+  if (max_len < LZ_MATCH_MIN) {
+    return 0;
+  }
+  const uint32_t first = target > LZ_DISTANCE_MAX ? target - LZ_DISTANCE_MAX : 0;
+  // Nearest first, so ties go to the most recent data.
+  for (uint32_t candidate = target; candidate-- > first;) {
+    if (_window_at(src, candidate) != src[pos] ||
+        _window_at(src, candidate + best_len) != src[pos + best_len]) {
+      continue;
+    }
+    uint32_t len = 1;
+    // Past target the candidate runs into src itself, which the decoder has
+    // by then.
+    while (len < max_len &&
+           _window_at(src, candidate + len) == src[pos + len]) {
+      len++;
+    }
+    if (len > best_len) {
+      best_len = len;
+      *distance = target - candidate;
+      if (len == max_len) {
+        break;
+      }
+    }
+  }
+  return best_len;
+}
+
+uint32_t h42_mqtt_compress(const uint8_t *src, uint32_t src_len, uint8_t *dst,
+                           uint32_t dst_size) {
+  uint32_t n = 0;
+  uint32_t pos = 0;
+  uint32_t literals = 0;
+  while (pos <= src_len) {
+    uint32_t distance = 0;
+    uint32_t len = pos < src_len ? _lz_find_match(src, src_len, pos, &distance)
+                                 : 0;
+    bool flush = literals == LZ_LITERAL_MAX || pos == src_len ||
+                 (len >= LZ_MATCH_MIN && literals > 0);
+    if (flush && literals > 0) {
+      if (dst_size - n < 1 + literals) {
+        return 0;
+      }
+      dst[n++] = literals - 1;
+      memcpy(dst + n, src + pos - literals, literals);
+      n += literals;
+      literals = 0;
+    }
+    if (pos == src_len) {
+      break;
+    }
+    if (len >= LZ_MATCH_MIN) {
+      if (dst_size - n < 3) {
+        return 0;
+      }
+      dst[n++] = 0x80 | (len - LZ_MATCH_MIN);
+      dst[n++] = distance >> 8;
+      dst[n++] = distance & 0xFF;
+      pos += len;
+    } else {
+      literals++;
+      pos++;
+    }
+  }
+  return n;
+}
+
+uint32_t h42_mqtt_decompress(const uint8_t *src, uint32_t src_len,
+                             uint8_t *dst, uint32_t dst_size) {
+  uint32_t pos = 0;
+  uint32_t n = 0;
+  while (pos < src_len) {
+    uint8_t tag = src[pos++];
+    if (tag < 0x80) {
+      uint32_t len = tag + 1;
+      if (src_len - pos < len || dst_size - n < len) {
+        return 0;
+      }
+      memcpy(dst + n, src + pos, len);
+      pos += len;
+      n += len;
+      continue;
+    }
+    uint32_t len = (tag & 0x7F) + LZ_MATCH_MIN;
+    if (src_len - pos < 2 || dst_size - n < len) {
+      return 0;
+    }
+    uint32_t distance = (src[pos] << 8) | src[pos + 1];
+    pos += 2;
+    if (distance == 0 || distance > DICTIONARY_LEN + n) {
+      return 0;
+    }
+    // Byte by byte, the copy may overlap.
+    for (uint32_t i = 0; i < len; i++, n++) {
+      uint32_t from = DICTIONARY_LEN + n - distance;
+      dst[n] = _window_at(dst, from);
+    }
+  }
+  return n;
+}
+
+static void _encoder_reset_aliases(h42_mqtt_compact_encoder_t *encoder) {
+  encoder->alias_count = 0;
+  encoder->arena_used = 0;
+}
+
+static int _encoder_find_alias(const h42_mqtt_compact_encoder_t *encoder,
+                               const uint8_t *topic, uint16_t len) {
+  for (int i = 0; i < encoder->alias_count; i++) {
+    if (encoder->aliases[i].len == len &&
+        memcmp(encoder->arena + encoder->aliases[i].offset, topic, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int _encoder_add_alias(h42_mqtt_compact_encoder_t *encoder,
+                              const uint8_t *topic, uint16_t len) {
+  if (encoder->alias_count == H42_MQTT_COMPACT_MAX_ALIASES ||
+      H42_MQTT_COMPACT_TOPIC_ARENA_SIZE - encoder->arena_used < len) {
+    return -1;
+  }
+  int alias = encoder->alias_count++;
+  encoder->aliases[alias].offset = encoder->arena_used;
+  encoder->aliases[alias].len = len;
+  memcpy(encoder->arena + encoder->arena_used, topic, len);
+  encoder->arena_used += len;
+  return alias;
+}
+
+static void _encoder_emit(h42_mqtt_compact_encoder_t *encoder,
+                          const uint8_t *data, uint32_t len) {
+  memcpy(encoder->pending + encoder->pending_len, data, len);
+  encoder->pending_len += len;
+}
+
+static void _encoder_start_body(h42_mqtt_compact_encoder_t *encoder,
+                                uint32_t body_left) {
+  encoder->held_len = 0;
+  encoder->body_left = body_left;
+  encoder->state = body_left ? PARSER_STATE_BODY : PARSER_STATE_HEADER;
+}
+
+/**
+ * @brief Pass on what is held and the rest of the packet unchanged.
+ */
+static void _encoder_emit_held(h42_mqtt_compact_encoder_t *encoder) {
+  _encoder_emit(encoder, encoder->held, encoder->held_len);
+  _encoder_start_body(encoder,
+                      encoder->remaining_length -
+                          (encoder->held_len - encoder->header_len));
+}
+
+static void _encoder_on_header(h42_mqtt_compact_encoder_t *encoder,
+                               uint8_t modes) {
+  uint8_t type = encoder->held[0] >> 4;
+  if (type == MQTT_CONNECT) {
+    encoder->modes = modes;
+    _encoder_reset_aliases(encoder);
+  }
+  if (type == MQTT_PUBLISH && encoder->modes &&
+      encoder->remaining_length >= 2) {
+    encoder->state = PARSER_STATE_TOPIC;
+    return;
+  }
+  _encoder_emit_held(encoder);
+}
+
+/**
+ * @brief held has at least the topic of a PUBLISH, or as much of it as fits.
+ * Sends it with an alias if there is one to be had, the rest of held after
+ * it.
+ */
+static void _encoder_emit_publish(h42_mqtt_compact_encoder_t *encoder,
+                                  uint16_t topic_len) {
+  const uint32_t topic_end = encoder->header_len + 2 + topic_len;
+  const uint8_t *topic = encoder->held + encoder->header_len + 2;
+  if (!(encoder->modes & H42_MQTT_COMPACT_ALIASES) ||
+      topic_len > H42_MQTT_COMPACT_TOPIC_MAX || encoder->held_len < topic_end) {
+    _encoder_emit_held(encoder);
+    return;
+  }
+  int alias = _encoder_find_alias(encoder, topic, topic_len);
+  uint8_t header[COMPACT_HEADER_MAX];
+  uint32_t n = 0;
+  if (alias < 0) {
+    alias = _encoder_add_alias(encoder, topic, topic_len);
+    if (alias < 0) {
+      _encoder_emit_held(encoder);
+      return;
+    }
+    header[n++] = COMPACT_REGISTER;
+    n += _put_varint(header + n, 2 + topic_len);
+    header[n++] = alias >> 8;
+    header[n++] = alias & 0xFF;
+    _encoder_emit(encoder, header, n);
+    _encoder_emit(encoder, topic, topic_len);
+    n = 0;
+  }
+  header[n++] = COMPACT_PUBLISH | (encoder->held[0] & 0x0F);
+  n += _put_varint(header + n, encoder->remaining_length - topic_len);
+  header[n++] = alias >> 8;
+  header[n++] = alias & 0xFF;
+  _encoder_emit(encoder, header, n);
+  _encoder_emit(encoder, encoder->held + topic_end,
+                encoder->held_len - topic_end);
+  _encoder_start_body(encoder, encoder->remaining_length -
+                                   (encoder->held_len - encoder->header_len));
+}
+
+/**
+ * @brief A PUBLISH that may be compressed is complete in held.
+ */
+static void _encoder_on_packet(h42_mqtt_compact_encoder_t *encoder,
+                               uint16_t topic_len) {
+  // Compress right into pending, the header goes in front once its size is
+  // known. Anything no smaller than the packet as it is doesn't count.
+  const uint8_t *body = encoder->held + encoder->header_len;
+  uint8_t *dst = encoder->pending + COMPACT_HEADER_MAX;
+  uint32_t len = h42_mqtt_compress(body, encoder->remaining_length, dst,
+                                   encoder->remaining_length - 1);
+  uint32_t header_len = 1 + _varint_len(2 + len) + 2;
+  if (len == 0 || header_len + len >= encoder->held_len) {
+    _encoder_emit_publish(encoder, topic_len);
+    return;
+  }
+  uint8_t *header = dst - header_len;
+  uint32_t n = 0;
+  header[n++] = COMPACT_PUBLISH | (encoder->held[0] & 0x0F);
+  n += _put_varint(header + n, 2 + len);
+  header[n++] = H42_MQTT_COMPACT_ALIAS_COMPRESSED >> 8;
+  header[n++] = H42_MQTT_COMPACT_ALIAS_COMPRESSED & 0xFF;
+  encoder->pending_pos = COMPACT_HEADER_MAX - header_len;
+  encoder->pending_len = COMPACT_HEADER_MAX + len;
+  _encoder_start_body(encoder, 0);
+}
+
+/**
+ * @brief The topic length of a PUBLISH is in held, decide how to go on.
+ */
+static void _encoder_on_topic_len(h42_mqtt_compact_encoder_t *encoder,
+                                  uint16_t topic_len) {
+  const uint32_t packet_id_len = (encoder->held[0] & 0x06) ? 2 : 0;
+  const uint32_t rl = encoder->remaining_length;
+  if ((encoder->modes & H42_MQTT_COMPACT_COMPRESS) &&
+      rl <= H42_MQTT_COMPACT_COMPRESS_MAX_PACKET &&
+      2 + topic_len + packet_id_len + H42_MQTT_COMPACT_COMPRESS_MIN_PAYLOAD <=
+          rl) {
+    encoder->state = PARSER_STATE_PACKET;
+  } else if (!(encoder->modes & H42_MQTT_COMPACT_ALIASES) ||
+             topic_len > H42_MQTT_COMPACT_TOPIC_MAX || 2u + topic_len > rl) {
+    _encoder_emit_held(encoder);
+  } else if (topic_len == 0) {
+    _encoder_emit_publish(encoder, topic_len);
+  }
+}
+
+void h42_mqtt_compact_encoder_init(h42_mqtt_compact_encoder_t *encoder) {
+  encoder->state = PARSER_STATE_HEADER;
+  encoder->modes = 0;
+  encoder->header_len = 0;
+  encoder->held_len = 0;
+  encoder->remaining_length = 0;
+  encoder->body_left = 0;
+  encoder->pending_pos = 0;
+  encoder->pending_len = 0;
+  _encoder_reset_aliases(encoder);
+}
+
+bool h42_mqtt_compact_idle(const h42_mqtt_compact_encoder_t *encoder) {
+  return encoder->state == PARSER_STATE_HEADER && encoder->held_len == 0 &&
+         encoder->pending_len == 0;
+}
+
+void h42_mqtt_compact_discovery(uint8_t op, uint32_t set_hash, uint8_t *out) {
+  out[0] = COMPACT_DISCOVERY;
+  out[1] = H42_MQTT_COMPACT_DISCOVERY_SIZE - 2;
+  out[2] = op;
+  out[3] = set_hash >> 24;
+  out[4] = (set_hash >> 16) & 0xFF;
+  out[5] = (set_hash >> 8) & 0xFF;
+  out[6] = set_hash & 0xFF;
+}
+
+/**
+ * @brief Take in[pos..] into held as far as the current state needs it, then
+ * act on it. Returns the number of bytes taken.
+ */
+static uint32_t _encoder_hold(h42_mqtt_compact_encoder_t *encoder,
+                              uint8_t modes, const uint8_t *in,
+                              uint32_t in_len) {
+  if (encoder->state == PARSER_STATE_HEADER) {
+    uint8_t b = in[0];
+    encoder->held[encoder->held_len++] = b;
+    if (encoder->held_len == 1) {
+      return 1;
+    }
+    if (encoder->held_len == 2) {
+      encoder->remaining_length = 0;
+    }
+    encoder->remaining_length |= (uint32_t)(b & 0x7F)
+                                 << (7 * (encoder->held_len - 2));
+    if (b & 0x80) {
+      if (encoder->held_len == 1 + MQTT_VARINT_MAX_BYTES) {
+        _encoder_emit(encoder, encoder->held, encoder->held_len);
+        encoder->held_len = 0;
+        encoder->state = PARSER_STATE_RAW;
+      }
+      return 1;
+    }
+    encoder->header_len = encoder->held_len;
+    _encoder_on_header(encoder, modes);
+    return 1;
+  }
+
+  const uint8_t *len_bytes = encoder->held + encoder->header_len;
+  uint32_t have = encoder->held_len - encoder->header_len;
+  uint32_t want;
+  if (have < 2) {
+    want = 2;
+  } else if (encoder->state == PARSER_STATE_TOPIC) {
+    want = 2 + ((len_bytes[0] << 8) | len_bytes[1]);
+  } else {
+    want = encoder->remaining_length;
+  }
+  uint32_t n = want - have;
+  if (n > in_len) {
+    n = in_len;
+  }
+  memcpy(encoder->held + encoder->held_len, in, n);
+  encoder->held_len += n;
+  have += n;
+  if (have < want) {
+    return n;
+  }
+  uint16_t topic_len = (len_bytes[0] << 8) | len_bytes[1];
+  if (want == 2) {
+    _encoder_on_topic_len(encoder, topic_len);
+  } else if (encoder->state == PARSER_STATE_TOPIC) {
+    _encoder_emit_publish(encoder, topic_len);
+  } else {
+    _encoder_on_packet(encoder, topic_len);
+  }
+  return n;
+}
+
+uint32_t h42_mqtt_compact_encode(h42_mqtt_compact_encoder_t *encoder,
+                                 uint8_t modes, const uint8_t *in,
+                                 uint32_t in_len, uint8_t *out,
+                                 uint32_t out_size, uint32_t *out_len) {
+  uint32_t pos = 0;
+  *out_len = 0;
+  for (;;) {
+    uint32_t out_left = out_size - *out_len;
+    if (encoder->pending_pos < encoder->pending_len) {
+      uint32_t n = encoder->pending_len - encoder->pending_pos;
+      if (n > out_left) {
+        n = out_left;
+      }
+      memcpy(out + *out_len, encoder->pending + encoder->pending_pos, n);
+      *out_len += n;
+      encoder->pending_pos += n;
+      if (encoder->pending_pos < encoder->pending_len) {
+        break;
+      }
+      encoder->pending_pos = 0;
+      encoder->pending_len = 0;
+      out_left -= n;
+    }
+    if (pos == in_len) {
+      break;
+    }
+    if (encoder->state == PARSER_STATE_BODY ||
+        encoder->state == PARSER_STATE_RAW) {
+      uint32_t n = in_len - pos;
+      if (encoder->state == PARSER_STATE_BODY && n > encoder->body_left) {
+        n = encoder->body_left;
+      }
+      if (n > out_left) {
+        n = out_left;
+      }
+      if (n == 0) {
+        break;
+      }
+      memcpy(out + *out_len, in + pos, n);
+      *out_len += n;
+      pos += n;
+      if (encoder->state == PARSER_STATE_BODY &&
+          (encoder->body_left -= n) == 0) {
+        encoder->state = PARSER_STATE_HEADER;
+      }
+      continue;
+    }
+    pos += _encoder_hold(encoder, modes, in + pos, in_len - pos);
+  }
+  return pos;
+}
@@ -0,0 +1,108 @@
+#include "h42_mqtt_keepalive.h"
+
+#include <string.h>
+
+#define MQTT_CONNECT 1
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_VARINT_MAX_BYTES 4
+
+static const uint8_t PINGRESP[] = {MQTT_PINGRESP << 4, 0};
+
+void h42_mqtt_keepalive_init(h42_mqtt_keepalive_t *keepalive) {
+  memset(keepalive, 0, sizeof(*keepalive));
+}
+
+static bool _between_packets(const h42_mqtt_keepalive_stream_t *stream) {
+  return stream->header_len == 0 && stream->body_left == 0;
+}
+
+static void _stream_feed(h42_mqtt_keepalive_stream_t *stream,
+                         const uint8_t *data, uint32_t len) {
+  uint32_t pos = 0;
+  while (pos < len) {
+    if (stream->body_left > 0) {
+      uint32_t n =
+          len - pos < stream->body_left ? len - pos : stream->body_left;
+      stream->body_left -= n;
+      pos += n;
+      continue;
+    }
+    uint8_t b = data[pos++];
+    if (stream->header_len == 0) {
+      stream->header_len = 1;
+      stream->remaining_length = 0;
+      continue;
+    }
+    stream->remaining_length |= (uint32_t)(b & 0x7F)
+                                << (7 * (stream->header_len - 1));
+    stream->header_len++;
+    if (!(b & 0x80) || stream->header_len > MQTT_VARINT_MAX_BYTES) {
+      stream->body_left = stream->remaining_length;
+      stream->header_len = 0;
+    }
+  }
+}
+
+/**
+ * @brief Keep alive of a CONNECT, 0 if the packet is too short for one.
+ */
+static uint16_t _connect_keepalive(const uint8_t *packet, uint32_t len) {
+  uint32_t pos = 1;
+  while (pos < len && pos <= MQTT_VARINT_MAX_BYTES && (packet[pos] & 0x80)) {
+    pos++;
+  }
+  // Protocol name, level and flags come first.
+  pos++;
+  if (pos + 2 > len) {
+    return 0;
+  }
+  pos += 2 + ((packet[pos] << 8) | packet[pos + 1]) + 2;
+  if (pos + 2 > len) {
+    return 0;
+  }
+  return (packet[pos] << 8) | packet[pos + 1];
+}
+
+bool h42_mqtt_keepalive_on_write(h42_mqtt_keepalive_t *keepalive,
+                                 const uint8_t *packet, uint32_t len,
+                                 uint32_t now_ms) {
+  const bool packet_start = _between_packets(&keepalive->write);
+  _stream_feed(&keepalive->write, packet, len);
+  if (len == 0 || !packet_start) {
+    // The rest of a packet, its payload can look like anything.
+    return false;
+  }
+  if (packet[0] >> 4 == MQTT_CONNECT) {
+    keepalive->keepalive_s = _connect_keepalive(packet, len);
+    keepalive->pinged = false;
+    return false;
+  }
+  if (len != 2 || packet[0] != (MQTT_PINGREQ << 4) || packet[1] != 0) {
+    return false;
+  }
+  const uint32_t period_ms =
+      H42_MQTT_KEEPALIVE_PROXY_FACTOR * keepalive->keepalive_s * 1000u;
+  if (keepalive->pinged && keepalive->pingresp_left == 0 &&
+      _between_packets(&keepalive->read) &&
+      now_ms - keepalive->last_ping_ms < period_ms) {
+    keepalive->pingresp_left = sizeof(PINGRESP);
+    return true;
+  }
+  keepalive->pinged = true;
+  keepalive->last_ping_ms = now_ms;
+  return false;
+}
+
+uint32_t h42_mqtt_keepalive_read(h42_mqtt_keepalive_t *keepalive, uint8_t *buf,
+                                 uint32_t len) {
+  uint32_t n = len < keepalive->pingresp_left ? len : keepalive->pingresp_left;
+  memcpy(buf, PINGRESP + sizeof(PINGRESP) - keepalive->pingresp_left, n);
+  keepalive->pingresp_left -= n;
+  return n;
+}
+
+void h42_mqtt_keepalive_on_read(h42_mqtt_keepalive_t *keepalive,
+                                const uint8_t *data, uint32_t len) {
+  _stream_feed(&keepalive->read, data, len);
+}
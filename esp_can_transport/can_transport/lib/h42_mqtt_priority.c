@@ -0,0 +1,142 @@
+#include "h42_mqtt_priority.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#define MQTT_PUBLISH 3
+#define MQTT_VARINT_MAX_BYTES 4
+
+static bool _ends_with(const uint8_t *topic, uint32_t len, const char *suffix) {
+  uint32_t n = strlen(suffix);
+  return len >= n && memcmp(topic + len - n, suffix, n) == 0;
+}
+
+h42_can_priority_t h42_mqtt_priority(const uint8_t *packet, uint32_t len) {
+  if (len == 0 || packet[0] >> 4 != MQTT_PUBLISH) {
+    return H42_CAN_PRIORITY_CONTROL;
+  }
+  uint32_t pos = 1;
+  while (pos < len && pos <= MQTT_VARINT_MAX_BYTES && (packet[pos] & 0x80)) {
+    pos++;
+  }
+  pos++;
+  if (pos + 2 > len) {
+    return H42_CAN_PRIORITY_STATE;
+  }
+  uint32_t topic_len = (packet[pos] << 8) | packet[pos + 1];
+  const uint8_t *topic = packet + pos + 2;
+  if (pos + 2 + topic_len > len) {
+    return H42_CAN_PRIORITY_STATE;
+  }
+  if (_ends_with(topic, topic_len, "/command") ||
+      _ends_with(topic, topic_len, "/set")) {
+    return H42_CAN_PRIORITY_COMMAND;
+  }
+  if (_ends_with(topic, topic_len, "/config") ||
+      _ends_with(topic, topic_len, "/debug")) {
+    return H42_CAN_PRIORITY_BULK;
+  }
+  return H42_CAN_PRIORITY_STATE;
+}
+
+/**
+ * @brief Parse the fixed header at the start of a packet.
+ *
+ * @return 1 with the length of the header and the whole packet, 0 if more
+ * bytes are needed, -1 if it is not MQTT.
+ */
+static int _fixed_header(const uint8_t *head, uint32_t len,
+                         uint32_t *header_len, uint32_t *total) {
+  uint32_t remaining = 0;
+  for (uint32_t i = 1; i < len; i++) {
+    remaining |= (uint32_t)(head[i] & 0x7F) << (7 * (i - 1));
+    if (!(head[i] & 0x80)) {
+      *header_len = i + 1;
+      *total = i + 1 + remaining;
+      return 1;
+    }
+    if (i == MQTT_VARINT_MAX_BYTES) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Work out the class of the current packet once its head says enough.
+ */
+static bool _stream_classify(h42_mqtt_priority_stream_t *stream) {
+  uint32_t header_len = 0;
+  uint32_t total = 0;
+  int res = _fixed_header(stream->head, stream->head_len, &header_len, &total);
+  if (res == 0) {
+    return false;
+  }
+  if (res < 0) {
+    // Not MQTT, send it as it comes.
+    total = stream->head_len;
+  } else if (stream->head_len < total &&
+             stream->head[0] >> 4 == MQTT_PUBLISH &&
+             stream->head_len < H42_MQTT_PRIORITY_HEAD_SIZE) {
+    if (stream->head_len < header_len + 2) {
+      return false;
+    }
+    uint32_t topic_end = header_len + 2 +
+                         ((stream->head[header_len] << 8) |
+                          stream->head[header_len + 1]);
+    if (topic_end > stream->head_len) {
+      return false;
+    }
+  }
+  stream->priority = h42_mqtt_priority(stream->head, stream->head_len);
+  stream->left = total - stream->head_len;
+  stream->head_len = 0;
+  stream->known = true;
+  return true;
+}
+
+void h42_mqtt_priority_stream_init(h42_mqtt_priority_stream_t *stream) {
+  stream->head_len = 0;
+  stream->known = false;
+  stream->priority = H42_CAN_PRIORITY_STATE;
+  stream->left = 0;
+}
+
+h42_can_priority_t
+h42_mqtt_priority_stream_feed(h42_mqtt_priority_stream_t *stream,
+                              const uint8_t *data, uint32_t len) {
+  bool any = false;
+  h42_can_priority_t result = H42_CAN_PRIORITY_STATE;
+  uint32_t pos = 0;
+  while (pos < len) {
+    if (!stream->known) {
+      stream->head[stream->head_len++] = data[pos++];
+      if (!_stream_classify(stream)) {
+        continue;
+      }
+    } else {
+      uint32_t n = stream->left < len - pos ? stream->left : len - pos;
+      stream->left -= n;
+      pos += n;
+    }
+    if (!any || stream->priority < result) {
+      result = stream->priority;
+    }
+    any = true;
+    if (stream->left == 0) {
+      stream->known = false;
+    }
+  }
+  if (stream->head_len > 0) {
+    // The piece ends before the packet's class is known.
+    h42_can_priority_t head = h42_mqtt_priority(stream->head, stream->head_len);
+    if (!any || head < result) {
+      result = head;
+    }
+  }
+  return result;
+}
+
+bool h42_mqtt_priority_stream_idle(const h42_mqtt_priority_stream_t *stream) {
+  return stream->head_len == 0 && !stream->known;
+}
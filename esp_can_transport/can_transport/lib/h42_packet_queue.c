@@ -1,44 +1,87 @@
 #include "h42_packet_queue.h"
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
-#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Packets that fit in a small block are the common case: state updates,
+// PINGRESP, SUBACK etc. Discovery configs and larger state PUBLISHes land in
+// the medium classes, so they don't take a whole large block each.
+#define H42_PACKET_POOL_SMALL_BLOCK_SIZE 128
+#define H42_PACKET_POOL_MEDIUM_BLOCK_SIZE 512
+#define H42_PACKET_POOL_LARGER_BLOCK_SIZE 1024
+// Share of max_size_bytes each medium class holds.
+#define H42_PACKET_POOL_MEDIUM_SHARE 4
+#define H42_PACKET_POOL_CLASS_SMALL 0
+#define H42_PACKET_POOL_CLASS_MEDIUM 1
+#define H42_PACKET_POOL_CLASS_LARGER 2
+#define H42_PACKET_POOL_CLASS_LARGE 3
+#define H42_PACKET_POOL_NUM_CLASSES 4
+
+// Free list head: | 16 bits ABA tag | 16 bits block index |
+#define H42_PACKET_POOL_INDEX_NONE 0xFFFF
+#define H42_PACKET_POOL_MAX_BLOCKS H42_PACKET_POOL_INDEX_NONE
+
+// Single producer, single consumer ring of packet handles. head and tail run
+// freely, the slot is the index modulo capacity.
 typedef struct h42_packet_queue {
   uint32_t max_size_bytes;
-  uint32_t current_size_bytes;
-  QueueHandle_t os_queue;
-  SemaphoreHandle_t lock;
+  uint32_t capacity;
+  // Written by the consumer only.
+  _Atomic uint32_t head;
+  // Written by the producer only.
+  _Atomic uint32_t tail;
+  _Atomic uint32_t current_size_bytes;
+  // Consumer blocked in h42_packet_queue_wait_data_available(), taken and
+  // notified by the next push.
+  _Atomic(TaskHandle_t) waiter;
+  h42_packet_handle_t slots[];
 } h42_packet_queue_t;
 
 typedef struct h42_packet {
   uint32_t size;
   uint32_t capacity;
   uint8_t *data;
+  // NULL for heap allocated packets.
+  struct h42_packet_pool *pool;
+  uint16_t pool_index;
+  uint16_t pool_next_free;
 } h42_packet_t;
 
+typedef struct h42_packet_pool_class {
+  uint32_t block_size;
+  uint16_t first_index;
+  uint16_t block_count;
+  _Atomic uint32_t free_head;
+} h42_packet_pool_class_t;
+
+typedef struct h42_packet_pool {
+  h42_packet_pool_class_t classes[H42_PACKET_POOL_NUM_CLASSES];
+  h42_packet_t *blocks;
+  uint8_t *arena;
+  uint32_t blocks_total;
+  _Atomic uint32_t blocks_in_use;
+  _Atomic uint32_t high_water_mark;
+  _Atomic uint32_t alloc_failures;
+} h42_packet_pool_t;
+
 h42_packet_queue_handle_t h42_packet_queue_create(uint32_t max_packets,
                                                   uint32_t max_size_bytes) {
-  h42_packet_queue_handle_t queue = malloc(sizeof(h42_packet_queue_t));
+  assert(max_packets > 0);
+  // The queue only carries handles, packets are never copied.
+  h42_packet_queue_handle_t queue = malloc(
+      sizeof(h42_packet_queue_t) + max_packets * sizeof(h42_packet_handle_t));
   if (queue == NULL) {
     return NULL;
   }
   queue->max_size_bytes = max_size_bytes;
-  queue->current_size_bytes = 0;
-  queue->os_queue = xQueueCreate(max_packets, sizeof(h42_packet_t));
-  if (queue->os_queue == NULL) {
-    free(queue);
-    return NULL;
-  }
-  queue->lock = xSemaphoreCreateMutex();
-  if (queue->lock == NULL) {
-    vQueueDelete(queue->os_queue);
-    free(queue);
-    return NULL;
-  }
-
+  queue->capacity = max_packets;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->current_size_bytes, 0);
+  atomic_init(&queue->waiter, NULL);
   return queue;
 }
 
@@ -50,8 +93,6 @@ void h42_packet_queue_destroy(h42_packet_queue_handle_t *queue) {
   while ((packet = h42_packet_queue_pop_release(*queue, 0)) != NULL) {
     h42_packet_free(&packet);
   }
-  vQueueDelete((*queue)->os_queue);
-  vSemaphoreDelete((*queue)->lock);
   free(*queue);
   *queue = NULL;
 }
@@ -60,50 +101,232 @@ bool h42_packet_queue_push_acquire(h42_packet_queue_handle_t queue,
                                    h42_packet_handle_t *packet) {
   assert(queue != NULL && packet != NULL && *packet != NULL);
 
-  if (xSemaphoreTake(queue->lock, portMAX_DELAY) != pdTRUE) {
-    return false;
-  }
-  if (queue->current_size_bytes + (*packet)->size > queue->max_size_bytes) {
-    xSemaphoreGive(queue->lock);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head == queue->capacity) {
     return false;
   }
-  queue->current_size_bytes += (*packet)->size;
-  xSemaphoreGive(queue->lock);
-
-  if (xQueueSend(queue->os_queue, (const void *)*packet, 0) != pdTRUE) {
+  // The consumer only ever lowers the byte count, so the check holds until
+  // the add.
+  uint32_t size = (*packet)->size;
+  if (atomic_load_explicit(&queue->current_size_bytes, memory_order_relaxed) +
+          size >
+      queue->max_size_bytes) {
     return false;
   }
-  free(*packet);
+  atomic_fetch_add_explicit(&queue->current_size_bytes, size,
+                            memory_order_relaxed);
+  queue->slots[tail % queue->capacity] = *packet;
   *packet = NULL;
+  // Publishing the tail and then looking for a waiter pairs with the
+  // consumer registering and then looking at the tail, so either it sees the
+  // packet or we see it.
+  atomic_store(&queue->tail, tail + 1);
+  TaskHandle_t waiter = atomic_exchange(&queue->waiter, NULL);
+  if (waiter != NULL) {
+    xTaskNotify(waiter, H42_PACKET_QUEUE_NOTIFY_BIT, eSetBits);
+  }
   return true;
 }
 
+static bool _queue_empty(h42_packet_queue_handle_t queue) {
+  return atomic_load(&queue->tail) ==
+         atomic_load_explicit(&queue->head, memory_order_relaxed);
+}
+
 h42_packet_handle_t
 h42_packet_queue_pop_release(h42_packet_queue_handle_t queue, int timeout_ms) {
-  h42_packet_handle_t packet = malloc(sizeof(h42_packet_t));
-  if (packet == NULL) {
+  if (!h42_packet_queue_wait_data_available(queue, timeout_ms)) {
     return NULL;
   }
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  h42_packet_handle_t packet = queue->slots[head % queue->capacity];
+  atomic_fetch_sub_explicit(&queue->current_size_bytes, packet->size,
+                            memory_order_relaxed);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return packet;
+}
 
-  if (xQueueReceive(queue->os_queue, (void *)packet,
-                    pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
-    free(packet);
+bool h42_packet_queue_wait_data_available(h42_packet_queue_handle_t queue,
+                                          int timeout_ms) {
+  assert(queue != NULL);
+  if (!_queue_empty(queue)) {
+    return true;
+  }
+  TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+  TickType_t start = xTaskGetTickCount();
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (;;) {
+    // Registered again every round, a push takes the registration.
+    atomic_store(&queue->waiter, self);
+    if (!_queue_empty(queue)) {
+      break;
+    }
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    if (elapsed >= timeout) {
+      break;
+    }
+    // A notification left over from an earlier wait only costs a round.
+    xTaskNotifyWait(0, H42_PACKET_QUEUE_NOTIFY_BIT, NULL, timeout - elapsed);
+  }
+  atomic_store(&queue->waiter, NULL);
+  return !_queue_empty(queue);
+}
+
+static void _pool_class_push(h42_packet_pool_class_t *cls,
+                             h42_packet_t *packet) {
+  uint32_t old_head = atomic_load(&cls->free_head);
+  uint32_t new_head;
+  do {
+    packet->pool_next_free = old_head & 0xFFFF;
+    new_head = ((old_head + 0x10000) & 0xFFFF0000) | packet->pool_index;
+  } while (!atomic_compare_exchange_weak(&cls->free_head, &old_head, new_head));
+}
+
+static h42_packet_t *_pool_class_pop(h42_packet_pool_t *pool,
+                                     h42_packet_pool_class_t *cls) {
+  uint32_t old_head = atomic_load(&cls->free_head);
+  uint32_t new_head;
+  h42_packet_t *packet;
+  do {
+    uint16_t index = old_head & 0xFFFF;
+    if (index == H42_PACKET_POOL_INDEX_NONE) {
+      return NULL;
+    }
+    packet = &pool->blocks[index];
+    // A stale next is harmless, the tag makes the exchange fail.
+    new_head = ((old_head + 0x10000) & 0xFFFF0000) | packet->pool_next_free;
+  } while (!atomic_compare_exchange_weak(&cls->free_head, &old_head, new_head));
+  return packet;
+}
+
+h42_packet_pool_handle_t h42_packet_pool_create(uint32_t max_packets,
+                                                uint32_t max_size_bytes,
+                                                uint32_t max_packet_size) {
+  assert(max_packets > 0 && max_packet_size > 0);
+  uint32_t medium_bytes = max_size_bytes / H42_PACKET_POOL_MEDIUM_SHARE;
+  uint32_t counts[H42_PACKET_POOL_NUM_CLASSES] = {
+      [H42_PACKET_POOL_CLASS_SMALL] = max_packets,
+      [H42_PACKET_POOL_CLASS_MEDIUM] =
+          medium_bytes / H42_PACKET_POOL_MEDIUM_BLOCK_SIZE,
+      [H42_PACKET_POOL_CLASS_LARGER] =
+          medium_bytes / H42_PACKET_POOL_LARGER_BLOCK_SIZE,
+      [H42_PACKET_POOL_CLASS_LARGE] =
+          (max_size_bytes + max_packet_size - 1) / max_packet_size,
+  };
+  uint32_t sizes[H42_PACKET_POOL_NUM_CLASSES] = {
+      [H42_PACKET_POOL_CLASS_SMALL] = H42_PACKET_POOL_SMALL_BLOCK_SIZE,
+      [H42_PACKET_POOL_CLASS_MEDIUM] = H42_PACKET_POOL_MEDIUM_BLOCK_SIZE,
+      [H42_PACKET_POOL_CLASS_LARGER] = H42_PACKET_POOL_LARGER_BLOCK_SIZE,
+      [H42_PACKET_POOL_CLASS_LARGE] = max_packet_size,
+  };
+  if (counts[H42_PACKET_POOL_CLASS_LARGE] == 0) {
+    counts[H42_PACKET_POOL_CLASS_LARGE] = 1;
+  }
+  uint32_t blocks_total = 0;
+  uint32_t arena_size = 0;
+  for (int i = 0; i < H42_PACKET_POOL_NUM_CLASSES; i++) {
+    // Classes at or above max_packet_size are left to the large one.
+    if (i != H42_PACKET_POOL_CLASS_LARGE && sizes[i] >= max_packet_size) {
+      sizes[i] = max_packet_size;
+      counts[i] = i == H42_PACKET_POOL_CLASS_SMALL ? max_packets : 0;
+    }
+    blocks_total += counts[i];
+    arena_size += counts[i] * sizes[i];
+  }
+  if (blocks_total > H42_PACKET_POOL_MAX_BLOCKS) {
+    return NULL;
+  }
+
+  h42_packet_pool_handle_t pool = malloc(sizeof(h42_packet_pool_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->blocks = malloc(blocks_total * sizeof(h42_packet_t));
+  pool->arena = malloc(arena_size);
+  if (pool->blocks == NULL || pool->arena == NULL) {
+    free(pool->blocks);
+    free(pool->arena);
+    free(pool);
     return NULL;
   }
+  pool->blocks_total = blocks_total;
+  atomic_init(&pool->blocks_in_use, 0);
+  atomic_init(&pool->high_water_mark, 0);
+  atomic_init(&pool->alloc_failures, 0);
 
-  assert(xSemaphoreTake(queue->lock, portMAX_DELAY) == pdTRUE);
-  queue->current_size_bytes -= packet->size;
-  xSemaphoreGive(queue->lock);
+  uint16_t index = 0;
+  uint8_t *data = pool->arena;
+  for (int i = 0; i < H42_PACKET_POOL_NUM_CLASSES; i++) {
+    h42_packet_pool_class_t *cls = &pool->classes[i];
+    cls->block_size = sizes[i];
+    cls->first_index = index;
+    cls->block_count = counts[i];
+    atomic_init(&cls->free_head, H42_PACKET_POOL_INDEX_NONE);
+    for (uint32_t j = 0; j < counts[i]; j++, index++) {
+      h42_packet_t *packet = &pool->blocks[index];
+      packet->size = 0;
+      packet->capacity = sizes[i];
+      packet->data = data;
+      packet->pool = pool;
+      packet->pool_index = index;
+      data += sizes[i];
+      _pool_class_push(cls, packet);
+    }
+  }
+  return pool;
+}
+
+void h42_packet_pool_destroy(h42_packet_pool_handle_t *pool) {
+  assert(pool != NULL && *pool != NULL);
+  assert(atomic_load(&(*pool)->blocks_in_use) == 0);
+  free((*pool)->blocks);
+  free((*pool)->arena);
+  free(*pool);
+  *pool = NULL;
+}
+
+h42_packet_handle_t h42_packet_pool_alloc(h42_packet_pool_handle_t pool,
+                                          uint32_t size) {
+  assert(pool != NULL);
+  h42_packet_t *packet = NULL;
+  for (int i = 0; i < H42_PACKET_POOL_NUM_CLASSES && packet == NULL; i++) {
+    if (size <= pool->classes[i].block_size) {
+      packet = _pool_class_pop(pool, &pool->classes[i]);
+    }
+  }
+  if (packet == NULL) {
+    atomic_fetch_add(&pool->alloc_failures, 1);
+    return NULL;
+  }
+  packet->size = 0;
 
+  uint32_t in_use = atomic_fetch_add(&pool->blocks_in_use, 1) + 1;
+  uint32_t high_water_mark = atomic_load(&pool->high_water_mark);
+  while (in_use > high_water_mark &&
+         !atomic_compare_exchange_weak(&pool->high_water_mark,
+                                       &high_water_mark, in_use)) {
+  }
   return packet;
 }
 
-bool h42_packet_queue_wait_data_available(h42_packet_queue_handle_t queue,
-                                          int timeout_ms) {
-  assert(queue != NULL);
-  h42_packet_t dummy_packet;
-  return xQueuePeek(queue->os_queue, &dummy_packet,
-                    pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+void h42_packet_pool_get_stats(h42_packet_pool_handle_t pool,
+                               h42_packet_pool_stats_t *stats) {
+  assert(pool != NULL && stats != NULL);
+  stats->blocks_total = pool->blocks_total;
+  stats->blocks_in_use = atomic_load(&pool->blocks_in_use);
+  stats->high_water_mark = atomic_load(&pool->high_water_mark);
+  stats->alloc_failures = atomic_load(&pool->alloc_failures);
+}
+
+static void _pool_free(h42_packet_pool_t *pool, h42_packet_t *packet) {
+  // Classes lie in the block table in order.
+  int i = H42_PACKET_POOL_NUM_CLASSES - 1;
+  while (packet->pool_index < pool->classes[i].first_index) {
+    i--;
+  }
+  _pool_class_push(&pool->classes[i], packet);
+  atomic_fetch_sub(&pool->blocks_in_use, 1);
 }
 
 h42_packet_handle_t h42_packet_alloc(uint32_t size) {
@@ -118,6 +341,7 @@ h42_packet_handle_t h42_packet_alloc(uint32_t size) {
   }
   packet->size = 0;
   packet->capacity = size;
+  packet->pool = NULL;
   return packet;
 }
 
@@ -133,10 +357,23 @@ bool h42_packet_append_data(h42_packet_handle_t packet, const uint8_t *data,
   return true;
 }
 
+bool h42_packet_set_size(h42_packet_handle_t packet, uint32_t size) {
+  assert(packet != NULL);
+  if (size > packet->capacity) {
+    return false;
+  }
+  packet->size = size;
+  return true;
+}
+
 void h42_packet_free(h42_packet_handle_t *packet) {
   assert(packet != NULL && *packet != NULL);
-  free((*packet)->data);
-  free(*packet);
+  if ((*packet)->pool != NULL) {
+    _pool_free((*packet)->pool, *packet);
+  } else {
+    free((*packet)->data);
+    free(*packet);
+  }
   *packet = NULL;
 }
 
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Compact MQTT encoding
+//
+// Shrinks the MQTT 3.1.1 stream a node sends to the master. The master
+// expands it back before the stream goes to the broker. Only used in the node
+// to master direction, with the modes the master granted:
+//
+// H42_MQTT_COMPACT_ALIASES replaces the topic of a PUBLISH with a 2 byte
+// alias, in the spirit of MQTT-SN topic IDs.
+// H42_MQTT_COMPACT_COMPRESS compresses PUBLISH packets with large payloads,
+// like discovery configs, against a dictionary both ends share.
+//
+// Packet type 0 and 15, which MQTT 3.1.1 reserves, are used:
+//
+//   REGISTER, sent before the first use of an alias:
+//     1 byte: 0x00
+//     Remaining length (MQTT varint)
+//     2 bytes: alias, big endian
+//     Topic, the rest of the packet
+//
+//   Compact PUBLISH:
+//     1 byte: 0xF0 | the DUP, QoS and RETAIN bits of the PUBLISH
+//     Remaining length (MQTT varint)
+//     2 bytes: alias, big endian
+//     Packet identifier and payload as in the PUBLISH
+//   With the alias H42_MQTT_COMPACT_ALIAS_COMPRESSED the rest is everything
+//   after the fixed header of the PUBLISH, topic included, compressed with
+//   h42_mqtt_compress().
+//
+//   DISCOVERY, see h42_can_discovery_check(). Not made by the encoder:
+//     1 byte: 0x01
+//     Remaining length: 5
+//     1 byte: H42_MQTT_COMPACT_DISCOVERY_*
+//     4 bytes: hash of the discovery set, big endian
+//
+// Aliases are numbered from 0 in the order they are registered and are valid
+// until the next CONNECT. Every other packet goes out unchanged, as does a
+// PUBLISH that neither mode makes smaller.
+
+#define H42_MQTT_COMPACT_ALIASES (1u << 0)
+#define H42_MQTT_COMPACT_COMPRESS (1u << 1)
+
+// Does the master have this discovery set?
+#define H42_MQTT_COMPACT_DISCOVERY_CHECK 0
+// The node sent this discovery set since its check.
+#define H42_MQTT_COMPACT_DISCOVERY_COMMIT 1
+#define H42_MQTT_COMPACT_DISCOVERY_SIZE 7
+
+#define H42_MQTT_COMPACT_MAX_ALIASES 32
+// Longer topics are never aliased.
+#define H42_MQTT_COMPACT_TOPIC_MAX 128
+#define H42_MQTT_COMPACT_TOPIC_ARENA_SIZE 1024
+#define H42_MQTT_COMPACT_ALIAS_COMPRESSED 0xFFFF
+// PUBLISH packets that may be compressed: payload of at least
+// COMPRESS_MIN_PAYLOAD bytes and a remaining length of at most
+// COMPRESS_MAX_PACKET. The whole packet is held back until it is complete.
+#define H42_MQTT_COMPACT_COMPRESS_MIN_PAYLOAD 48
+#define H42_MQTT_COMPACT_COMPRESS_MAX_PACKET 1024
+
+// Fixed header plus as much of the packet as is held back.
+#define H42_MQTT_COMPACT_HELD_MAX (1 + 4 + H42_MQTT_COMPACT_COMPRESS_MAX_PACKET)
+// A REGISTER and a compact PUBLISH header, then the rest of a held packet.
+#define H42_MQTT_COMPACT_PENDING_MAX                                           \
+  (2 * (1 + 4 + 2) + H42_MQTT_COMPACT_TOPIC_MAX +                              \
+   H42_MQTT_COMPACT_COMPRESS_MAX_PACKET)
+
+typedef struct h42_mqtt_compact_encoder {
+  uint8_t state;
+  // Modes of the current MQTT session.
+  uint8_t modes;
+  uint8_t header_len;
+  uint16_t held_len;
+  uint32_t remaining_length;
+  // Bytes of the current packet still to pass through.
+  uint32_t body_left;
+  // Start of the current packet, until it is known how to send it.
+  uint8_t held[H42_MQTT_COMPACT_HELD_MAX];
+  // Encoded output that did not fit the caller's buffer yet.
+  uint16_t pending_pos;
+  uint16_t pending_len;
+  uint8_t pending[H42_MQTT_COMPACT_PENDING_MAX];
+
+  uint8_t alias_count;
+  uint16_t arena_used;
+  struct {
+    uint16_t offset;
+    uint16_t len;
+  } aliases[H42_MQTT_COMPACT_MAX_ALIASES];
+  uint8_t arena[H42_MQTT_COMPACT_TOPIC_ARENA_SIZE];
+} h42_mqtt_compact_encoder_t;
+
+// Also for every new connection, the stream starts over.
+void h42_mqtt_compact_encoder_init(h42_mqtt_compact_encoder_t *encoder);
+/**
+ * @brief Encode the next piece of the MQTT stream.
+ *
+ * @details The stream can be cut anywhere. The start of a PUBLISH is held back
+ * until its topic, or the whole packet when it may be compressed, is
+ * complete.
+ *
+ * @param modes H42_MQTT_COMPACT_* the session starting with the next CONNECT
+ * uses.
+ * @return Bytes of `in` consumed, less than in_len when `out` is full. Call
+ * again with no input to get the rest of the output.
+ */
+uint32_t h42_mqtt_compact_encode(h42_mqtt_compact_encoder_t *encoder,
+                                 uint8_t modes, const uint8_t *in,
+                                 uint32_t in_len, uint8_t *out,
+                                 uint32_t out_size, uint32_t *out_len);
+
+// Nothing of a packet is held back or waiting to be sent, the next byte
+// starts a new one.
+bool h42_mqtt_compact_idle(const h42_mqtt_compact_encoder_t *encoder);
+/**
+ * @brief Make a DISCOVERY packet of H42_MQTT_COMPACT_DISCOVERY_SIZE bytes.
+ */
+void h42_mqtt_compact_discovery(uint8_t op, uint32_t set_hash, uint8_t *out);
+
+/**
+ * @brief Compress src against the shared dictionary.
+ *
+ * @details A sequence of tokens, each starting with a tag byte T:
+ *   T < 0x80: T + 1 literal bytes follow.
+ *   T >= 0x80: (T & 0x7F) + 4 bytes copied from 2 bytes (big endian) back,
+ *   1 to 65535, in the dictionary followed by everything decompressed so far.
+ *   The copy may overlap its own output.
+ *
+ * @return Compressed size, 0 if that would exceed dst_size.
+ */
+uint32_t h42_mqtt_compress(const uint8_t *src, uint32_t src_len, uint8_t *dst,
+                           uint32_t dst_size);
+/**
+ * @brief The other way round, as the master does it.
+ *
+ * @return Decompressed size, 0 if src is malformed or dst too small.
+ */
+uint32_t h42_mqtt_decompress(const uint8_t *src, uint32_t src_len,
+                             uint8_t *dst, uint32_t dst_size);
+
+#ifdef __cplusplus
+}
+#endif
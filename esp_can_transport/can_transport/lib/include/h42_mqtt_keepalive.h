@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// MQTT keepalive proxy
+//
+// With H42_CAN_FEATURE_KEEPALIVE_PROXY the master keeps the node's broker
+// session alive and tells from the node's frames on the bus whether the node
+// is still there. The transport then answers most of esp-mqtt's PINGREQs
+// itself: one goes through to the broker every
+// H42_MQTT_KEEPALIVE_PROXY_FACTOR keepalive periods, so the node still finds
+// out about a lost broker connection, and it is what the master hears from an
+// idle node. The others get a PINGRESP made up here, put between two packets
+// of the stream from the master.
+//
+// Only esp-mqtt's task uses it, from the transport's connect, read and write.
+
+// Keep in step with KEEPALIVE_PROXY_FACTOR in the bridge's mqtt_keepalive.py.
+#define H42_MQTT_KEEPALIVE_PROXY_FACTOR 4
+
+// Position in one direction of the stream: bytes of the current fixed header
+// so far, 0 between packets, and the bytes left of the packet.
+typedef struct h42_mqtt_keepalive_stream {
+  uint8_t header_len;
+  uint32_t remaining_length;
+  uint32_t body_left;
+} h42_mqtt_keepalive_stream_t;
+
+typedef struct h42_mqtt_keepalive {
+  // From the CONNECT, 0 for none.
+  uint16_t keepalive_s;
+  bool pinged;
+  // Of the last PINGREQ that went through to the broker.
+  uint32_t last_ping_ms;
+  // Bytes of the made up PINGRESP esp-mqtt has yet to read.
+  uint8_t pingresp_left;
+  // From the master, and to it: esp-mqtt writes a PUBLISH larger than its
+  // out buffer in several pieces.
+  h42_mqtt_keepalive_stream_t read;
+  h42_mqtt_keepalive_stream_t write;
+} h42_mqtt_keepalive_t;
+
+// Also for every new connection.
+void h42_mqtt_keepalive_init(h42_mqtt_keepalive_t *keepalive);
+/**
+ * @brief Look at a piece of the stream esp-mqtt writes.
+ *
+ * @details Only a piece that starts a packet is looked at. A PINGREQ is
+ * answered if the piece is just that, a CONNECT is expected whole.
+ *
+ * @return true for a PINGREQ the transport answers itself, with
+ * h42_mqtt_keepalive_read(). Don't send it.
+ */
+bool h42_mqtt_keepalive_on_write(h42_mqtt_keepalive_t *keepalive,
+                                 const uint8_t *packet, uint32_t len,
+                                 uint32_t now_ms);
+// Bytes esp-mqtt reads before anything from the master, 0 if none.
+uint32_t h42_mqtt_keepalive_read(h42_mqtt_keepalive_t *keepalive,
+                                 uint8_t *buf, uint32_t len);
+// Bytes from the master esp-mqtt read.
+void h42_mqtt_keepalive_on_read(h42_mqtt_keepalive_t *keepalive,
+                                const uint8_t *data, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "h42_can_types.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Priority classes of MQTT packets
+//
+// Both ends put MQTT packets in classes by packet type and topic, and send
+// the ISO-TP messages carrying them with that priority:
+//   H42_CAN_PRIORITY_CONTROL: everything but PUBLISH
+//   H42_CAN_PRIORITY_COMMAND: PUBLISH to a topic ending in /command or /set
+//   H42_CAN_PRIORITY_BULK: PUBLISH to a topic ending in /config, Home
+//     Assistant discovery, or /debug, ESPHome's logs
+//   H42_CAN_PRIORITY_STATE: any other PUBLISH
+//
+// Keep in step with mqtt_priority.py in the bridge.
+
+/**
+ * @brief Class of an MQTT packet, whole or at least up to its topic. A
+ * PUBLISH cut short before the end of its topic is H42_CAN_PRIORITY_STATE.
+ */
+h42_can_priority_t h42_mqtt_priority(const uint8_t *packet, uint32_t len);
+
+// Bytes of a PUBLISH held on to until its topic is known. A longer topic is
+// taken for state.
+#define H42_MQTT_PRIORITY_HEAD_SIZE 192
+
+// Classes the pieces an MQTT stream is written in, which needn't start or end
+// at packet boundaries: esp-mqtt writes a PUBLISH larger than its out buffer
+// in several. StreamPriority in mqtt_priority.py.
+typedef struct h42_mqtt_priority_stream {
+  // Start of the current packet while its class is not known yet.
+  uint8_t head[H42_MQTT_PRIORITY_HEAD_SIZE];
+  uint32_t head_len;
+  // Class of the current packet once known, and its bytes still to come.
+  bool known;
+  h42_can_priority_t priority;
+  uint32_t left;
+} h42_mqtt_priority_stream_t;
+
+// Also for every new connection.
+void h42_mqtt_priority_stream_init(h42_mqtt_priority_stream_t *stream);
+/**
+ * @brief Class of the next piece of the stream.
+ *
+ * @details The most urgent class of the packets the piece carries bytes of, so
+ * packets keep their order and a command never waits behind its own piece.
+ */
+h42_can_priority_t
+h42_mqtt_priority_stream_feed(h42_mqtt_priority_stream_t *stream,
+                              const uint8_t *data, uint32_t len);
+// The stream is between two packets, the next byte starts a new one.
+bool h42_mqtt_priority_stream_idle(const h42_mqtt_priority_stream_t *stream);
+
+#ifdef __cplusplus
+}
+#endif
@@ -11,9 +11,25 @@ typedef struct h42_packet_queue *h42_packet_queue_handle_t;
 
 typedef struct h42_packet *h42_packet_handle_t;
 
+typedef struct h42_packet_pool *h42_packet_pool_handle_t;
+
+typedef struct h42_packet_pool_stats {
+  uint32_t blocks_total;
+  uint32_t blocks_in_use;
+  uint32_t high_water_mark; // Max blocks_in_use ever seen
+  uint32_t alloc_failures; // Requests no free block could take
+} h42_packet_pool_stats_t;
+
 //
 // Packet Queue API
 //
+// Lock-free queue of packet handles for one producer task and one consumer
+// task. The byte budget max_size_bytes limits the sum of the queued packet
+// sizes. A consumer blocked in pop or wait is woken by setting
+// H42_PACKET_QUEUE_NOTIFY_BIT in its task notification value, other bits are
+// left to the task.
+#define H42_PACKET_QUEUE_NOTIFY_BIT (1u << 31)
+
 h42_packet_queue_handle_t h42_packet_queue_create(uint32_t max_packets,
                                                   uint32_t max_size_bytes);
 void h42_packet_queue_destroy(h42_packet_queue_handle_t *queue);
@@ -26,12 +42,38 @@ h42_packet_queue_pop_release(h42_packet_queue_handle_t queue, int timeout_ms);
 bool h42_packet_queue_wait_data_available(h42_packet_queue_handle_t queue,
                                           int timeout_ms);
 
+//
+// Packet Pool API
+//
+// Fixed-block allocator for packets. All memory is allocated once in
+// h42_packet_pool_create(); alloc and free are O(1) and lock-free, so they can
+// be used from the daemon and the reader task concurrently.
+//
+// The pool has a class of small blocks (one per packet), two medium classes
+// of 512 and 1024 byte blocks holding a quarter of max_size_bytes each, and a
+// class of max_packet_size blocks sized to hold max_size_bytes. Requests fall
+// back to the larger classes when their own is exhausted. A mix of medium
+// packets can still run the pool dry before the byte budget is reached.
+h42_packet_pool_handle_t h42_packet_pool_create(uint32_t max_packets,
+                                                uint32_t max_size_bytes,
+                                                uint32_t max_packet_size);
+// All packets must have been returned to the pool.
+void h42_packet_pool_destroy(h42_packet_pool_handle_t *pool);
+// Capacity of the returned packet is the block size, which may exceed size.
+h42_packet_handle_t h42_packet_pool_alloc(h42_packet_pool_handle_t pool,
+                                          uint32_t size);
+void h42_packet_pool_get_stats(h42_packet_pool_handle_t pool,
+                               h42_packet_pool_stats_t *stats);
+
 //
 // Packet API
 //
+// Heap allocated packet. h42_packet_free() releases both heap and pool packets.
 h42_packet_handle_t h42_packet_alloc(uint32_t size);
 bool h42_packet_append_data(h42_packet_handle_t packet, const uint8_t *data,
                             uint32_t size);
+// For data written directly into h42_packet_data(). Fails if size > capacity.
+bool h42_packet_set_size(h42_packet_handle_t packet, uint32_t size);
 void h42_packet_free(h42_packet_handle_t *packet);
 uint8_t *h42_packet_data(h42_packet_handle_t packet);
 uint32_t h42_packet_size(h42_packet_handle_t packet);
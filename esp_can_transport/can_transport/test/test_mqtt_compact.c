@@ -0,0 +1,332 @@
+#include <unity.h>
+
+#include "h42_mqtt_compact.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ALIASES H42_MQTT_COMPACT_ALIASES
+#define COMPRESS H42_MQTT_COMPACT_COMPRESS
+
+// The encoder does not look into CONNECT.
+static const uint8_t CONNECT[] = {0x10, 0x02, 0x00, 0x00};
+static const char DISCOVERY[] =
+    "{\"dev_cla\":\"voltage\",\"unit_of_meas\":\"V\",\"stat_cla\":"
+    "\"measurement\",\"name\":\"Battery voltage\",\"stat_t\":\"van/sensor/"
+    "battery_voltage/state\",\"avty_t\":\"van/status\",\"uniq_id\":"
+    "\"ESPsensorbattery_voltage\",\"dev\":{\"ids\":\"a0b1c2d3e4f5\",\"name\":"
+    "\"van\",\"sw\":\"2024.6.1 (Jun 20 2024, 10:11:12)\",\"mdl\":\"esp32-c3-"
+    "devkitm-1\",\"mf\":\"Espressif\",\"cns\":[[\"mac\",\"a0b1c2d3e4f5\"]]}}";
+
+static uint32_t _make_publish(uint8_t *buf, uint8_t flags, const char *topic,
+                              uint16_t packet_id, const char *payload) {
+  uint32_t topic_len = strlen(topic);
+  uint32_t payload_len = strlen(payload);
+  uint32_t remaining = 2 + topic_len + ((flags & 0x06) ? 2 : 0) + payload_len;
+  uint32_t n = 0;
+  buf[n++] = 0x30 | flags;
+  do {
+    buf[n++] = (remaining & 0x7F) | (remaining > 0x7F ? 0x80 : 0);
+    remaining >>= 7;
+  } while (remaining);
+  buf[n++] = topic_len >> 8;
+  buf[n++] = topic_len & 0xFF;
+  memcpy(buf + n, topic, topic_len);
+  n += topic_len;
+  if (flags & 0x06) {
+    buf[n++] = packet_id >> 8;
+    buf[n++] = packet_id & 0xFF;
+  }
+  memcpy(buf + n, payload, payload_len);
+  return n + payload_len;
+}
+
+// Encodes all of in, `step` bytes at a time.
+static uint32_t _encode_all(h42_mqtt_compact_encoder_t *encoder, uint8_t modes,
+                            const uint8_t *in, uint32_t in_len, uint32_t step,
+                            uint8_t *out, uint32_t out_size) {
+  uint32_t pos = 0, out_pos = 0;
+  while (pos < in_len) {
+    uint32_t n = in_len - pos < step ? in_len - pos : step;
+    uint32_t out_len = 0;
+    uint32_t consumed =
+        h42_mqtt_compact_encode(encoder, modes, in + pos, n, out + out_pos,
+                                out_size - out_pos, &out_len);
+    TEST_ASSERT_EQUAL(n, consumed);
+    pos += n;
+    out_pos += out_len;
+  }
+  return out_pos;
+}
+
+TEST_CASE("test_compact_disabled", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t in[256], out[1024];
+  uint32_t n = 0;
+  memcpy(in, CONNECT, sizeof(CONNECT));
+  n += sizeof(CONNECT);
+  n += _make_publish(in + n, 0x02, "h42/state", 1, "ON");
+
+  h42_mqtt_compact_encoder_init(&encoder);
+  uint32_t out_len = _encode_all(&encoder, 0, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+
+  // Modes only count from the next CONNECT on
+  n = _make_publish(in, 0x00, "h42/state", 0, "OFF");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+}
+
+TEST_CASE("test_compact_publish", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t in[256], out[1024];
+  h42_mqtt_compact_encoder_init(&encoder);
+
+  uint32_t out_len =
+      _encode_all(&encoder, ALIASES, CONNECT, sizeof(CONNECT), 4, out, 1024);
+  TEST_ASSERT_EQUAL(sizeof(CONNECT), out_len);
+
+  uint32_t n = _make_publish(in, 0x03, "h42/state", 0x1234, "ON");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  const uint8_t first[] = {
+      0x00, 11, 0x00, 0x00, 'h',  '4',  '2', '/', 's', 't', 'a', 't', 'e',
+      0xF3, 6,  0x00, 0x00, 0x12, 0x34, 'O', 'N',
+  };
+  TEST_ASSERT_EQUAL(sizeof(first), out_len);
+  TEST_ASSERT_EQUAL_MEMORY(first, out, sizeof(first));
+
+  // Known topic, no REGISTER
+  n = _make_publish(in, 0x00, "h42/state", 0, "OFF");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  const uint8_t second[] = {0xF0, 5, 0x00, 0x00, 'O', 'F', 'F'};
+  TEST_ASSERT_EQUAL(sizeof(second), out_len);
+  TEST_ASSERT_EQUAL_MEMORY(second, out, sizeof(second));
+
+  n = _make_publish(in, 0x00, "h42/other", 0, "");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(13 + 4, out_len);
+  TEST_ASSERT_EQUAL(0x01, out[3]);
+  TEST_ASSERT_EQUAL(0x01, out[13 + 3]);
+
+  // A new session starts over
+  out_len = _encode_all(&encoder, ALIASES, CONNECT, sizeof(CONNECT), 4, out, 1024);
+  n = _make_publish(in, 0x00, "h42/other", 0, "");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(0x00, out[0]);
+  TEST_ASSERT_EQUAL(0x00, out[3]);
+}
+
+TEST_CASE("test_compact_any_cut", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t in[1024], whole[2048], cut[2048];
+  uint32_t n = 0;
+  memcpy(in, CONNECT, sizeof(CONNECT));
+  n += sizeof(CONNECT);
+  char payload[200];
+  memset(payload, 'x', sizeof(payload) - 1);
+  payload[sizeof(payload) - 1] = '\0';
+  for (int i = 0; i < 4; i++) {
+    n += _make_publish(in + n, 0x02, i % 2 ? "a/b/c" : "homeassistant/switch",
+                       i, i == 2 ? payload : "1");
+  }
+  const uint8_t pingreq[] = {0xC0, 0x00};
+  memcpy(in + n, pingreq, sizeof(pingreq));
+  n += sizeof(pingreq);
+
+  h42_mqtt_compact_encoder_init(&encoder);
+  uint32_t whole_len =
+      _encode_all(&encoder, ALIASES, in, n, n, whole, sizeof(whole));
+  TEST_ASSERT(whole_len < n);
+  for (uint32_t step = 1; step < 16; step++) {
+    h42_mqtt_compact_encoder_init(&encoder);
+    uint32_t cut_len = _encode_all(&encoder, ALIASES, in, n, step, cut, 2048);
+    TEST_ASSERT_EQUAL(whole_len, cut_len);
+    TEST_ASSERT_EQUAL_MEMORY(whole, cut, whole_len);
+  }
+
+  // Output space runs out
+  h42_mqtt_compact_encoder_init(&encoder);
+  uint32_t pos = 0, cut_len = 0;
+  while (pos < n) {
+    uint32_t out_len = 0;
+    pos += h42_mqtt_compact_encode(&encoder, ALIASES, in + pos, n - pos,
+                                   cut + cut_len, 3, &out_len);
+    cut_len += out_len;
+  }
+  for (uint32_t out_len = 1; out_len > 0; cut_len += out_len) {
+    h42_mqtt_compact_encode(&encoder, ALIASES, NULL, 0, cut + cut_len, 3,
+                            &out_len);
+  }
+  TEST_ASSERT_EQUAL(whole_len, cut_len);
+  TEST_ASSERT_EQUAL_MEMORY(whole, cut, whole_len);
+}
+
+TEST_CASE("test_compact_unaliased", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t in[512], out[1024];
+  h42_mqtt_compact_encoder_init(&encoder);
+  uint32_t out_len =
+      _encode_all(&encoder, ALIASES, CONNECT, sizeof(CONNECT), 4, out, 1024);
+
+  char topic[H42_MQTT_COMPACT_TOPIC_MAX + 2];
+  memset(topic, 't', sizeof(topic) - 1);
+  topic[sizeof(topic) - 1] = '\0';
+  uint32_t n = _make_publish(in, 0x00, topic, 0, "long");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+
+  // Table full
+  for (int i = 0; i < H42_MQTT_COMPACT_MAX_ALIASES; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "topic/%d", i);
+    n = _make_publish(in, 0x00, name, 0, "");
+    out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+    TEST_ASSERT_EQUAL(0x00, out[0]);
+  }
+  n = _make_publish(in, 0x00, "one/too/many", 0, "");
+  out_len = _encode_all(&encoder, ALIASES, in, n, n, out, sizeof(out));
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+}
+
+TEST_CASE("test_compress", "[mqtt_compact]") {
+  const uint32_t len = strlen(DISCOVERY);
+  uint8_t packed[512], unpacked[512];
+  uint32_t packed_len =
+      h42_mqtt_compress((const uint8_t *)DISCOVERY, len, packed, 512);
+  // Mostly dictionary, it has to pay off
+  TEST_ASSERT(packed_len > 0);
+  TEST_ASSERT(packed_len < len / 2);
+  TEST_ASSERT_EQUAL(len,
+                    h42_mqtt_decompress(packed, packed_len, unpacked, 512));
+  TEST_ASSERT_EQUAL_MEMORY(DISCOVERY, unpacked, len);
+
+  // Repeats within the data and literal runs longer than a token
+  uint8_t data[400];
+  for (uint32_t i = 0; i < sizeof(data); i++) {
+    data[i] = i < 200 ? (i * 7919) >> 3 : 'z';
+  }
+  packed_len = h42_mqtt_compress(data, sizeof(data), packed, sizeof(packed));
+  TEST_ASSERT(packed_len > 0);
+  TEST_ASSERT_EQUAL(sizeof(data), h42_mqtt_decompress(packed, packed_len,
+                                                      unpacked, 512));
+  TEST_ASSERT_EQUAL_MEMORY(data, unpacked, sizeof(data));
+
+  // Does not fit
+  TEST_ASSERT_EQUAL(0, h42_mqtt_compress(data, sizeof(data), packed, 100));
+  TEST_ASSERT_EQUAL(0, h42_mqtt_decompress(packed, packed_len, unpacked, 100));
+}
+
+TEST_CASE("test_compact_compressed_publish", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  static uint8_t in[2048], out[2048], cut[2048];
+  const char *topic = "homeassistant/sensor/van/battery_voltage/config";
+  h42_mqtt_compact_encoder_init(&encoder);
+  uint32_t out_len = _encode_all(&encoder, ALIASES | COMPRESS, CONNECT,
+                                 sizeof(CONNECT), 4, out, sizeof(out));
+  TEST_ASSERT_EQUAL(sizeof(CONNECT), out_len);
+
+  uint32_t n = _make_publish(in, 0x03, topic, 0x1234, DISCOVERY);
+  out_len = _encode_all(&encoder, ALIASES | COMPRESS, in, n, n, out, 2048);
+  TEST_ASSERT(out_len < n / 2);
+  TEST_ASSERT_EQUAL(0xF3, out[0]);
+  uint32_t header_len = out[1] & 0x80 ? 3 : 2;
+  TEST_ASSERT_EQUAL(0xFF, out[header_len]);
+  TEST_ASSERT_EQUAL(0xFF, out[header_len + 1]);
+  // Everything after the fixed header of the PUBLISH, packet identifier
+  // included
+  uint8_t unpacked[1024];
+  uint32_t unpacked_len =
+      h42_mqtt_decompress(out + header_len + 2, out_len - header_len - 2,
+                          unpacked, sizeof(unpacked));
+  uint32_t in_header_len = in[1] & 0x80 ? 3 : 2;
+  TEST_ASSERT_EQUAL(n - in_header_len, unpacked_len);
+  TEST_ASSERT_EQUAL_MEMORY(in + in_header_len, unpacked, unpacked_len);
+
+  // Any cut, any output space
+  h42_mqtt_compact_encoder_init(&encoder);
+  _encode_all(&encoder, ALIASES | COMPRESS, CONNECT, sizeof(CONNECT), 4, cut,
+              sizeof(cut));
+  uint32_t cut_len =
+      _encode_all(&encoder, ALIASES | COMPRESS, in, n, 5, cut, sizeof(cut));
+  TEST_ASSERT_EQUAL(out_len, cut_len);
+  TEST_ASSERT_EQUAL_MEMORY(out, cut, out_len);
+
+  // Short payloads are left to the aliases
+  n = _make_publish(in, 0x00, topic, 0, "12.8");
+  out_len = _encode_all(&encoder, ALIASES | COMPRESS, in, n, n, out, 2048);
+  TEST_ASSERT_EQUAL(0x00, out[0]);
+  // Packets too large to hold go out as they are
+  _encode_all(&encoder, COMPRESS, CONNECT, sizeof(CONNECT), 4, out, 2048);
+  char payload[H42_MQTT_COMPACT_COMPRESS_MAX_PACKET];
+  memset(payload, 'x', sizeof(payload) - 1);
+  payload[sizeof(payload) - 1] = '\0';
+  n = _make_publish(in, 0x00, "x", 0, payload);
+  out_len = _encode_all(&encoder, COMPRESS, in, n, 100, out, 2048);
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+}
+
+TEST_CASE("test_compact_incompressible", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t in[256], out[512];
+  char payload[65];
+  for (uint32_t i = 0; i < sizeof(payload) - 1; i++) {
+    payload[i] = 33 + (i * 37) % 90;
+  }
+  payload[sizeof(payload) - 1] = '\0';
+  h42_mqtt_compact_encoder_init(&encoder);
+  _encode_all(&encoder, COMPRESS, CONNECT, sizeof(CONNECT), 4, out, 512);
+
+  // Without aliases as it is
+  uint32_t n = _make_publish(in, 0x00, "q/r", 0, payload);
+  uint32_t out_len = _encode_all(&encoder, COMPRESS, in, n, 7, out, 512);
+  TEST_ASSERT_EQUAL(n, out_len);
+  TEST_ASSERT_EQUAL_MEMORY(in, out, n);
+
+  // With aliases as a compact PUBLISH
+  h42_mqtt_compact_encoder_init(&encoder);
+  _encode_all(&encoder, ALIASES | COMPRESS, CONNECT, sizeof(CONNECT), 4, out,
+              512);
+  out_len = _encode_all(&encoder, ALIASES | COMPRESS, in, n, 7, out, 512);
+  TEST_ASSERT_EQUAL(0x00, out[0]);
+  TEST_ASSERT_EQUAL(2 + 2 + 3 + 2 + 2 + 64, out_len);
+  TEST_ASSERT_EQUAL(0xF0, out[7]);
+  TEST_ASSERT_EQUAL_MEMORY(payload, out + 11, 64);
+}
+
+TEST_CASE("test_compact_discovery", "[mqtt_compact]") {
+  static h42_mqtt_compact_encoder_t encoder;
+  uint8_t packet[H42_MQTT_COMPACT_DISCOVERY_SIZE], out[64];
+  h42_mqtt_compact_discovery(H42_MQTT_COMPACT_DISCOVERY_COMMIT, 0xA1B2C3D4,
+                             packet);
+  const uint8_t expected[] = {0x01, 5, 1, 0xA1, 0xB2, 0xC3, 0xD4};
+  TEST_ASSERT_EQUAL_MEMORY(expected, packet, sizeof(expected));
+
+  // Only between two packets
+  h42_mqtt_compact_encoder_init(&encoder);
+  TEST_ASSERT_TRUE(h42_mqtt_compact_idle(&encoder));
+  uint32_t out_len;
+  h42_mqtt_compact_encode(&encoder, ALIASES, CONNECT, 3, out, sizeof(out),
+                          &out_len);
+  TEST_ASSERT_FALSE(h42_mqtt_compact_idle(&encoder));
+  h42_mqtt_compact_encode(&encoder, ALIASES, CONNECT + 3, 1, out, sizeof(out),
+                          &out_len);
+  TEST_ASSERT_TRUE(h42_mqtt_compact_idle(&encoder));
+  uint8_t in[64];
+  uint32_t n = _make_publish(in, 0x00, "a/b", 0, "1");
+  h42_mqtt_compact_encode(&encoder, ALIASES, in, 4, out, sizeof(out),
+                          &out_len);
+  TEST_ASSERT_FALSE(h42_mqtt_compact_idle(&encoder));
+  uint32_t pos = 4;
+  pos += h42_mqtt_compact_encode(&encoder, ALIASES, in + pos, n - pos, out, 2,
+                                 &out_len);
+  TEST_ASSERT_FALSE(h42_mqtt_compact_idle(&encoder));
+  while (pos < n || out_len > 0) {
+    pos += h42_mqtt_compact_encode(&encoder, ALIASES, in + pos, n - pos, out,
+                                   2, &out_len);
+  }
+  TEST_ASSERT_TRUE(h42_mqtt_compact_idle(&encoder));
+}
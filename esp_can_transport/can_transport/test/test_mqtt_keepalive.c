@@ -0,0 +1,104 @@
+#include <unity.h>
+
+#include "h42_mqtt_keepalive.h"
+#include <string.h>
+
+// Keepalive 15 s
+static const uint8_t CONNECT[] = {0x10, 0x0C, 0x00, 0x04, 'M',  'Q', 'T',
+                                  'T',  0x04, 0x02, 0x00, 0x0F, 0x00, 0x00};
+static const uint8_t PINGREQ[] = {0xC0, 0x00};
+static const uint8_t PINGRESP[] = {0xD0, 0x00};
+static const uint8_t SUBACK[] = {0x90, 0x03, 0x00, 0x01, 0x00};
+
+#define PERIOD_MS (H42_MQTT_KEEPALIVE_PROXY_FACTOR * 15 * 1000)
+
+TEST_CASE("test_keepalive_proxy", "[mqtt_keepalive]") {
+  h42_mqtt_keepalive_t keepalive;
+  uint8_t buf[8];
+  h42_mqtt_keepalive_init(&keepalive);
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, CONNECT, sizeof(CONNECT), 0));
+  TEST_ASSERT_EQUAL(15, keepalive.keepalive_s);
+
+  // The first goes through, the next ones are answered here
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 1000));
+  TEST_ASSERT_EQUAL(0, h42_mqtt_keepalive_read(&keepalive, buf, sizeof(buf)));
+  TEST_ASSERT_TRUE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 8000));
+  // esp-mqtt reads the fixed header a byte at a time
+  TEST_ASSERT_EQUAL(1, h42_mqtt_keepalive_read(&keepalive, buf, 1));
+  TEST_ASSERT_EQUAL(1, h42_mqtt_keepalive_read(&keepalive, buf + 1, 8));
+  TEST_ASSERT_EQUAL_MEMORY(PINGRESP, buf, sizeof(PINGRESP));
+  TEST_ASSERT_EQUAL(0, h42_mqtt_keepalive_read(&keepalive, buf, sizeof(buf)));
+
+  // Every PERIOD_MS one goes through again
+  TEST_ASSERT_FALSE(h42_mqtt_keepalive_on_write(&keepalive, PINGREQ,
+                                                sizeof(PINGREQ),
+                                                1000 + PERIOD_MS));
+  TEST_ASSERT_TRUE(h42_mqtt_keepalive_on_write(
+      &keepalive, PINGREQ, sizeof(PINGREQ), 1000 + PERIOD_MS + 7500));
+
+  // Anything else goes through
+  TEST_ASSERT_EQUAL(2, h42_mqtt_keepalive_read(&keepalive, buf, sizeof(buf)));
+  TEST_ASSERT_FALSE(h42_mqtt_keepalive_on_write(&keepalive, SUBACK,
+                                                sizeof(SUBACK), 1000));
+}
+
+TEST_CASE("test_keepalive_between_packets", "[mqtt_keepalive]") {
+  h42_mqtt_keepalive_t keepalive;
+  h42_mqtt_keepalive_init(&keepalive);
+  h42_mqtt_keepalive_on_write(&keepalive, CONNECT, sizeof(CONNECT), 0);
+  h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 0);
+
+  // In the middle of a packet from the master the PINGREQ goes through
+  h42_mqtt_keepalive_on_read(&keepalive, SUBACK, 2);
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 1));
+  h42_mqtt_keepalive_on_read(&keepalive, SUBACK + 2, sizeof(SUBACK) - 2);
+  TEST_ASSERT_TRUE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 2));
+
+  // Remaining length over several bytes, read a byte at a time
+  uint8_t publish[3 + 200] = {0x30, 0xC8, 0x01};
+  uint8_t buf[2];
+  h42_mqtt_keepalive_read(&keepalive, buf, sizeof(buf));
+  for (uint32_t i = 0; i < sizeof(publish); i++) {
+    h42_mqtt_keepalive_on_read(&keepalive, publish + i, 1);
+    TEST_ASSERT_EQUAL(i + 1 == sizeof(publish),
+                      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ,
+                                                  sizeof(PINGREQ), 3));
+  }
+
+  // No keepalive, nothing to proxy
+  h42_mqtt_keepalive_init(&keepalive);
+  uint8_t connect[sizeof(CONNECT)];
+  memcpy(connect, CONNECT, sizeof(CONNECT));
+  connect[11] = 0;
+  h42_mqtt_keepalive_on_write(&keepalive, connect, sizeof(connect), 0);
+  h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 0);
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 1));
+}
+
+TEST_CASE("test_keepalive_split_write", "[mqtt_keepalive]") {
+  h42_mqtt_keepalive_t keepalive;
+  h42_mqtt_keepalive_init(&keepalive);
+  h42_mqtt_keepalive_on_write(&keepalive, CONNECT, sizeof(CONNECT), 0);
+  h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 0);
+
+  // A PUBLISH written in pieces, the last ones look like a CONNECT and a
+  // PINGREQ
+  static const uint8_t publish[] = {0x30, 0x09, 0x00, 0x01, 't', 0x10,
+                                    0x02, 0x00, 0x00, 0xC0, 0x00};
+  TEST_ASSERT_FALSE(h42_mqtt_keepalive_on_write(&keepalive, publish, 5, 1));
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, publish + 5, 4, 2));
+  TEST_ASSERT_EQUAL(15, keepalive.keepalive_s);
+  TEST_ASSERT_FALSE(
+      h42_mqtt_keepalive_on_write(&keepalive, publish + 9, 2, 3));
+
+  // The PINGREQ after it is answered
+  TEST_ASSERT_TRUE(
+      h42_mqtt_keepalive_on_write(&keepalive, PINGREQ, sizeof(PINGREQ), 4));
+}
@@ -0,0 +1,104 @@
+#include <unity.h>
+
+#include "h42_mqtt_priority.h"
+#include <string.h>
+
+static uint32_t _publish(uint8_t *buf, const char *topic, const char *payload) {
+  uint32_t topic_len = strlen(topic);
+  uint32_t payload_len = strlen(payload);
+  buf[0] = 0x30;
+  buf[1] = 2 + topic_len + payload_len;
+  buf[2] = 0;
+  buf[3] = topic_len;
+  memcpy(buf + 4, topic, topic_len);
+  memcpy(buf + 4 + topic_len, payload, payload_len);
+  return 4 + topic_len + payload_len;
+}
+
+TEST_CASE("test_priority_classes", "[mqtt_priority]") {
+  static const uint8_t PINGREQ[] = {0xC0, 0x00};
+  static const uint8_t PUBACK[] = {0x40, 0x02, 0x00, 0x01};
+  uint8_t buf[128];
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL,
+                    h42_mqtt_priority(PINGREQ, sizeof(PINGREQ)));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL,
+                    h42_mqtt_priority(PUBACK, sizeof(PUBACK)));
+  uint32_t len = _publish(buf, "van/switch/pump/command", "ON");
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_COMMAND, h42_mqtt_priority(buf, len));
+  len = _publish(buf, "van/switch/pump/state", "ON");
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE, h42_mqtt_priority(buf, len));
+  len = _publish(buf, "homeassistant/switch/van/pump/config", "{}");
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_BULK, h42_mqtt_priority(buf, len));
+  len = _publish(buf, "van/debug", "[I][app]");
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_BULK, h42_mqtt_priority(buf, len));
+}
+
+TEST_CASE("test_priority_short", "[mqtt_priority]") {
+  uint8_t buf[128];
+  uint32_t len = _publish(buf, "van/switch/pump/command", "ON");
+  // Up to the topic is enough, less is taken for state
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_COMMAND,
+                    h42_mqtt_priority(buf, len - 2));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE, h42_mqtt_priority(buf, len - 3));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE, h42_mqtt_priority(buf, 1));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL, h42_mqtt_priority(buf, 0));
+}
+
+TEST_CASE("test_priority_stream_split", "[mqtt_priority]") {
+  h42_mqtt_priority_stream_t stream;
+  h42_mqtt_priority_stream_init(&stream);
+  uint8_t buf[128];
+  uint32_t len = _publish(buf, "van/switch/pump/command", "ON");
+  // The second write starts with payload bytes, it keeps the packet's class
+  TEST_ASSERT_TRUE(h42_mqtt_priority_stream_idle(&stream));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_COMMAND,
+                    h42_mqtt_priority_stream_feed(&stream, buf, len - 2));
+  TEST_ASSERT_FALSE(h42_mqtt_priority_stream_idle(&stream));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_COMMAND,
+                    h42_mqtt_priority_stream_feed(&stream, buf + len - 2, 2));
+  TEST_ASSERT_TRUE(h42_mqtt_priority_stream_idle(&stream));
+
+  // Cut in the topic, the first piece goes as state
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE,
+                    h42_mqtt_priority_stream_feed(&stream, buf, 10));
+  TEST_ASSERT_FALSE(h42_mqtt_priority_stream_idle(&stream));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_COMMAND,
+                    h42_mqtt_priority_stream_feed(&stream, buf + 10, len - 10));
+
+  // Payload that looks like a PINGREQ
+  len = _publish(buf, "van/debug", "\xC0");
+  buf[len++] = 0x00;
+  buf[1]++;
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_BULK,
+                    h42_mqtt_priority_stream_feed(&stream, buf, len - 2));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_BULK,
+                    h42_mqtt_priority_stream_feed(&stream, buf + len - 2, 2));
+}
+
+TEST_CASE("test_priority_stream_pieces", "[mqtt_priority]") {
+  static const uint8_t PINGREQ[] = {0xC0, 0x00};
+  h42_mqtt_priority_stream_t stream;
+  h42_mqtt_priority_stream_init(&stream);
+  // A state PUBLISH with a 2 byte remaining length, then a PINGREQ
+  uint8_t buf[256];
+  uint32_t len = _publish(buf, "van/sensor/temp/state", "");
+  const uint32_t payload_len = 200;
+  const uint32_t remaining = len - 2 + payload_len;
+  memmove(buf + 3, buf + 2, len - 2);
+  buf[1] = 0x80 | (remaining & 0x7F);
+  buf[2] = remaining >> 7;
+  memset(buf + len + 1, 'x', payload_len);
+  len += 1 + payload_len;
+  memcpy(buf + len, PINGREQ, sizeof(PINGREQ));
+
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE,
+                    h42_mqtt_priority_stream_feed(&stream, buf, 2));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE,
+                    h42_mqtt_priority_stream_feed(&stream, buf + 2, 100));
+  // The piece ending the PUBLISH carries the PINGREQ too
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL,
+                    h42_mqtt_priority_stream_feed(&stream, buf + 102,
+                                                  len - 102 + 2));
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL,
+                    h42_mqtt_priority_stream_feed(&stream, PINGREQ, 2));
+}
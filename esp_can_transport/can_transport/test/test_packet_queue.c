@@ -1,7 +1,11 @@
 #include <unity.h>
 
 #include "h42_packet_queue.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <stdio.h>
+#include <string.h>
 
 TEST_CASE("test_create_destroy", "[packet_queue]") {
   h42_packet_queue_handle_t queue = h42_packet_queue_create(10, 100);
@@ -29,6 +33,21 @@ TEST_CASE("test_packet", "[packet_queue]") {
   TEST_ASSERT_NULL(packet);
 }
 
+TEST_CASE("test_packet_set_size", "[packet_queue]") {
+  h42_packet_handle_t packet = h42_packet_alloc(10);
+  TEST_ASSERT_NOT_NULL(packet);
+
+  memcpy(h42_packet_data(packet), "hello", 5);
+  TEST_ASSERT_TRUE(h42_packet_set_size(packet, 5));
+  TEST_ASSERT_EQUAL(5, h42_packet_size(packet));
+  TEST_ASSERT_EQUAL_STRING_LEN("hello", h42_packet_data(packet), 5);
+
+  TEST_ASSERT_FALSE(h42_packet_set_size(packet, 11));
+  TEST_ASSERT_EQUAL(5, h42_packet_size(packet));
+
+  h42_packet_free(&packet);
+}
+
 TEST_CASE("test_push_pop", "[packet_queue]") {
   h42_packet_queue_handle_t queue = h42_packet_queue_create(10, 100);
   TEST_ASSERT_NOT_NULL(queue);
@@ -116,3 +135,244 @@ TEST_CASE("test_queue_wait_data", "[packet_queue]") {
 
   h42_packet_queue_destroy(&queue);
 }
+
+typedef struct queue_producer {
+  h42_packet_queue_handle_t queue;
+  uint32_t count;
+  uint32_t delay_ms;
+  // The queue wakes the consumer through its notification value.
+  SemaphoreHandle_t done;
+} queue_producer_t;
+
+// Pushes count packets holding their sequence number, retrying while the
+// queue is full.
+static void vTaskQueueProducer(void *pvParameters) {
+  queue_producer_t *producer = (queue_producer_t *)pvParameters;
+  vTaskDelay(pdMS_TO_TICKS(producer->delay_ms));
+  for (uint32_t i = 0; i < producer->count; i++) {
+    h42_packet_handle_t packet = h42_packet_alloc(sizeof(i));
+    h42_packet_append_data(packet, (const uint8_t *)&i, sizeof(i));
+    while (!h42_packet_queue_push_acquire(producer->queue, &packet)) {
+      taskYIELD();
+    }
+  }
+  xSemaphoreGive(producer->done);
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("test_queue_wait_wakeup", "[packet_queue]") {
+  h42_packet_queue_handle_t queue = h42_packet_queue_create(2, 100);
+  queue_producer_t producer = {
+      .queue = queue,
+      .count = 1,
+      .delay_ms = 50,
+      .done = xSemaphoreCreateBinary(),
+  };
+  TEST_ASSERT_TRUE(xTaskCreate(vTaskQueueProducer, "producer", 2048,
+                               &producer, 5, NULL) == pdPASS);
+  // Woken by the push, well before the timeout.
+  TickType_t start = xTaskGetTickCount();
+  TEST_ASSERT_TRUE(h42_packet_queue_wait_data_available(queue, 5000));
+  TEST_ASSERT_TRUE(xTaskGetTickCount() - start < pdMS_TO_TICKS(1000));
+  xSemaphoreTake(producer.done, portMAX_DELAY);
+
+  h42_packet_handle_t popped = h42_packet_queue_pop_release(queue, 0);
+  TEST_ASSERT_NOT_NULL(popped);
+  h42_packet_free(&popped);
+  vSemaphoreDelete(producer.done);
+  h42_packet_queue_destroy(&queue);
+}
+
+TEST_CASE("test_queue_spsc_order", "[packet_queue]") {
+  // Small enough for the producer to fill it over and over.
+  h42_packet_queue_handle_t queue = h42_packet_queue_create(4, 12);
+  queue_producer_t producer = {
+      .queue = queue,
+      .count = 20000,
+      .delay_ms = 0,
+      .done = xSemaphoreCreateBinary(),
+  };
+  TEST_ASSERT_TRUE(xTaskCreate(vTaskQueueProducer, "producer", 2048,
+                               &producer, 5, NULL) == pdPASS);
+  for (uint32_t i = 0; i < producer.count; i++) {
+    h42_packet_handle_t popped = h42_packet_queue_pop_release(queue, 5000);
+    TEST_ASSERT_NOT_NULL(popped);
+    uint32_t value;
+    memcpy(&value, h42_packet_data(popped), sizeof(value));
+    TEST_ASSERT_EQUAL(i, value);
+    h42_packet_free(&popped);
+  }
+  xSemaphoreTake(producer.done, portMAX_DELAY);
+  TEST_ASSERT_NULL(h42_packet_queue_pop_release(queue, 0));
+  vSemaphoreDelete(producer.done);
+  h42_packet_queue_destroy(&queue);
+}
+
+TEST_CASE("test_pool_alloc_free", "[packet_pool]") {
+  h42_packet_pool_handle_t pool = h42_packet_pool_create(2, 1000, 1000);
+  TEST_ASSERT_NOT_NULL(pool);
+
+  h42_packet_pool_stats_t stats;
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(3, stats.blocks_total);
+  TEST_ASSERT_EQUAL(0, stats.blocks_in_use);
+
+  h42_packet_handle_t packet = h42_packet_pool_alloc(pool, 5);
+  TEST_ASSERT_NOT_NULL(packet);
+  TEST_ASSERT_EQUAL(0, h42_packet_size(packet));
+  TEST_ASSERT_TRUE(h42_packet_capacity(packet) >= 5);
+  TEST_ASSERT_TRUE(h42_packet_append_data(packet, (const uint8_t *)"hello", 5));
+  TEST_ASSERT_EQUAL_STRING_LEN("hello", h42_packet_data(packet), 5);
+
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(1, stats.blocks_in_use);
+
+  h42_packet_free(&packet);
+  TEST_ASSERT_NULL(packet);
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(0, stats.blocks_in_use);
+  TEST_ASSERT_EQUAL(1, stats.high_water_mark);
+
+  h42_packet_pool_destroy(&pool);
+  TEST_ASSERT_NULL(pool);
+}
+
+TEST_CASE("test_pool_exhaustion", "[packet_pool]") {
+  // 2 small blocks and 1 large block
+  h42_packet_pool_handle_t pool = h42_packet_pool_create(2, 1000, 1000);
+  TEST_ASSERT_NOT_NULL(pool);
+
+  // Large requests only fit the large class
+  h42_packet_handle_t large = h42_packet_pool_alloc(pool, 1000);
+  TEST_ASSERT_NOT_NULL(large);
+  TEST_ASSERT_EQUAL(1000, h42_packet_capacity(large));
+  TEST_ASSERT_NULL(h42_packet_pool_alloc(pool, 500));
+
+  h42_packet_handle_t small1 = h42_packet_pool_alloc(pool, 10);
+  h42_packet_handle_t small2 = h42_packet_pool_alloc(pool, 10);
+  TEST_ASSERT_NOT_NULL(small1);
+  TEST_ASSERT_NOT_NULL(small2);
+  TEST_ASSERT_NULL(h42_packet_pool_alloc(pool, 10));
+
+  h42_packet_pool_stats_t stats;
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(3, stats.blocks_in_use);
+  TEST_ASSERT_EQUAL(3, stats.high_water_mark);
+  TEST_ASSERT_EQUAL(2, stats.alloc_failures);
+
+  // Small requests fall back to the large class
+  h42_packet_free(&large);
+  h42_packet_handle_t small3 = h42_packet_pool_alloc(pool, 10);
+  TEST_ASSERT_NOT_NULL(small3);
+  TEST_ASSERT_EQUAL(1000, h42_packet_capacity(small3));
+
+  h42_packet_free(&small1);
+  h42_packet_free(&small2);
+  h42_packet_free(&small3);
+  h42_packet_pool_destroy(&pool);
+}
+
+TEST_CASE("test_pool_push_pop", "[packet_pool]") {
+  h42_packet_pool_handle_t pool = h42_packet_pool_create(4, 100, 100);
+  h42_packet_queue_handle_t queue = h42_packet_queue_create(4, 100);
+  TEST_ASSERT_NOT_NULL(pool);
+  TEST_ASSERT_NOT_NULL(queue);
+
+  h42_packet_handle_t packet = h42_packet_pool_alloc(pool, 5);
+  TEST_ASSERT_TRUE(h42_packet_append_data(packet, (const uint8_t *)"hello", 5));
+  TEST_ASSERT_TRUE(h42_packet_queue_push_acquire(queue, &packet));
+  TEST_ASSERT_NULL(packet);
+
+  h42_packet_handle_t popped = h42_packet_queue_pop_release(queue, 100);
+  TEST_ASSERT_NOT_NULL(popped);
+  TEST_ASSERT_EQUAL_STRING_LEN("hello", h42_packet_data(popped), 5);
+  h42_packet_free(&popped);
+
+  h42_packet_queue_destroy(&queue);
+  h42_packet_pool_destroy(&pool);
+}
+
+// Pushes packets of the given sizes, in turn, until the next one would exceed
+// max_size_bytes or the pool has no block for it. Returns the number of bytes
+// pushed.
+static uint32_t _fill_queue(h42_packet_queue_handle_t queue,
+                            h42_packet_pool_handle_t pool,
+                            uint32_t max_size_bytes, const uint32_t *sizes,
+                            int num_sizes) {
+  uint32_t total = 0;
+  for (int i = 0; total + sizes[i % num_sizes] <= max_size_bytes; i++) {
+    uint32_t size = sizes[i % num_sizes];
+    h42_packet_handle_t packet = h42_packet_pool_alloc(pool, size);
+    if (packet == NULL) {
+      break;
+    }
+    TEST_ASSERT_TRUE(h42_packet_set_size(packet, size));
+    TEST_ASSERT_TRUE(h42_packet_queue_push_acquire(queue, &packet));
+    total += size;
+  }
+  return total;
+}
+
+static void _drain_queue(h42_packet_queue_handle_t queue) {
+  h42_packet_handle_t packet;
+  while ((packet = h42_packet_queue_pop_release(queue, 0)) != NULL) {
+    h42_packet_free(&packet);
+  }
+}
+
+TEST_CASE("test_pool_medium_classes", "[packet_pool]") {
+  // Sized like the daemon's receive pool
+  h42_packet_pool_handle_t pool = h42_packet_pool_create(35, 16384, 4095);
+  TEST_ASSERT_NOT_NULL(pool);
+
+  h42_packet_pool_stats_t stats;
+  h42_packet_pool_get_stats(pool, &stats);
+  // 35 small, 8 of 512, 4 of 1024 and 5 large blocks
+  TEST_ASSERT_EQUAL(52, stats.blocks_total);
+
+  h42_packet_handle_t packets[3] = {
+      h42_packet_pool_alloc(pool, 129),
+      h42_packet_pool_alloc(pool, 513),
+      h42_packet_pool_alloc(pool, 1025),
+  };
+  TEST_ASSERT_EQUAL(512, h42_packet_capacity(packets[0]));
+  TEST_ASSERT_EQUAL(1024, h42_packet_capacity(packets[1]));
+  TEST_ASSERT_EQUAL(4095, h42_packet_capacity(packets[2]));
+  for (int i = 0; i < 3; i++) {
+    h42_packet_free(&packets[i]);
+  }
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(0, stats.blocks_in_use);
+  h42_packet_pool_destroy(&pool);
+}
+
+TEST_CASE("test_pool_fill_medium", "[packet_pool]") {
+  // The daemon's receive queue and pool
+  h42_packet_queue_handle_t queue = h42_packet_queue_create(32, 16384);
+  h42_packet_pool_handle_t pool = h42_packet_pool_create(35, 16384, 4095);
+  TEST_ASSERT_NOT_NULL(queue);
+  TEST_ASSERT_NOT_NULL(pool);
+
+  // A mix of medium packets fits the pool's blocks
+  const uint32_t mix[] = {129, 511, 513, 1024, 1500, 4095};
+  uint32_t total = _fill_queue(queue, pool, 16384, mix, 6);
+  TEST_ASSERT_EQUAL(16184, total);
+  h42_packet_pool_stats_t stats;
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(0, stats.alloc_failures);
+  _drain_queue(queue);
+
+  // Packets of one medium size run their classes dry first. The pool is the
+  // limit then, and each miss counts once.
+  const uint32_t uniform[] = {1000};
+  total = _fill_queue(queue, pool, 16384, uniform, 1);
+  TEST_ASSERT_EQUAL(9000, total);
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(1, stats.alloc_failures);
+  _drain_queue(queue);
+
+  h42_packet_pool_get_stats(pool, &stats);
+  TEST_ASSERT_EQUAL(0, stats.blocks_in_use);
+  h42_packet_queue_destroy(&queue);
+  h42_packet_pool_destroy(&pool);
+}
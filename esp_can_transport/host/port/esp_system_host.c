@@ -0,0 +1,191 @@
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+
+#include "h42_host.h"
+#include "h42_host_internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t g_system_lock = PTHREAD_MUTEX_INITIALIZER;
+static esp_log_level_t g_log_level = ESP_LOG_INFO;
+static uint32_t g_random_state = 1;
+static uint8_t g_mac[6] = {0x02, 0x42, 0x00, 0x00, 0x00, 0x01};
+
+//
+// Logging
+//
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  if (strcmp(tag, "*") == 0) {
+    __atomic_store_n(&g_log_level, level, __ATOMIC_RELAXED);
+  }
+}
+
+void esp_log_writev(esp_log_level_t level, const char *tag,
+                    const char *format, va_list args) {
+  static const char letters[] = "NEWIDV";
+  if (level > __atomic_load_n(&g_log_level, __ATOMIC_RELAXED)) {
+    return;
+  }
+  flockfile(stderr);
+  fprintf(stderr, "%c (%u) %s: ", letters[level],
+          (unsigned)(h42_host_time_us() / 1000), tag);
+  vfprintf(stderr, format, args);
+  fputc('\n', stderr);
+  funlockfile(stderr);
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format,
+                   ...) {
+  va_list args;
+  va_start(args, format);
+  esp_log_writev(level, tag, format, args);
+  va_end(args);
+}
+
+//
+// Chip
+//
+void h42_host_set_random_seed(uint32_t seed) {
+  pthread_mutex_lock(&g_system_lock);
+  // xorshift never leaves 0.
+  g_random_state = seed != 0 ? seed : 1;
+  pthread_mutex_unlock(&g_system_lock);
+}
+
+uint32_t esp_random(void) {
+  pthread_mutex_lock(&g_system_lock);
+  uint32_t x = g_random_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  g_random_state = x;
+  pthread_mutex_unlock(&g_system_lock);
+  return x;
+}
+
+void h42_host_set_mac(const uint8_t mac[6]) {
+  pthread_mutex_lock(&g_system_lock);
+  memcpy(g_mac, mac, sizeof(g_mac));
+  pthread_mutex_unlock(&g_system_lock);
+}
+
+esp_err_t esp_efuse_mac_get_default(uint8_t *mac) {
+  pthread_mutex_lock(&g_system_lock);
+  memcpy(mac, g_mac, sizeof(g_mac));
+  pthread_mutex_unlock(&g_system_lock);
+  return ESP_OK;
+}
+
+esp_err_t nvs_flash_init(void) { return ESP_OK; }
+
+//
+// esp_timer
+//
+typedef struct esp_timer {
+  esp_timer_cb_t callback;
+  void *arg;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  bool armed;
+  struct timespec deadline;
+} esp_timer_t;
+
+static bool _timespec_before(const struct timespec *a,
+                             const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void *_timer_thread(void *arg) {
+  esp_timer_t *timer = (esp_timer_t *)arg;
+  pthread_mutex_lock(&timer->lock);
+  for (;;) {
+    if (!timer->armed) {
+      pthread_cond_wait(&timer->changed, &timer->lock);
+      continue;
+    }
+    if (pthread_cond_timedwait(&timer->changed, &timer->lock,
+                               &timer->deadline) != ETIMEDOUT) {
+      continue;
+    }
+    // Restarted while we were waking up?
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!timer->armed || _timespec_before(&now, &timer->deadline)) {
+      continue;
+    }
+    timer->armed = false;
+    pthread_mutex_unlock(&timer->lock);
+    timer->callback(timer->arg);
+    pthread_mutex_lock(&timer->lock);
+  }
+  return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle) {
+  if (create_args == NULL || create_args->callback == NULL ||
+      out_handle == NULL) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  esp_timer_t *timer = calloc(1, sizeof(esp_timer_t));
+  if (timer == NULL) {
+    return ESP_ERR_NO_MEM;
+  }
+  timer->callback = create_args->callback;
+  timer->arg = create_args->arg;
+  pthread_mutex_init(&timer->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer->changed, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, _timer_thread, timer) != 0) {
+    free(timer);
+    return ESP_ERR_NO_MEM;
+  }
+  if (create_args->name != NULL) {
+    pthread_setname_np(thread, create_args->name);
+  }
+  pthread_detach(thread);
+  *out_handle = timer;
+  return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+  esp_err_t err = ESP_OK;
+  pthread_mutex_lock(&timer->lock);
+  if (timer->armed) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    h42_host_deadline(timeout_us, &timer->deadline);
+    timer->armed = true;
+    pthread_cond_signal(&timer->changed);
+  }
+  pthread_mutex_unlock(&timer->lock);
+  return err;
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+  esp_err_t err = ESP_OK;
+  pthread_mutex_lock(&timer->lock);
+  if (!timer->armed) {
+    err = ESP_ERR_INVALID_STATE;
+  } else {
+    timer->armed = false;
+    pthread_cond_signal(&timer->changed);
+  }
+  pthread_mutex_unlock(&timer->lock);
+  return err;
+}
+
+int64_t esp_timer_get_time(void) { return (int64_t)h42_host_time_us(); }
@@ -0,0 +1,448 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "h42_host.h"
+#include "h42_host_internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct h42_host_task {
+  TaskFunction_t task_code;
+  void *parameters;
+  pthread_mutex_t lock;
+  pthread_cond_t notified;
+  uint32_t notify_value;
+  bool notify_pending;
+} h42_host_task_t;
+
+typedef struct h42_host_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  UBaseType_t length;
+  UBaseType_t item_size;
+  UBaseType_t count;
+  UBaseType_t head;
+  uint8_t *items;
+} h42_host_queue_t;
+
+typedef struct h42_host_event_group {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  EventBits_t bits;
+} h42_host_event_group_t;
+
+static _Thread_local h42_host_task_t *t_current_task;
+
+//
+// Time
+//
+static void _cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+uint64_t h42_host_time_us(void) {
+  static uint64_t start_us;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t now_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  // The first caller sets time zero, like a boot.
+  uint64_t expected = 0;
+  __atomic_compare_exchange_n(&start_us, &expected, now_us, false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return now_us - __atomic_load_n(&start_us, __ATOMIC_RELAXED);
+}
+
+void h42_host_deadline(uint64_t timeout_us, struct timespec *deadline) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  uint64_t ns = deadline->tv_nsec + (timeout_us % 1000000) * 1000;
+  deadline->tv_sec += timeout_us / 1000000 + ns / 1000000000;
+  deadline->tv_nsec = ns % 1000000000;
+}
+
+/**
+ * @brief Wait on `cond` until `deadline`, forever if it is NULL.
+ *
+ * @return false once the deadline has passed.
+ */
+static bool _cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock,
+                             const struct timespec *deadline) {
+  if (deadline == NULL) {
+    pthread_cond_wait(cond, lock);
+    return true;
+  }
+  return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static const struct timespec *_ticks_deadline(TickType_t ticks,
+                                              struct timespec *storage) {
+  if (ticks == portMAX_DELAY) {
+    return NULL;
+  }
+  h42_host_deadline((uint64_t)pdTICKS_TO_MS(ticks) * 1000, storage);
+  return storage;
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return (TickType_t)(h42_host_time_us() / (1000 * portTICK_PERIOD_MS));
+}
+
+void vTaskDelay(TickType_t ticks) {
+  struct timespec deadline;
+  h42_host_deadline((uint64_t)pdTICKS_TO_MS(ticks) * 1000, &deadline);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+void vTaskYieldHost(void) { sched_yield(); }
+
+//
+// Tasks
+//
+static h42_host_task_t *_task_new(TaskFunction_t task_code, void *parameters) {
+  h42_host_task_t *task = calloc(1, sizeof(h42_host_task_t));
+  assert(task != NULL);
+  task->task_code = task_code;
+  task->parameters = parameters;
+  pthread_mutex_init(&task->lock, NULL);
+  _cond_init(&task->notified);
+  return task;
+}
+
+static void *_task_entry(void *arg) {
+  h42_host_task_t *task = (h42_host_task_t *)arg;
+  t_current_task = task;
+  task->task_code(task->parameters);
+  // Returning from a task function is a bug in FreeRTOS.
+  abort();
+  return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name,
+                       uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task) {
+  (void)stack_depth;
+  (void)priority;
+  h42_host_task_t *task = _task_new(task_code, parameters);
+  // Set before the task runs, the daemon task reads its own handle from it.
+  if (created_task != NULL) {
+    *created_task = task;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, _task_entry, task) != 0) {
+    if (created_task != NULL) {
+      *created_task = NULL;
+    }
+    free(task);
+    return pdFAIL;
+  }
+  pthread_setname_np(thread, name);
+  pthread_detach(thread);
+  return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  assert(task == NULL || task == t_current_task);
+  // The handle stays valid, someone may still notify it.
+  pthread_exit(NULL);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+  if (t_current_task == NULL) {
+    t_current_task = _task_new(NULL, NULL);
+  }
+  return t_current_task;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value,
+                       eNotifyAction action) {
+  BaseType_t ret = pdPASS;
+  pthread_mutex_lock(&task->lock);
+  switch (action) {
+  case eNoAction:
+    break;
+  case eSetBits:
+    task->notify_value |= value;
+    break;
+  case eIncrement:
+    task->notify_value++;
+    break;
+  case eSetValueWithOverwrite:
+    task->notify_value = value;
+    break;
+  case eSetValueWithoutOverwrite:
+    if (task->notify_pending) {
+      ret = pdFAIL;
+    } else {
+      task->notify_value = value;
+    }
+    break;
+  }
+  if (ret == pdPASS) {
+    task->notify_pending = true;
+    pthread_cond_broadcast(&task->notified);
+  }
+  pthread_mutex_unlock(&task->lock);
+  return ret;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t bits_to_clear_on_entry,
+                           uint32_t bits_to_clear_on_exit,
+                           uint32_t *notification_value, TickType_t ticks) {
+  h42_host_task_t *task = xTaskGetCurrentTaskHandle();
+  struct timespec storage;
+  const struct timespec *deadline = _ticks_deadline(ticks, &storage);
+  BaseType_t ret = pdPASS;
+
+  pthread_mutex_lock(&task->lock);
+  if (!task->notify_pending) {
+    task->notify_value &= ~bits_to_clear_on_entry;
+  }
+  while (!task->notify_pending) {
+    if (ticks == 0 || !_cond_wait_until(&task->notified, &task->lock,
+                                        deadline)) {
+      ret = task->notify_pending ? pdPASS : pdFAIL;
+      break;
+    }
+  }
+  if (notification_value != NULL) {
+    *notification_value = task->notify_value;
+  }
+  if (ret == pdPASS) {
+    task->notify_value &= ~bits_to_clear_on_exit;
+  }
+  task->notify_pending = false;
+  pthread_mutex_unlock(&task->lock);
+  return ret;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks) {
+  h42_host_task_t *task = xTaskGetCurrentTaskHandle();
+  struct timespec storage;
+  const struct timespec *deadline = _ticks_deadline(ticks, &storage);
+
+  pthread_mutex_lock(&task->lock);
+  while (task->notify_value == 0 && ticks != 0 &&
+         _cond_wait_until(&task->notified, &task->lock, deadline)) {
+  }
+  uint32_t value = task->notify_value;
+  if (value != 0) {
+    task->notify_value = clear_count_on_exit ? 0 : value - 1;
+  }
+  task->notify_pending = false;
+  pthread_mutex_unlock(&task->lock);
+  return value;
+}
+
+//
+// Queues and semaphores
+//
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  assert(length > 0);
+  h42_host_queue_t *queue = calloc(1, sizeof(h42_host_queue_t));
+  if (queue == NULL) {
+    return NULL;
+  }
+  queue->items = malloc(length * item_size + 1);
+  if (queue->items == NULL) {
+    free(queue);
+    return NULL;
+  }
+  queue->length = length;
+  queue->item_size = item_size;
+  pthread_mutex_init(&queue->lock, NULL);
+  _cond_init(&queue->not_empty);
+  _cond_init(&queue->not_full);
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->items);
+  free(queue);
+}
+
+static void _queue_put(h42_host_queue_t *queue, const void *item) {
+  UBaseType_t tail = (queue->head + queue->count) % queue->length;
+  if (queue->item_size > 0) {
+    memcpy(queue->items + tail * queue->item_size, item, queue->item_size);
+  }
+  queue->count++;
+  pthread_cond_broadcast(&queue->not_empty);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t ticks) {
+  struct timespec storage;
+  const struct timespec *deadline = _ticks_deadline(ticks, &storage);
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->length) {
+    if (ticks == 0 ||
+        !_cond_wait_until(&queue->not_full, &queue->lock, deadline)) {
+      if (queue->count == queue->length) {
+        pthread_mutex_unlock(&queue->lock);
+        return errQUEUE_FULL;
+      }
+    }
+  }
+  _queue_put(queue, item);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+  assert(queue->length == 1);
+  pthread_mutex_lock(&queue->lock);
+  queue->count = 0;
+  _queue_put(queue, item);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+static BaseType_t _queue_get(QueueHandle_t queue, void *item, TickType_t ticks,
+                             bool remove) {
+  struct timespec storage;
+  const struct timespec *deadline = _ticks_deadline(ticks, &storage);
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0) {
+    if (ticks == 0 ||
+        !_cond_wait_until(&queue->not_empty, &queue->lock, deadline)) {
+      if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return errQUEUE_EMPTY;
+      }
+    }
+  }
+  if (queue->item_size > 0) {
+    memcpy(item, queue->items + queue->head * queue->item_size,
+           queue->item_size);
+  }
+  if (remove) {
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return _queue_get(queue, item, ticks, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks) {
+  return _queue_get(queue, item, ticks, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  pthread_mutex_lock(&queue->lock);
+  UBaseType_t count = queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+  pthread_mutex_lock(&queue->lock);
+  UBaseType_t spaces = queue->length - queue->count;
+  pthread_mutex_unlock(&queue->lock);
+  return spaces;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return xQueueCreate(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  if (mutex != NULL) {
+    xSemaphoreGive(mutex);
+  }
+  return mutex;
+}
+
+//
+// Event groups
+//
+EventGroupHandle_t xEventGroupCreate(void) {
+  h42_host_event_group_t *group = calloc(1, sizeof(h42_host_event_group_t));
+  if (group == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&group->lock, NULL);
+  _cond_init(&group->changed);
+  return group;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+  pthread_mutex_destroy(&group->lock);
+  pthread_cond_destroy(&group->changed);
+  free(group);
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group,
+                                 EventBits_t bits_to_clear) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t bits = group->bits;
+  group->bits &= ~bits_to_clear;
+  pthread_mutex_unlock(&group->lock);
+  return bits;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group,
+                               EventBits_t bits_to_set) {
+  pthread_mutex_lock(&group->lock);
+  group->bits |= bits_to_set;
+  EventBits_t bits = group->bits;
+  pthread_cond_broadcast(&group->changed);
+  pthread_mutex_unlock(&group->lock);
+  return bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+  pthread_mutex_lock(&group->lock);
+  EventBits_t bits = group->bits;
+  pthread_mutex_unlock(&group->lock);
+  return bits;
+}
+
+static bool _event_bits_match(EventBits_t bits, EventBits_t wanted,
+                              BaseType_t wait_for_all_bits) {
+  return wait_for_all_bits ? (bits & wanted) == wanted : (bits & wanted) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group,
+                                EventBits_t bits_to_wait_for,
+                                BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all_bits,
+                                TickType_t ticks) {
+  struct timespec storage;
+  const struct timespec *deadline = _ticks_deadline(ticks, &storage);
+
+  pthread_mutex_lock(&group->lock);
+  while (!_event_bits_match(group->bits, bits_to_wait_for, wait_for_all_bits) &&
+         ticks != 0 && _cond_wait_until(&group->changed, &group->lock, deadline)) {
+  }
+  EventBits_t bits = group->bits;
+  if (clear_on_exit &&
+      _event_bits_match(bits, bits_to_wait_for, wait_for_all_bits)) {
+    group->bits &= ~bits_to_wait_for;
+  }
+  pthread_mutex_unlock(&group->lock);
+  return bits;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// CLOCK_MONOTONIC time `timeout_us` from now, for timed waits on condition
+// variables created with that clock.
+void h42_host_deadline(uint64_t timeout_us, struct timespec *deadline);
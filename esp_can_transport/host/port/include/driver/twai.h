@@ -0,0 +1,68 @@
+#pragma once
+
+// Host port of the TWAI driver API used by can_transport. There is no
+// controller: frames the node transmits and frames it receives go through
+// the simulated bus in h42_host.h. Types, flags and alert values match
+// ESP-IDF.
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TWAI_FRAME_MAX_DLC 8
+#define TWAI_EXTD_ID_MASK 0x1FFFFFFF
+#define TWAI_STD_ID_MASK 0x7FF
+
+#define TWAI_ALERT_TX_IDLE 0x00000001
+#define TWAI_ALERT_TX_SUCCESS 0x00000002
+#define TWAI_ALERT_RX_DATA 0x00000004
+#define TWAI_ALERT_BELOW_ERR_WARN 0x00000008
+#define TWAI_ALERT_ERR_ACTIVE 0x00000010
+#define TWAI_ALERT_RECOVERY_IN_PROGRESS 0x00000020
+#define TWAI_ALERT_BUS_RECOVERED 0x00000040
+#define TWAI_ALERT_ARB_LOST 0x00000080
+#define TWAI_ALERT_ABOVE_ERR_WARN 0x00000100
+#define TWAI_ALERT_BUS_ERROR 0x00000200
+#define TWAI_ALERT_TX_FAILED 0x00000400
+#define TWAI_ALERT_RX_QUEUE_FULL 0x00000800
+#define TWAI_ALERT_ERR_PASS 0x00001000
+#define TWAI_ALERT_BUS_OFF 0x00002000
+#define TWAI_ALERT_ALL 0x00003FFF
+
+typedef struct {
+  union {
+    struct {
+      uint32_t extd : 1;
+      uint32_t rtr : 1;
+      uint32_t ss : 1;
+      uint32_t self : 1;
+      uint32_t dlc_non_comp : 1;
+      uint32_t reserved : 27;
+    };
+    uint32_t flags;
+  };
+  uint32_t identifier;
+  uint8_t data_length_code;
+  uint8_t data[TWAI_FRAME_MAX_DLC];
+} twai_message_t;
+
+// Blocks while the transmit queue is full.
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks);
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks);
+esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks);
+// Clears the raised alerts.
+esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled,
+                                  uint32_t *current_alerts);
+esp_err_t twai_start(void);
+esp_err_t twai_stop(void);
+// Recovery completes at once and raises TWAI_ALERT_BUS_RECOVERED.
+esp_err_t twai_initiate_recovery(void);
+
+#ifdef __cplusplus
+}
+#endif
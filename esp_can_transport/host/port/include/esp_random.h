@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pseudo random on the host, see h42_host_set_random_seed().
+uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
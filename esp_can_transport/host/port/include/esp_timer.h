@@ -0,0 +1,41 @@
+#pragma once
+
+// Host port of the one-shot part of esp_timer. Every timer has its own
+// thread, which runs the callback the way ESP_TIMER_TASK dispatch does.
+
+#include "esp_err.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct esp_timer *esp_timer_handle_t;
+typedef void (*esp_timer_cb_t)(void *arg);
+
+typedef enum {
+  ESP_TIMER_TASK,
+} esp_timer_dispatch_t;
+
+typedef struct {
+  esp_timer_cb_t callback;
+  void *arg;
+  esp_timer_dispatch_t dispatch_method;
+  const char *name;
+  bool skip_unhandled_events;
+} esp_timer_create_args_t;
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args,
+                           esp_timer_handle_t *out_handle);
+// ESP_ERR_INVALID_STATE if the timer is already running.
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us);
+// ESP_ERR_INVALID_STATE if the timer is not running.
+esp_err_t esp_timer_stop(esp_timer_handle_t timer);
+// Microseconds since the first call into the port.
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
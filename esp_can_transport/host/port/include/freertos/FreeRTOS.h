@@ -0,0 +1,41 @@
+#pragma once
+
+// Host port of the FreeRTOS API used by can_transport. Tasks are pthreads,
+// ticks are milliseconds of CLOCK_MONOTONIC. There is no scheduler, so task
+// priorities and stack sizes are ignored.
+
+// ESP-IDF's FreeRTOSConfig.h brings assert() along, the component relies on
+// it.
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t)0)
+#define pdTRUE ((BaseType_t)1)
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define errQUEUE_EMPTY pdFALSE
+#define errQUEUE_FULL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portTICK_PERIOD_MS ((TickType_t)1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms)                                                      \
+  ((TickType_t)(((TickType_t)(ms) * (TickType_t)configTICK_RATE_HZ) /          \
+                (TickType_t)1000))
+#define pdTICKS_TO_MS(ticks)                                                   \
+  ((TickType_t)(((TickType_t)(ticks) * (TickType_t)1000) /                     \
+                (TickType_t)configTICK_RATE_HZ))
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct h42_host_event_group *EventGroupHandle_t;
+typedef TickType_t EventBits_t;
+
+EventGroupHandle_t xEventGroupCreate(void);
+void vEventGroupDelete(EventGroupHandle_t group);
+// Return the bits before clearing / after setting, as FreeRTOS does.
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group,
+                                 EventBits_t bits_to_clear);
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group,
+                               EventBits_t bits_to_set);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group,
+                                EventBits_t bits_to_wait_for,
+                                BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all_bits,
+                                TickType_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
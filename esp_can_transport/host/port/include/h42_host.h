@@ -0,0 +1,44 @@
+#pragma once
+
+// Control of the host port, for tests and benchmarks. Nothing in
+// can_transport uses this.
+
+#include "driver/twai.h"
+#include "esp_err.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Queue lengths of TWAI_GENERAL_CONFIG_DEFAULT().
+#define H42_HOST_TWAI_TX_QUEUE_LEN 5
+#define H42_HOST_TWAI_RX_QUEUE_LEN 5
+
+// Clock of the port: ticks, esp_timer and the ISO-TP microsecond clock.
+// Starts at 0 on first use.
+uint64_t h42_host_time_us(void);
+// esp_random() is a fixed sequence for a given seed. 1 when not set.
+void h42_host_set_random_seed(uint32_t seed);
+void h42_host_set_mac(const uint8_t mac[6]);
+
+//
+// Simulated bus. The caller is the rest of the bus, and sees the frames the
+// node transmits in the order twai_transmit() accepted them.
+//
+// Frame from the bus to the node. Like the controller, a full receive queue
+// loses the frame and raises TWAI_ALERT_RX_QUEUE_FULL. ESP_FAIL then.
+esp_err_t h42_host_twai_deliver(const twai_message_t *message);
+// Next frame the node transmitted, ESP_ERR_TIMEOUT if none came in time.
+esp_err_t h42_host_twai_take_transmitted(twai_message_t *message,
+                                         int timeout_ms);
+// Puts the controller in bus-off: transmits fail with ESP_ERR_INVALID_STATE
+// and TWAI_ALERT_BUS_OFF is raised until twai_initiate_recovery().
+void h42_host_twai_bus_off(void);
+// Frames lost to a full receive queue.
+uint32_t h42_host_twai_rx_missed(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// There is no flash on the host, this always succeeds.
+esp_err_t nvs_flash_init(void);
+
+#ifdef __cplusplus
+}
+#endif
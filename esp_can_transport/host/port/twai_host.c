@@ -0,0 +1,169 @@
+#include "driver/twai.h"
+#include "freertos/queue.h"
+
+#include "h42_host.h"
+#include "h42_host_internal.h"
+
+#include <pthread.h>
+
+typedef struct twai_host {
+  QueueHandle_t tx_queue;
+  QueueHandle_t rx_queue;
+  pthread_mutex_t lock;
+  pthread_cond_t alert_raised;
+  uint32_t alerts_enabled;
+  uint32_t alerts_raised;
+  bool bus_off;
+  uint32_t rx_missed;
+} twai_host_t;
+
+// TWAI_GENERAL_CONFIG_DEFAULT() enables no alerts.
+static twai_host_t g_twai = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t g_twai_once = PTHREAD_ONCE_INIT;
+
+static void _twai_init(void) {
+  g_twai.tx_queue =
+      xQueueCreate(H42_HOST_TWAI_TX_QUEUE_LEN, sizeof(twai_message_t));
+  g_twai.rx_queue =
+      xQueueCreate(H42_HOST_TWAI_RX_QUEUE_LEN, sizeof(twai_message_t));
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&g_twai.alert_raised, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// The driver is always installed and running on the host.
+static twai_host_t *_twai(void) {
+  pthread_once(&g_twai_once, _twai_init);
+  return &g_twai;
+}
+
+// Like the driver, alerts that are not enabled are not recorded.
+static void _twai_raise(twai_host_t *twai, uint32_t alerts) {
+  pthread_mutex_lock(&twai->lock);
+  twai->alerts_raised |= alerts & twai->alerts_enabled;
+  if (twai->alerts_raised != 0) {
+    pthread_cond_broadcast(&twai->alert_raised);
+  }
+  pthread_mutex_unlock(&twai->lock);
+}
+
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks) {
+  twai_host_t *twai = _twai();
+  if (message == NULL || message->data_length_code > TWAI_FRAME_MAX_DLC) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  pthread_mutex_lock(&twai->lock);
+  bool bus_off = twai->bus_off;
+  pthread_mutex_unlock(&twai->lock);
+  if (bus_off) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  return xQueueSend(twai->tx_queue, message, ticks) == pdTRUE
+             ? ESP_OK
+             : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks) {
+  return xQueueReceive(_twai()->rx_queue, message, ticks) == pdTRUE
+             ? ESP_OK
+             : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_read_alerts(uint32_t *alerts, TickType_t ticks) {
+  twai_host_t *twai = _twai();
+  struct timespec deadline;
+  if (ticks != portMAX_DELAY) {
+    h42_host_deadline((uint64_t)pdTICKS_TO_MS(ticks) * 1000, &deadline);
+  }
+  pthread_mutex_lock(&twai->lock);
+  while (twai->alerts_raised == 0 && ticks != 0) {
+    if (ticks == portMAX_DELAY) {
+      pthread_cond_wait(&twai->alert_raised, &twai->lock);
+    } else if (pthread_cond_timedwait(&twai->alert_raised, &twai->lock,
+                                      &deadline) != 0) {
+      break;
+    }
+  }
+  *alerts = twai->alerts_raised;
+  twai->alerts_raised = 0;
+  pthread_mutex_unlock(&twai->lock);
+  return *alerts != 0 ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_reconfigure_alerts(uint32_t alerts_enabled,
+                                  uint32_t *current_alerts) {
+  twai_host_t *twai = _twai();
+  pthread_mutex_lock(&twai->lock);
+  if (current_alerts != NULL) {
+    *current_alerts = twai->alerts_raised;
+  }
+  twai->alerts_enabled = alerts_enabled;
+  twai->alerts_raised = 0;
+  pthread_mutex_unlock(&twai->lock);
+  return ESP_OK;
+}
+
+esp_err_t twai_start(void) {
+  _twai();
+  return ESP_OK;
+}
+
+esp_err_t twai_stop(void) {
+  _twai();
+  return ESP_OK;
+}
+
+esp_err_t twai_initiate_recovery(void) {
+  twai_host_t *twai = _twai();
+  pthread_mutex_lock(&twai->lock);
+  bool bus_off = twai->bus_off;
+  twai->bus_off = false;
+  pthread_mutex_unlock(&twai->lock);
+  if (!bus_off) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  _twai_raise(twai, TWAI_ALERT_BUS_RECOVERED);
+  return ESP_OK;
+}
+
+esp_err_t h42_host_twai_deliver(const twai_message_t *message) {
+  twai_host_t *twai = _twai();
+  if (xQueueSend(twai->rx_queue, message, 0) != pdTRUE) {
+    pthread_mutex_lock(&twai->lock);
+    twai->rx_missed++;
+    pthread_mutex_unlock(&twai->lock);
+    _twai_raise(twai, TWAI_ALERT_RX_QUEUE_FULL);
+    return ESP_FAIL;
+  }
+  _twai_raise(twai, TWAI_ALERT_RX_DATA);
+  return ESP_OK;
+}
+
+esp_err_t h42_host_twai_take_transmitted(twai_message_t *message,
+                                         int timeout_ms) {
+  twai_host_t *twai = _twai();
+  if (xQueueReceive(twai->tx_queue, message, pdMS_TO_TICKS(timeout_ms)) !=
+      pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  _twai_raise(twai, TWAI_ALERT_TX_SUCCESS);
+  return ESP_OK;
+}
+
+void h42_host_twai_bus_off(void) {
+  twai_host_t *twai = _twai();
+  pthread_mutex_lock(&twai->lock);
+  twai->bus_off = true;
+  pthread_mutex_unlock(&twai->lock);
+  _twai_raise(twai, TWAI_ALERT_BUS_OFF);
+}
+
+uint32_t h42_host_twai_rx_missed(void) {
+  twai_host_t *twai = _twai();
+  pthread_mutex_lock(&twai->lock);
+  uint32_t missed = twai->rx_missed;
+  pthread_mutex_unlock(&twai->lock);
+  return missed;
+}
@@ -0,0 +1,586 @@
+// One node of the simulated bus in can_mqtt_bridge/canbus_sim.py: the
+// transport daemon on the host port, with a sensor-like workload on top.
+//
+// Frames travel as 16 byte records (sim_record_t) on stdin and stdout.
+// Records on stdout are frames this node transmits. Records on stdin are
+// frames from the rest of the bus, and TX_DONE once our frame has gone out,
+// so like the TWAI controller we hold one frame at a time and the rest waits
+// in the driver queue. The node exits when stdin closes.
+//
+// Once connected the node sends a packet of --size bytes every --period-ms:
+//   4 bytes: sequence number
+//   8 bytes: CLOCK_MONOTONIC time of the send, in microseconds
+//   2 bytes: --index
+//   rest: filler
+// All little endian, which both ends of the pipe are.
+//
+// With --mqtt it is an MQTT client instead, through the bridge: CONNECT, then
+// a QoS 1 PUBLISH with --size bytes of payload every --period-ms, or back to
+// back with a period of 0, each waiting for its PUBACK. The round trip of
+// every PUBLISH goes to stdout as a REPORT record: sequence number and
+// microseconds, 4 bytes each. --compact asks the bridge for topic aliases and
+// --compress for compressed PUBLISH packets, see h42_mqtt_compact.h.
+// --discovery publishes a Home Assistant discovery config like ESPHome's
+// instead of filler, cut or padded with spaces to --size. --discovery-cache
+// publishes it once more, retained, after the CONNECT, unless the bridge has
+// it cached, see h42_can_discovery_check().
+
+#include "h42_can_daemon.h"
+#include "h42_host.h"
+#include "h42_mqtt_compact.h"
+#include "h42_mqtt_priority.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_RECORD_FRAME 0
+#define SIM_RECORD_TX_DONE 1
+#define SIM_RECORD_REPORT 2
+#define SIM_PAYLOAD_HEADER_SIZE 14
+
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_KEEP_ALIVE_S 600
+#define MQTT_RESPONSE_TIMEOUT_MS (30 * 1000)
+
+typedef struct __attribute__((packed)) sim_record {
+  uint32_t identifier;
+  uint8_t kind;
+  uint8_t data_length_code;
+  uint8_t reserved[2];
+  uint8_t data[TWAI_FRAME_MAX_DLC];
+} sim_record_t;
+
+typedef struct sim_node_config {
+  uint16_t index;
+  uint32_t size;
+  uint32_t period_ms;
+  uint32_t seed;
+  bool mqtt;
+  bool discovery;
+  bool discovery_cache;
+  h42_can_daemon_config_t daemon;
+} sim_node_config_t;
+
+// Byte stream from the broker, split into MQTT packets.
+typedef struct mqtt_stream {
+  uint8_t buf[4096];
+  uint32_t len;
+} mqtt_stream_t;
+
+static const char *TAG = "sim-node";
+static SemaphoreHandle_t g_tx_done;
+// Frames and reports share stdout.
+static SemaphoreHandle_t g_stdout_lock;
+
+static bool _read_full(int fd, void *buf, size_t size) {
+  uint8_t *p = buf;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static bool _write_full(int fd, const void *buf, size_t size) {
+  const uint8_t *p = buf;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+static void _write_record(const sim_record_t *record) {
+  xSemaphoreTake(g_stdout_lock, portMAX_DELAY);
+  bool ok = _write_full(STDOUT_FILENO, record, sizeof(*record));
+  xSemaphoreGive(g_stdout_lock);
+  if (!ok) {
+    exit(0);
+  }
+}
+
+static void vTaskBusRx(void *pvParameters) {
+  sim_record_t record;
+  while (_read_full(STDIN_FILENO, &record, sizeof(record))) {
+    if (record.kind == SIM_RECORD_TX_DONE) {
+      xSemaphoreGive(g_tx_done);
+      continue;
+    }
+    twai_message_t m = {
+        .extd = 1,
+        .identifier = record.identifier,
+        .data_length_code = record.data_length_code,
+    };
+    memcpy(m.data, record.data, sizeof(m.data));
+    // A full receive queue loses the frame, like the controller does.
+    h42_host_twai_deliver(&m);
+  }
+  // The simulation is over.
+  exit(0);
+}
+
+static void vTaskBusTx(void *pvParameters) {
+  for (;;) {
+    twai_message_t m;
+    if (h42_host_twai_take_transmitted(&m, 1000) != ESP_OK) {
+      continue;
+    }
+    sim_record_t record = {
+        .identifier = m.identifier,
+        .kind = SIM_RECORD_FRAME,
+        .data_length_code = m.data_length_code,
+    };
+    memcpy(record.data, m.data, sizeof(record.data));
+    _write_record(&record);
+    xSemaphoreTake(g_tx_done, portMAX_DELAY);
+  }
+}
+
+static uint64_t _monotonic_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void _report(uint32_t seq, uint32_t rtt_us) {
+  sim_record_t record = {
+      .kind = SIM_RECORD_REPORT,
+      .data_length_code = 8,
+  };
+  memcpy(&record.data[0], &seq, 4);
+  memcpy(&record.data[4], &rtt_us, 4);
+  _write_record(&record);
+}
+
+static uint32_t _mqtt_put_remaining_length(uint8_t *p, uint32_t length) {
+  uint32_t n = 0;
+  do {
+    uint8_t b = length % 128;
+    length /= 128;
+    p[n++] = length > 0 ? b | 0x80 : b;
+  } while (length > 0);
+  return n;
+}
+
+// Next packet from the broker: its type and, for acks, the packet id.
+static esp_err_t _mqtt_read(mqtt_stream_t *stream, uint8_t *type,
+                            uint16_t *packet_id, int timeout_ms) {
+  for (;;) {
+    uint32_t length = 0;
+    uint32_t header = 1;
+    bool complete = false;
+    while (header < stream->len && header <= 4) {
+      uint8_t b = stream->buf[header];
+      length |= (uint32_t)(b & 0x7F) << (7 * (header - 1));
+      header++;
+      if (!(b & 0x80)) {
+        complete = true;
+        break;
+      }
+    }
+    if (complete && header + length > sizeof(stream->buf)) {
+      // Nothing the broker says to us is this long.
+      stream->len = 0;
+      return ESP_ERR_INVALID_SIZE;
+    }
+    if (complete && stream->len >= header + length) {
+      *type = stream->buf[0] >> 4;
+      *packet_id = length >= 2
+                       ? (stream->buf[header] << 8) | stream->buf[header + 1]
+                       : 0;
+      stream->len -= header + length;
+      memmove(stream->buf, &stream->buf[header + length], stream->len);
+      return ESP_OK;
+    }
+    uint32_t received;
+    esp_err_t err =
+        h42_can_daemon_recv(&stream->buf[stream->len],
+                            sizeof(stream->buf) - stream->len, &received,
+                            timeout_ms);
+    if (err != ESP_OK) {
+      return err;
+    }
+    stream->len += received;
+  }
+}
+
+static esp_err_t _mqtt_wait(mqtt_stream_t *stream, uint8_t type,
+                            uint16_t packet_id) {
+  for (;;) {
+    uint8_t got_type;
+    uint16_t got_id;
+    esp_err_t err =
+        _mqtt_read(stream, &got_type, &got_id, MQTT_RESPONSE_TIMEOUT_MS);
+    if (err != ESP_OK) {
+      return err;
+    }
+    if (got_type == type && (type != MQTT_PUBACK || got_id == packet_id)) {
+      return ESP_OK;
+    }
+  }
+}
+
+static esp_err_t _mqtt_send(const uint8_t *data, uint32_t size) {
+  static h42_mqtt_compact_encoder_t encoder;
+  static uint8_t out[512];
+  uint32_t written;
+  // Like the transport, by the class of the packet.
+  const h42_can_priority_t priority = h42_mqtt_priority(data, size);
+  const uint8_t features = h42_can_daemon_link_features();
+  if (features == 0) {
+    return h42_can_daemon_write_priority(data, size, priority, &written,
+                                         60 * 1000);
+  }
+  const uint8_t modes =
+      ((features & H42_CAN_FEATURE_COMPACT_MQTT) ? H42_MQTT_COMPACT_ALIASES
+                                                 : 0) |
+      ((features & H42_CAN_FEATURE_COMPRESSION) ? H42_MQTT_COMPACT_COMPRESS
+                                                : 0);
+  // Starts with the CONNECT, nothing is sent before.
+  uint32_t pos = 0;
+  for (;;) {
+    uint32_t out_len;
+    pos += h42_mqtt_compact_encode(&encoder, modes, data + pos, size - pos, out,
+                                   sizeof(out), &out_len);
+    if (out_len == 0) {
+      return ESP_OK;
+    }
+    esp_err_t err = h42_can_daemon_write_priority(out, out_len, priority,
+                                                  &written, 60 * 1000);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+}
+
+/**
+ * @brief Discovery config of a temperature sensor, the way ESPHome sends it.
+ */
+static void _make_discovery(const sim_node_config_t *config, char *topic,
+                            size_t topic_size, uint8_t *payload) {
+  char json[640];
+  int n = snprintf(
+      json, sizeof(json),
+      "{\"dev_cla\":\"temperature\",\"unit_of_meas\":\"\xc2\xb0"
+      "C\",\"stat_cla\":\"measurement\",\"name\":\"Temperature %u\","
+      "\"stat_t\":\"h42-sim-%u/sensor/temperature_%u/state\","
+      "\"avty_t\":\"h42-sim-%u/status\","
+      "\"uniq_id\":\"ESPsensortemperature_%u\",\"dev\":{\"ids\":"
+      "\"02425151%04x\",\"name\":\"h42-sim-%u\",\"sw\":\"2024.6.1 "
+      "(Jun 20 2024, 10:11:12)\",\"mdl\":\"esp32-c3-devkitm-1\","
+      "\"mf\":\"Espressif\",\"cns\":[[\"mac\",\"02425151%04x\"]]}}",
+      config->index, config->index, config->index, config->index,
+      config->index, config->index, config->index, config->index);
+  snprintf(topic, topic_size,
+           "homeassistant/sensor/h42-sim-%u/temperature_%u/config",
+           config->index, config->index);
+  uint32_t len = (uint32_t)n < config->size ? (uint32_t)n : config->size;
+  memcpy(payload, json, len);
+  memset(payload + len, ' ', config->size - len);
+}
+
+static uint32_t _mqtt_put_publish_header(uint8_t *p, uint8_t flags,
+                                         const char *topic,
+                                         uint32_t remaining_length) {
+  uint32_t topic_len = strlen(topic);
+  uint32_t n = 0;
+  p[n++] = (MQTT_PUBLISH << 4) | flags;
+  n += _mqtt_put_remaining_length(&p[n], remaining_length);
+  p[n++] = topic_len >> 8;
+  p[n++] = topic_len & 0xFF;
+  memcpy(&p[n], topic, topic_len);
+  return n + topic_len;
+}
+
+/**
+ * @brief The discovery config as a retained QoS 0 PUBLISH, unless the bridge
+ * has it cached.
+ */
+static void _mqtt_discovery(const sim_node_config_t *config, uint8_t *packet) {
+  char topic[64];
+  uint8_t *payload = malloc(config->size);
+  _make_discovery(config, topic, sizeof(topic), payload);
+  // FNV-1a
+  uint32_t set_hash = 2166136261u;
+  for (uint32_t i = 0; i < config->size; i++) {
+    set_hash = (set_hash ^ payload[i]) * 16777619u;
+  }
+
+  uint8_t control[H42_MQTT_COMPACT_DISCOVERY_SIZE];
+  uint32_t written;
+  bool cached = false;
+  h42_mqtt_compact_discovery(H42_MQTT_COMPACT_DISCOVERY_CHECK, set_hash,
+                             control);
+  if (h42_can_daemon_write(control, sizeof(control), &written,
+                           MQTT_RESPONSE_TIMEOUT_MS) == ESP_OK &&
+      h42_can_daemon_wait_discovery_status(set_hash, &cached,
+                                           MQTT_RESPONSE_TIMEOUT_MS) ==
+          ESP_OK &&
+      cached) {
+    ESP_LOGI(TAG, "Discovery set %08x cached", (unsigned)set_hash);
+    free(payload);
+    return;
+  }
+
+  uint32_t n = _mqtt_put_publish_header(packet, 0x01, topic,
+                                        2 + strlen(topic) + config->size);
+  memcpy(&packet[n], payload, config->size);
+  n += config->size;
+  free(payload);
+  if (_mqtt_send(packet, n) != ESP_OK) {
+    return;
+  }
+  h42_mqtt_compact_discovery(H42_MQTT_COMPACT_DISCOVERY_COMMIT, set_hash,
+                             control);
+  h42_can_daemon_write(control, sizeof(control), &written,
+                       MQTT_RESPONSE_TIMEOUT_MS);
+}
+
+static void _run_mqtt(const sim_node_config_t *config) {
+  static mqtt_stream_t stream;
+  uint8_t *packet = malloc(config->size + 128);
+  char client_id[16];
+  uint32_t client_id_len =
+      snprintf(client_id, sizeof(client_id), "h42-sim-%u", config->index);
+
+  // Clean session, no credentials.
+  uint32_t n = 0;
+  packet[n++] = MQTT_CONNECT << 4;
+  n += _mqtt_put_remaining_length(&packet[n], 12 + client_id_len);
+  const uint8_t variable_header[] = {
+      0, 4, 'M', 'Q', 'T', 'T', 4, 0x02, MQTT_KEEP_ALIVE_S >> 8,
+      MQTT_KEEP_ALIVE_S & 0xFF};
+  memcpy(&packet[n], variable_header, sizeof(variable_header));
+  n += sizeof(variable_header);
+  packet[n++] = client_id_len >> 8;
+  packet[n++] = client_id_len & 0xFF;
+  memcpy(&packet[n], client_id, client_id_len);
+  n += client_id_len;
+  while (_mqtt_send(packet, n) != ESP_OK ||
+         _mqtt_wait(&stream, MQTT_CONNACK, 0) != ESP_OK) {
+    ESP_LOGW(TAG, "No CONNACK");
+  }
+  ESP_LOGI(TAG, "MQTT connected");
+  if (config->discovery_cache &&
+      (h42_can_daemon_link_features() & H42_CAN_FEATURE_DISCOVERY_CACHE)) {
+    _mqtt_discovery(config, packet);
+  }
+
+  char topic[64];
+  uint8_t *payload = malloc(config->size + 1);
+  if (config->discovery) {
+    _make_discovery(config, topic, sizeof(topic), payload);
+  } else {
+    snprintf(topic, sizeof(topic), "h42/sim/%u", config->index);
+    memset(payload, 'a' + config->index % 26, config->size);
+  }
+  uint32_t topic_len = strlen(topic);
+  uint64_t next_us = _monotonic_us();
+  for (uint32_t seq = 0;; seq++) {
+    uint16_t packet_id = (seq % 0xFFFF) + 1;
+    n = _mqtt_put_publish_header(packet, 0x02, topic,
+                                 2 + topic_len + 2 + config->size);
+    packet[n++] = packet_id >> 8;
+    packet[n++] = packet_id & 0xFF;
+    memcpy(&packet[n], payload, config->size);
+    n += config->size;
+
+    uint64_t start_us = _monotonic_us();
+    esp_err_t err = _mqtt_send(packet, n);
+    if (err == ESP_OK) {
+      err = _mqtt_wait(&stream, MQTT_PUBACK, packet_id);
+    }
+    if (err == ESP_OK) {
+      _report(seq, (uint32_t)(_monotonic_us() - start_us));
+    } else {
+      ESP_LOGW(TAG, "PUBLISH %d failed (%d)", (int)seq, err);
+    }
+
+    next_us += (uint64_t)config->period_ms * 1000;
+    uint64_t now_us = _monotonic_us();
+    if (next_us > now_us) {
+      vTaskDelay(pdMS_TO_TICKS((next_us - now_us) / 1000));
+    } else {
+      next_us = now_us;
+    }
+  }
+}
+
+static void _usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s --index N [--size BYTES] [--period-ms MS] [--seed S]\n"
+          "          [--rx-block-size BS] [--rx-st-min-us US] [--tx-async]\n"
+          "          [--mqtt] [--compact] [--compress] [--discovery]\n"
+          "          [--discovery-cache] [--verbose]\n",
+          argv0);
+  exit(2);
+}
+
+static void _parse_args(int argc, char **argv, sim_node_config_t *config) {
+  enum {
+    OPT_RX_BS = 256,
+    OPT_RX_ST_MIN,
+    OPT_TX_ASYNC,
+    OPT_MQTT,
+    OPT_COMPACT,
+    OPT_COMPRESS,
+    OPT_DISCOVERY,
+    OPT_DISCOVERY_CACHE,
+    OPT_VERBOSE
+  };
+  static const struct option options[] = {
+      {"index", required_argument, NULL, 'i'},
+      {"size", required_argument, NULL, 's'},
+      {"period-ms", required_argument, NULL, 'p'},
+      {"seed", required_argument, NULL, 'r'},
+      {"rx-block-size", required_argument, NULL, OPT_RX_BS},
+      {"rx-st-min-us", required_argument, NULL, OPT_RX_ST_MIN},
+      {"tx-async", no_argument, NULL, OPT_TX_ASYNC},
+      {"mqtt", no_argument, NULL, OPT_MQTT},
+      {"compact", no_argument, NULL, OPT_COMPACT},
+      {"compress", no_argument, NULL, OPT_COMPRESS},
+      {"discovery", no_argument, NULL, OPT_DISCOVERY},
+      {"discovery-cache", no_argument, NULL, OPT_DISCOVERY_CACHE},
+      {"verbose", no_argument, NULL, OPT_VERBOSE},
+      {NULL, 0, NULL, 0},
+  };
+  bool have_index = false;
+  int opt;
+  esp_log_level_set("*", ESP_LOG_WARN);
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      config->index = (uint16_t)strtoul(optarg, NULL, 0);
+      have_index = true;
+      break;
+    case 's':
+      config->size = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      config->period_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      config->seed = strtoul(optarg, NULL, 0);
+      break;
+    case OPT_RX_BS:
+      config->daemon.rx_block_size = (uint8_t)strtoul(optarg, NULL, 0);
+      break;
+    case OPT_RX_ST_MIN:
+      config->daemon.rx_st_min_us = strtoul(optarg, NULL, 0);
+      break;
+    case OPT_TX_ASYNC:
+      config->daemon.tx_async = true;
+      break;
+    case OPT_MQTT:
+      config->mqtt = true;
+      break;
+    case OPT_COMPACT:
+      config->daemon.features |= H42_CAN_FEATURE_COMPACT_MQTT;
+      break;
+    case OPT_COMPRESS:
+      config->daemon.features |= H42_CAN_FEATURE_COMPRESSION;
+      break;
+    case OPT_DISCOVERY:
+      config->discovery = true;
+      break;
+    case OPT_DISCOVERY_CACHE:
+      config->daemon.features |= H42_CAN_FEATURE_DISCOVERY_CACHE;
+      config->discovery_cache = true;
+      break;
+    case OPT_VERBOSE:
+      esp_log_level_set("*", ESP_LOG_INFO);
+      break;
+    default:
+      _usage(argv[0]);
+    }
+  }
+  if (!have_index) {
+    _usage(argv[0]);
+  }
+  // MQTT packets are written as a stream, any size goes.
+  if (!config->mqtt && (config->size < SIM_PAYLOAD_HEADER_SIZE ||
+                        config->size > h42_max_packet_size() ||
+                        config->period_ms == 0)) {
+    _usage(argv[0]);
+  }
+}
+
+int main(int argc, char **argv) {
+  sim_node_config_t config = {
+      .size = 32,
+      .period_ms = 5000,
+      .seed = 1,
+      .daemon = H42_CAN_DAEMON_CONFIG_DEFAULT(),
+  };
+  _parse_args(argc, argv, &config);
+
+  const uint8_t mac[6] = {0x02, 0x42, 0x51, 0x4D, config.index >> 8,
+                          config.index & 0xFF};
+  h42_host_set_mac(mac);
+  // Nodes must not share the identifier seed sequence.
+  h42_host_set_random_seed(config.seed * 1000003u + config.index + 1);
+
+  g_tx_done = xSemaphoreCreateBinary();
+  g_stdout_lock = xSemaphoreCreateMutex();
+  if (xTaskCreate(vTaskBusRx, "bus_rx", 4096, NULL, 5, NULL) != pdPASS ||
+      xTaskCreate(vTaskBusTx, "bus_tx", 4096, NULL, 5, NULL) != pdPASS) {
+    return 1;
+  }
+  if (h42_can_daemon_start(&config.daemon) != ESP_OK) {
+    return 1;
+  }
+  while (h42_can_daemon_connect(10 * 1000) != ESP_OK) {
+    ESP_LOGW(TAG, "Not connected yet");
+  }
+  ESP_LOGI(TAG, "Node %d connected", config.index);
+  if (config.mqtt) {
+    _run_mqtt(&config);
+  }
+
+  uint8_t *payload = malloc(config.size);
+  for (uint32_t i = 0; i < config.size; i++) {
+    payload[i] = (uint8_t)(i + config.index);
+  }
+  // Spread the nodes over the period.
+  vTaskDelay(pdMS_TO_TICKS(esp_random() % config.period_ms));
+  uint64_t next_us = _monotonic_us();
+  for (uint32_t seq = 0;; seq++) {
+    uint64_t now_us = _monotonic_us();
+    memcpy(&payload[0], &seq, 4);
+    memcpy(&payload[4], &now_us, 8);
+    memcpy(&payload[12], &config.index, 2);
+    esp_err_t err = h42_can_daemon_send(payload, config.size, 60 * 1000);
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "Send %d failed (%d)", (int)seq, err);
+    }
+    next_us += (uint64_t)config.period_ms * 1000;
+    now_us = _monotonic_us();
+    if (next_us > now_us) {
+      vTaskDelay(pdMS_TO_TICKS((next_us - now_us) / 1000));
+    } else {
+      // Behind schedule, don't try to catch up.
+      next_us = now_us;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,599 @@
+#include <unity.h>
+
+#include "h42_can_daemon.h"
+#include "h42_host.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The master end of the bus: hands out the address, answers the link
+// params and speaks ISO-TP with the node, like the bridge does. Classic CAN
+// frames only.
+
+#define MASTER 0x00
+#define BROADCAST 0xFF
+#define NODE_ADDRESS 0x2A
+#define MSG_TYPE_ISOTP 0
+#define MSG_TYPE_LINK_PARAMS 1
+#define MSG_TYPE_DISCOVERY_STATUS 2
+#define MSG_TYPE_BROADCAST_DATA 3
+#define MSG_TYPE_ADDRESS_REQUEST 5
+#define MSG_TYPE_ADDRESS_RESPONSE 6
+#define ISOTP_MAX_SIZE 4095
+
+typedef struct master_msg {
+  uint16_t size;
+  uint8_t data[ISOTP_MAX_SIZE];
+} master_msg_t;
+
+typedef struct master {
+  // Flow control frames from the node, for _master_send().
+  QueueHandle_t fc_queue;
+  // master_msg_t pointers, received from the node.
+  QueueHandle_t msg_queue;
+  // Message being reassembled.
+  master_msg_t *rx;
+  uint16_t rx_received;
+  uint8_t rx_sn;
+  // Last link params proposal.
+  uint8_t link_params[4];
+  // Held before answering a first frame, to keep node sends in progress.
+  volatile uint32_t fc_delay_ms;
+  // Refuse the next first frame with FC OVERFLOW.
+  volatile bool fc_overflow;
+  // FC WAIT frames the node answered _master_send() with.
+  volatile uint32_t fc_waits;
+  // Set while _master_send() sends consecutive frames, and the node's
+  // consecutive frames seen meanwhile.
+  volatile bool sending;
+  volatile uint32_t node_cfs_while_sending;
+  // CAN IDs of the last data and flow control frames from the node.
+  volatile uint32_t data_frame_id;
+  volatile uint32_t fc_frame_id;
+} master_t;
+
+static master_t g_master;
+
+static uint32_t _can_id(uint8_t type, uint8_t src, uint8_t dst) {
+  return ((uint32_t)type << 16) | (src << 8) | dst;
+}
+
+static void _master_send_frame(uint8_t type, uint8_t dst, const uint8_t *data,
+                               uint8_t size) {
+  twai_message_t m = {
+      .extd = 1,
+      .identifier = _can_id(type, MASTER, dst),
+      .data_length_code = size,
+  };
+  memcpy(m.data, data, size);
+  // The node drains its receive queue faster than we send here, a full
+  // queue is a bug.
+  if (h42_host_twai_deliver(&m) != ESP_OK) {
+    ESP_LOGE("master", "Node missed a frame");
+  }
+}
+
+static void _master_msg_done(master_t *master, master_msg_t *msg) {
+  xQueueSend(master->msg_queue, &msg, portMAX_DELAY);
+}
+
+static void _master_on_isotp(master_t *master, const twai_message_t *m) {
+  switch (m->data[0] >> 4) {
+  case 0: { // Single frame
+    master_msg_t *msg = malloc(sizeof(master_msg_t));
+    msg->size = m->data[0] & 0x0F;
+    memcpy(msg->data, &m->data[1], msg->size);
+    _master_msg_done(master, msg);
+    break;
+  }
+  case 1: { // First frame. No block size, the whole message in one go.
+    free(master->rx);
+    master->rx = malloc(sizeof(master_msg_t));
+    master->rx->size = ((m->data[0] & 0x0F) << 8) | m->data[1];
+    memcpy(master->rx->data, &m->data[2], 6);
+    master->rx_received = 6;
+    master->rx_sn = 1;
+    vTaskDelay(pdMS_TO_TICKS(master->fc_delay_ms));
+    const uint8_t fc[3] = {master->fc_overflow ? 0x32 : 0x30, 0, 0};
+    if (master->fc_overflow) {
+      master->fc_overflow = false;
+      free(master->rx);
+      master->rx = NULL;
+    }
+    _master_send_frame(MSG_TYPE_ISOTP, NODE_ADDRESS, fc, sizeof(fc));
+    break;
+  }
+  case 2: { // Consecutive frame
+    master_msg_t *msg = master->rx;
+    if (msg == NULL || (m->data[0] & 0x0F) != master->rx_sn) {
+      ESP_LOGE("master", "Unexpected consecutive frame");
+      break;
+    }
+    if (master->sending) {
+      master->node_cfs_while_sending++;
+    }
+    master->rx_sn = (master->rx_sn + 1) & 0x0F;
+    uint16_t size = msg->size - master->rx_received;
+    if (size > 7) {
+      size = 7;
+    }
+    memcpy(&msg->data[master->rx_received], &m->data[1], size);
+    master->rx_received += size;
+    if (master->rx_received == msg->size) {
+      master->rx = NULL;
+      _master_msg_done(master, msg);
+    }
+    break;
+  }
+  case 3: // Flow control
+    xQueueSend(master->fc_queue, m, portMAX_DELAY);
+    break;
+  }
+}
+
+static void vTaskMaster(void *pvParameters) {
+  master_t *master = (master_t *)pvParameters;
+  for (;;) {
+    twai_message_t m;
+    if (h42_host_twai_take_transmitted(&m, 1000) != ESP_OK) {
+      continue;
+    }
+    uint8_t type = (m.identifier >> 16) & 7;
+    if (type == MSG_TYPE_ADDRESS_REQUEST) {
+      uint8_t response[8];
+      memcpy(response, m.data, 6);
+      response[6] = 0;
+      response[7] = NODE_ADDRESS;
+      _master_send_frame(MSG_TYPE_ADDRESS_RESPONSE, BROADCAST, response, 8);
+    } else if (type == MSG_TYPE_LINK_PARAMS) {
+      memcpy(master->link_params, m.data, 4);
+      // Take the node's receive parameters, no lower limit for its STmin.
+      // Of the features only compact MQTT and broadcast are known here.
+      const uint8_t reply[5] = {
+          m.data[0], m.data[1], 0, 8,
+          m.data[3] &
+              (H42_CAN_FEATURE_COMPACT_MQTT | H42_CAN_FEATURE_BROADCAST)};
+      _master_send_frame(MSG_TYPE_LINK_PARAMS, NODE_ADDRESS, reply,
+                         m.data_length_code >= 4 ? 5 : 3);
+    } else if (type == MSG_TYPE_ISOTP) {
+      if ((m.data[0] >> 4) == 3) {
+        master->fc_frame_id = m.identifier;
+      } else {
+        master->data_frame_id = m.identifier;
+      }
+      _master_on_isotp(master, &m);
+    }
+  }
+}
+
+static void _master_wait_fc(master_t *master, uint8_t *block_size,
+                            uint32_t *st_min_ms) {
+  twai_message_t fc;
+  // The node sends FC WAIT well within the 2 s the bridge waits for each.
+  TEST_ASSERT_TRUE(xQueueReceive(master->fc_queue, &fc, pdMS_TO_TICKS(2000)));
+  while (fc.data[0] == 0x31) {
+    master->fc_waits++;
+    TEST_ASSERT_TRUE(
+        xQueueReceive(master->fc_queue, &fc, pdMS_TO_TICKS(2000)));
+  }
+  TEST_ASSERT_EQUAL(0x30, fc.data[0]);
+  *block_size = fc.data[1];
+  // Microsecond values round up to a millisecond.
+  *st_min_ms = fc.data[2] <= 0x7F ? fc.data[2] : 1;
+}
+
+// Sends data to the node as ISO-TP, honouring its flow control.
+static void _master_send(master_t *master, const uint8_t *data,
+                         uint16_t size) {
+  uint8_t frame[8];
+  if (size <= 7) {
+    frame[0] = size;
+    memcpy(&frame[1], data, size);
+    _master_send_frame(MSG_TYPE_ISOTP, NODE_ADDRESS, frame, size + 1);
+    return;
+  }
+  frame[0] = 0x10 | (size >> 8);
+  frame[1] = size & 0xFF;
+  memcpy(&frame[2], data, 6);
+  _master_send_frame(MSG_TYPE_ISOTP, NODE_ADDRESS, frame, 8);
+
+  uint8_t block_size;
+  uint32_t st_min_ms;
+  _master_wait_fc(master, &block_size, &st_min_ms);
+  master->sending = true;
+  uint16_t offset = 6;
+  uint8_t sn = 1;
+  uint8_t block_sent = 0;
+  while (offset < size) {
+    if (block_size != 0 && block_sent == block_size) {
+      _master_wait_fc(master, &block_size, &st_min_ms);
+      block_sent = 0;
+    }
+    uint16_t chunk = size - offset < 7 ? size - offset : 7;
+    frame[0] = 0x20 | sn;
+    memcpy(&frame[1], &data[offset], chunk);
+    _master_send_frame(MSG_TYPE_ISOTP, NODE_ADDRESS, frame, chunk + 1);
+    offset += chunk;
+    sn = (sn + 1) & 0x0F;
+    block_sent++;
+    vTaskDelay(pdMS_TO_TICKS(st_min_ms));
+  }
+  master->sending = false;
+}
+
+// Broadcasts data for the nodes in `targets`, with no flow control and at
+// the STmin the node asked for.
+static void _master_broadcast(const uint8_t *targets, uint8_t target_count,
+                              const uint8_t *data, uint16_t size) {
+  static uint8_t msg[ISOTP_MAX_SIZE];
+  msg[0] = target_count;
+  memcpy(&msg[1], targets, target_count);
+  memcpy(&msg[1 + target_count], data, size);
+  size += 1 + target_count;
+  uint8_t frame[8];
+  if (size <= 7) {
+    frame[0] = size;
+    memcpy(&frame[1], msg, size);
+    _master_send_frame(MSG_TYPE_BROADCAST_DATA, BROADCAST, frame, size + 1);
+    return;
+  }
+  frame[0] = 0x10 | (size >> 8);
+  frame[1] = size & 0xFF;
+  memcpy(&frame[2], msg, 6);
+  _master_send_frame(MSG_TYPE_BROADCAST_DATA, BROADCAST, frame, 8);
+  uint16_t offset = 6;
+  uint8_t sn = 1;
+  while (offset < size) {
+    vTaskDelay(pdMS_TO_TICKS(g_master.link_params[1]));
+    uint16_t chunk = size - offset < 7 ? size - offset : 7;
+    frame[0] = 0x20 | sn;
+    memcpy(&frame[1], &msg[offset], chunk);
+    _master_send_frame(MSG_TYPE_BROADCAST_DATA, BROADCAST, frame, chunk + 1);
+    offset += chunk;
+    sn = (sn + 1) & 0x0F;
+  }
+}
+
+static master_msg_t *_master_recv(master_t *master, int timeout_ms) {
+  master_msg_t *msg = NULL;
+  xQueueReceive(master->msg_queue, &msg, pdMS_TO_TICKS(timeout_ms));
+  return msg;
+}
+
+static void _fill(uint8_t *data, uint32_t size, uint32_t seed) {
+  for (uint32_t i = 0; i < size; i++) {
+    data[i] = (uint8_t)(i * 31 + seed);
+  }
+}
+
+// The daemon is a singleton, so every test case uses the same connection.
+static void _daemon_connected(void) {
+  static bool started = false;
+  if (started) {
+    return;
+  }
+  esp_log_level_set("*", ESP_LOG_WARN);
+  g_master.fc_queue = xQueueCreate(4, sizeof(twai_message_t));
+  g_master.msg_queue = xQueueCreate(8, sizeof(master_msg_t *));
+  TEST_ASSERT_TRUE(xTaskCreate(vTaskMaster, "master", 4096, &g_master, 5,
+                               NULL) == pdPASS);
+  h42_can_daemon_config_t config = H42_CAN_DAEMON_CONFIG_DEFAULT();
+  // Like the transport.
+  config.tx_async = true;
+  config.features =
+      H42_CAN_FEATURE_COMPACT_MQTT | H42_CAN_FEATURE_BROADCAST | 0x80;
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_start(&config));
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_connect(5000));
+  started = true;
+}
+
+TEST_CASE("connect", "[daemon]") {
+  _daemon_connected();
+  // The proposal carries the configured flow control, the classic frame size
+  // and the features.
+  vTaskDelay(pdMS_TO_TICKS(10));
+  TEST_ASSERT_EQUAL(8, g_master.link_params[0]);
+  TEST_ASSERT_EQUAL(2, g_master.link_params[1]);
+  TEST_ASSERT_EQUAL(8, g_master.link_params[2]);
+  TEST_ASSERT_EQUAL(H42_CAN_FEATURE_COMPACT_MQTT |
+                        H42_CAN_FEATURE_BROADCAST | 0x80,
+                    g_master.link_params[3]);
+  TEST_ASSERT_EQUAL(H42_CAN_FEATURE_COMPACT_MQTT | H42_CAN_FEATURE_BROADCAST,
+                    h42_can_daemon_link_features());
+}
+
+TEST_CASE("discovery_status", "[daemon]") {
+  _daemon_connected();
+  bool cached = false;
+  TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT,
+                    h42_can_daemon_wait_discovery_status(0x12345678, &cached,
+                                                         10));
+  // An answer to an earlier check does not count
+  const uint8_t stale[5] = {1, 0xAA, 0xBB, 0xCC, 0xDD};
+  const uint8_t answer[5] = {1, 0x12, 0x34, 0x56, 0x78};
+  _master_send_frame(MSG_TYPE_DISCOVERY_STATUS, NODE_ADDRESS, stale, 5);
+  _master_send_frame(MSG_TYPE_DISCOVERY_STATUS, NODE_ADDRESS, answer, 5);
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_wait_discovery_status(
+                                0x12345678, &cached, 1000));
+  TEST_ASSERT_TRUE(cached);
+
+  const uint8_t miss[5] = {0, 0x12, 0x34, 0x56, 0x78};
+  _master_send_frame(MSG_TYPE_DISCOVERY_STATUS, NODE_ADDRESS, miss, 5);
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_wait_discovery_status(
+                                0x12345678, &cached, 1000));
+  TEST_ASSERT_FALSE(cached);
+}
+
+TEST_CASE("send_to_master", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[ISOTP_MAX_SIZE];
+  const uint16_t sizes[] = {1, 7, 8, 100, 4094};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    _fill(data, sizes[i], i);
+    TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_send(data, sizes[i], 5000));
+    master_msg_t *msg = _master_recv(&g_master, 5000);
+    TEST_ASSERT_NOT_NULL(msg);
+    TEST_ASSERT_EQUAL(sizes[i], msg->size);
+    TEST_ASSERT_EQUAL_MEMORY(data, msg->data, sizes[i]);
+    free(msg);
+  }
+}
+
+TEST_CASE("recv_from_master", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[ISOTP_MAX_SIZE];
+  const uint16_t sizes[] = {5, 300, 1000};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    _fill(data, sizes[i], i);
+    _master_send(&g_master, data, sizes[i]);
+    h42_packet_handle_t packet;
+    TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_recv_packet(&packet, 5000));
+    TEST_ASSERT_EQUAL(sizes[i], h42_packet_size(packet));
+    TEST_ASSERT_EQUAL_MEMORY(data, h42_packet_data(packet), sizes[i]);
+    h42_packet_free(&packet);
+  }
+  TEST_ASSERT_EQUAL(0, h42_host_twai_rx_missed());
+}
+
+TEST_CASE("broadcast", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[1000];
+  const uint8_t others[] = {0x10, 0x11};
+  const uint8_t with_us[] = {0x10, NODE_ADDRESS, 0x11};
+  // Messages for other nodes are dropped, ours come without the target list.
+  _fill(data, sizeof(data), 3);
+  _master_broadcast(others, sizeof(others), data, 300);
+  _master_broadcast(with_us, sizeof(with_us), data, sizeof(data));
+  _master_broadcast(others, sizeof(others), data, 2);
+  _master_broadcast(&with_us[1], 1, data, 3);
+  h42_packet_handle_t packet;
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_recv_packet(&packet, 5000));
+  TEST_ASSERT_EQUAL(sizeof(data), h42_packet_size(packet));
+  TEST_ASSERT_EQUAL_MEMORY(data, h42_packet_data(packet), sizeof(data));
+  h42_packet_free(&packet);
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_recv_packet(&packet, 5000));
+  TEST_ASSERT_EQUAL(3, h42_packet_size(packet));
+  TEST_ASSERT_EQUAL_MEMORY(data, h42_packet_data(packet), 3);
+  h42_packet_free(&packet);
+  TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, h42_can_daemon_recv_packet(&packet, 50));
+}
+
+TEST_CASE("priority", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[100];
+  _fill(data, sizeof(data), 5);
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_send_priority(
+                                data, sizeof(data), H42_CAN_PRIORITY_BULK,
+                                5000));
+  master_msg_t *msg = _master_recv(&g_master, 5000);
+  TEST_ASSERT_NOT_NULL(msg);
+  free(msg);
+  uint32_t id = g_master.data_frame_id;
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_BULK, id >> H42_CAN_ID_PRIORITY_SHIFT);
+  TEST_ASSERT_EQUAL(_can_id(MSG_TYPE_ISOTP, NODE_ADDRESS, MASTER),
+                    id & ~(H42_CAN_ID_PRIORITY_MASK | H42_CAN_ID_RANDOM_MASK));
+
+  // Flow control for a transfer from the master always goes first
+  _master_send(&g_master, data, sizeof(data));
+  h42_packet_handle_t packet;
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_recv_packet(&packet, 5000));
+  h42_packet_free(&packet);
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_CONTROL,
+                    g_master.fc_frame_id >> H42_CAN_ID_PRIORITY_SHIFT);
+
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_send(data, sizeof(data), 5000));
+  msg = _master_recv(&g_master, 5000);
+  TEST_ASSERT_NOT_NULL(msg);
+  free(msg);
+  TEST_ASSERT_EQUAL(H42_CAN_PRIORITY_STATE,
+                    g_master.data_frame_id >> H42_CAN_ID_PRIORITY_SHIFT);
+}
+
+TEST_CASE("write_stream", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[10000];
+  _fill(data, sizeof(data), 7);
+  uint32_t written;
+  TEST_ASSERT_EQUAL(ESP_OK,
+                    h42_can_daemon_write(data, sizeof(data), &written, 10000));
+  TEST_ASSERT_EQUAL(sizeof(data), written);
+  uint32_t received = 0;
+  while (received < sizeof(data)) {
+    master_msg_t *msg = _master_recv(&g_master, 5000);
+    TEST_ASSERT_NOT_NULL(msg);
+    TEST_ASSERT_TRUE(msg->size <= h42_max_packet_size());
+    TEST_ASSERT_EQUAL_MEMORY(&data[received], msg->data, msg->size);
+    received += msg->size;
+    free(msg);
+  }
+  TEST_ASSERT_EQUAL(sizeof(data), received);
+}
+
+#define DUPLEX_RX_SIZE 3000
+#define DUPLEX_TX_SIZE 2000
+
+static uint8_t g_duplex_tx_data[DUPLEX_TX_SIZE];
+
+// Sends to the master once its transfer to the node is under way.
+static void vTaskDuplexSender(void *pvParameters) {
+  QueueHandle_t done = (QueueHandle_t)pvParameters;
+  vTaskDelay(pdMS_TO_TICKS(100));
+  esp_err_t err =
+      h42_can_daemon_send(g_duplex_tx_data, sizeof(g_duplex_tx_data), 5000);
+  xQueueSend(done, &err, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("full_duplex", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[DUPLEX_RX_SIZE];
+  _fill(data, sizeof(data), 11);
+  _fill(g_duplex_tx_data, sizeof(g_duplex_tx_data), 12);
+  QueueHandle_t done = xQueueCreate(1, sizeof(esp_err_t));
+  g_master.node_cfs_while_sending = 0;
+  TEST_ASSERT_TRUE(xTaskCreate(vTaskDuplexSender, "sender", 4096, done, 5,
+                               NULL) == pdPASS);
+  // Over 400 consecutive frames at the node's STmin, the node sends all of
+  // its message in between.
+  _master_send(&g_master, data, sizeof(data));
+  esp_err_t err;
+  TEST_ASSERT_TRUE(xQueueReceive(done, &err, pdMS_TO_TICKS(5000)));
+  TEST_ASSERT_EQUAL(ESP_OK, err);
+  vQueueDelete(done);
+  // All consecutive frames after the 6 bytes of the first frame, 7 a frame.
+  TEST_ASSERT_EQUAL((DUPLEX_TX_SIZE - 6 + 6) / 7,
+                    g_master.node_cfs_while_sending);
+
+  h42_packet_handle_t packet;
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_recv_packet(&packet, 5000));
+  TEST_ASSERT_EQUAL(sizeof(data), h42_packet_size(packet));
+  TEST_ASSERT_EQUAL_MEMORY(data, h42_packet_data(packet), sizeof(data));
+  h42_packet_free(&packet);
+  master_msg_t *msg = _master_recv(&g_master, 5000);
+  TEST_ASSERT_NOT_NULL(msg);
+  TEST_ASSERT_EQUAL(sizeof(g_duplex_tx_data), msg->size);
+  TEST_ASSERT_EQUAL_MEMORY(g_duplex_tx_data, msg->data, msg->size);
+  free(msg);
+}
+
+#define POOL_WAIT_SIZE 2000
+#define POOL_WAIT_PACKETS 6
+
+static uint8_t g_pool_wait_data[POOL_WAIT_PACKETS][POOL_WAIT_SIZE];
+
+// Starts reading late, then checks and frees each packet.
+static void vTaskLateReader(void *pvParameters) {
+  QueueHandle_t done = (QueueHandle_t)pvParameters;
+  vTaskDelay(pdMS_TO_TICKS(300));
+  for (int i = 0; i < POOL_WAIT_PACKETS; i++) {
+    h42_packet_handle_t packet = NULL;
+    bool intact =
+        h42_can_daemon_recv_packet(&packet, 5000) == ESP_OK &&
+        h42_packet_size(packet) == POOL_WAIT_SIZE &&
+        memcmp(g_pool_wait_data[i], h42_packet_data(packet),
+               POOL_WAIT_SIZE) == 0;
+    h42_packet_free(&packet);
+    xQueueSend(done, &intact, portMAX_DELAY);
+  }
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("recv_pool_wait", "[daemon]") {
+  _daemon_connected();
+  // Five of these take all large blocks of the receive pool. The node holds
+  // the sixth with FC WAIT until the reader frees one, nothing is lost.
+  QueueHandle_t done = xQueueCreate(POOL_WAIT_PACKETS, sizeof(bool));
+  g_master.fc_waits = 0;
+  for (int i = 0; i < POOL_WAIT_PACKETS; i++) {
+    if (i == POOL_WAIT_PACKETS - 1) {
+      TEST_ASSERT_TRUE(xTaskCreate(vTaskLateReader, "reader", 4096, done, 5,
+                                   NULL) == pdPASS);
+    }
+    _fill(g_pool_wait_data[i], POOL_WAIT_SIZE, 20 + i);
+    _master_send(&g_master, g_pool_wait_data[i], POOL_WAIT_SIZE);
+  }
+  TEST_ASSERT_TRUE(g_master.fc_waits > 0);
+
+  for (int i = 0; i < POOL_WAIT_PACKETS; i++) {
+    bool intact = false;
+    TEST_ASSERT_TRUE(xQueueReceive(done, &intact, pdMS_TO_TICKS(5000)));
+    TEST_ASSERT_TRUE(intact);
+  }
+  vQueueDelete(done);
+}
+
+#define POLL_WRITE_SENDERS 6
+#define POLL_WRITE_SIZE 100
+
+static void vTaskSender(void *pvParameters) {
+  QueueHandle_t done = (QueueHandle_t)pvParameters;
+  static uint8_t data[POLL_WRITE_SIZE];
+  esp_err_t err = h42_can_daemon_send(data, sizeof(data), 10000);
+  xQueueSend(done, &err, portMAX_DELAY);
+  vTaskDelete(NULL);
+}
+
+TEST_CASE("poll_write", "[daemon]") {
+  _daemon_connected();
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_poll_write(0));
+
+  // With each transfer held at its flow control, the senders fill the queue:
+  // one in progress, tx_queue_depth queued and one blocked.
+  g_master.fc_delay_ms = 200;
+  QueueHandle_t done = xQueueCreate(POLL_WRITE_SENDERS, sizeof(esp_err_t));
+  for (int i = 0; i < POLL_WRITE_SENDERS; i++) {
+    TEST_ASSERT_TRUE(xTaskCreate(vTaskSender, "sender", 4096, done, 5, NULL) ==
+                     pdPASS);
+  }
+  vTaskDelay(pdMS_TO_TICKS(50));
+  TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, h42_can_daemon_poll_write(0));
+  // Woken when the daemon takes the next packet, at most a transfer or two
+  // later.
+  TickType_t start = xTaskGetTickCount();
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_poll_write(5000));
+  TEST_ASSERT_TRUE(xTaskGetTickCount() - start < pdMS_TO_TICKS(1000));
+  g_master.fc_delay_ms = 0;
+
+  for (int i = 0; i < POLL_WRITE_SENDERS; i++) {
+    esp_err_t err;
+    TEST_ASSERT_TRUE(xQueueReceive(done, &err, pdMS_TO_TICKS(5000)));
+    TEST_ASSERT_EQUAL(ESP_OK, err);
+    master_msg_t *msg = _master_recv(&g_master, 5000);
+    TEST_ASSERT_NOT_NULL(msg);
+    TEST_ASSERT_EQUAL(POLL_WRITE_SIZE, msg->size);
+    free(msg);
+  }
+  vQueueDelete(done);
+}
+
+TEST_CASE("async_send_error", "[daemon]") {
+  _daemon_connected();
+  static uint8_t data[100];
+  _fill(data, sizeof(data), 9);
+  // Queued fine, then refused by the master
+  g_master.fc_overflow = true;
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_send(data, sizeof(data), 5000));
+  vTaskDelay(pdMS_TO_TICKS(100));
+  TEST_ASSERT_NULL(_master_recv(&g_master, 0));
+
+  // The rest of the stream would have a hole, so the next writes fail
+  TEST_ASSERT_EQUAL(ESP_FAIL, h42_can_daemon_poll_write(0));
+  TEST_ASSERT_EQUAL(ESP_FAIL, h42_can_daemon_send(data, sizeof(data), 5000));
+  uint32_t written;
+  TEST_ASSERT_EQUAL(ESP_FAIL,
+                    h42_can_daemon_write(data, sizeof(data), &written, 5000));
+  TEST_ASSERT_EQUAL(0, written);
+
+  // Until the next connection
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_connect(5000));
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_poll_write(0));
+  TEST_ASSERT_EQUAL(ESP_OK, h42_can_daemon_send(data, sizeof(data), 5000));
+  master_msg_t *msg = _master_recv(&g_master, 5000);
+  TEST_ASSERT_NOT_NULL(msg);
+  TEST_ASSERT_EQUAL_MEMORY(data, msg->data, sizeof(data));
+  free(msg);
+}
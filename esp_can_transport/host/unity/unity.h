@@ -0,0 +1,61 @@
+#pragma once
+
+// The part of the ESP-IDF unity API the can_transport tests use, so they run
+// on the host unchanged. Test cases register themselves and unity_main.c
+// runs them. A failed assertion ends the test case.
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*unity_test_func_t)(void);
+
+void unity_register_test(const char *name, const char *tags,
+                         unity_test_func_t func);
+void unity_fail(const char *file, int line, const char *message);
+
+#define _UNITY_CONCAT2(a, b) a##b
+#define _UNITY_CONCAT(a, b) _UNITY_CONCAT2(a, b)
+#define _UNITY_TEST_FUNC _UNITY_CONCAT(_unity_test_, __LINE__)
+#define _UNITY_TEST_REG _UNITY_CONCAT(_unity_register_, __LINE__)
+
+#define TEST_CASE(name, tags)                                                  \
+  static void _UNITY_TEST_FUNC(void);                                          \
+  __attribute__((constructor)) static void _UNITY_TEST_REG(void) {             \
+    unity_register_test(name, tags, _UNITY_TEST_FUNC);                         \
+  }                                                                            \
+  static void _UNITY_TEST_FUNC(void)
+
+#define TEST_ASSERT_MESSAGE(condition, message)                                \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      unity_fail(__FILE__, __LINE__, message);                                 \
+    }                                                                          \
+  } while (0)
+
+#define TEST_ASSERT(condition) TEST_ASSERT_MESSAGE(condition, #condition)
+#define TEST_ASSERT_TRUE(condition)                                            \
+  TEST_ASSERT_MESSAGE(condition, "Expected TRUE: " #condition)
+#define TEST_ASSERT_FALSE(condition)                                           \
+  TEST_ASSERT_MESSAGE(!(condition), "Expected FALSE: " #condition)
+#define TEST_ASSERT_NULL(pointer)                                              \
+  TEST_ASSERT_MESSAGE((pointer) == NULL, "Expected NULL: " #pointer)
+#define TEST_ASSERT_NOT_NULL(pointer)                                          \
+  TEST_ASSERT_MESSAGE((pointer) != NULL, "Expected not NULL: " #pointer)
+#define TEST_ASSERT_EQUAL(expected, actual)                                    \
+  TEST_ASSERT_MESSAGE((intmax_t)(expected) == (intmax_t)(actual),              \
+                      "Expected " #expected " == " #actual)
+#define TEST_ASSERT_EQUAL_STRING_LEN(expected, actual, len)                    \
+  TEST_ASSERT_MESSAGE(memcmp((expected), (actual), (len)) == 0,                \
+                      "Expected " #expected " == " #actual)
+#define TEST_ASSERT_EQUAL_MEMORY(expected, actual, len)                        \
+  TEST_ASSERT_EQUAL_STRING_LEN(expected, actual, len)
+
+#ifdef __cplusplus
+}
+#endif
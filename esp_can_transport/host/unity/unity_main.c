@@ -0,0 +1,61 @@
+#include "unity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define UNITY_MAX_TESTS 256
+
+typedef struct unity_test {
+  const char *name;
+  const char *tags;
+  unity_test_func_t func;
+} unity_test_t;
+
+static unity_test_t g_tests[UNITY_MAX_TESTS];
+static int g_test_count;
+static jmp_buf g_test_abort;
+
+void unity_register_test(const char *name, const char *tags,
+                         unity_test_func_t func) {
+  if (g_test_count == UNITY_MAX_TESTS) {
+    fprintf(stderr, "Too many test cases\n");
+    abort();
+  }
+  g_tests[g_test_count++] = (unity_test_t){name, tags, func};
+}
+
+void unity_fail(const char *file, int line, const char *message) {
+  printf("%s:%d: %s\n", file, line, message);
+  longjmp(g_test_abort, 1);
+}
+
+/**
+ * Runs all test cases, or those whose name or tag is given as an argument.
+ * The exit status is the number of failed test cases.
+ */
+int main(int argc, char **argv) {
+  int run = 0;
+  int failed = 0;
+  for (int i = 0; i < g_test_count; i++) {
+    const unity_test_t *test = &g_tests[i];
+    bool selected = argc < 2;
+    for (int a = 1; a < argc && !selected; a++) {
+      selected = strcmp(argv[a], test->name) == 0 ||
+                 strstr(test->tags, argv[a]) != NULL;
+    }
+    if (!selected) {
+      continue;
+    }
+    run++;
+    fflush(stdout);
+    if (setjmp(g_test_abort) == 0) {
+      test->func();
+      printf("PASS %s %s\n", test->name, test->tags);
+    } else {
+      printf("FAIL %s %s\n", test->name, test->tags);
+      failed++;
+    }
+  }
+  printf("%d Tests %d Failures\n", run, failed);
+  return failed;
+}
@@ -57,7 +57,7 @@ void app_main(void) {
   printf("Chip ID: %02X:%02X:%02X:%02X:%02X:%02X:%02X:%02X\n", mac[0], mac[1],
          mac[2], mac[3], mac[4], mac[5], mac[6], mac[7]);
 
-  if (h42_can_init() != ESP_OK) {
+  if (h42_can_init(NULL) != ESP_OK) {
     printf("Failed to initialize CAN transport\n");
   }
 
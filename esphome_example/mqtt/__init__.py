@@ -1,6 +1,6 @@
 import re
 
-from esphome import automation
+from esphome import automation, pins
 from esphome.automation import Condition
 import esphome.codegen as cg
 from esphome.components import logger
@@ -40,6 +40,7 @@ from esphome.const import (
     CONF_QOS,
     CONF_REBOOT_TIMEOUT,
     CONF_RETAIN,
+    CONF_RX_PIN,
     CONF_SHUTDOWN_MESSAGE,
     CONF_SSL_FINGERPRINTS,
     CONF_STATE_TOPIC,
@@ -47,6 +48,7 @@ from esphome.const import (
     CONF_TOPIC,
     CONF_TOPIC_PREFIX,
     CONF_TRIGGER_ID,
+    CONF_TX_PIN,
     CONF_USE_ABBREVIATIONS,
     CONF_USERNAME,
     CONF_WILL_MESSAGE,
@@ -68,6 +70,43 @@ def AUTO_LOAD():
 CONF_DISCOVER_IP = "discover_ip"
 CONF_IDF_SEND_ASYNC = "idf_send_async"
 CONF_SKIP_CERT_CN_CHECK = "skip_cert_cn_check"
+CONF_H42_CAN = "h42_can"
+CONF_BIT_RATE = "bit_rate"
+CONF_HARDWARE_FILTER = "hardware_filter"
+CONF_COMPACT_MQTT = "compact_mqtt"
+CONF_COMPRESS_MQTT = "compress_mqtt"
+CONF_DISCOVERY_CACHE = "discovery_cache"
+CONF_KEEPALIVE_PROXY = "keepalive_proxy"
+CONF_BROADCAST = "broadcast"
+
+H42_CAN_BIT_RATES = {
+    "20KBPS": 20000,
+    "25KBPS": 25000,
+    "50KBPS": 50000,
+    "100KBPS": 100000,
+    "125KBPS": 125000,
+    "250KBPS": 250000,
+    "500KBPS": 500000,
+    "800KBPS": 800000,
+    "1000KBPS": 1000000,
+}
+
+# MQTT over CAN bus settings. Only used with the esp-mqtt patch and -DH42_CAN_PATCH=1.
+H42_CAN_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_BIT_RATE, default="20KBPS"): cv.enum(
+            H42_CAN_BIT_RATES, upper=True
+        ),
+        cv.Optional(CONF_TX_PIN, default=21): pins.internal_gpio_output_pin_number,
+        cv.Optional(CONF_RX_PIN, default=20): pins.internal_gpio_input_pin_number,
+        cv.Optional(CONF_HARDWARE_FILTER, default=False): cv.boolean,
+        cv.Optional(CONF_COMPACT_MQTT, default=False): cv.boolean,
+        cv.Optional(CONF_COMPRESS_MQTT, default=False): cv.boolean,
+        cv.Optional(CONF_DISCOVERY_CACHE, default=False): cv.boolean,
+        cv.Optional(CONF_KEEPALIVE_PROXY, default=False): cv.boolean,
+        cv.Optional(CONF_BROADCAST, default=False): cv.boolean,
+    }
+)
 
 
 def validate_message_just_topic(value):
@@ -298,6 +337,7 @@ CONFIG_SCHEMA = cv.All(
                 }
             ),
             cv.Optional(CONF_PUBLISH_NAN_AS_NONE, default=False): cv.boolean,
+            cv.Optional(CONF_H42_CAN): cv.All(H42_CAN_SCHEMA, cv.only_with_esp_idf),
         }
     ),
     validate_config,
@@ -413,6 +453,22 @@ async def to_code(config):
 
     cg.add(var.set_keep_alive(config[CONF_KEEPALIVE]))
 
+    if CONF_H42_CAN in config:
+        h42_can = config[CONF_H42_CAN]
+        cg.add(
+            var.set_h42_can_config(
+                H42_CAN_BIT_RATES[h42_can[CONF_BIT_RATE]],
+                h42_can[CONF_TX_PIN],
+                h42_can[CONF_RX_PIN],
+                h42_can[CONF_HARDWARE_FILTER],
+                h42_can[CONF_COMPACT_MQTT],
+                h42_can[CONF_COMPRESS_MQTT],
+                h42_can[CONF_DISCOVERY_CACHE],
+                h42_can[CONF_KEEPALIVE_PROXY],
+                h42_can[CONF_BROADCAST],
+            )
+        )
+
     cg.add(var.set_reboot_timeout(config[CONF_REBOOT_TIMEOUT]))
 
     # esp-idf only
@@ -35,6 +35,15 @@ MQTTClientComponent::MQTTClientComponent() {
 // Connection
 void MQTTClientComponent::setup() {
   ESP_LOGCONFIG(TAG, "Setting up MQTT...");
+#if H42_CAN_PATCH
+  // Has to come first, esp-mqtt itself calls h42_can_init(NULL) and would
+  // start with the defaults.
+  if (h42_can_init(&this->h42_can_config_) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to initialize MQTT over CAN");
+    this->mark_failed();
+    return;
+  }
+#endif /* H42_CAN_PATCH */
   this->mqtt_backend_.set_on_message(
       [this](const char *topic, const char *payload, size_t len, size_t index, size_t total) {
         if (index == 0)
@@ -301,11 +310,73 @@ void MQTTClientComponent::check_connected() {
 
   this->resubscribe_subscriptions_();
   this->send_device_info_();
+#if H42_CAN_PATCH
+  this->check_discovery_cache_();
+#endif /* H42_CAN_PATCH */
 
   for (MQTTComponent *component : this->children_)
     component->schedule_resend_state();
 }
 
+#if H42_CAN_PATCH
+uint32_t MQTTClientComponent::get_discovery_set_hash_() const {
+  // Everything the discovery configs are made from is fixed at build time,
+  // except the MAC. A new build gives a new hash.
+  std::string inputs = App.get_name();
+  inputs += '\0';
+  inputs += App.get_compilation_time();
+  inputs += '\0';
+  inputs += ESPHOME_VERSION;
+  inputs += '\0';
+  inputs += get_mac_address();
+  inputs += '\0';
+  inputs += this->discovery_info_.prefix;
+  inputs += '\0';
+  inputs += static_cast<char>(this->discovery_info_.unique_id_generator);
+  inputs += static_cast<char>(this->discovery_info_.object_id_generator);
+  inputs += static_cast<char>(this->children_.size());
+  return fnv1_hash(inputs);
+}
+
+void MQTTClientComponent::check_discovery_cache_() {
+  this->discovery_cached_ = false;
+  this->discovery_commit_pending_ = false;
+  // Only retained configs are cached. The commit has to follow the last of
+  // them in the stream, which queued publishes would not.
+#if defined(USE_MQTT_IDF_ENQUEUE)
+  const bool in_order = false;
+#else
+  const bool in_order = true;
+#endif
+  if (!in_order || !this->h42_can_config_.discovery_cache || !this->is_discovery_enabled() ||
+      this->discovery_info_.clean || !this->discovery_info_.retain) {
+    return;
+  }
+  const uint32_t set_hash = this->get_discovery_set_hash_();
+  bool cached;
+  esp_err_t err = h42_can_discovery_check(set_hash, &cached, 1000);
+  if (err != ESP_OK) {
+    ESP_LOGD(TAG, "No discovery cache on the bridge (%s)", esp_err_to_name(err));
+    return;
+  }
+  ESP_LOGI(TAG, "Discovery set %08" PRIx32 " %s", set_hash, cached ? "cached by the bridge" : "not cached");
+  this->discovery_cached_ = cached;
+  this->discovery_commit_pending_ = !cached;
+}
+
+void MQTTClientComponent::commit_discovery_cache_() {
+  for (MQTTComponent *component : this->children_) {
+    if (component->is_resend_state_pending())
+      return;
+  }
+  this->discovery_commit_pending_ = false;
+  esp_err_t err = h42_can_discovery_commit(this->get_discovery_set_hash_(), 1000);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Discovery set not committed (%s)", esp_err_to_name(err));
+  }
+}
+#endif /* H42_CAN_PATCH */
+
 void MQTTClientComponent::loop() {
   // Call the backend loop first
   mqtt_backend_.loop();
@@ -379,6 +450,11 @@ void MQTTClientComponent::loop() {
 
         this->last_connected_ = now;
         this->resubscribe_subscriptions_();
+#if H42_CAN_PATCH
+        if (this->discovery_commit_pending_) {
+          this->commit_discovery_cache_();
+        }
+#endif /* H42_CAN_PATCH */
       }
       break;
   }
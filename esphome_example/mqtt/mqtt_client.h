@@ -17,6 +17,9 @@
 #include "mqtt_backend_libretiny.h"
 #endif
 #include "lwip/ip_addr.h"
+#if H42_CAN_PATCH
+#include "h42_can.h"
+#endif /* H42_CAN_PATCH */
 
 #include <vector>
 
@@ -267,6 +270,23 @@ class MQTTClientComponent : public Component {
   void set_publish_nan_as_none(bool publish_nan_as_none);
   bool is_publish_nan_as_none() const;
 
+#if H42_CAN_PATCH
+  void set_h42_can_config(uint32_t bitrate, int tx_pin, int rx_pin, bool hw_filter, bool compact_mqtt,
+                          bool compress_mqtt, bool discovery_cache, bool keepalive_proxy, bool broadcast) {
+    this->h42_can_config_.bitrate = bitrate;
+    this->h42_can_config_.tx_gpio = tx_pin;
+    this->h42_can_config_.rx_gpio = rx_pin;
+    this->h42_can_config_.hw_filter = hw_filter;
+    this->h42_can_config_.compact_mqtt = compact_mqtt;
+    this->h42_can_config_.compress_mqtt = compress_mqtt;
+    this->h42_can_config_.discovery_cache = discovery_cache;
+    this->h42_can_config_.keepalive_proxy = keepalive_proxy;
+    this->h42_can_config_.broadcast = broadcast;
+  }
+  /// The bridge has the discovery configs of this connection and sent them in our place.
+  bool is_discovery_cached() const { return this->discovery_cached_; }
+#endif /* H42_CAN_PATCH */
+
  protected:
   void send_device_info_();
 
@@ -286,6 +306,11 @@ class MQTTClientComponent : public Component {
   bool subscribe_(const char *topic, uint8_t qos);
   void resubscribe_subscription_(MQTTSubscription *sub);
   void resubscribe_subscriptions_();
+#if H42_CAN_PATCH
+  uint32_t get_discovery_set_hash_() const;
+  void check_discovery_cache_();
+  void commit_discovery_cache_();
+#endif /* H42_CAN_PATCH */
 
   MQTTCredentials credentials_;
   /// The last will message. Disabled optional denotes it being default and
@@ -298,6 +323,12 @@ class MQTTClientComponent : public Component {
   MQTTMessage shutdown_message_;
   /// Caches availability.
   Availability availability_{};
+#if H42_CAN_PATCH
+  h42_can_config_t h42_can_config_ = H42_CAN_CONFIG_DEFAULT();
+  bool discovery_cached_{false};
+  /// Commit the discovery set once every component has sent its discovery.
+  bool discovery_commit_pending_{false};
+#endif /* H42_CAN_PATCH */
   /// The discovery info options for Home Assistant. Undefined optional means
   /// default and empty prefix means disabled.
   MQTTDiscoveryInfo discovery_info_{
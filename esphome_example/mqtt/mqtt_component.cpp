@@ -68,6 +68,13 @@ bool MQTTComponent::send_discovery_() {
     return global_mqtt_client->publish(this->get_discovery_topic_(discovery_info), "", 0, this->qos_, true);
   }
 
+#if H42_CAN_PATCH
+  if (global_mqtt_client->is_discovery_cached()) {
+    ESP_LOGV(TAG, "'%s': Discovery cached by the bridge", this->friendly_name().c_str());
+    return true;
+  }
+#endif /* H42_CAN_PATCH */
+
   ESP_LOGV(TAG, "'%s': Sending discovery...", this->friendly_name().c_str());
 
   return global_mqtt_client->publish_json(
@@ -114,6 +114,10 @@ class MQTTComponent : public Component {
 
   /// Internal method for the MQTT client base to schedule a resend of the state on reconnect.
   void schedule_resend_state();
+#if H42_CAN_PATCH
+  /// Whether discovery and state still have to be sent since the last schedule_resend_state().
+  bool is_resend_state_pending() const { return this->resend_state_; }
+#endif /* H42_CAN_PATCH */
 
   /** Send a MQTT message.
    *